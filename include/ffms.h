@@ -22,7 +22,7 @@
 #define FFMS_H
 
 // Version format: major - minor - micro - bump
-#define FFMS_VERSION ((2 << 24) | (20 << 16) | (0 << 8) | 0)
+#define FFMS_VERSION ((2 << 24) | (21 << 16) | (12 << 8) | 0)
 
 #include <stdint.h>
 
@@ -176,6 +176,22 @@ typedef enum FFMS_IndexErrorHandling {
 	FFMS_IEH_IGNORE = 3
 } FFMS_IndexErrorHandling;
 
+typedef enum FFMS_IndexFormat {
+	FFMS_INDEX_FORMAT_COMPRESSED = 0,
+	FFMS_INDEX_FORMAT_COLUMNAR = 1
+} FFMS_IndexFormat;
+
+typedef enum FFMS_SignatureType {
+	FFMS_SIGNATURE_SHA1 = 0,
+	FFMS_SIGNATURE_XXH64 = 1
+} FFMS_SignatureType;
+
+typedef enum FFMS_IOBackend {
+	FFMS_IO_DEFAULT = 0,
+	FFMS_IO_MMAP = 1,
+	FFMS_IO_PREAD = 2
+} FFMS_IOBackend;
+
 typedef enum FFMS_TrackType {
 	FFMS_TYPE_UNKNOWN = -1,
 	FFMS_TYPE_VIDEO,
@@ -361,6 +377,29 @@ typedef struct FFMS_AudioProperties {
 	double LastTime;
 } FFMS_AudioProperties;
 
+typedef struct FFMS_WaveformPeak {
+	float Min;
+	float Max;
+	float RMS;
+} FFMS_WaveformPeak;
+
+typedef struct FFMS_SourceStats {
+	int64_t PacketsRead;
+	int64_t BytesRead;
+	int64_t FramesDecoded;
+	int64_t FramesOutput;
+	int64_t Seeks;
+	int64_t SeekRetries;
+	int64_t Flushes;
+	int64_t Reopens;
+	int64_t CacheHits;
+	int64_t CacheMisses;
+	// times are in microseconds
+	int64_t DemuxTime;
+	int64_t DecodeTime;
+	int64_t ConvertTime;
+} FFMS_SourceStats;
+
 typedef int (FFMS_CC *TIndexCallback)(int64_t Current, int64_t Total, void *ICPrivate);
 typedef int (FFMS_CC *TAudioNameCallback)(const char *SourceFile, int Track, const FFMS_AudioProperties *AP, char *FileName, int FNSize, void *Private);
 
@@ -370,8 +409,13 @@ FFMS_API(void) FFMS_Init(int CPUFeatures, int UseUTF8Paths);
 FFMS_API(int) FFMS_GetVersion();
 FFMS_API(int) FFMS_GetLogLevel();
 FFMS_API(void) FFMS_SetLogLevel(int Level);
+FFMS_API(int) FFMS_StartTrace(const char *TraceFile, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (9 << 8) | 0) */
+FFMS_API(int) FFMS_StopTrace(FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (9 << 8) | 0) */
+FFMS_API(void) FFMS_SetIOBackend(int Backend); /* Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (10 << 8) | 0) */
 FFMS_API(FFMS_VideoSource *) FFMS_CreateVideoSource(const char *SourceFile, int Track, FFMS_Index *Index, int Threads, int SeekMode, FFMS_ErrorInfo *ErrorInfo);
 FFMS_API(FFMS_AudioSource *) FFMS_CreateAudioSource(const char *SourceFile, int Track, FFMS_Index *Index, int DelayMode, FFMS_ErrorInfo *ErrorInfo);
+FFMS_API(FFMS_VideoSource *) FFMS_CreateLazyVideoSource(const char *SourceFile, int Track, FFMS_Index *Index, int Threads, int SeekMode, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (12 << 8) | 0) */
+FFMS_API(FFMS_AudioSource *) FFMS_CreateLazyAudioSource(const char *SourceFile, int Track, FFMS_Index *Index, int DelayMode, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (12 << 8) | 0) */
 FFMS_API(void) FFMS_DestroyVideoSource(FFMS_VideoSource *V);
 FFMS_API(void) FFMS_DestroyAudioSource(FFMS_AudioSource *A);
 FFMS_API(const FFMS_VideoProperties *) FFMS_GetVideoProperties(FFMS_VideoSource *V);
@@ -386,6 +430,11 @@ FFMS_API(void) FFMS_ResetInputFormatV(FFMS_VideoSource *V);
 FFMS_API(FFMS_ResampleOptions *) FFMS_CreateResampleOptions(FFMS_AudioSource *A); /* Introduced in FFMS_VERSION ((2 << 24) | (15 << 16) | (4 << 8) | 0) */
 FFMS_API(int) FFMS_SetOutputFormatA(FFMS_AudioSource *A, const FFMS_ResampleOptions*options, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (15 << 16) | (4 << 8) | 0) */
 FFMS_API(void) FFMS_DestroyResampleOptions(FFMS_ResampleOptions *options); /* Introduced in FFMS_VERSION ((2 << 24) | (15 << 16) | (4 << 8) | 0) */
+FFMS_API(void) FFMS_SetAudioDecodingThreads(FFMS_AudioSource *A, int Threads); /* Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (0 << 8) | 0) */
+FFMS_API(void) FFMS_GetVideoSourceStats(FFMS_VideoSource *V, FFMS_SourceStats *Stats); /* Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (8 << 8) | 0) */
+FFMS_API(void) FFMS_ResetVideoSourceStats(FFMS_VideoSource *V); /* Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (8 << 8) | 0) */
+FFMS_API(void) FFMS_GetAudioSourceStats(FFMS_AudioSource *A, FFMS_SourceStats *Stats); /* Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (8 << 8) | 0) */
+FFMS_API(void) FFMS_ResetAudioSourceStats(FFMS_AudioSource *A); /* Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (8 << 8) | 0) */
 FFMS_API(void) FFMS_DestroyIndex(FFMS_Index *Index);
 FFMS_API(int) FFMS_GetSourceType(FFMS_Index *Index);
 FFMS_API(int) FFMS_GetSourceTypeI(FFMS_Indexer *Indexer);
@@ -409,11 +458,24 @@ FFMS_API(FFMS_Index *) FFMS_MakeIndex(const char *SourceFile, int IndexMask, int
 FFMS_API(int) FFMS_DefaultAudioFilename(const char *SourceFile, int Track, const FFMS_AudioProperties *AP, char *FileName, int FNSize, void *Private);
 FFMS_API(FFMS_Indexer *) FFMS_CreateIndexer(const char *SourceFile, FFMS_ErrorInfo *ErrorInfo);
 FFMS_API(FFMS_Indexer *) FFMS_CreateIndexerWithDemuxer(const char *SourceFile, int Demuxer, FFMS_ErrorInfo *ErrorInfo);
+FFMS_API(void) FFMS_SetWaveformMask(FFMS_Indexer *Indexer, int WaveformMask); /* Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (0 << 8) | 0) */
+FFMS_API(void) FFMS_SetIndexingThreads(FFMS_Indexer *Indexer, int Threads); /* Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (0 << 8) | 0) */
+FFMS_API(void) FFMS_SetIndexingSplitSize(FFMS_Indexer *Indexer, int64_t MinSize); /* Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (12 << 8) | 0) */
+FFMS_API(void) FFMS_SetIndexCheckpoint(FFMS_Indexer *Indexer, const char *IndexFile, int64_t Interval); /* Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (1 << 8) | 0) */
+FFMS_API(int) FFMS_SetSignatureType(FFMS_Indexer *Indexer, int SignatureType, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (3 << 8) | 0) */
+FFMS_API(void) FFMS_SetStoreTrackProperties(FFMS_Indexer *Indexer, int Enable); /* Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (11 << 8) | 0) */
 FFMS_API(FFMS_Index *) FFMS_DoIndexing(FFMS_Indexer *Indexer, int IndexMask, int DumpMask, TAudioNameCallback ANC, void *ANCPrivate, int ErrorHandling, TIndexCallback IC, void *ICPrivate, FFMS_ErrorInfo *ErrorInfo);
 FFMS_API(void) FFMS_CancelIndexing(FFMS_Indexer *Indexer);
 FFMS_API(FFMS_Index *) FFMS_ReadIndex(const char *IndexFile, FFMS_ErrorInfo *ErrorInfo);
+FFMS_API(void) FFMS_SetIndexCaching(int Enable); /* Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (4 << 8) | 0) */
 FFMS_API(int) FFMS_IndexBelongsToFile(FFMS_Index *Index, const char *SourceFile, FFMS_ErrorInfo *ErrorInfo);
+FFMS_API(int) FFMS_UpdateIndex(FFMS_Index *Index, const char *SourceFile, TIndexCallback IC, void *ICPrivate, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (1 << 8) | 0) */
+FFMS_API(int) FFMS_GetIndexedVideoProperties(FFMS_Index *Index, int Track, FFMS_VideoProperties *VP, int *EncodedWidth, int *EncodedHeight, int *EncodedPixelFormat, int *ColorSpace, int *ColorRange, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (6 << 8) | 0) */
+FFMS_API(int) FFMS_GetIndexedAudioProperties(FFMS_Index *Index, int Track, FFMS_AudioProperties *AP, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (6 << 8) | 0) */
+FFMS_API(int) FFMS_CompactIndex(FFMS_Index *Index, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (7 << 8) | 0) */
 FFMS_API(int) FFMS_WriteIndex(const char *IndexFile, FFMS_Index *Index, FFMS_ErrorInfo *ErrorInfo);
+FFMS_API(int) FFMS_WriteIndexV2(const char *IndexFile, FFMS_Index *Index, int Format, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (2 << 8) | 0) */
+FFMS_API(const FFMS_WaveformPeak *) FFMS_GetWaveformPeaks(FFMS_Index *Index, int Track, int SamplesPerPeak, int *Channels, int64_t *NumPeaks, FFMS_ErrorInfo *ErrorInfo); /* Introduced in FFMS_VERSION ((2 << 24) | (21 << 16) | (0 << 8) | 0) */
 FFMS_API(int) FFMS_GetPixFmt(const char *Name);
 FFMS_API(int) FFMS_GetPresentSources();
 FFMS_API(int) FFMS_GetEnabledSources();
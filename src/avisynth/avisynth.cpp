@@ -86,6 +86,8 @@ static AVSValue __cdecl CreateFFIndex(AVSValue Args, void* UserData, IScriptEnvi
 
 static AVSValue __cdecl CreateFFVideoSource(AVSValue Args, void* UserData, IScriptEnvironment* Env) {
 	FFMS_Init(0, Args[14].AsBool(false));
+	// Scripts often open the same file several times
+	FFMS_SetIndexCaching(1);
 
 	if (!Args[0].Defined())
 		Env->ThrowError("FFVideoSource: No source specified");
@@ -186,6 +188,7 @@ static AVSValue __cdecl CreateFFVideoSource(AVSValue Args, void* UserData, IScri
 
 static AVSValue __cdecl CreateFFAudioSource(AVSValue Args, void* UserData, IScriptEnvironment* Env) {
 	FFMS_Init(0, Args[5].AsBool(false));
+	FFMS_SetIndexCaching(1);
 
 	if (!Args[0].Defined())
 		Env->ThrowError("FFAudioSource: No source specified");
@@ -0,0 +1,889 @@
+//  Copyright (c) 2015 The FFmpegSource Project
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#include "ffms.h"
+#include "ffmscompat.h"
+
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/log.h>
+#include <libavutil/pixdesc.h>
+}
+
+#ifdef _WIN32
+#include <objbase.h>
+#include <psapi.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "psapi.lib")
+#endif
+#else
+#include <sys/resource.h>
+#include <sys/time.h>
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+const char *InputFile = 0;
+std::string IndexFile;
+std::string OutputFile;
+std::string Workloads = "sequential,reverse,random,strided,keyframes,audio-sequential,audio-random";
+int VideoTrack = -1;
+int AudioTrack = -1;
+int SeekMode = FFMS_SEEK_NORMAL;
+int Threads = 0;
+const char *OutputFormat = 0;
+int Calls = 1000;
+int Stride = 10;
+int AudioSamples = 4096;
+unsigned Seed = 1;
+bool Check = false;
+bool CheckUpdate = false;
+bool CheckFormats = false;
+
+// Hashes of every frame and of every AudioSamples samples, from decoding
+// the tracks linearly, when checking
+std::vector<uint64_t> FrameHashes;
+std::vector<uint64_t> AudioHashes;
+
+struct Error {
+	std::string msg;
+	Error(const char *msg) : msg(msg) { }
+	Error(const char *msg, FFMS_ErrorInfo const& e) : msg(msg) {
+		this->msg.append(e.Buffer);
+	}
+};
+
+struct ErrorInfo : FFMS_ErrorInfo {
+	char Message[1024];
+	ErrorInfo() {
+		Buffer = Message;
+		BufferSize = sizeof(Message);
+		Message[0] = 0;
+	}
+};
+
+void PrintUsage() {
+	std::cout <<
+		"FFmpegSource2 decoding benchmark\n"
+		"Usage: ffmsbench [options] inputfile\n"
+		"Decodes inputfile in a number of access patterns and writes the timings as JSON.\n"
+		"\n"
+		"Options:\n"
+		"-i NAME   Read the index from NAME instead of indexing the file (default: inputfile.ffindex if it exists)\n"
+		"-o NAME   Write the results to NAME (default: stdout)\n"
+		"-w LIST   Comma-separated workloads to run (default: all of sequential, reverse, random, strided,\n"
+		"          keyframes, audio-sequential, audio-random)\n"
+		"-v N      Use video track N (default: the first video track)\n"
+		"-a N      Use audio track N (default: the first audio track)\n"
+		"-s N      Set the seek mode of the video source to N (default: 1)\n"
+		"-t N      Decode video with N threads (default: 0, one per CPU)\n"
+		"-f NAME   Convert frames to the pixel format NAME (default: no conversion)\n"
+		"-n N      Make at most N calls per workload (default: 1000)\n"
+		"-S N      Request every Nth frame in the strided workload (default: 10)\n"
+		"-A N      Request N samples per call in the audio workloads (default: 4096)\n"
+		"-r N      Seed the random workloads with N (default: 1)\n"
+		"-c        Decode the tracks linearly first and check that every workload gets the same frames and\n"
+		"          samples; random audio requests are then aligned to -A samples (default: no)\n"
+		"-u        Instead of benchmarking, check that indexing the first half of the file with libavformat\n"
+		"          and updating that index with the whole file gives the same index as indexing all of it\n"
+		"-x        Instead of benchmarking, check that indexing the file in parts on several threads gives the\n"
+		"          same index as indexing it serially, and that the index reads back the same after writing\n"
+		"          it compressed, columnar and compacted"
+		<< std::endl;
+}
+
+void ParseCMDLine(int argc, char *argv[]) {
+	for (int i = 1; i < argc; ++i) {
+		const char *Option = argv[i];
+#define OPTION_ARG(flag) i + 1 < argc ? argv[i+1] : throw Error("Error: missing argument for -" flag)
+
+		if (!strcmp(Option, "-i")) {
+			IndexFile = OPTION_ARG("i");
+			i++;
+		} else if (!strcmp(Option, "-o")) {
+			OutputFile = OPTION_ARG("o");
+			i++;
+		} else if (!strcmp(Option, "-w")) {
+			Workloads = OPTION_ARG("w");
+			i++;
+		} else if (!strcmp(Option, "-v")) {
+			VideoTrack = atoi(OPTION_ARG("v"));
+			i++;
+		} else if (!strcmp(Option, "-a")) {
+			AudioTrack = atoi(OPTION_ARG("a"));
+			i++;
+		} else if (!strcmp(Option, "-s")) {
+			SeekMode = atoi(OPTION_ARG("s"));
+			i++;
+		} else if (!strcmp(Option, "-t")) {
+			Threads = atoi(OPTION_ARG("t"));
+			i++;
+		} else if (!strcmp(Option, "-f")) {
+			OutputFormat = OPTION_ARG("f");
+			i++;
+		} else if (!strcmp(Option, "-n")) {
+			Calls = atoi(OPTION_ARG("n"));
+			i++;
+		} else if (!strcmp(Option, "-S")) {
+			Stride = atoi(OPTION_ARG("S"));
+			i++;
+		} else if (!strcmp(Option, "-A")) {
+			AudioSamples = atoi(OPTION_ARG("A"));
+			i++;
+		} else if (!strcmp(Option, "-r")) {
+			Seed = static_cast<unsigned>(strtoul(OPTION_ARG("r"), NULL, 10));
+			i++;
+		} else if (!strcmp(Option, "-c")) {
+			Check = true;
+		} else if (!strcmp(Option, "-u")) {
+			CheckUpdate = true;
+		} else if (!strcmp(Option, "-x")) {
+			CheckFormats = true;
+		} else if (!InputFile) {
+			InputFile = Option;
+		} else {
+			std::cerr << "Warning: ignoring unknown option " << Option << std::endl;
+		}
+	}
+
+	if (!InputFile)
+		throw Error("Error: no input file specified");
+	if (Calls < 1 || Stride < 1 || AudioSamples < 1)
+		throw Error("Error: -n, -S and -A must be positive");
+	if (OutputFormat && FFMS_GetPixFmt(OutputFormat) < 0)
+		throw Error("Error: unknown pixel format");
+}
+
+double Now() {
+#ifdef _WIN32
+	LARGE_INTEGER Frequency, Counter;
+	QueryPerformanceFrequency(&Frequency);
+	QueryPerformanceCounter(&Counter);
+	return double(Counter.QuadPart) / double(Frequency.QuadPart);
+#else
+	timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+#endif
+}
+
+// Peak resident set size of the process so far, in kB
+int64_t PeakRSS() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS Counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &Counters, sizeof(Counters)))
+		return -1;
+	return Counters.PeakWorkingSetSize / 1024;
+#else
+	rusage Usage;
+	if (getrusage(RUSAGE_SELF, &Usage))
+		return -1;
+#ifdef __APPLE__
+	return Usage.ru_maxrss / 1024;
+#else
+	return Usage.ru_maxrss;
+#endif
+#endif
+}
+
+// A small xorshift generator so that random workloads request the same
+// frames everywhere for a given seed
+class Random {
+	uint32_t State;
+public:
+	Random(uint32_t Seed) : State(Seed ? Seed : 1) { }
+	uint32_t Next() {
+		State ^= State << 13;
+		State ^= State >> 17;
+		State ^= State << 5;
+		return State;
+	}
+	int64_t Below(int64_t Limit) {
+		uint64_t Value = (static_cast<uint64_t>(Next()) << 32) | Next();
+		return static_cast<int64_t>(Value % static_cast<uint64_t>(Limit));
+	}
+};
+
+std::string JSONString(std::string const& Str) {
+	std::string Out = "\"";
+	for (size_t i = 0; i < Str.size(); ++i) {
+		unsigned char c = Str[i];
+		if (c == '"' || c == '\\') {
+			Out += '\\';
+			Out += c;
+		} else if (c < 0x20) {
+			char Escape[8];
+			snprintf(Escape, sizeof(Escape), "\\u%04x", c);
+			Out += Escape;
+		} else {
+			Out += c;
+		}
+	}
+	return Out + "\"";
+}
+
+struct Result {
+	std::string Name;
+	std::vector<double> Latencies;
+	double OpenSeconds;
+	double Seconds;
+	// Requests which weren't for the frame or sample right after the
+	// previous one, so the source had to seek or skip ahead unless it had
+	// the data cached
+	int NonSequential;
+	// What the source itself counted, including its actual seeks
+	FFMS_SourceStats Stats;
+	// Frames or blocks of samples which differed from the linear decode
+	int Mismatches;
+	int64_t Units;
+	const char *UnitName;
+	int64_t PeakRSS;
+
+	Result() : OpenSeconds(0), Seconds(0), NonSequential(0), Mismatches(0), Units(0), UnitName("frames"), PeakRSS(0) {
+		memset(&Stats, 0, sizeof(Stats));
+	}
+};
+
+double Percentile(std::vector<double> const& Sorted, double P) {
+	if (Sorted.empty()) return 0;
+	size_t Rank = static_cast<size_t>(std::ceil(P / 100 * Sorted.size()));
+	return Sorted[Rank ? Rank - 1 : 0];
+}
+
+void WriteResult(std::ostream &Out, Result const& R) {
+	std::vector<double> Sorted(R.Latencies);
+	std::sort(Sorted.begin(), Sorted.end());
+
+	Out << "    {\n"
+		<< "      \"name\": " << JSONString(R.Name) << ",\n"
+		<< "      \"calls\": " << R.Latencies.size() << ",\n"
+		<< "      \"" << R.UnitName << "\": " << R.Units << ",\n"
+		<< "      \"open_seconds\": " << R.OpenSeconds << ",\n"
+		<< "      \"seconds\": " << R.Seconds << ",\n"
+		<< "      \"calls_per_second\": " << (R.Seconds > 0 ? R.Latencies.size() / R.Seconds : 0) << ",\n"
+		<< "      \"" << R.UnitName << "_per_second\": " << (R.Seconds > 0 ? R.Units / R.Seconds : 0) << ",\n"
+		<< "      \"latency_ms\": {\"p50\": " << Percentile(Sorted, 50) * 1000
+		<< ", \"p95\": " << Percentile(Sorted, 95) * 1000
+		<< ", \"p99\": " << Percentile(Sorted, 99) * 1000
+		<< ", \"max\": " << (Sorted.empty() ? 0 : Sorted.back() * 1000) << "},\n"
+		<< "      \"non_sequential_requests\": " << R.NonSequential << ",\n"
+		<< "      \"seeks\": " << R.Stats.Seeks << ",\n"
+		<< "      \"seek_retries\": " << R.Stats.SeekRetries << ",\n"
+		<< "      \"reopens\": " << R.Stats.Reopens << ",\n";
+	if (Check)
+		Out << "      \"mismatches\": " << R.Mismatches << ",\n";
+	Out
+		<< "      \"peak_rss_kb\": " << R.PeakRSS << "\n"
+		<< "    }";
+}
+
+uint64_t Hash(const uint8_t *Data, size_t Size, uint64_t Value = 14695981039346656037ULL) {
+	for (size_t i = 0; i < Size; ++i) {
+		Value ^= Data[i];
+		Value *= 1099511628211ULL;
+	}
+	return Value;
+}
+
+// Hash of the visible part of each plane, leaving out the padding
+uint64_t HashFrame(const FFMS_Frame *Frame) {
+	int Format = Frame->ConvertedPixelFormat >= 0 ? Frame->ConvertedPixelFormat : Frame->EncodedPixelFormat;
+	int Width = Frame->ScaledWidth > 0 ? Frame->ScaledWidth : Frame->EncodedWidth;
+	int Height = Frame->ScaledHeight > 0 ? Frame->ScaledHeight : Frame->EncodedHeight;
+	const AVPixFmtDescriptor *Desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(Format));
+	int RowBytes[4];
+	if (!Desc || av_image_fill_linesizes(RowBytes, static_cast<AVPixelFormat>(Format), Width) < 0)
+		return 0;
+
+	uint64_t Value = Hash(NULL, 0);
+	for (int p = 0; p < 4; ++p) {
+		if (!Frame->Data[p] || RowBytes[p] <= 0)
+			continue;
+		int Rows = p == 1 || p == 2 ? -((-Height) >> Desc->log2_chroma_h) : Height;
+		for (int y = 0; y < Rows; ++y)
+			Value = Hash(Frame->Data[p] + y * Frame->Linesize[p], RowBytes[p], Value);
+	}
+	return Value;
+}
+
+FFMS_Index *OpenIndex(double &Seconds) {
+	ErrorInfo E;
+	double Start = Now();
+
+	std::string Name = IndexFile.empty() ? std::string(InputFile) + ".ffindex" : IndexFile;
+	FFMS_Index *Index = FFMS_ReadIndex(Name.c_str(), &E);
+	if (Index && FFMS_IndexBelongsToFile(Index, InputFile, &E)) {
+		FFMS_DestroyIndex(Index);
+		Index = NULL;
+	}
+	if (!Index && !IndexFile.empty())
+		throw Error("Error reading index: ", E);
+
+	if (!Index) {
+		FFMS_Indexer *Indexer = FFMS_CreateIndexer(InputFile, &E);
+		if (!Indexer)
+			throw Error("Failed to initialize indexing: ", E);
+		Index = FFMS_DoIndexing(Indexer, -1, 0, NULL, NULL, FFMS_IEH_IGNORE, NULL, NULL, &E);
+		if (!Index)
+			throw Error("Indexing error: ", E);
+	}
+
+	Seconds = Now() - Start;
+	return Index;
+}
+
+// The frames each video workload requests, in order
+std::vector<int> VideoFrames(std::string const& Name, FFMS_Track *Track, int NumFrames) {
+	std::vector<int> Frames;
+	if (Name == "sequential") {
+		for (int i = 0; i < NumFrames && i < Calls; ++i)
+			Frames.push_back(i);
+	} else if (Name == "reverse") {
+		for (int i = NumFrames - 1; i >= 0 && NumFrames - i <= Calls; --i)
+			Frames.push_back(i);
+	} else if (Name == "random") {
+		Random R(Seed);
+		for (int i = 0; i < Calls; ++i)
+			Frames.push_back(static_cast<int>(R.Below(NumFrames)));
+	} else if (Name == "strided") {
+		for (int i = 0; i < NumFrames && static_cast<int>(Frames.size()) < Calls; i += Stride)
+			Frames.push_back(i);
+	} else if (Name == "keyframes") {
+		for (int i = 0; i < NumFrames && static_cast<int>(Frames.size()) < Calls; ++i) {
+			const FFMS_FrameInfo *Info = FFMS_GetFrameInfo(Track, i);
+			if (Info && Info->KeyFrame)
+				Frames.push_back(i);
+		}
+	}
+	return Frames;
+}
+
+// Opens a video source with the requested settings which hasn't decoded
+// anything yet
+FFMS_VideoSource *OpenVideo(FFMS_Index *Index) {
+	ErrorInfo E;
+	FFMS_VideoSource *V = FFMS_CreateVideoSource(InputFile, VideoTrack, Index, Threads, SeekMode, &E);
+	if (!V)
+		throw Error("Failed to open video source: ", E);
+	if (!OutputFormat)
+		return V;
+
+	// The frame size is only known after decoding a frame, so find it out
+	// and start again from a fresh source
+	const FFMS_Frame *First = FFMS_GetFrame(V, 0, &E);
+	int Width = First ? First->EncodedWidth : 0;
+	int Height = First ? First->EncodedHeight : 0;
+	FFMS_DestroyVideoSource(V);
+	if (!First)
+		throw Error("Decoding error: ", E);
+
+	V = FFMS_CreateVideoSource(InputFile, VideoTrack, Index, Threads, SeekMode, &E);
+	if (!V)
+		throw Error("Failed to open video source: ", E);
+	int Formats[2] = { FFMS_GetPixFmt(OutputFormat), -1 };
+	if (FFMS_SetOutputFormatV2(V, Formats, Width, Height, FFMS_RESIZER_BICUBIC, &E)) {
+		FFMS_DestroyVideoSource(V);
+		throw Error("Failed to set the output format: ", E);
+	}
+	return V;
+}
+
+Result RunVideo(std::string const& Name, FFMS_Index *Index) {
+	ErrorInfo E;
+	Result R;
+	R.Name = Name;
+
+	double Start = Now();
+	FFMS_VideoSource *V = OpenVideo(Index);
+	R.OpenSeconds = Now() - Start;
+
+	try {
+		const FFMS_VideoProperties *VP = FFMS_GetVideoProperties(V);
+		std::vector<int> Frames = VideoFrames(Name, FFMS_GetTrackFromVideo(V), VP->NumFrames);
+		int Last = -2;
+		for (size_t i = 0; i < Frames.size(); ++i) {
+			double CallStart = Now();
+			const FFMS_Frame *Frame = FFMS_GetFrame(V, Frames[i], &E);
+			if (!Frame)
+				throw Error("Decoding error: ", E);
+			R.Latencies.push_back(Now() - CallStart);
+			R.Seconds += R.Latencies.back();
+
+			if (Check && HashFrame(Frame) != FrameHashes[Frames[i]])
+				R.Mismatches++;
+			if (Frames[i] != Last + 1)
+				R.NonSequential++;
+			Last = Frames[i];
+		}
+		R.Units = Frames.size();
+		FFMS_GetVideoSourceStats(V, &R.Stats);
+	} catch (...) {
+		FFMS_DestroyVideoSource(V);
+		throw;
+	}
+	FFMS_DestroyVideoSource(V);
+
+	R.PeakRSS = PeakRSS();
+	return R;
+}
+
+int SampleSize(const FFMS_AudioProperties *AP) {
+	switch (AP->SampleFormat) {
+		case FFMS_FMT_U8: return 1;
+		case FFMS_FMT_S16: return 2;
+		case FFMS_FMT_S32: return 4;
+		case FFMS_FMT_FLT: return 4;
+		case FFMS_FMT_DBL: return 8;
+		default: return 8;
+	}
+}
+
+Result RunAudio(std::string const& Name, FFMS_Index *Index) {
+	ErrorInfo E;
+	Result R;
+	R.Name = Name;
+	R.UnitName = "samples";
+
+	double Start = Now();
+	FFMS_AudioSource *A = FFMS_CreateAudioSource(InputFile, AudioTrack, Index, FFMS_DELAY_FIRST_VIDEO_TRACK, &E);
+	if (!A)
+		throw Error("Failed to open audio source: ", E);
+	R.OpenSeconds = Now() - Start;
+
+	try {
+		const FFMS_AudioProperties *AP = FFMS_GetAudioProperties(A);
+		size_t BytesPerSample = AP->Channels * SampleSize(AP);
+		std::vector<uint8_t> Buffer(static_cast<size_t>(AudioSamples) * BytesPerSample);
+		Random Rand(Seed);
+		int64_t Next = 0;
+
+		for (int i = 0; i < Calls; ++i) {
+			int64_t Position = Next;
+			if (Name == "audio-random") {
+				if (AP->NumSamples <= AudioSamples) break;
+				Position = Rand.Below(AP->NumSamples - AudioSamples);
+				if (Check)
+					Position -= Position % AudioSamples;
+			}
+			int64_t Count = std::min<int64_t>(AudioSamples, AP->NumSamples - Position);
+			if (Count <= 0) break;
+
+			double CallStart = Now();
+			if (FFMS_GetAudio(A, &Buffer[0], Position, Count, &E))
+				throw Error("Decoding error: ", E);
+			R.Latencies.push_back(Now() - CallStart);
+			R.Seconds += R.Latencies.back();
+
+			if (Check && Hash(&Buffer[0], static_cast<size_t>(Count) * BytesPerSample) != AudioHashes[Position / AudioSamples])
+				R.Mismatches++;
+			if (Position != Next)
+				R.NonSequential++;
+			Next = Position + Count;
+			R.Units += Count;
+		}
+		FFMS_GetAudioSourceStats(A, &R.Stats);
+	} catch (...) {
+		FFMS_DestroyAudioSource(A);
+		throw;
+	}
+	FFMS_DestroyAudioSource(A);
+
+	R.PeakRSS = PeakRSS();
+	return R;
+}
+
+// Fill in FrameHashes and AudioHashes
+void DecodeLinearly(FFMS_Index *Index, bool Video, bool Audio) {
+	ErrorInfo E;
+	if (Video) {
+		FFMS_VideoSource *V = OpenVideo(Index);
+		int NumFrames = FFMS_GetVideoProperties(V)->NumFrames;
+		for (int i = 0; i < NumFrames; ++i) {
+			const FFMS_Frame *Frame = FFMS_GetFrame(V, i, &E);
+			if (!Frame) {
+				FFMS_DestroyVideoSource(V);
+				throw Error("Decoding error: ", E);
+			}
+			FrameHashes.push_back(HashFrame(Frame));
+		}
+		FFMS_DestroyVideoSource(V);
+	}
+
+	if (Audio) {
+		FFMS_AudioSource *A = FFMS_CreateAudioSource(InputFile, AudioTrack, Index, FFMS_DELAY_FIRST_VIDEO_TRACK, &E);
+		if (!A)
+			throw Error("Failed to open audio source: ", E);
+		const FFMS_AudioProperties *AP = FFMS_GetAudioProperties(A);
+		size_t BytesPerSample = AP->Channels * SampleSize(AP);
+		std::vector<uint8_t> Buffer(static_cast<size_t>(AudioSamples) * BytesPerSample);
+		for (int64_t Position = 0; Position < AP->NumSamples; Position += AudioSamples) {
+			int64_t Count = std::min<int64_t>(AudioSamples, AP->NumSamples - Position);
+			if (FFMS_GetAudio(A, &Buffer[0], Position, Count, &E)) {
+				FFMS_DestroyAudioSource(A);
+				throw Error("Decoding error: ", E);
+			}
+			AudioHashes.push_back(Hash(&Buffer[0], static_cast<size_t>(Count) * BytesPerSample));
+		}
+		FFMS_DestroyAudioSource(A);
+	}
+}
+
+bool IsVideoWorkload(std::string const& Name) {
+	return Name == "sequential" || Name == "reverse" || Name == "random" || Name == "strided" || Name == "keyframes";
+}
+
+bool IsAudioWorkload(std::string const& Name) {
+	return Name == "audio-sequential" || Name == "audio-random";
+}
+
+// Returns the total number of mismatches
+int RunBenchmark() {
+	double IndexSeconds;
+	FFMS_Index *Index = OpenIndex(IndexSeconds);
+
+	std::vector<Result> Results;
+	try {
+		ErrorInfo E;
+		if (VideoTrack < 0)
+			VideoTrack = FFMS_GetFirstTrackOfType(Index, FFMS_TYPE_VIDEO, &E);
+		if (AudioTrack < 0)
+			AudioTrack = FFMS_GetFirstTrackOfType(Index, FFMS_TYPE_AUDIO, &E);
+
+		std::vector<std::string> Names;
+		std::stringstream List(Workloads);
+		std::string Name;
+		bool Video = false, Audio = false;
+		while (std::getline(List, Name, ',')) {
+			if (!IsVideoWorkload(Name) && !IsAudioWorkload(Name))
+				throw Error(("Error: unknown workload " + Name).c_str());
+			Video = Video || IsVideoWorkload(Name);
+			Audio = Audio || IsAudioWorkload(Name);
+			Names.push_back(Name);
+		}
+		if (Video && VideoTrack < 0)
+			throw Error("Error: the file has no video track");
+
+		if (Check)
+			DecodeLinearly(Index, Video, Audio && AudioTrack >= 0);
+
+		for (size_t i = 0; i < Names.size(); ++i) {
+			std::string const& Name = Names[i];
+			if (IsVideoWorkload(Name)) {
+				Results.push_back(RunVideo(Name, Index));
+			} else {
+				if (AudioTrack < 0) {
+					std::cerr << "Skipping " << Name << ": the file has no audio track" << std::endl;
+					continue;
+				}
+				Results.push_back(RunAudio(Name, Index));
+			}
+		}
+	} catch (...) {
+		FFMS_DestroyIndex(Index);
+		throw;
+	}
+	FFMS_DestroyIndex(Index);
+
+	std::ofstream File;
+	if (!OutputFile.empty()) {
+		File.open(OutputFile.c_str());
+		if (!File)
+			throw Error("Error: can't open the output file");
+	}
+	std::ostream &Out = OutputFile.empty() ? std::cout : File;
+
+	Out << "{\n"
+		<< "  \"file\": " << JSONString(InputFile) << ",\n"
+		<< "  \"ffms_version\": " << FFMS_GetVersion() << ",\n"
+		<< "  \"seek_mode\": " << SeekMode << ",\n"
+		<< "  \"threads\": " << Threads << ",\n"
+		<< "  \"output_format\": " << (OutputFormat ? JSONString(OutputFormat) : "null") << ",\n"
+		<< "  \"video_track\": " << VideoTrack << ",\n"
+		<< "  \"audio_track\": " << AudioTrack << ",\n"
+		<< "  \"seed\": " << Seed << ",\n"
+		<< "  \"checked\": " << (Check ? "true" : "false") << ",\n"
+		<< "  \"index_seconds\": " << IndexSeconds << ",\n"
+		<< "  \"workloads\": [\n";
+	for (size_t i = 0; i < Results.size(); ++i) {
+		WriteResult(Out, Results[i]);
+		Out << (i + 1 < Results.size() ? ",\n" : "\n");
+	}
+	Out << "  ],\n"
+		<< "  \"peak_rss_kb\": " << PeakRSS() << "\n"
+		<< "}" << std::endl;
+
+	int Mismatches = 0;
+	for (size_t i = 0; i < Results.size(); ++i)
+		Mismatches += Results[i].Mismatches;
+	return Mismatches;
+}
+
+FFMS_Index *IndexWithLAVF(const char *File) {
+	ErrorInfo E;
+	FFMS_Indexer *Indexer = FFMS_CreateIndexerWithDemuxer(File, FFMS_SOURCE_LAVF, &E);
+	if (!Indexer)
+		throw Error("Failed to initialize indexing: ", E);
+	FFMS_Index *Index = FFMS_DoIndexing(Indexer, -1, 0, NULL, NULL, FFMS_IEH_IGNORE, NULL, NULL, &E);
+	if (!Index)
+		throw Error("Indexing error: ", E);
+	return Index;
+}
+
+// Write the first half of the input file to Part, as if it was still being written
+void CopyFirstHalf(std::string const& Part) {
+	std::ifstream In(InputFile, std::ios::binary);
+	In.seekg(0, std::ios::end);
+	int64_t Remaining = static_cast<int64_t>(In.tellg()) / 2;
+	In.seekg(0, std::ios::beg);
+	std::ofstream Out(Part.c_str(), std::ios::binary);
+	if (!In || !Out)
+		throw Error("Error: can't copy the start of the file");
+
+	std::vector<char> Buffer(1 << 20);
+	while (Remaining > 0) {
+		std::streamsize Size = static_cast<std::streamsize>(std::min<int64_t>(Remaining, Buffer.size()));
+		if (!In.read(&Buffer[0], Size) || !Out.write(&Buffer[0], Size))
+			throw Error("Error: can't copy the start of the file");
+		Remaining -= Size;
+	}
+}
+
+int64_t NumSamples(FFMS_Index *Index, int Track) {
+	ErrorInfo E;
+	FFMS_AudioSource *A = FFMS_CreateAudioSource(InputFile, Track, Index, FFMS_DELAY_NO_SHIFT, &E);
+	if (!A)
+		throw Error("Failed to open audio source: ", E);
+	int64_t Samples = FFMS_GetAudioProperties(A)->NumSamples;
+	FFMS_DestroyAudioSource(A);
+	return Samples;
+}
+
+bool SameTrack(FFMS_Index *Expected, FFMS_Index *Actual, int Track) {
+	FFMS_Track *A = FFMS_GetTrackFromIndex(Expected, Track);
+	FFMS_Track *B = FFMS_GetTrackFromIndex(Actual, Track);
+	if (FFMS_GetTrackType(A) != FFMS_GetTrackType(B) || FFMS_GetNumFrames(A) != FFMS_GetNumFrames(B))
+		return false;
+	for (int i = 0; i < FFMS_GetNumFrames(A); ++i) {
+		const FFMS_FrameInfo *FA = FFMS_GetFrameInfo(A, i);
+		const FFMS_FrameInfo *FB = FFMS_GetFrameInfo(B, i);
+		if (!FA != !FB)
+			return false;
+		if (FA && (FA->PTS != FB->PTS || FA->RepeatPict != FB->RepeatPict || FA->KeyFrame != FB->KeyFrame))
+			return false;
+	}
+	// Audio frames have no public frame info, but duplicated or missing
+	// frames show up in the sample count
+	if (FFMS_GetTrackType(A) == FFMS_TYPE_AUDIO && FFMS_GetNumFrames(A) > 0)
+		return NumSamples(Expected, Track) == NumSamples(Actual, Track);
+	return true;
+}
+
+// Returns the number of tracks which differ between an index of the whole
+// file and one of its first half updated with the whole file
+int RunUpdateCheck() {
+	ErrorInfo E;
+	std::string Part = std::string(InputFile) + ".part";
+	CopyFirstHalf(Part);
+	FFMS_Index *Updated = NULL;
+	try {
+		Updated = IndexWithLAVF(Part.c_str());
+	} catch (...) {
+		remove(Part.c_str());
+		throw;
+	}
+	remove(Part.c_str());
+
+	FFMS_Index *Full = NULL;
+	int Differences = 0;
+	try {
+		if (FFMS_UpdateIndex(Updated, InputFile, NULL, NULL, &E))
+			throw Error("Updating the index failed: ", E);
+		Full = IndexWithLAVF(InputFile);
+
+		if (FFMS_GetNumTracks(Full) != FFMS_GetNumTracks(Updated))
+			throw Error("Error: the updated index has a different number of tracks");
+		for (int i = 0; i < FFMS_GetNumTracks(Full); ++i) {
+			if (!SameTrack(Full, Updated, i)) {
+				std::cerr << "Track " << i << " of the updated index differs from a full index" << std::endl;
+				Differences++;
+			}
+		}
+	} catch (...) {
+		FFMS_DestroyIndex(Updated);
+		if (Full)
+			FFMS_DestroyIndex(Full);
+		throw;
+	}
+	FFMS_DestroyIndex(Updated);
+	FFMS_DestroyIndex(Full);
+	return Differences;
+}
+
+// Index the input file with the source module it would normally use, on up
+// to IndexThreads threads with parts of at least SplitSize bytes
+FFMS_Index *IndexInParts(int IndexThreads, int64_t SplitSize) {
+	ErrorInfo E;
+	FFMS_Indexer *Indexer = FFMS_CreateIndexer(InputFile, &E);
+	if (!Indexer)
+		throw Error("Failed to initialize indexing: ", E);
+	FFMS_SetIndexingThreads(Indexer, IndexThreads);
+	FFMS_SetIndexingSplitSize(Indexer, SplitSize);
+	FFMS_Index *Index = FFMS_DoIndexing(Indexer, -1, 0, NULL, NULL, FFMS_IEH_IGNORE, NULL, NULL, &E);
+	if (!Index)
+		throw Error("Indexing error: ", E);
+	return Index;
+}
+
+// The indexes and index files made by the format check, which are released
+// together once it's done since columnar indexes read their tracks from the
+// file on first use
+struct FormatCheck {
+	std::vector<FFMS_Index *> Indexes;
+	std::vector<std::string> Files;
+
+	~FormatCheck() {
+		for (size_t i = 0; i < Indexes.size(); ++i)
+			FFMS_DestroyIndex(Indexes[i]);
+		for (size_t i = 0; i < Files.size(); ++i)
+			remove(Files[i].c_str());
+	}
+
+	FFMS_Index *Keep(FFMS_Index *Index) {
+		Indexes.push_back(Index);
+		return Index;
+	}
+
+	// Write Index in Format and read it back
+	FFMS_Index *RoundTrip(FFMS_Index *Index, int Format, const char *Suffix) {
+		ErrorInfo E;
+		Files.push_back(std::string(InputFile) + Suffix);
+		const char *File = Files.back().c_str();
+		if (FFMS_WriteIndexV2(File, Index, Format, &E))
+			throw Error("Writing the index failed: ", E);
+		FFMS_Index *Read = FFMS_ReadIndex(File, &E);
+		if (!Read)
+			throw Error("Reading the index back failed: ", E);
+		return Keep(Read);
+	}
+};
+
+// Returns the number of tracks which differ between Expected and Actual
+int CompareIndexes(FFMS_Index *Expected, FFMS_Index *Actual, const char *What) {
+	if (FFMS_GetNumTracks(Expected) != FFMS_GetNumTracks(Actual)) {
+		std::cerr << "The " << What << " index has a different number of tracks" << std::endl;
+		return 1;
+	}
+	int Differences = 0;
+	for (int i = 0; i < FFMS_GetNumTracks(Expected); ++i) {
+		if (!SameTrack(Expected, Actual, i)) {
+			std::cerr << "Track " << i << " of the " << What << " index differs" << std::endl;
+			Differences++;
+		}
+	}
+	return Differences;
+}
+
+// Returns the number of tracks which differ between a serially made index
+// and one made in parts, or read back after writing it in each index format
+int RunFormatCheck() {
+	FormatCheck C;
+	FFMS_Index *Serial = C.Keep(IndexInParts(1, 1));
+	// Parts of a single byte make every file as many parts as there are threads
+	int Differences = CompareIndexes(Serial, C.Keep(IndexInParts(4, 1)), "split");
+
+	FFMS_Index *Compressed = C.RoundTrip(Serial, FFMS_INDEX_FORMAT_COMPRESSED, ".compressed.ffindex");
+	Differences += CompareIndexes(Serial, Compressed, "compressed");
+	Differences += CompareIndexes(Compressed, C.RoundTrip(Serial, FFMS_INDEX_FORMAT_COLUMNAR, ".columnar.ffindex"), "columnar");
+
+	// Compacting before the tracks are first used also covers compacting them as they're loaded
+	FFMS_Index *Compact = C.RoundTrip(Serial, FFMS_INDEX_FORMAT_COLUMNAR, ".compact.ffindex");
+	ErrorInfo E;
+	if (FFMS_CompactIndex(Compact, &E))
+		throw Error("Compacting the index failed: ", E);
+	Differences += CompareIndexes(Compressed, Compact, "compact");
+	Differences += CompareIndexes(Compressed, C.RoundTrip(Compact, FFMS_INDEX_FORMAT_COMPRESSED, ".recompressed.ffindex"), "rewritten compact");
+	return Differences;
+}
+
+} // namespace {
+
+int main(int argc, char *argv[]) {
+	try {
+		if (argc <= 1) {
+			PrintUsage();
+			return 0;
+		}
+
+		ParseCMDLine(argc, argv);
+	}
+	catch (Error const& e) {
+		std::cerr << e.msg << std::endl;
+		return 1;
+	}
+
+#ifdef _WIN32
+	if (FAILED(CoInitializeEx(NULL, COINIT_MULTITHREADED))) {
+		std::cerr << "COM initialization failure" << std::endl;
+		return 1;
+	}
+#endif /* _WIN32 */
+
+	FFMS_Init(0, 0);
+	FFMS_SetLogLevel(AV_LOG_QUIET);
+
+	try {
+		if (CheckUpdate) {
+			if (int Differences = RunUpdateCheck()) {
+				std::cerr << Differences << " tracks differed after updating the index" << std::endl;
+				return 2;
+			}
+			return 0;
+		}
+		if (CheckFormats) {
+			if (int Differences = RunFormatCheck()) {
+				std::cerr << Differences << " tracks differed between index formats" << std::endl;
+				return 2;
+			}
+			return 0;
+		}
+		if (int Mismatches = RunBenchmark()) {
+			std::cerr << Mismatches << " frames or blocks of samples differed from a linear decode" << std::endl;
+			return 2;
+		}
+	}
+	catch (Error const& e) {
+		std::cerr << e.msg << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,386 @@
+//  Copyright (c) 2015 The FFmpegSource Project
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+// Writes short synthetic clips with the encoders and muxers libavcodec and
+// libavformat were built with, for make check and make bench to run
+// ffmsbench -c over. Clips which need a missing encoder are skipped.
+
+#include "ffmscompat.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/dict.h>
+#include <libavutil/frame.h>
+#include <libavutil/log.h>
+#include <libavutil/mathematics.h>
+}
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+namespace {
+
+const char *OutputDir = 0;
+int NumFrames = 250;
+
+struct Error {
+	std::string msg;
+	Error(std::string const& msg) : msg(msg) { }
+};
+
+enum ClipFlags {
+	CLIP_INTERLACED = 1,
+	CLIP_VFR = 2
+};
+
+struct ClipSpec {
+	const char *Name;
+	const char *Encoder;
+	int GOPSize;
+	int BFrames;
+	int Flags;
+};
+
+// The file extension picks the muxer
+const ClipSpec Clips[] = {
+	{ "mpeg4-ip.mkv",          "mpeg4",      12, 0, 0 },
+	{ "mpeg4-b2.mp4",          "mpeg4",      30, 2, 0 },
+	{ "mpeg4-b2-vfr.mkv",      "mpeg4",      30, 2, CLIP_VFR },
+	{ "mpeg2-b2.ts",           "mpeg2video", 15, 2, 0 },
+	{ "mpeg2-interlaced.ts",   "mpeg2video", 15, 2, CLIP_INTERLACED },
+	{ "mpeg2-interlaced.mkv",  "mpeg2video", 15, 2, CLIP_INTERLACED },
+	{ "h264-b3.mkv",           "libx264",    50, 3, 0 },
+	{ "h264-b3.mp4",           "libx264",    50, 3, 0 },
+	{ "h264-b3.ts",            "libx264",    50, 3, 0 },
+	{ "h264-interlaced.ts",    "libx264",    25, 2, CLIP_INTERLACED },
+	{ "h264-vfr.mp4",          "libx264",    50, 3, CLIP_VFR },
+	{ "mjpeg-intra.mkv",       "mjpeg",       1, 0, 0 },
+};
+
+// Frame durations in milliseconds which variable frame rate clips cycle through
+const int VFRDurations[] = { 40, 40, 20, 60, 33, 100 };
+
+const int Width = 320;
+const int Height = 240;
+const int SampleRate = 48000;
+const double Pi = 3.14159265358979323846;
+
+void PrintUsage() {
+	std::cout <<
+		"FFmpegSource2 test clip generator\n"
+		"Usage: ffmsgen [options] outputdir\n"
+		"Writes synthetic clips in a number of codecs, frame layouts and containers to outputdir\n"
+		"and prints the name of every clip written.\n"
+		"\n"
+		"Options:\n"
+		"-n N      Make every clip N frames long (default: 250)"
+		<< std::endl;
+}
+
+void ParseCMDLine(int argc, char *argv[]) {
+	for (int i = 1; i < argc; ++i) {
+		const char *Option = argv[i];
+		if (!strcmp(Option, "-n")) {
+			if (i + 1 >= argc)
+				throw Error("Error: missing argument for -n");
+			NumFrames = atoi(argv[++i]);
+		} else if (!OutputDir) {
+			OutputDir = Option;
+		} else {
+			std::cerr << "Warning: ignoring unknown option " << Option << std::endl;
+		}
+	}
+
+	if (!OutputDir)
+		throw Error("Error: no output directory specified");
+	if (NumFrames < 1)
+		throw Error("Error: -n must be positive");
+}
+
+// A moving box over a gradient, which moves between the fields of
+// interlaced clips so that the fields differ
+void FillVideoFrame(AVFrame *Frame, int N, bool Interlaced) {
+	for (int y = 0; y < Height; ++y) {
+		int t = N * 2 + (Interlaced ? (y & 1) : 0);
+		int BoxX = (t * 3) % (Width - 32);
+		int BoxY = (t * 2) % (Height - 32);
+		uint8_t *Line = Frame->data[0] + y * Frame->linesize[0];
+		for (int x = 0; x < Width; ++x) {
+			bool InBox = x >= BoxX && x < BoxX + 32 && y >= BoxY && y < BoxY + 32;
+			Line[x] = InBox ? 235 : static_cast<uint8_t>(16 + (x + y * 2 + N) % 200);
+		}
+	}
+	for (int y = 0; y < Height / 2; ++y) {
+		uint8_t *U = Frame->data[1] + y * Frame->linesize[1];
+		uint8_t *V = Frame->data[2] + y * Frame->linesize[2];
+		for (int x = 0; x < Width / 2; ++x) {
+			U[x] = static_cast<uint8_t>(64 + (x + N) % 128);
+			V[x] = static_cast<uint8_t>(64 + (y + N * 2) % 128);
+		}
+	}
+}
+
+// A tone whose pitch changes every second
+void FillAudioFrame(AVFrame *Frame, int64_t FirstSample) {
+	int16_t *Samples = reinterpret_cast<int16_t *>(Frame->data[0]);
+	for (int i = 0; i < Frame->nb_samples; ++i) {
+		int64_t s = FirstSample + i;
+		double Frequency = 220 * (1 + (s / SampleRate) % 4);
+		int16_t Value = static_cast<int16_t>(8000 * sin(2 * Pi * Frequency * s / SampleRate));
+		Samples[i * 2] = Value;
+		Samples[i * 2 + 1] = static_cast<int16_t>(Value / 2);
+	}
+}
+
+class ClipWriter {
+	AVFormatContext *Format;
+	AVStream *VideoStream;
+	AVStream *AudioStream;
+	AVFrame *VideoFrame;
+	AVFrame *AudioFrame;
+	ClipSpec const& Spec;
+
+	AVStream *AddStream(AVCodec *Codec) {
+		AVStream *Stream = avformat_new_stream(Format, Codec);
+		if (!Stream)
+			throw Error("Could not add a stream");
+		if (Format->oformat->flags & AVFMT_GLOBALHEADER)
+			Stream->codec->flags |= CODEC_FLAG_GLOBAL_HEADER;
+		return Stream;
+	}
+
+	void OpenVideo(AVCodec *Codec) {
+		VideoStream = AddStream(Codec);
+		AVCodecContext *Context = VideoStream->codec;
+		Context->width = Width;
+		Context->height = Height;
+		Context->pix_fmt = Codec->id == AV_CODEC_ID_MJPEG ? AV_PIX_FMT_YUVJ420P : AV_PIX_FMT_YUV420P;
+		Context->time_base.num = 1;
+		Context->time_base.den = (Spec.Flags & CLIP_VFR) ? 1000 : 25;
+		Context->gop_size = Spec.GOPSize;
+		Context->max_b_frames = Spec.BFrames;
+		Context->bit_rate = 1000000;
+		if (Spec.Flags & CLIP_INTERLACED) {
+			Context->flags |= CODEC_FLAG_INTERLACED_DCT | CODEC_FLAG_INTERLACED_ME;
+			Context->field_order = AV_FIELD_TT;
+		}
+		VideoStream->time_base = Context->time_base;
+
+		AVDictionary *Options = NULL;
+		if (!strcmp(Codec->name, "libx264"))
+			av_dict_set(&Options, "preset", "veryfast", 0);
+		int Ret = avcodec_open2(Context, Codec, &Options);
+		av_dict_free(&Options);
+		if (Ret < 0)
+			throw Error(std::string("Could not open the ") + Codec->name + " encoder");
+
+		VideoFrame = av_frame_alloc();
+		VideoFrame->format = Context->pix_fmt;
+		VideoFrame->width = Width;
+		VideoFrame->height = Height;
+		if (av_frame_get_buffer(VideoFrame, 32) < 0)
+			throw Error("Could not allocate a video frame");
+	}
+
+	void OpenAudio(AVCodec *Codec) {
+		AudioStream = AddStream(Codec);
+		AVCodecContext *Context = AudioStream->codec;
+		Context->sample_fmt = AV_SAMPLE_FMT_S16;
+		Context->sample_rate = SampleRate;
+		Context->channels = 2;
+		Context->channel_layout = AV_CH_LAYOUT_STEREO;
+		Context->bit_rate = 128000;
+		Context->time_base.num = 1;
+		Context->time_base.den = SampleRate;
+		AudioStream->time_base = Context->time_base;
+		if (avcodec_open2(Context, Codec, NULL) < 0)
+			throw Error("Could not open the mp2 encoder");
+
+		AudioFrame = av_frame_alloc();
+		AudioFrame->format = Context->sample_fmt;
+		AudioFrame->channel_layout = Context->channel_layout;
+		AudioFrame->nb_samples = Context->frame_size;
+		if (av_frame_get_buffer(AudioFrame, 0) < 0)
+			throw Error("Could not allocate an audio frame");
+	}
+
+	void WritePacket(AVStream *Stream, AVPacket &Packet) {
+		AVRational TimeBase = Stream->codec->time_base;
+		if (Packet.pts != AV_NOPTS_VALUE)
+			Packet.pts = av_rescale_q(Packet.pts, TimeBase, Stream->time_base);
+		if (Packet.dts != AV_NOPTS_VALUE)
+			Packet.dts = av_rescale_q(Packet.dts, TimeBase, Stream->time_base);
+		Packet.duration = static_cast<int>(av_rescale_q(Packet.duration, TimeBase, Stream->time_base));
+		Packet.stream_index = Stream->index;
+		if (av_interleaved_write_frame(Format, &Packet) < 0)
+			throw Error("Could not write a packet");
+	}
+
+	// Returns whether the encoder gave back a packet
+	bool Encode(AVStream *Stream, AVFrame *Frame) {
+		AVPacket Packet;
+		av_init_packet(&Packet);
+		Packet.data = NULL;
+		Packet.size = 0;
+		int GotPacket = 0;
+		int Ret = Stream->codec->codec_type == AVMEDIA_TYPE_VIDEO ?
+			avcodec_encode_video2(Stream->codec, &Packet, Frame, &GotPacket) :
+			avcodec_encode_audio2(Stream->codec, &Packet, Frame, &GotPacket);
+		if (Ret < 0)
+			throw Error("Encoding failed");
+		if (GotPacket)
+			WritePacket(Stream, Packet);
+		return !!GotPacket;
+	}
+
+	void Flush(AVStream *Stream) {
+		if (Stream->codec->codec->capabilities & CODEC_CAP_DELAY)
+			while (Encode(Stream, NULL)) { }
+	}
+
+public:
+	ClipWriter(ClipSpec const& Spec, AVCodec *VideoCodec, AVCodec *AudioCodec, std::string const& Path)
+	: Format(NULL)
+	, VideoStream(NULL)
+	, AudioStream(NULL)
+	, VideoFrame(NULL)
+	, AudioFrame(NULL)
+	, Spec(Spec)
+	{
+		if (avformat_alloc_output_context2(&Format, NULL, NULL, Path.c_str()) < 0 || !Format)
+			throw Error("Could not find a muxer for " + Path);
+		try {
+			OpenVideo(VideoCodec);
+			OpenAudio(AudioCodec);
+			if (!(Format->oformat->flags & AVFMT_NOFILE) && avio_open(&Format->pb, Path.c_str(), AVIO_FLAG_WRITE) < 0)
+				throw Error("Could not create " + Path);
+		} catch (...) {
+			Close();
+			throw;
+		}
+	}
+
+	~ClipWriter() {
+		Close();
+	}
+
+	void Close() {
+		av_frame_free(&VideoFrame);
+		av_frame_free(&AudioFrame);
+		if (!Format)
+			return;
+		for (unsigned i = 0; i < Format->nb_streams; ++i)
+			avcodec_close(Format->streams[i]->codec);
+		if (Format->pb && !(Format->oformat->flags & AVFMT_NOFILE))
+			avio_closep(&Format->pb);
+		avformat_free_context(Format);
+		Format = NULL;
+	}
+
+	void Write() {
+		if (avformat_write_header(Format, NULL) < 0)
+			throw Error("Could not write the header");
+
+		AVRational VideoBase = VideoStream->codec->time_base;
+		AVRational AudioBase = AudioStream->codec->time_base;
+		int64_t VideoPTS = 0;
+		int64_t AudioPTS = 0;
+		int Frame = 0;
+		// Audio covers the video, so that both end at the same time
+		while (Frame < NumFrames || av_compare_ts(AudioPTS, AudioBase, VideoPTS, VideoBase) < 0) {
+			if (Frame < NumFrames && av_compare_ts(VideoPTS, VideoBase, AudioPTS, AudioBase) <= 0) {
+				if (av_frame_make_writable(VideoFrame) < 0)
+					throw Error("Could not make the video frame writable");
+				FillVideoFrame(VideoFrame, Frame, !!(Spec.Flags & CLIP_INTERLACED));
+				VideoFrame->pts = VideoPTS;
+				VideoFrame->interlaced_frame = !!(Spec.Flags & CLIP_INTERLACED);
+				VideoFrame->top_field_first = VideoFrame->interlaced_frame;
+				Encode(VideoStream, VideoFrame);
+				VideoPTS += (Spec.Flags & CLIP_VFR) ? VFRDurations[Frame % (sizeof(VFRDurations) / sizeof(VFRDurations[0]))] : 1;
+				Frame++;
+			} else {
+				if (av_frame_make_writable(AudioFrame) < 0)
+					throw Error("Could not make the audio frame writable");
+				FillAudioFrame(AudioFrame, AudioPTS);
+				AudioFrame->pts = AudioPTS;
+				Encode(AudioStream, AudioFrame);
+				AudioPTS += AudioFrame->nb_samples;
+			}
+		}
+
+		Flush(VideoStream);
+		Flush(AudioStream);
+		if (av_write_trailer(Format) < 0)
+			throw Error("Could not write the trailer");
+	}
+};
+
+// Returns whether the clip was written, or false if it was skipped
+bool WriteClip(ClipSpec const& Spec) {
+	AVCodec *VideoCodec = avcodec_find_encoder_by_name(Spec.Encoder);
+	AVCodec *AudioCodec = avcodec_find_encoder(AV_CODEC_ID_MP2);
+	if (!VideoCodec || !AudioCodec) {
+		std::cerr << "Skipping " << Spec.Name << ": no " << (VideoCodec ? "mp2" : Spec.Encoder) << " encoder" << std::endl;
+		return false;
+	}
+
+	std::string Path = std::string(OutputDir) + "/" + Spec.Name;
+	ClipWriter Writer(Spec, VideoCodec, AudioCodec, Path);
+	Writer.Write();
+	return true;
+}
+
+} // namespace {
+
+int main(int argc, char *argv[]) {
+	try {
+		if (argc <= 1) {
+			PrintUsage();
+			return 0;
+		}
+
+		ParseCMDLine(argc, argv);
+	}
+	catch (Error const& e) {
+		std::cerr << e.msg << std::endl;
+		return 1;
+	}
+
+	av_register_all();
+	av_log_set_level(AV_LOG_ERROR);
+
+	for (size_t i = 0; i < sizeof(Clips) / sizeof(Clips[0]); ++i) {
+		try {
+			if (WriteClip(Clips[i]))
+				std::cout << OutputDir << "/" << Clips[i].Name << std::endl;
+		}
+		catch (Error const& e) {
+			std::cerr << Clips[i].Name << ": " << e.msg << std::endl;
+			return 1;
+		}
+	}
+
+	return 0;
+}
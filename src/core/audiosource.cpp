@@ -21,9 +21,13 @@
 #include "audiosource.h"
 
 #include "indexing.h"
+#include "numthreads.h"
+#include "threading.h"
+#include "trace.h"
 
 #include <algorithm>
 #include <cassert>
+#include <memory>
 
 extern "C" {
 #if VERSION_CHECK(LIBAVUTIL_VERSION_INT, >=, 52, 2, 0, 52, 6, 100)
@@ -31,6 +35,9 @@ extern "C" {
 #endif
 }
 
+extern bool HasHaaliMPEG;
+extern bool HasHaaliOGG;
+
 namespace {
 #define MAPPER(m, n) OptionMapper<FFMS_ResampleOptions>(n, &FFMS_ResampleOptions::m)
 OptionMapper<FFMS_ResampleOptions> resample_options[] = {
@@ -62,10 +69,14 @@ FFMS_AudioSource::FFMS_AudioSource(const char *SourceFile, FFMS_Index &Index, in
 , NeedsResample(false)
 , CurrentSample(-1)
 , PacketNumber(0)
-, CurrentFrame(NULL)
+, CurrentFrame()
 , TrackNumber(Track)
 , SeekOffset(0)
+, SourceFile(SourceFile)
+, Index(Index)
+, DecodingThreads(1)
 {
+	::ResetStats(Stats);
 #ifdef FFMBC
 	throw FFMS_Exception(FFMS_ERROR_DECODING, FFMS_ERROR_UNSUPPORTED,
 		"Audio is unsupported in ffmbc build");
@@ -74,11 +85,11 @@ FFMS_AudioSource::FFMS_AudioSource(const char *SourceFile, FFMS_Index &Index, in
 		throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
 			"Out of bounds track index selected");
 
-	if (Index[Track].TT != FFMS_TYPE_AUDIO)
+	if (Index.GetTrackType(Track) != FFMS_TYPE_AUDIO)
 		throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
 			"Not an audio track");
 
-	if (Index[Track].empty())
+	if (Index.IsTrackEmpty(Track))
 		throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
 			"Audio track contains no audio frames");
 
@@ -87,6 +98,14 @@ FFMS_AudioSource::FFMS_AudioSource(const char *SourceFile, FFMS_Index &Index, in
 			"The index does not match the source file");
 
 	Frames = Index[Track];
+
+	Index.AddRef();
+}
+
+FFMS_AudioSource::~FFMS_AudioSource() {
+	for (size_t i = 0; i < Workers.size(); ++i)
+		delete Workers[i];
+	Index.Release();
 }
 
 #define EXCESSIVE_CACHE_SIZE 400
@@ -109,6 +128,11 @@ void FFMS_AudioSource::Init(const FFMS_Index &Index, int DelayMode) {
 	std::auto_ptr<FFMS_ResampleOptions> opt(CreateResampleOptions());
 	SetOutputFormat(opt.get());
 
+	ApplyDelay(Index, DelayMode);
+#endif
+}
+
+void FFMS_AudioSource::ApplyDelay(const FFMS_Index &Index, int DelayMode) {
 	if (DelayMode < FFMS_DELAY_NO_SHIFT)
 		throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
 			"Bad audio delay compensation mode");
@@ -119,13 +143,13 @@ void FFMS_AudioSource::Init(const FFMS_Index &Index, int DelayMode) {
 		throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
 			"Out of bounds track index selected for audio delay compensation");
 
-	if (DelayMode >= 0 && Index[DelayMode].TT != FFMS_TYPE_VIDEO)
+	if (DelayMode >= 0 && Index.GetTrackType(DelayMode) != FFMS_TYPE_VIDEO)
 		throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
 			"Audio delay compensation must be relative to a video track");
 
 	if (DelayMode == FFMS_DELAY_FIRST_VIDEO_TRACK) {
 		for (size_t i = 0; i < Index.size(); ++i) {
-			if (Index[i].TT == FFMS_TYPE_VIDEO && !Index[i].empty()) {
+			if (Index.GetTrackType(i) == FFMS_TYPE_VIDEO && !Index.IsTrackEmpty(i)) {
 				DelayMode = i;
 				break;
 			}
@@ -146,7 +170,6 @@ void FFMS_AudioSource::Init(const FFMS_Index &Index, int DelayMode) {
 	}
 
 	AP.NumSamples += Delay;
-#endif
 }
 
 void FFMS_AudioSource::CacheBeginning() {
@@ -202,11 +225,16 @@ void FFMS_AudioSource::SetOutputFormat(const FFMS_ResampleOptions *opt) {
 			"FFMS was not built with resampling enabled. The only supported conversion is interleaving planar audio.");
 #endif
 
+	for (size_t i = 0; i < Workers.size(); ++i)
+		Workers[i]->SetOutputFormat(opt);
+
 	// Cache stores audio in the output format, so clear it and reopen the file
 	Cache.clear();
 	PacketNumber = 0;
 	ReopenFile();
-	FlushBuffers(CodecContext);
+	++Stats.Flushes;
+	if (FlushBuffers(CodecContext))
+		++Stats.Reopens;
 
 	BytesPerSample = av_get_bytes_per_sample(static_cast<AVSampleFormat>(opt->SampleFormat)) * av_get_channel_layout_nb_channels(opt->ChannelLayout);
 	NeedsResample =
@@ -246,6 +274,8 @@ FFMS_ResampleOptions *FFMS_AudioSource::CreateResampleOptions() const {
 
 void FFMS_AudioSource::ResampleAndCache(CacheIterator pos) {
 #ifndef FFMBC
+	StatsTimer Timer(Stats.ConvertTime);
+	TraceSpan Span("audio", "ResampleAndCache");
 	AudioBlock& block = *pos;
 	size_t old_size = block.Data.size();
 	size_t new_req = DecodeFrame->nb_samples * BytesPerSample;
@@ -303,23 +333,33 @@ void FFMS_AudioSource::CacheBlock(CacheIterator &pos) {
 
 void FFMS_AudioSource::DecodeNextBlock(CacheIterator *pos) {
 #ifndef FFMBC
-	CurrentFrame = &Frames[PacketNumber];
+	TraceSpan Span("audio", "DecodeNextBlock", PacketNumber);
+	CurrentFrame = Frames[PacketNumber];
 
 	AVPacket Packet;
-	if (!ReadPacket(&Packet))
-		throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_UNKNOWN,
-			"ReadPacket unexpectedly failed to read a packet");
+	{
+		StatsTimer Timer(Stats.DemuxTime);
+		if (!ReadPacket(&Packet))
+			throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_UNKNOWN,
+				"ReadPacket unexpectedly failed to read a packet");
+	}
+	++Stats.PacketsRead;
+	Stats.BytesRead += Packet.size;
 
 	// ReadPacket may have changed the packet number
-	CurrentFrame = &Frames[PacketNumber];
-	CurrentSample = CurrentFrame->SampleStart;
+	CurrentFrame = Frames[PacketNumber];
+	CurrentSample = CurrentFrame.SampleStart;
 
 	bool GotSamples = false;
 	uint8_t *Data = Packet.data;
 	while (Packet.size > 0) {
 		DecodeFrame.reset();
 		int GotFrame = 0;
-		int Ret = avcodec_decode_audio4(CodecContext, DecodeFrame, &GotFrame, &Packet);
+		int Ret;
+		{
+			StatsTimer Timer(Stats.DecodeTime);
+			Ret = avcodec_decode_audio4(CodecContext, DecodeFrame, &GotFrame, &Packet);
+		}
 
 		// Should only ever happen if the user chose to ignore decoding errors
 		// during indexing, so continue to just ignore decoding errors
@@ -329,6 +369,7 @@ void FFMS_AudioSource::DecodeNextBlock(CacheIterator *pos) {
 			Packet.size -= Ret;
 			Packet.data += Ret;
 			if (GotFrame && DecodeFrame->nb_samples > 0) {
+				++Stats.FramesDecoded;
 				GotSamples = true;
 				if (pos)
 					CacheBlock(*pos);
@@ -344,12 +385,9 @@ void FFMS_AudioSource::DecodeNextBlock(CacheIterator *pos) {
 #endif
 }
 
-static bool SampleStartComp(const FrameInfo &a, const FrameInfo &b) {
-	return a.SampleStart < b.SampleStart;
-}
-
 void FFMS_AudioSource::GetAudio(void *Buf, int64_t Start, int64_t Count) {
 #ifndef FFMBC
+	TraceSpan Span("audio", "GetAudio", Start);
 	if (Start < 0 || Start + Count > AP.NumSamples || Count < 0)
 		throw FFMS_Exception(FFMS_ERROR_DECODING, FFMS_ERROR_INVALID_ARGUMENT,
 			"Out of bounds audio samples requested");
@@ -372,6 +410,15 @@ void FFMS_AudioSource::GetAudio(void *Buf, int64_t Start, int64_t Count) {
 		Dst += Bytes;
 	}
 
+	if (DecodingThreads > 1 && SeekOffset >= 0 && Index.Decoder != FFMS_SOURCE_HAALIMPEG && Index.Decoder != FFMS_SOURCE_HAALIOGG)
+		DecodeRangeParallel(Dst, Start, Count);
+	else
+		DecodeRange(Dst, Start, Count);
+#endif
+}
+
+void FFMS_AudioSource::DecodeRange(uint8_t *Dst, int64_t Start, int64_t Count) {
+#ifndef FFMBC
 	CacheIterator it = Cache.begin();
 
 	while (Count > 0) {
@@ -380,6 +427,8 @@ void FFMS_AudioSource::GetAudio(void *Buf, int64_t Start, int64_t Count) {
 
 		// Cache has the next block we want
 		if (it != Cache.end() && it->Start <= Start) {
+			++Stats.CacheHits;
+			++Stats.FramesOutput;
 			int64_t SrcOffset = FFMAX(0, Start - it->Start);
 			int64_t DstOffset = FFMAX(0, it->Start - Start);
 			int64_t CopySamples = FFMIN(it->Samples - SrcOffset, Count - DstOffset);
@@ -393,15 +442,12 @@ void FFMS_AudioSource::GetAudio(void *Buf, int64_t Start, int64_t Count) {
 		}
 		// Decode another block
 		else {
+			++Stats.CacheMisses;
 			if (Start < CurrentSample && SeekOffset == -1)
 				throw FFMS_Exception(FFMS_ERROR_SEEKING, FFMS_ERROR_CODEC, "Audio stream is not seekable");
 
 			if (SeekOffset >= 0 && (Start < CurrentSample || Start > CurrentSample + DecodeFrame->nb_samples * 5)) {
-				FrameInfo f;
-				f.SampleStart = Start;
-				size_t NewPacketNumber = std::distance(
-					Frames.begin(),
-					std::lower_bound(Frames.begin(), Frames.end(), f, SampleStartComp));
+				size_t NewPacketNumber = Frames.LowerBoundSampleStart(Start);
 				NewPacketNumber = NewPacketNumber > static_cast<size_t>(SeekOffset + 15)
 				                ? NewPacketNumber - SeekOffset - 15
 				                : 0;
@@ -413,6 +459,9 @@ void FFMS_AudioSource::GetAudio(void *Buf, int64_t Start, int64_t Count) {
 					CurrentSample = -1;
 					DecodeFrame.reset();
 					avcodec_flush_buffers(CodecContext);
+					++Stats.Flushes;
+					++Stats.Seeks;
+					TraceSpan Span("audio", "Seek", PacketNumber);
 					Seek();
 				}
 			}
@@ -432,6 +481,197 @@ void FFMS_AudioSource::GetAudio(void *Buf, int64_t Start, int64_t Count) {
 #endif
 }
 
+namespace {
+// Each part of a split request should be at least this many seconds long,
+// as every worker has to seek and decode some packets it then throws away
+const int MinSecondsPerThread = 10;
+
+struct DecodeJob {
+	FFMS_AudioSource *Source;
+	uint8_t *Dst;
+	int64_t Start;
+	int64_t Count;
+	ThreadError Error;
+};
+
+void RunDecodeJob(void *Arg) {
+	DecodeJob *Job = static_cast<DecodeJob *>(Arg);
+	try {
+		Job->Source->GetAudio(Job->Dst, Job->Start, Job->Count);
+	} catch (...) {
+		Job->Error.Catch();
+	}
+}
+}
+
+void FFMS_AudioSource::DecodeRangeParallel(uint8_t *Dst, int64_t Start, int64_t Count) {
+	int64_t MinSamples = static_cast<int64_t>(AP.SampleRate) * MinSecondsPerThread;
+	int64_t Parts = FFMIN(DecodingThreads, Count / FFMAX(MinSamples, 1));
+
+	// Split at the first sample of seekable keyframe packets, so that each
+	// worker starts on a packet boundary and gets the same pre-roll it would
+	// when seeking there for a normal request
+	std::vector<int64_t> Splits(1, Start);
+	for (int64_t i = 1; i < Parts; ++i) {
+		size_t Packet = Frames.UpperBoundSampleStart(Start + Count * i / Parts);
+		Packet = Packet > 0 ? Packet - 1 : 0;
+		while (Packet > 0 && !Frames[Packet].KeyFrame) --Packet;
+		Packet = GetSeekablePacketNumber(Frames, Packet);
+
+		if (Frames[Packet].SampleStart > Splits.back() && Frames[Packet].SampleStart < Start + Count)
+			Splits.push_back(Frames[Packet].SampleStart);
+	}
+	Splits.push_back(Start + Count);
+
+	if (Splits.size() < 3) {
+		DecodeRange(Dst, Start, Count);
+		return;
+	}
+
+	// Workers decode the later parts with no delay applied, so they're
+	// addressed in the same undelayed sample numbers as DecodeRange
+	Workers.reserve(Splits.size() - 2);
+	while (Workers.size() < Splits.size() - 2) {
+		std::auto_ptr<FFMS_AudioSource> Worker(CreateAudioSource(SourceFile.c_str(), TrackNumber, Index, FFMS_DELAY_NO_SHIFT));
+		std::auto_ptr<FFMS_ResampleOptions> opt(CreateResampleOptions());
+		Worker->SetOutputFormat(opt.get());
+		Workers.push_back(Worker.release());
+	}
+
+	std::vector<DecodeJob> Jobs(Splits.size() - 2);
+	for (size_t i = 0; i < Jobs.size(); ++i) {
+		DecodeJob &Job = Jobs[i];
+		Job.Source = Workers[i];
+		Job.Dst = Dst + (Splits[i + 1] - Start) * BytesPerSample;
+		Job.Start = Splits[i + 1];
+		Job.Count = Splits[i + 2] - Splits[i + 1];
+	}
+
+	{
+		ThreadGroup Threads;
+		for (size_t i = 0; i < Jobs.size(); ++i)
+			Threads.Start(RunDecodeJob, &Jobs[i]);
+
+		// This source decodes the first part itself so that its cache and
+		// decoder state continue on from wherever the previous request was
+		DecodeRange(Dst, Splits[0], Splits[1] - Splits[0]);
+		Threads.JoinAll();
+	}
+
+	for (size_t i = 0; i < Jobs.size(); ++i)
+		Jobs[i].Error.Rethrow();
+}
+
+void FFMS_AudioSource::SetDecodingThreads(int Threads) {
+	if (Threads < 1)
+		DecodingThreads = GetNumberOfLogicalCPUs();
+	else
+		DecodingThreads = Threads;
+
+	while (Workers.size() > static_cast<size_t>(FFMAX(DecodingThreads - 1, 0))) {
+		delete Workers.back();
+		Workers.pop_back();
+	}
+}
+
+void FFMS_AudioSource::GetStats(FFMS_SourceStats &Out) const {
+	Out = Stats;
+	for (size_t i = 0; i < Workers.size(); ++i) {
+		FFMS_SourceStats WorkerStats;
+		Workers[i]->GetStats(WorkerStats);
+		AddStats(Out, WorkerStats);
+	}
+}
+
+void FFMS_AudioSource::ResetStats() {
+	::ResetStats(Stats);
+	for (size_t i = 0; i < Workers.size(); ++i)
+		Workers[i]->ResetStats();
+}
+
+FFMS_AudioSource *CreateAudioSource(const char *SourceFile, int Track, FFMS_Index &Index, int DelayMode) {
+	switch (Index.Decoder) {
+		case FFMS_SOURCE_LAVF:
+			return CreateLavfAudioSource(SourceFile, Track, Index, DelayMode);
+		case FFMS_SOURCE_MATROSKA:
+			return CreateMatroskaAudioSource(SourceFile, Track, Index, DelayMode);
+#ifdef HAALISOURCE
+		case FFMS_SOURCE_HAALIMPEG:
+			if (HasHaaliMPEG)
+				return CreateHaaliAudioSource(SourceFile, Track, Index, FFMS_SOURCE_HAALIMPEG, DelayMode);
+			throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_NOT_AVAILABLE, "Haali MPEG/TS source unavailable");
+		case FFMS_SOURCE_HAALIOGG:
+			if (HasHaaliOGG)
+				return CreateHaaliAudioSource(SourceFile, Track, Index, FFMS_SOURCE_HAALIOGG, DelayMode);
+			throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_NOT_AVAILABLE, "Haali OGG/OGM source unavailable");
+#endif
+		default:
+			throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ, "Unsupported format");
+	}
+}
+
+namespace {
+class FFLazyAudio : public FFMS_AudioSource {
+	int DelayMode;
+	mutable std::auto_ptr<FFMS_AudioSource> Source;
+
+	FFMS_AudioSource *Open() const {
+		if (!Source.get()) {
+			Source.reset(CreateAudioSource(SourceFile.c_str(), TrackNumber, Index, DelayMode));
+			Source->SetDecodingThreads(DecodingThreads);
+		}
+		return Source.get();
+	}
+
+	bool ReadPacket(AVPacket *) { return false; }
+
+public:
+	FFLazyAudio(const char *SourceFile, int Track, FFMS_Index &Index, int DelayMode)
+	: FFMS_AudioSource(SourceFile, Index, Track)
+	, DelayMode(DelayMode)
+	{
+		// The stored properties are those of a source with no delay applied
+		AP = Index.Properties[Track].AP;
+		ApplyDelay(Index, DelayMode);
+	}
+
+	void GetAudio(void *Buf, int64_t Start, int64_t Count) {
+		Open()->GetAudio(Buf, Start, Count);
+	}
+
+	// The resampling options depend on what the decoder outputs
+	FFMS_ResampleOptions *CreateResampleOptions() const {
+		return Open()->CreateResampleOptions();
+	}
+	void SetOutputFormat(const FFMS_ResampleOptions *opt) {
+		Open()->SetOutputFormat(opt);
+	}
+
+	void SetDecodingThreads(int Threads) {
+		FFMS_AudioSource::SetDecodingThreads(Threads);
+		if (Source.get())
+			Source->SetDecodingThreads(DecodingThreads);
+	}
+
+	void GetStats(FFMS_SourceStats &Out) const {
+		if (Source.get())
+			Source->GetStats(Out);
+		else
+			Out = Stats;
+	}
+	void ResetStats() {
+		if (Source.get())
+			Source->ResetStats();
+	}
+};
+}
+
+FFMS_AudioSource *CreateLazyAudioSource(const char *SourceFile, int Track, FFMS_Index &Index, int DelayMode) {
+	if (Track >= 0 && Track < static_cast<int>(Index.Properties.size()) && Index.Properties[Track].Valid)
+		return new FFLazyAudio(SourceFile, Track, Index, DelayMode);
+	return CreateAudioSource(SourceFile, Track, Index, DelayMode);
+}
+
 size_t GetSeekablePacketNumber(FFMS_Track const& Frames, size_t PacketNumber) {
 	// Packets don't always have unique PTSes, so we may not be able to
 	// uniquely identify the packet we want. This function attempts to find
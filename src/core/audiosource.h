@@ -25,6 +25,7 @@
 #include "track.h"
 
 #include <list>
+#include <string>
 #include <vector>
 
 struct FFMS_AudioSource {
@@ -67,6 +68,13 @@ struct FFMS_AudioSource {
 	// Cache the unseekable beginning of the file once the output format is set
 	void CacheBeginning();
 
+	// Copy the decoded samples from Start to Start + Count into Dst,
+	// decoding and seeking as needed
+	void DecodeRange(uint8_t *Dst, int64_t Start, int64_t Count);
+
+	// Split a large request between this source and the workers
+	void DecodeRangeParallel(uint8_t *Dst, int64_t Start, int64_t Count);
+
 	// Called after seeking
 	virtual void Seek() { }
 	// Read the next packet from the file
@@ -82,33 +90,49 @@ protected:
 	// Next packet to be read
 	size_t PacketNumber;
 	// Current audio frame
-	const FrameInfo *CurrentFrame;
+	FrameInfo CurrentFrame;
 	// Track which this corresponds to
 	int TrackNumber;
 	// Number of packets which the demuxer requires to know where it is
 	// If -1, seeking is assumed to be impossible
 	int SeekOffset;
 
+	// Needed to open the additional decoders used for parallel decoding
+	std::string SourceFile;
+	FFMS_Index &Index;
+	// Maximum number of decoders a single request may be split between
+	int DecodingThreads;
+	// Additional decoders of the same track with no delay applied, opened
+	// the first time a request is large enough to be split
+	std::vector<FFMS_AudioSource *> Workers;
+
 	// Buffer which audio is decoded into
 	ScopedFrame DecodeFrame;
 	FFMS_Track Frames;
 	FFCodecContext CodecContext;
 	FFMS_AudioProperties AP;
+	FFMS_SourceStats Stats;
 
 	void DecodeNextBlock(CacheIterator *cachePos = 0);
 	// Initialization which has to be done after the codec is opened
 	void Init(const FFMS_Index &Index, int DelayMode);
+	// Set Delay for the delay mode and adjust AP.NumSamples for it
+	void ApplyDelay(const FFMS_Index &Index, int DelayMode);
 
 	FFMS_AudioSource(const char *SourceFile, FFMS_Index &Index, int Track);
 
 public:
-	virtual ~FFMS_AudioSource() { }
+	virtual ~FFMS_AudioSource();
 	FFMS_Track *GetTrack() { return &Frames; }
 	const FFMS_AudioProperties& GetAudioProperties() const { return AP; }
-	void GetAudio(void *Buf, int64_t Start, int64_t Count);
-
-	FFMS_ResampleOptions *CreateResampleOptions() const;
-	void SetOutputFormat(const FFMS_ResampleOptions *opt);
+	virtual void GetAudio(void *Buf, int64_t Start, int64_t Count);
+
+	virtual FFMS_ResampleOptions *CreateResampleOptions() const;
+	virtual void SetOutputFormat(const FFMS_ResampleOptions *opt);
+	virtual void SetDecodingThreads(int Threads);
+	// Includes the statistics of the parallel decoding workers
+	virtual void GetStats(FFMS_SourceStats &Out) const;
+	virtual void ResetStats();
 };
 
 size_t GetSeekablePacketNumber(FFMS_Track const& Frames, size_t PacketNumber);
@@ -116,5 +140,9 @@ size_t GetSeekablePacketNumber(FFMS_Track const& Frames, size_t PacketNumber);
 FFMS_AudioSource *CreateLavfAudioSource(const char *SourceFile, int Track, FFMS_Index &Index, int DelayMode);
 FFMS_AudioSource *CreateMatroskaAudioSource(const char *SourceFile, int Track, FFMS_Index &Index, int DelayMode);
 FFMS_AudioSource *CreateHaaliAudioSource(const char *SourceFile, int Track, FFMS_Index &Index, FFMS_Sources SourceMode, int DelayMode);
+FFMS_AudioSource *CreateAudioSource(const char *SourceFile, int Track, FFMS_Index &Index, int DelayMode);
+// Uses the properties stored in the index, if it has any for the track, and
+// opens the file and the decoder the first time audio is needed
+FFMS_AudioSource *CreateLazyAudioSource(const char *SourceFile, int Track, FFMS_Index &Index, int DelayMode);
 
 #endif
@@ -21,8 +21,10 @@
 #include "ffms.h"
 
 #include "audiosource.h"
+#include "filereader.h"
 #include "indexing.h"
 #include "haalicommon.h"
+#include "trace.h"
 #include "videosource.h"
 #include "videoutils.h"
 
@@ -30,6 +32,7 @@ extern "C" {
 #include <libavutil/pixdesc.h>
 }
 
+#include <cstdlib>
 #include <sstream>
 #include <iomanip>
 
@@ -77,6 +80,13 @@ void av_log_windebug_callback(void* ptr, int level, const char* fmt, va_list vl)
 
 #endif
 
+static void StopTraceAtExit() {
+	try {
+		StopTrace();
+	} catch (...) {
+	}
+}
+
 FFMS_API(void) FFMS_Init(int, int UseUTF8Paths) {
 	if (!FFmpegInited) {
 		av_register_all();
@@ -102,6 +112,15 @@ FFMS_API(void) FFMS_Init(int, int UseUTF8Paths) {
 		HasHaaliOGG = !FAILED(pMMC.CoCreateInstance(HAALI_OGG_PARSER));
 		pMMC = NULL;
 #endif
+		// Tracing can be turned on without changing the program using the
+		// library; the trace is written when the program exits
+		if (const char *TraceFile = getenv("FFMS_TRACE")) {
+			try {
+				StartTrace(TraceFile);
+				atexit(StopTraceAtExit);
+			} catch (FFMS_Exception &) {
+			}
+		}
 		FFmpegInited = true;
 	}
 }
@@ -118,26 +137,33 @@ FFMS_API(void) FFMS_SetLogLevel(int Level) {
 	av_log_set_level(Level);
 }
 
+FFMS_API(int) FFMS_StartTrace(const char *TraceFile, FFMS_ErrorInfo *ErrorInfo) {
+	ClearErrorInfo(ErrorInfo);
+	try {
+		StartTrace(TraceFile);
+	} catch (FFMS_Exception &e) {
+		return e.CopyOut(ErrorInfo);
+	}
+	return FFMS_ERROR_SUCCESS;
+}
+
+FFMS_API(int) FFMS_StopTrace(FFMS_ErrorInfo *ErrorInfo) {
+	ClearErrorInfo(ErrorInfo);
+	try {
+		StopTrace();
+	} catch (FFMS_Exception &e) {
+		return e.CopyOut(ErrorInfo);
+	}
+	return FFMS_ERROR_SUCCESS;
+}
+
+FFMS_API(void) FFMS_SetIOBackend(int Backend) {
+	SetIOBackend(Backend);
+}
+
 FFMS_API(FFMS_VideoSource *) FFMS_CreateVideoSource(const char *SourceFile, int Track, FFMS_Index *Index, int Threads, int SeekMode, FFMS_ErrorInfo *ErrorInfo) {
 	try {
-		switch (Index->Decoder) {
-			case FFMS_SOURCE_LAVF:
-				return CreateLavfVideoSource(SourceFile, Track, *Index, Threads, SeekMode);
-			case FFMS_SOURCE_MATROSKA:
-				return CreateMatroskaVideoSource(SourceFile, Track, *Index, Threads);
-#ifdef HAALISOURCE
-			case FFMS_SOURCE_HAALIMPEG:
-				if (HasHaaliMPEG)
-					return CreateHaaliVideoSource(SourceFile, Track, *Index, Threads, FFMS_SOURCE_HAALIMPEG);
-				throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_NOT_AVAILABLE, "Haali MPEG/TS source unavailable");
-			case FFMS_SOURCE_HAALIOGG:
-				if (HasHaaliOGG)
-					return CreateHaaliVideoSource(SourceFile, Track, *Index, Threads, FFMS_SOURCE_HAALIOGG);
-				throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_NOT_AVAILABLE, "Haali OGG/OGM source unavailable");
-#endif
-			default:
-				throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ, "Unsupported format");
-		}
+		return CreateVideoSource(SourceFile, Track, *Index, Threads, SeekMode);
 	} catch (FFMS_Exception &e) {
 		e.CopyOut(ErrorInfo);
 		return NULL;
@@ -146,24 +172,27 @@ FFMS_API(FFMS_VideoSource *) FFMS_CreateVideoSource(const char *SourceFile, int
 
 FFMS_API(FFMS_AudioSource *) FFMS_CreateAudioSource(const char *SourceFile, int Track, FFMS_Index *Index, int DelayMode, FFMS_ErrorInfo *ErrorInfo) {
 	try {
-		switch (Index->Decoder) {
-			case FFMS_SOURCE_LAVF:
-				return CreateLavfAudioSource(SourceFile, Track, *Index, DelayMode);
-			case FFMS_SOURCE_MATROSKA:
-				return CreateMatroskaAudioSource(SourceFile, Track, *Index, DelayMode);
-#ifdef HAALISOURCE
-			case FFMS_SOURCE_HAALIMPEG:
-				if (HasHaaliMPEG)
-					return CreateHaaliAudioSource(SourceFile, Track, *Index, FFMS_SOURCE_HAALIMPEG, DelayMode);
-				throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_NOT_AVAILABLE, "Haali MPEG/TS source unavailable");
-			case FFMS_SOURCE_HAALIOGG:
-				if (HasHaaliOGG)
-					return CreateHaaliAudioSource(SourceFile, Track, *Index, FFMS_SOURCE_HAALIOGG, DelayMode);
-				throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_NOT_AVAILABLE, "Haali OGG/OGM source unavailable");
-#endif
-			default:
-				throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ, "Unsupported format");
-		}
+		return CreateAudioSource(SourceFile, Track, *Index, DelayMode);
+	} catch (FFMS_Exception &e) {
+		e.CopyOut(ErrorInfo);
+		return NULL;
+	}
+}
+
+FFMS_API(FFMS_VideoSource *) FFMS_CreateLazyVideoSource(const char *SourceFile, int Track, FFMS_Index *Index, int Threads, int SeekMode, FFMS_ErrorInfo *ErrorInfo) {
+	ClearErrorInfo(ErrorInfo);
+	try {
+		return CreateLazyVideoSource(SourceFile, Track, *Index, Threads, SeekMode);
+	} catch (FFMS_Exception &e) {
+		e.CopyOut(ErrorInfo);
+		return NULL;
+	}
+}
+
+FFMS_API(FFMS_AudioSource *) FFMS_CreateLazyAudioSource(const char *SourceFile, int Track, FFMS_Index *Index, int DelayMode, FFMS_ErrorInfo *ErrorInfo) {
+	ClearErrorInfo(ErrorInfo);
+	try {
+		return CreateLazyAudioSource(SourceFile, Track, *Index, DelayMode);
 	} catch (FFMS_Exception &e) {
 		e.CopyOut(ErrorInfo);
 		return NULL;
@@ -188,6 +217,7 @@ FFMS_API(const FFMS_AudioProperties *) FFMS_GetAudioProperties(FFMS_AudioSource
 
 FFMS_API(const FFMS_Frame *) FFMS_GetFrame(FFMS_VideoSource *V, int n, FFMS_ErrorInfo *ErrorInfo) {
 	ClearErrorInfo(ErrorInfo);
+	TraceSpan Span("video", "GetFrame", n);
 	try {
 		return V->GetFrame(n);
 	} catch (FFMS_Exception &e) {
@@ -252,6 +282,26 @@ FFMS_API(void) FFMS_DestroyResampleOptions(FFMS_ResampleOptions *options) {
 	delete options;
 }
 
+FFMS_API(void) FFMS_SetAudioDecodingThreads(FFMS_AudioSource *A, int Threads) {
+	A->SetDecodingThreads(Threads);
+}
+
+FFMS_API(void) FFMS_GetVideoSourceStats(FFMS_VideoSource *V, FFMS_SourceStats *Stats) {
+	*Stats = V->GetStats();
+}
+
+FFMS_API(void) FFMS_ResetVideoSourceStats(FFMS_VideoSource *V) {
+	V->ResetStats();
+}
+
+FFMS_API(void) FFMS_GetAudioSourceStats(FFMS_AudioSource *A, FFMS_SourceStats *Stats) {
+	A->GetStats(*Stats);
+}
+
+FFMS_API(void) FFMS_ResetAudioSourceStats(FFMS_AudioSource *A) {
+	A->ResetStats();
+}
+
 FFMS_API(int) FFMS_SetOutputFormatA(FFMS_AudioSource *A, const FFMS_ResampleOptions *options, FFMS_ErrorInfo *ErrorInfo) {
 	ClearErrorInfo(ErrorInfo);
 	try {
@@ -279,7 +329,7 @@ FFMS_API(FFMS_IndexErrorHandling) FFMS_GetErrorHandling(FFMS_Index *Index) {
 FFMS_API(int) FFMS_GetFirstTrackOfType(FFMS_Index *Index, int TrackType, FFMS_ErrorInfo *ErrorInfo) {
 	ClearErrorInfo(ErrorInfo);
 	for (int i = 0; i < static_cast<int>(Index->size()); i++)
-		if ((*Index)[i].TT == TrackType)
+		if (Index->GetTrackType(i) == TrackType)
 			return i;
 
 	try {
@@ -294,7 +344,7 @@ FFMS_API(int) FFMS_GetFirstTrackOfType(FFMS_Index *Index, int TrackType, FFMS_Er
 FFMS_API(int) FFMS_GetFirstIndexedTrackOfType(FFMS_Index *Index, int TrackType, FFMS_ErrorInfo *ErrorInfo) {
 	ClearErrorInfo(ErrorInfo);
 	for (int i = 0; i < static_cast<int>(Index->size()); i++)
-		if ((*Index)[i].TT == TrackType && !(*Index)[i].empty())
+		if (Index->GetTrackType(i) == TrackType && !Index->IsTrackEmpty(i))
 			return i;
 	try {
 		throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_NOT_AVAILABLE,
@@ -334,7 +384,11 @@ FFMS_API(const FFMS_FrameInfo *) FFMS_GetFrameInfo(FFMS_Track *T, int Frame) {
 }
 
 FFMS_API(FFMS_Track *) FFMS_GetTrackFromIndex(FFMS_Index *Index, int Track) {
-	return &(*Index)[Track];
+	try {
+		return &(*Index)[Track];
+	} catch (FFMS_Exception &) {
+		return NULL;
+	}
 }
 
 FFMS_API(FFMS_Track *) FFMS_GetTrackFromVideo(FFMS_VideoSource *V) {
@@ -413,6 +467,88 @@ FFMS_API(FFMS_Indexer *) FFMS_CreateIndexerWithDemuxer(const char *SourceFile, i
 	}
 }
 
+FFMS_API(void) FFMS_SetWaveformMask(FFMS_Indexer *Indexer, int WaveformMask) {
+	Indexer->SetWaveformMask(WaveformMask);
+}
+
+FFMS_API(void) FFMS_SetIndexingThreads(FFMS_Indexer *Indexer, int Threads) {
+	Indexer->SetThreads(Threads);
+}
+
+FFMS_API(void) FFMS_SetIndexingSplitSize(FFMS_Indexer *Indexer, int64_t MinSize) {
+	Indexer->SetMinSplitSize(MinSize);
+}
+
+FFMS_API(void) FFMS_SetIndexCheckpoint(FFMS_Indexer *Indexer, const char *IndexFile, int64_t Interval) {
+	Indexer->SetCheckpoint(IndexFile, Interval);
+}
+
+FFMS_API(int) FFMS_SetSignatureType(FFMS_Indexer *Indexer, int SignatureType, FFMS_ErrorInfo *ErrorInfo) {
+	ClearErrorInfo(ErrorInfo);
+	try {
+		Indexer->SetSignatureType(SignatureType);
+	} catch (FFMS_Exception &e) {
+		return e.CopyOut(ErrorInfo);
+	}
+	return FFMS_ERROR_SUCCESS;
+}
+
+// Open each track once so that its properties can be stored in the index.
+// Tracks which can't be opened are left without properties, with the reason
+// kept for FFMS_GetIndexedVideoProperties and FFMS_GetIndexedAudioProperties.
+static void StoreTrackProperties(FFMS_Index *Index, const char *SourceFile) {
+	std::vector<TrackProperties> Properties(Index->size());
+	for (size_t i = 0; i < Index->size(); ++i) {
+		if (Index->IsTrackEmpty(i))
+			continue;
+
+		TrackProperties &Props = Properties[i];
+		char ErrorMsg[1024] = "";
+		FFMS_ErrorInfo E;
+		E.Buffer = ErrorMsg;
+		E.BufferSize = sizeof(ErrorMsg);
+
+		if (Index->GetTrackType(i) == FFMS_TYPE_VIDEO) {
+			FFMS_VideoSource *V = FFMS_CreateVideoSource(SourceFile, i, Index, 1, FFMS_SEEK_NORMAL, &E);
+			if (V) {
+				const FFMS_Frame *Frame = FFMS_GetFrame(V, 0, &E);
+				if (Frame) {
+					Props.VP = V->GetVideoProperties();
+					Props.EncodedWidth = Frame->EncodedWidth;
+					Props.EncodedHeight = Frame->EncodedHeight;
+					Props.EncodedPixelFormat = Frame->EncodedPixelFormat;
+					Props.Valid = true;
+
+					// Frames only report the colorspace and range once an
+					// output format is set, so ask for the unscaled frame in
+					// its own format to have them resolved
+					int Formats[] = { Frame->EncodedPixelFormat, -1 };
+					if (!FFMS_SetOutputFormatV2(V, Formats, Frame->EncodedWidth, Frame->EncodedHeight, FFMS_RESIZER_BICUBIC, &E)) {
+						Props.ColorSpace = Frame->ColorSpace;
+						Props.ColorRange = Frame->ColorRange;
+					}
+				}
+				delete V;
+			}
+		} else if (Index->GetTrackType(i) == FFMS_TYPE_AUDIO) {
+			FFMS_AudioSource *A = FFMS_CreateAudioSource(SourceFile, i, Index, FFMS_DELAY_NO_SHIFT, &E);
+			if (A) {
+				Props.AP = A->GetAudioProperties();
+				Props.Valid = true;
+				delete A;
+			}
+		}
+
+		if (!Props.Valid)
+			Props.Error = ErrorMsg;
+	}
+	Index->Properties.swap(Properties);
+}
+
+FFMS_API(void) FFMS_SetStoreTrackProperties(FFMS_Indexer *Indexer, int Enable) {
+	Indexer->SetStoreProperties(!!Enable);
+}
+
 FFMS_API(FFMS_Index *) FFMS_DoIndexing(FFMS_Indexer *Indexer, int IndexMask, int DumpMask, TAudioNameCallback ANC, void *ANCPrivate, int ErrorHandling, TIndexCallback IC, void *ICPrivate, FFMS_ErrorInfo *ErrorInfo) {
 	ClearErrorInfo(ErrorInfo);
 
@@ -424,10 +560,13 @@ FFMS_API(FFMS_Index *) FFMS_DoIndexing(FFMS_Indexer *Indexer, int IndexMask, int
 
 	FFMS_Index *Index = NULL;
 	try {
+		TraceSpan Span("indexing", "DoIndexing");
 		Index = Indexer->DoIndexing();
 	} catch (FFMS_Exception &e) {
 		e.CopyOut(ErrorInfo);
 	}
+	if (Index && Indexer->GetStoreProperties())
+		StoreTrackProperties(Index, Indexer->GetSourceFile());
 	delete Indexer;
 	return Index;
 }
@@ -439,13 +578,17 @@ FFMS_API(void) FFMS_CancelIndexing(FFMS_Indexer *Indexer) {
 FFMS_API(FFMS_Index *) FFMS_ReadIndex(const char *IndexFile, FFMS_ErrorInfo *ErrorInfo) {
 	ClearErrorInfo(ErrorInfo);
 	try {
-		return new FFMS_Index(IndexFile);
+		return FFMS_Index::ReadIndex(IndexFile);
 	} catch (FFMS_Exception &e) {
 		e.CopyOut(ErrorInfo);
 		return NULL;
 	}
 }
 
+FFMS_API(void) FFMS_SetIndexCaching(int Enable) {
+	FFMS_Index::SetCaching(!!Enable);
+}
+
 FFMS_API(int) FFMS_IndexBelongsToFile(FFMS_Index *Index, const char *SourceFile, FFMS_ErrorInfo *ErrorInfo) {
 	ClearErrorInfo(ErrorInfo);
 	try {
@@ -458,6 +601,89 @@ FFMS_API(int) FFMS_IndexBelongsToFile(FFMS_Index *Index, const char *SourceFile,
 	return FFMS_ERROR_SUCCESS;
 }
 
+FFMS_API(int) FFMS_UpdateIndex(FFMS_Index *Index, const char *SourceFile, TIndexCallback IC, void *ICPrivate, FFMS_ErrorInfo *ErrorInfo) {
+	ClearErrorInfo(ErrorInfo);
+	try {
+		if (Index->Decoder != FFMS_SOURCE_LAVF)
+			throw FFMS_Exception(FFMS_ERROR_INDEXING, FFMS_ERROR_UNSUPPORTED,
+				"Updating indexes is only supported for files indexed with libavformat");
+		if (Index->IsCached())
+			throw FFMS_Exception(FFMS_ERROR_INDEXING, FFMS_ERROR_UNSUPPORTED,
+				"Indexes shared through the index cache can't be updated");
+
+		std::auto_ptr<FFMS_Indexer> Indexer(CreateIndexer(SourceFile, FFMS_SOURCE_LAVF));
+		Indexer->SetProgressCallback(IC, ICPrivate);
+		Indexer->UpdateIndex(*Index);
+		// The stored properties (frame and sample counts, last timestamps)
+		// are out of date now, so refresh them if the index has any
+		if (!Index->Properties.empty())
+			StoreTrackProperties(Index, SourceFile);
+	} catch (FFMS_Exception &e) {
+		return e.CopyOut(ErrorInfo);
+	}
+	return FFMS_ERROR_SUCCESS;
+}
+
+FFMS_API(int) FFMS_GetIndexedVideoProperties(FFMS_Index *Index, int Track, FFMS_VideoProperties *VP, int *EncodedWidth, int *EncodedHeight, int *EncodedPixelFormat, int *ColorSpace, int *ColorRange, FFMS_ErrorInfo *ErrorInfo) {
+	ClearErrorInfo(ErrorInfo);
+	try {
+		if (Track < 0 || Track >= static_cast<int>(Index->size()) || Index->GetTrackType(Track) != FFMS_TYPE_VIDEO)
+			throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
+				"Not a video track");
+		if (Index->Properties.empty())
+			throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_NOT_AVAILABLE,
+				"The index has no track properties");
+		if (!Index->Properties[Track].Valid)
+			throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_NOT_AVAILABLE,
+				"The track couldn't be opened to get its properties: " + Index->Properties[Track].Error);
+
+		TrackProperties const& Props = Index->Properties[Track];
+		if (VP) *VP = Props.VP;
+		if (EncodedWidth) *EncodedWidth = Props.EncodedWidth;
+		if (EncodedHeight) *EncodedHeight = Props.EncodedHeight;
+		if (EncodedPixelFormat) *EncodedPixelFormat = Props.EncodedPixelFormat;
+		if (ColorSpace) *ColorSpace = Props.ColorSpace;
+		if (ColorRange) *ColorRange = Props.ColorRange;
+	} catch (FFMS_Exception &e) {
+		return e.CopyOut(ErrorInfo);
+	}
+	return FFMS_ERROR_SUCCESS;
+}
+
+FFMS_API(int) FFMS_GetIndexedAudioProperties(FFMS_Index *Index, int Track, FFMS_AudioProperties *AP, FFMS_ErrorInfo *ErrorInfo) {
+	ClearErrorInfo(ErrorInfo);
+	try {
+		if (Track < 0 || Track >= static_cast<int>(Index->size()) || Index->GetTrackType(Track) != FFMS_TYPE_AUDIO)
+			throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
+				"Not an audio track");
+		if (Index->Properties.empty())
+			throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_NOT_AVAILABLE,
+				"The index has no track properties");
+		if (!Index->Properties[Track].Valid)
+			throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_NOT_AVAILABLE,
+				"The track couldn't be opened to get its properties: " + Index->Properties[Track].Error);
+
+		if (AP) *AP = Index->Properties[Track].AP;
+	} catch (FFMS_Exception &e) {
+		return e.CopyOut(ErrorInfo);
+	}
+	return FFMS_ERROR_SUCCESS;
+}
+
+FFMS_API(int) FFMS_CompactIndex(FFMS_Index *Index, FFMS_ErrorInfo *ErrorInfo) {
+	ClearErrorInfo(ErrorInfo);
+	try {
+		// Other holders of a cached index read its tracks without any locking
+		if (Index->IsCached())
+			throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_UNSUPPORTED,
+				"Indexes shared through the index cache can't be compacted");
+		Index->CompactTracks();
+	} catch (FFMS_Exception &e) {
+		return e.CopyOut(ErrorInfo);
+	}
+	return FFMS_ERROR_SUCCESS;
+}
+
 FFMS_API(int) FFMS_WriteIndex(const char *IndexFile, FFMS_Index *Index, FFMS_ErrorInfo *ErrorInfo) {
 	ClearErrorInfo(ErrorInfo);
 	try {
@@ -468,6 +694,30 @@ FFMS_API(int) FFMS_WriteIndex(const char *IndexFile, FFMS_Index *Index, FFMS_Err
 	return FFMS_ERROR_SUCCESS;
 }
 
+FFMS_API(int) FFMS_WriteIndexV2(const char *IndexFile, FFMS_Index *Index, int Format, FFMS_ErrorInfo *ErrorInfo) {
+	ClearErrorInfo(ErrorInfo);
+	try {
+		Index->WriteIndex(IndexFile, Format);
+	} catch (FFMS_Exception &e) {
+		return e.CopyOut(ErrorInfo);
+	}
+	return FFMS_ERROR_SUCCESS;
+}
+
+FFMS_API(const FFMS_WaveformPeak *) FFMS_GetWaveformPeaks(FFMS_Index *Index, int Track, int SamplesPerPeak, int *Channels, int64_t *NumPeaks, FFMS_ErrorInfo *ErrorInfo) {
+	ClearErrorInfo(ErrorInfo);
+	try {
+		std::map<int, WaveformSummary>::const_iterator it = Index->Waveforms.find(Track);
+		if (it == Index->Waveforms.end())
+			throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_NOT_AVAILABLE,
+				"No waveform was generated for the given track");
+		return it->second.GetPeaks(SamplesPerPeak, Channels, NumPeaks);
+	} catch (FFMS_Exception &e) {
+		e.CopyOut(ErrorInfo);
+		return NULL;
+	}
+}
+
 FFMS_API(int) FFMS_GetPixFmt(const char *Name) {
 	return av_get_pix_fmt(Name);
 }
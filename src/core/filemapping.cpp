@@ -0,0 +1,215 @@
+//  Copyright (c) 2014 Thomas Goyne <tgoyne@gmail.com>
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#include "filemapping.h"
+
+#include "utils.h"
+
+#include <algorithm>
+#include <cassert>
+
+#ifdef _WIN32
+#define WIN32_EXTRA_LEAN
+#include <windows.h>
+
+namespace {
+class HandleCloser {
+	HANDLE h;
+public:
+	HandleCloser(HANDLE h = INVALID_HANDLE_VALUE) : h(h) { }
+	~HandleCloser() { if (h != INVALID_HANDLE_VALUE) CloseHandle(h); }
+	operator HANDLE() const { return h; }
+};
+
+std::string errmsg() {
+	LPWSTR lpstr = NULL;
+
+	if(FormatMessageW(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM, NULL, GetLastError(), 0, reinterpret_cast<LPWSTR>(&lpstr), 0, NULL) == NULL)
+		return "Unknown Error";
+
+	int len = WideCharToMultiByte(CP_UTF8, 0, lpstr, -1, NULL, 0, NULL, NULL);
+	if (len == 0) {
+		LocalFree(lpstr);
+		return "Unknown Error";
+	}
+
+	std::string ret(len, '\0');
+	WideCharToMultiByte(CP_UTF8, 0, lpstr, -1, &ret[0], len, NULL, NULL);
+	LocalFree(lpstr);
+	return ret;
+}
+}
+
+FileMapping::FileMapping(const char *path)
+: file_mapping(NULL)
+, mapping_start(0)
+, mapping_length(0)
+, buffer(NULL)
+, pattern(ACCESS_NORMAL)
+{
+	HandleCloser file = CreateFileW(widen_path(path).c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, 0, 0);
+	if (file == INVALID_HANDLE_VALUE)
+		throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
+			std::string("Can't open '") + path + "': " + errmsg());
+
+	LARGE_INTEGER li;
+	if (!GetFileSizeEx(file, &li))
+		throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
+			std::string("Can't get size of file '") + path + "': " + errmsg());
+	file_size = li.QuadPart;
+
+	file_mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (file_mapping == NULL)
+		throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
+			std::string("Can't create mapping for '") + path + "': " + errmsg());
+}
+
+FileMapping::~FileMapping() {
+	Unmap();
+	CloseHandle(file_mapping);
+}
+
+void FileMapping::Unmap() {
+	if (buffer)
+		UnmapViewOfFile(buffer);
+	buffer = NULL;
+}
+
+void FileMapping::Map(uint64_t start, size_t length) {
+	Unmap();
+
+	LARGE_INTEGER li;
+	li.QuadPart = start;
+	buffer = (uint8_t *)MapViewOfFile(file_mapping, FILE_MAP_READ, li.HighPart, li.LowPart, length);
+	if (!buffer)
+		throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_ALLOCATION_FAILED,
+			"MapViewOfFile failed: " + errmsg());
+	mapping_length = length;
+}
+
+// Windows only takes access hints when opening the file, and prefetching
+// mapped memory needs Windows 8
+void FileMapping::Advise() { }
+void FileMapping::Prefetch(uint64_t, uint64_t) { }
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+FileMapping::FileMapping(const char *path)
+: fd(open(path, O_RDONLY))
+, mapping_start(0)
+, mapping_length(0)
+, buffer(NULL)
+, pattern(ACCESS_NORMAL)
+{
+	if (fd < 0)
+		throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
+			std::string("Can't open '") + path + "': " + strerror(errno));
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
+			std::string("Can't get size of file '") + path + "': " + strerror(errno));
+	}
+	file_size = st.st_size;
+}
+
+FileMapping::~FileMapping() {
+	Unmap();
+	close(fd);
+}
+
+void FileMapping::Unmap() {
+	if (buffer)
+		munmap(const_cast<uint8_t *>(buffer), mapping_length);
+	buffer = NULL;
+}
+
+void FileMapping::Map(uint64_t start, size_t length) {
+	Unmap();
+
+	void *mapping = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, start);
+	if (mapping == MAP_FAILED)
+		throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_ALLOCATION_FAILED,
+			std::string("mmap failed: ") + strerror(errno));
+	buffer = static_cast<const uint8_t *>(mapping);
+	mapping_length = length;
+	Advise();
+}
+
+void FileMapping::Advise() {
+	if (!buffer)
+		return;
+
+	// ACCESS_RANDOM keeps the normal readahead: MADV_RANDOM turns it off for
+	// the runs of packets decoded after each seek too, and on 32-bit Prefetch
+	// can't ask for anything outside the current window to make up for it
+	int advice = MADV_NORMAL;
+	if (pattern == ACCESS_SEQUENTIAL)
+		advice = MADV_SEQUENTIAL;
+	// Only a hint, so failure doesn't matter
+	madvise(const_cast<uint8_t *>(buffer), mapping_length, advice);
+}
+
+void FileMapping::Prefetch(uint64_t start, uint64_t length) {
+	// Only what's already mapped can be prefetched; on 64-bit that's
+	// everything after the first read
+	if (!buffer || start >= mapping_start + mapping_length || start + length <= mapping_start)
+		return;
+
+	uint64_t page_size = sysconf(_SC_PAGESIZE);
+	uint64_t end = std::min(start + length, mapping_start + mapping_length);
+	start = std::max(start, mapping_start);
+	start -= (start - mapping_start) % page_size;
+	madvise(const_cast<uint8_t *>(buffer + (start - mapping_start)), static_cast<size_t>(end - start), MADV_WILLNEED);
+}
+#endif
+
+void FileMapping::SetAccessPattern(AccessPattern Pattern) {
+	pattern = Pattern;
+	Advise();
+}
+
+const uint8_t *FileMapping::Read(uint64_t start, uint64_t length) {
+	assert(start + length <= static_cast<uint64_t>(file_size));
+
+	// Check if we can just use the current mapping
+	if (buffer && start >= mapping_start && start + length <= mapping_start + mapping_length)
+		return buffer + start - mapping_start;
+
+	if (sizeof(size_t) == 4) {
+		mapping_start = start & ~0xFFFFFULL; // Align to 1 MB boundary
+		length += static_cast<size_t>(start - mapping_start);
+		// Map 16 MB or length rounded up to the next MB
+		length = std::min<uint64_t>(std::max<uint64_t>(0x1000000U, (length + 0xFFFFF) & ~0xFFFFF), file_size - mapping_start);
+	}
+	else {
+		// Just map the whole file
+		mapping_start = 0;
+		length = file_size;
+	}
+
+	Map(mapping_start, static_cast<size_t>(length));
+	return buffer + start - mapping_start;
+}
@@ -0,0 +1,61 @@
+//  Copyright (c) 2014 Thomas Goyne <tgoyne@gmail.com>
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#ifndef FILEMAPPING_H
+#define FILEMAPPING_H
+
+#include "filereader.h"
+
+#include <stdint.h>
+#include <cstddef>
+
+// Read-only memory mapping of a file. 64-bit builds map the whole file at
+// once, while 32-bit builds map a window around what was last read, so a
+// pointer returned by Read is only valid until the next call to it.
+class FileMapping : public FileReader {
+#ifdef _WIN32
+	void *file_mapping;
+#else
+	int fd;
+#endif
+	int64_t file_size;
+
+	uint64_t mapping_start;
+	uint64_t mapping_length;
+	const uint8_t *buffer;
+	AccessPattern pattern;
+
+	void Map(uint64_t start, size_t length);
+	void Unmap();
+	// Passes the access pattern on to the current mapping
+	void Advise();
+
+public:
+	FileMapping(const char *path);
+	~FileMapping();
+
+	uint64_t Size() const { return file_size; }
+	const uint8_t *Read(uint64_t start, uint64_t length);
+	void SetAccessPattern(AccessPattern Pattern);
+	void Prefetch(uint64_t start, uint64_t length);
+};
+
+#endif
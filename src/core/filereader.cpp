@@ -0,0 +1,224 @@
+//  Copyright (c) 2015 The FFmpegSource Project
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#include "filereader.h"
+
+#include "filemapping.h"
+
+#include <algorithm>
+#include <cassert>
+#include <vector>
+
+namespace {
+volatile int IOBackend = FFMS_IO_DEFAULT;
+
+// Window sizes for BufferedReader; sequential reads want few large reads,
+// while random reads shouldn't pull in much they won't use
+const size_t SequentialWindow = 4 * 1024 * 1024;
+const size_t RandomWindow = 256 * 1024;
+const size_t NormalWindow = 1024 * 1024;
+}
+
+#ifdef _WIN32
+#define WIN32_EXTRA_LEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+// Reads the file with positioned reads into a window buffer, for when
+// mapping the file is undesirable (network filesystems, 32-bit address
+// space, files being appended to)
+class BufferedReader : public FileReader {
+	std::string Path;
+#ifdef _WIN32
+	HANDLE File;
+#else
+	int File;
+#endif
+	uint64_t FileSize;
+	std::vector<uint8_t> Buffer;
+	uint64_t BufferStart;
+	size_t BufferLength;
+	size_t Window;
+
+	void ReadAt(uint64_t Pos, uint8_t *Dst, size_t Length);
+
+public:
+	BufferedReader(const char *Filename);
+	~BufferedReader();
+
+	uint64_t Size() const { return FileSize; }
+	const uint8_t *Read(uint64_t Start, uint64_t Length);
+	void SetAccessPattern(AccessPattern Pattern);
+	void Prefetch(uint64_t Start, uint64_t Length);
+};
+
+#ifdef _WIN32
+BufferedReader::BufferedReader(const char *Filename)
+: Path(Filename)
+, File(CreateFileW(widen_path(Filename).c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, 0, 0))
+, BufferStart(0)
+, BufferLength(0)
+, Window(NormalWindow)
+{
+	if (File == INVALID_HANDLE_VALUE)
+		throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
+			"Can't open '" + Path + "'");
+
+	LARGE_INTEGER li;
+	if (!GetFileSizeEx(File, &li)) {
+		CloseHandle(File);
+		throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
+			"Can't get size of file '" + Path + "'");
+	}
+	FileSize = li.QuadPart;
+}
+
+BufferedReader::~BufferedReader() {
+	CloseHandle(File);
+}
+
+void BufferedReader::ReadAt(uint64_t Pos, uint8_t *Dst, size_t Length) {
+	while (Length) {
+		OVERLAPPED Offset = {};
+		Offset.Offset = static_cast<DWORD>(Pos);
+		Offset.OffsetHigh = static_cast<DWORD>(Pos >> 32);
+		DWORD Got = 0;
+		if (!ReadFile(File, Dst, static_cast<DWORD>(std::min<size_t>(Length, 0x40000000)), &Got, &Offset) || !Got)
+			throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
+				"Can't read from '" + Path + "'");
+		Pos += Got;
+		Dst += Got;
+		Length -= Got;
+	}
+}
+
+// There's no cheap way to ask Windows for readahead on an open handle, and
+// its own readahead already follows sequential reads
+void BufferedReader::Prefetch(uint64_t, uint64_t) { }
+#else
+BufferedReader::BufferedReader(const char *Filename)
+: Path(Filename)
+, File(open(Filename, O_RDONLY))
+, BufferStart(0)
+, BufferLength(0)
+, Window(NormalWindow)
+{
+	if (File < 0)
+		throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
+			"Can't open '" + Path + "': " + strerror(errno));
+
+	struct stat st;
+	if (fstat(File, &st) < 0) {
+		close(File);
+		throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
+			"Can't get size of file '" + Path + "': " + strerror(errno));
+	}
+	FileSize = st.st_size;
+}
+
+BufferedReader::~BufferedReader() {
+	close(File);
+}
+
+void BufferedReader::ReadAt(uint64_t Pos, uint8_t *Dst, size_t Length) {
+	while (Length) {
+		ssize_t Got = pread(File, Dst, Length, static_cast<off_t>(Pos));
+		if (Got < 0 && errno == EINTR)
+			continue;
+		if (Got < 0)
+			throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
+				"Can't read from '" + Path + "': " + strerror(errno));
+		if (Got == 0)
+			throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
+				"Unexpected end of '" + Path + "'");
+		Pos += Got;
+		Dst += Got;
+		Length -= Got;
+	}
+}
+
+void BufferedReader::Prefetch(uint64_t Start, uint64_t Length) {
+	// Skip what's already buffered so that the kernel only queues
+	// readahead for what's missing
+	if (Start >= BufferStart && Start < BufferStart + BufferLength) {
+		uint64_t Buffered = BufferStart + BufferLength - Start;
+		if (Buffered >= Length)
+			return;
+		Start += Buffered;
+		Length -= Buffered;
+	}
+#ifdef POSIX_FADV_WILLNEED
+	posix_fadvise(File, static_cast<off_t>(Start), static_cast<off_t>(Length), POSIX_FADV_WILLNEED);
+#endif
+}
+#endif
+
+const uint8_t *BufferedReader::Read(uint64_t Start, uint64_t Length) {
+	assert(Start + Length <= FileSize);
+
+	if (Start < BufferStart || Start + Length > BufferStart + BufferLength) {
+		size_t NewLength = static_cast<size_t>(std::min(std::max<uint64_t>(Length, Window), FileSize - Start));
+		if (Buffer.size() < NewLength)
+			Buffer.resize(NewLength);
+		// Invalidate the buffer first so a failed read doesn't leave it
+		// claiming to hold data it doesn't
+		BufferLength = 0;
+		ReadAt(Start, &Buffer[0], NewLength);
+		BufferStart = Start;
+		BufferLength = NewLength;
+	}
+
+	return &Buffer[0] + (Start - BufferStart);
+}
+
+void BufferedReader::SetAccessPattern(AccessPattern Pattern) {
+	switch (Pattern) {
+		case ACCESS_SEQUENTIAL: Window = SequentialWindow; break;
+		case ACCESS_RANDOM: Window = RandomWindow; break;
+		default: Window = NormalWindow; break;
+	}
+#if !defined(_WIN32) && defined(POSIX_FADV_SEQUENTIAL)
+	int Advice = POSIX_FADV_NORMAL;
+	if (Pattern == ACCESS_SEQUENTIAL)
+		Advice = POSIX_FADV_SEQUENTIAL;
+	else if (Pattern == ACCESS_RANDOM)
+		Advice = POSIX_FADV_RANDOM;
+	posix_fadvise(File, 0, 0, Advice);
+#endif
+}
+}
+
+FileReader *CreateFileReader(const char *Filename) {
+	if (IOBackend == FFMS_IO_PREAD)
+		return new BufferedReader(Filename);
+	return new FileMapping(Filename);
+}
+
+void SetIOBackend(int Backend) {
+	if (Backend != FFMS_IO_MMAP && Backend != FFMS_IO_PREAD)
+		Backend = FFMS_IO_DEFAULT;
+	IOBackend = Backend;
+}
@@ -0,0 +1,59 @@
+//  Copyright (c) 2015 The FFmpegSource Project
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#ifndef FILEREADER_H
+#define FILEREADER_H
+
+#include "utils.h"
+
+#include <stdint.h>
+
+// Random access reading of a source file through one of the backends
+// selected with FFMS_SetIOBackend. Only the Matroska reader uses this;
+// libavformat opens files with its own I/O.
+class FileReader : private noncopyable {
+public:
+	enum AccessPattern {
+		ACCESS_NORMAL,
+		// Read from start to end, as when indexing
+		ACCESS_SEQUENTIAL,
+		// Read in short runs at unpredictable positions, as when decoding
+		// with seeking; the reader should Prefetch what it will need. Only
+		// the pread backend reads less ahead for this, as mappings depend on
+		// the system's readahead
+		ACCESS_RANDOM
+	};
+
+	virtual ~FileReader() { }
+
+	virtual uint64_t Size() const = 0;
+	// The returned pointer is only valid until the next call
+	virtual const uint8_t *Read(uint64_t Start, uint64_t Length) = 0;
+	virtual void SetAccessPattern(AccessPattern Pattern) = 0;
+	// Hints that the range will be read soon, so that it can be loaded in
+	// the background
+	virtual void Prefetch(uint64_t Start, uint64_t Length) = 0;
+};
+
+FileReader *CreateFileReader(const char *Filename);
+void SetIOBackend(int Backend);
+
+#endif
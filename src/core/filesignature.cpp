@@ -0,0 +1,272 @@
+//  Copyright (c) 2015 The FFmpegSource Project
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#include "filesignature.h"
+
+#include "filehandle.h"
+#include "indexing.h"
+#include "threading.h"
+#include "trace.h"
+#include "track.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <map>
+
+extern "C" {
+#include <libavutil/sha.h>
+}
+
+#include <cstdlib>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#	include <windows.h>
+#endif
+
+namespace {
+const uint64_t Prime1 = 11400714785074694791ULL;
+const uint64_t Prime2 = 14029467366897019727ULL;
+const uint64_t Prime3 = 1609587929392839161ULL;
+const uint64_t Prime4 = 9650029242287828579ULL;
+const uint64_t Prime5 = 2870177450012600261ULL;
+
+uint64_t RotateLeft(uint64_t Value, int Bits) {
+	return (Value << Bits) | (Value >> (64 - Bits));
+}
+
+uint64_t Read64(const uint8_t *Data) {
+	uint64_t Value = 0;
+	for (int i = 7; i >= 0; --i)
+		Value = (Value << 8) | Data[i];
+	return Value;
+}
+
+uint32_t Read32(const uint8_t *Data) {
+	return Data[0] | (Data[1] << 8) | (Data[2] << 16) | (static_cast<uint32_t>(Data[3]) << 24);
+}
+
+uint64_t Round(uint64_t Acc, uint64_t Input) {
+	Acc += Input * Prime2;
+	return RotateLeft(Acc, 31) * Prime1;
+}
+
+uint64_t MergeRound(uint64_t Acc, uint64_t Value) {
+	Acc ^= Round(0, Value);
+	return Acc * Prime1 + Prime4;
+}
+
+// Signatures are only calculated from the start and end of files, so
+// they're cached until the file changes
+struct SignatureKey {
+	FileIdentity Identity;
+	int64_t Length;
+	int Type;
+
+	bool operator<(SignatureKey const& other) const {
+		if (Length != other.Length) return Length < other.Length;
+		if (Type != other.Type) return Type < other.Type;
+		return Identity < other.Identity;
+	}
+};
+
+struct Signature {
+	int64_t Filesize;
+	uint8_t Digest[20];
+};
+
+const size_t MaxCachedSignatures = 4096;
+
+Mutex SignatureCacheLock;
+std::map<SignatureKey, Signature> SignatureCache;
+
+void ffms_free_sha(AVSHA **ctx) { av_freep(ctx); }
+
+void HashFile(const char *Filename, int64_t *Filesize, uint8_t Digest[20], int64_t Length, int Type) {
+	FileHandle file(Filename, "rb", FFMS_ERROR_INDEX, FFMS_ERROR_FILE_READ);
+
+	*Filesize = file.Size();
+	if (Length >= 0 && Length < *Filesize)
+		*Filesize = Length;
+	std::vector<char> FileBuffer(static_cast<size_t>(std::min<int64_t>(1024*1024, *Filesize)));
+	std::vector<char> TailBuffer;
+	size_t BytesRead = file.Read(&FileBuffer[0], FileBuffer.size());
+	FileBuffer.resize(BytesRead);
+
+	if (*Filesize > static_cast<int64_t>(BytesRead)) {
+		TailBuffer.resize(FileBuffer.capacity());
+		file.Seek(*Filesize - (int)TailBuffer.size(), SEEK_SET);
+		TailBuffer.resize(file.Read(&TailBuffer[0], TailBuffer.size()));
+	}
+
+	memset(Digest, 0, 20);
+	if (Type == FFMS_SIGNATURE_XXH64) {
+		uint64_t Hash = XXH64(FileBuffer.empty() ? NULL : &FileBuffer[0], FileBuffer.size(), 0);
+		Hash = XXH64(TailBuffer.empty() ? NULL : &TailBuffer[0], TailBuffer.size(), Hash);
+		for (int i = 0; i < 8; ++i)
+			Digest[i] = static_cast<uint8_t>(Hash >> (56 - i * 8));
+		return;
+	}
+
+#if VERSION_CHECK(LIBAVUTIL_VERSION_INT, >=, 51, 43, 0, 51, 75, 100)
+	unknown_size<AVSHA, av_sha_alloc, ffms_free_sha> ctx;
+#else
+	std::vector<uint8_t> ctxmem(av_sha_size);
+	AVSHA *ctx = (AVSHA*)(&ctxmem[0]);
+#endif
+	av_sha_init(ctx, 160);
+	if (!FileBuffer.empty())
+		av_sha_update(ctx, reinterpret_cast<const uint8_t*>(&FileBuffer[0]), FileBuffer.size());
+	if (!TailBuffer.empty())
+		av_sha_update(ctx, reinterpret_cast<const uint8_t*>(&TailBuffer[0]), TailBuffer.size());
+	av_sha_final(ctx, Digest);
+}
+}
+
+bool FileIdentity::operator<(FileIdentity const& other) const {
+	if (Device != other.Device) return Device < other.Device;
+	if (Inode != other.Inode) return Inode < other.Inode;
+	if (Size != other.Size) return Size < other.Size;
+	if (ModificationTime != other.ModificationTime) return ModificationTime < other.ModificationTime;
+	return Path < other.Path;
+}
+
+bool GetFileIdentity(const char *Filename, FileIdentity &Identity) {
+#ifdef _WIN32
+	struct _stati64 st;
+	if (_wstati64(widen_path(Filename).c_str(), &st) != 0)
+		return false;
+#else
+	struct stat st;
+	if (stat(Filename, &st) != 0)
+		return false;
+#endif
+	// Windows has no inode numbers, so the path is part of the identity
+#ifdef _WIN32
+	wchar_t FullPath[_MAX_PATH];
+	if (_wfullpath(FullPath, widen_path(Filename).c_str(), _MAX_PATH)) {
+		_wcslwr(FullPath);
+		Identity.Path.assign(reinterpret_cast<const char *>(FullPath), wcslen(FullPath) * sizeof(wchar_t));
+	} else {
+		Identity.Path = Filename;
+	}
+#else
+	char *FullPath = realpath(Filename, NULL);
+	Identity.Path = FullPath ? FullPath : Filename;
+	free(FullPath);
+#endif
+	Identity.Device = st.st_dev;
+	Identity.Inode = st.st_ino;
+	Identity.Size = st.st_size;
+	// Files rewritten at the same size within a second still have to get a
+	// different identity, so use the full resolution of the timestamp
+#ifdef _WIN32
+	WIN32_FILE_ATTRIBUTE_DATA Attributes;
+	if (GetFileAttributesExW(widen_path(Filename).c_str(), GetFileExInfoStandard, &Attributes))
+		Identity.ModificationTime = (static_cast<int64_t>(Attributes.ftLastWriteTime.dwHighDateTime) << 32) | Attributes.ftLastWriteTime.dwLowDateTime;
+	else
+		Identity.ModificationTime = st.st_mtime;
+#elif defined(__APPLE__)
+	Identity.ModificationTime = static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+	Identity.ModificationTime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+	return true;
+}
+
+uint64_t XXH64(const void *Data, size_t Length, uint64_t Seed) {
+	const uint8_t *Pos = static_cast<const uint8_t *>(Data);
+	const uint8_t *End = Pos + Length;
+	uint64_t Hash;
+
+	if (Length >= 32) {
+		uint64_t V1 = Seed + Prime1 + Prime2;
+		uint64_t V2 = Seed + Prime2;
+		uint64_t V3 = Seed;
+		uint64_t V4 = Seed - Prime1;
+		do {
+			V1 = Round(V1, Read64(Pos));
+			V2 = Round(V2, Read64(Pos + 8));
+			V3 = Round(V3, Read64(Pos + 16));
+			V4 = Round(V4, Read64(Pos + 24));
+			Pos += 32;
+		} while (Pos + 32 <= End);
+
+		Hash = RotateLeft(V1, 1) + RotateLeft(V2, 7) + RotateLeft(V3, 12) + RotateLeft(V4, 18);
+		Hash = MergeRound(Hash, V1);
+		Hash = MergeRound(Hash, V2);
+		Hash = MergeRound(Hash, V3);
+		Hash = MergeRound(Hash, V4);
+	} else {
+		Hash = Seed + Prime5;
+	}
+
+	Hash += Length;
+	for (; Pos + 8 <= End; Pos += 8)
+		Hash = RotateLeft(Hash ^ Round(0, Read64(Pos)), 27) * Prime1 + Prime4;
+	if (Pos + 4 <= End) {
+		Hash = RotateLeft(Hash ^ (Read32(Pos) * Prime1), 23) * Prime2 + Prime3;
+		Pos += 4;
+	}
+	for (; Pos < End; ++Pos)
+		Hash = RotateLeft(Hash ^ (*Pos * Prime5), 11) * Prime1;
+
+	Hash ^= Hash >> 33;
+	Hash *= Prime2;
+	Hash ^= Hash >> 29;
+	Hash *= Prime3;
+	Hash ^= Hash >> 32;
+	return Hash;
+}
+
+void FFMS_Index::CalculateFileSignature(const char *Filename, int64_t *Filesize, uint8_t Digest[20], int64_t Length, int Type) {
+	TraceSpan Span("index", "FileSignature");
+	if (Type != FFMS_SIGNATURE_SHA1 && Type != FFMS_SIGNATURE_XXH64)
+		throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
+			"Invalid signature type specified");
+
+	SignatureKey Key;
+	bool Cacheable = GetFileIdentity(Filename, Key.Identity);
+	Key.Length = Length;
+	Key.Type = Type;
+
+	if (Cacheable) {
+		ScopedLock Lock(SignatureCacheLock);
+		std::map<SignatureKey, Signature>::const_iterator it = SignatureCache.find(Key);
+		if (it != SignatureCache.end()) {
+			*Filesize = it->second.Filesize;
+			memcpy(Digest, it->second.Digest, sizeof(it->second.Digest));
+			return;
+		}
+	}
+
+	Signature Result;
+	HashFile(Filename, &Result.Filesize, Result.Digest, Length, Type);
+	*Filesize = Result.Filesize;
+	memcpy(Digest, Result.Digest, sizeof(Result.Digest));
+
+	if (Cacheable) {
+		ScopedLock Lock(SignatureCacheLock);
+		if (SignatureCache.size() >= MaxCachedSignatures)
+			SignatureCache.clear();
+		SignatureCache[Key] = Result;
+	}
+}
@@ -0,0 +1,50 @@
+//  Copyright (c) 2015 The FFmpegSource Project
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#ifndef FILESIGNATURE_H
+#define FILESIGNATURE_H
+
+#include <stdint.h>
+#include <cstddef>
+#include <string>
+
+// Identifies a version of a file without reading it. Used as the key of
+// the process-wide caches of file signatures.
+struct FileIdentity {
+	std::string Path;
+	uint64_t Device;
+	uint64_t Inode;
+	int64_t Size;
+	// In the finest units the platform has (nanoseconds, or 100ns on Windows)
+	int64_t ModificationTime;
+
+	bool operator<(FileIdentity const& other) const;
+};
+
+// Identity.Path is made absolute so that different names for the same
+// file compare equal where possible. Returns false if the file can't be
+// stat'ed.
+bool GetFileIdentity(const char *Filename, FileIdentity &Identity);
+
+// xxHash64 as specified at https://github.com/Cyan4973/xxHash
+uint64_t XXH64(const void *Data, size_t Length, uint64_t Seed);
+
+#endif
@@ -21,6 +21,7 @@
 #ifdef HAALISOURCE
 
 #include "haalicommon.h"
+#include "trace.h"
 #include "videosource.h"
 
 namespace {
@@ -129,6 +130,7 @@ FFHaaliVideo::FFHaaliVideo(const char *SourceFile, int Track, FFMS_Index &Index,
 }
 
 void FFHaaliVideo::DecodeNextFrame(int64_t *AFirstStartTime) {
+	TraceSpan Span("video", "DecodeNextFrame");
 	*AFirstStartTime = -1;
 	if (HasPendingDelayedFrames()) return;
 
@@ -137,12 +139,18 @@ void FFHaaliVideo::DecodeNextFrame(int64_t *AFirstStartTime) {
 
 	for (;;) {
 		CComPtr<IMMFrame> pMMF;
-		if (pMMC->ReadFrame(NULL, &pMMF) != S_OK)
-			break;
+		{
+			StatsTimer Timer(Stats.DemuxTime);
+			if (pMMC->ReadFrame(NULL, &pMMF) != S_OK)
+				break;
+		}
 
 		if (pMMF->GetTrack() != VideoTrack)
 			continue;
 
+		++Stats.PacketsRead;
+		Stats.BytesRead += pMMF->GetActualDataLength();
+
 		REFERENCE_TIME  Ts, Te;
 		if (*AFirstStartTime < 0 && SUCCEEDED(pMMF->GetTime(&Ts, &Te)))
 			*AFirstStartTime = Ts;
@@ -186,8 +194,11 @@ FFMS_Frame *FFHaaliVideo::GetFrame(int n) {
 	GetFrameCheck(n);
 	n = Frames.RealFrameNumber(n);
 
-	if (LastFrameNum == n)
+	if (LastFrameNum == n) {
+		++Stats.CacheHits;
 		return &LocalFrame;
+	}
+	++Stats.CacheMisses;
 
 	bool HasSeeked = false;
 	int SeekOffset = 0;
@@ -195,7 +206,8 @@ FFMS_Frame *FFHaaliVideo::GetFrame(int n) {
 	if (n < CurrentFrame || Frames.FindClosestVideoKeyFrame(n) > CurrentFrame + 10) {
 ReSeek:
 		pMMC->Seek(Frames[n + SeekOffset].PTS, MMSF_PREV_KF);
-		FlushBuffers(CodecContext);
+		FlushDecoder();
+		++Stats.Seeks;
 		DelayCounter = 0;
 		InitialDecode = 1;
 		HasSeeked = true;
@@ -219,6 +231,7 @@ ReSeek:
 						"Frame accurate seeking is not possible in this file");
 
 				SeekOffset -= FFMIN(20, n + SeekOffset);
+				++Stats.SeekRetries;
 				goto ReSeek;
 			}
 		}
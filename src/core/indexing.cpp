@@ -23,6 +23,10 @@
 #include "indexing.h"
 
 #include "codectype.h"
+#include "filemapping.h"
+#include "filesignature.h"
+#include "samplecount.h"
+#include "trace.h"
 #include "track.h"
 #include "wave64writer.h"
 #include "zipfile.h"
@@ -34,10 +38,25 @@
 
 extern "C" {
 #include <libavutil/avutil.h>
-#include <libavutil/sha.h>
 }
 
 #define INDEXID 0x53920873
+// 'FFMC' in little endian; can't be mistaken for the zlib header that
+// compressed index files start with
+#define COLUMNAR_INDEXID 0x434D4646
+
+namespace {
+// Size of the fixed part of the columnar index header
+const uint64_t ColumnarHeaderSize = 80;
+}
+
+// Number of packets whose header sample counts have to match what the
+// decoder outputs before the decoder is skipped for the rest of the track
+#define HEADER_VALIDATION_PACKETS 64
+// After this many packets counted from their headers, a few are decoded
+// again to check that the decoder still agrees
+#define HEADER_REVALIDATION_INTERVAL 1024
+#define HEADER_REVALIDATION_PACKETS 8
 
 extern bool HasHaaliMPEG;
 extern bool HasHaaliOGG;
@@ -69,6 +88,14 @@ SharedAudioContext::SharedAudioContext(bool FreeCodecContext)
 , W64Writer(NULL)
 , CurrentSample(0)
 , TCC(NULL)
+, Waveform(NULL)
+, Format()
+, HasFormat(false)
+, DumpDeclined(false)
+, HeaderCounts(HEADERS_UNCHECKED)
+, ValidatedPackets(0)
+, TrustedPackets(0)
+, Resynced(false)
 {
 }
 
@@ -82,56 +109,311 @@ SharedAudioContext::~SharedAudioContext() {
 	delete TCC;
 }
 
-void ffms_free_sha(AVSHA **ctx) { av_freep(ctx); }
+IndexResumePoint::IndexResumePoint()
+: FilePos(-1)
+, IndexMask(0)
+{
+}
 
-void FFMS_Index::CalculateFileSignature(const char *Filename, int64_t *Filesize, uint8_t Digest[20]) {
-	FileHandle file(Filename, "rb", FFMS_ERROR_INDEX, FFMS_ERROR_FILE_READ);
+void IndexResumePoint::Read(ZipFile &Stream) {
+	FilePos = Stream.Read<int64_t>();
+	IndexMask = Stream.Read<int32_t>();
+	uint32_t Tracks = Stream.Read<uint32_t>();
+	LastValidTS.resize(Tracks);
+	LastDuration.resize(Tracks);
+	for (size_t i = 0; i < Tracks; ++i) {
+		LastValidTS[i] = Stream.Read<int64_t>();
+		LastDuration[i] = Stream.Read<int32_t>();
+	}
+}
 
-#if VERSION_CHECK(LIBAVUTIL_VERSION_INT, >=, 51, 43, 0, 51, 75, 100)
-	unknown_size<AVSHA, av_sha_alloc, ffms_free_sha> ctx;
-#else
-	std::vector<uint8_t> ctxmem(av_sha_size);
-	AVSHA *ctx = (AVSHA*)(&ctxmem[0]);
-#endif
-	av_sha_init(ctx, 160);
+void IndexResumePoint::Write(ZipFile &Stream) const {
+	Stream.Write<int64_t>(FilePos);
+	Stream.Write<int32_t>(IndexMask);
+	Stream.Write<uint32_t>(LastValidTS.size());
+	for (size_t i = 0; i < LastValidTS.size(); ++i) {
+		Stream.Write<int64_t>(LastValidTS[i]);
+		Stream.Write<int32_t>(LastDuration[i]);
+	}
+}
 
-	try {
-		*Filesize = file.Size();
-		std::vector<char> FileBuffer(static_cast<size_t>(std::min<int64_t>(1024*1024, *Filesize)));
-		size_t BytesRead = file.Read(&FileBuffer[0], FileBuffer.size());
-		av_sha_update(ctx, reinterpret_cast<const uint8_t*>(&FileBuffer[0]), BytesRead);
-
-		if (*Filesize > static_cast<int64_t>(FileBuffer.size())) {
-			file.Seek(*Filesize - (int)FileBuffer.size(), SEEK_SET);
-			BytesRead = file.Read(&FileBuffer[0], FileBuffer.size());
-			av_sha_update(ctx, reinterpret_cast<const uint8_t*>(&FileBuffer[0]), BytesRead);
+StreamParameters::StreamParameters()
+: CodecType(AVMEDIA_TYPE_UNKNOWN)
+, CodecID(FFMS_ID(NONE))
+, CodecTag(0)
+, Width(0)
+, Height(0)
+, PixFmt(PIX_FMT_NONE)
+, SampleRate(0)
+, Channels(0)
+, ChannelLayout(0)
+, SampleFormat(AV_SAMPLE_FMT_NONE)
+, BitsPerCodedSample(0)
+, BlockAlign(0)
+, BitRate(0)
+{
+	TimeBase.num = TimeBase.den = 0;
+	SampleAspectRatio.num = SampleAspectRatio.den = 0;
+}
+
+StreamParameters::StreamParameters(AVStream const* Stream)
+: CodecType(Stream->codec->codec_type)
+, CodecID(Stream->codec->codec_id)
+, CodecTag(Stream->codec->codec_tag)
+, Width(Stream->codec->width)
+, Height(Stream->codec->height)
+, PixFmt(Stream->codec->pix_fmt)
+, SampleRate(Stream->codec->sample_rate)
+, Channels(Stream->codec->channels)
+, ChannelLayout(Stream->codec->channel_layout)
+, SampleFormat(Stream->codec->sample_fmt)
+, BitsPerCodedSample(Stream->codec->bits_per_coded_sample)
+, BlockAlign(Stream->codec->block_align)
+, BitRate(Stream->codec->bit_rate)
+, TimeBase(Stream->time_base)
+, SampleAspectRatio(Stream->sample_aspect_ratio)
+{
+	if (Stream->codec->extradata_size > 0)
+		ExtraData.assign(Stream->codec->extradata, Stream->codec->extradata + Stream->codec->extradata_size);
+}
+
+void StreamParameters::Read(ZipFile &Stream) {
+	CodecType = Stream.Read<int32_t>();
+	CodecID = Stream.Read<int32_t>();
+	CodecTag = Stream.Read<uint32_t>();
+	ExtraData.resize(Stream.Read<uint32_t>());
+	if (!ExtraData.empty())
+		Stream.Read(&ExtraData[0], ExtraData.size());
+	Width = Stream.Read<int32_t>();
+	Height = Stream.Read<int32_t>();
+	PixFmt = Stream.Read<int32_t>();
+	SampleRate = Stream.Read<int32_t>();
+	Channels = Stream.Read<int32_t>();
+	ChannelLayout = Stream.Read<uint64_t>();
+	SampleFormat = Stream.Read<int32_t>();
+	BitsPerCodedSample = Stream.Read<int32_t>();
+	BlockAlign = Stream.Read<int32_t>();
+	BitRate = Stream.Read<int64_t>();
+	TimeBase.num = Stream.Read<int32_t>();
+	TimeBase.den = Stream.Read<int32_t>();
+	SampleAspectRatio.num = Stream.Read<int32_t>();
+	SampleAspectRatio.den = Stream.Read<int32_t>();
+}
+
+void StreamParameters::Write(ZipFile &Stream) const {
+	Stream.Write<int32_t>(CodecType);
+	Stream.Write<int32_t>(CodecID);
+	Stream.Write<uint32_t>(CodecTag);
+	Stream.Write<uint32_t>(ExtraData.size());
+	if (!ExtraData.empty())
+		Stream.Write(&ExtraData[0], ExtraData.size());
+	Stream.Write<int32_t>(Width);
+	Stream.Write<int32_t>(Height);
+	Stream.Write<int32_t>(PixFmt);
+	Stream.Write<int32_t>(SampleRate);
+	Stream.Write<int32_t>(Channels);
+	Stream.Write<uint64_t>(ChannelLayout);
+	Stream.Write<int32_t>(SampleFormat);
+	Stream.Write<int32_t>(BitsPerCodedSample);
+	Stream.Write<int32_t>(BlockAlign);
+	Stream.Write<int64_t>(BitRate);
+	Stream.Write<int32_t>(TimeBase.num);
+	Stream.Write<int32_t>(TimeBase.den);
+	Stream.Write<int32_t>(SampleAspectRatio.num);
+	Stream.Write<int32_t>(SampleAspectRatio.den);
+}
+
+bool StreamParameters::Matches(AVStream const* Stream) const {
+	// Without probing, some demuxers only know the type of a stream, or
+	// nothing at all
+	return Stream->codec->codec_type == CodecType &&
+		Stream->codec->codec_id == CodecID &&
+		Stream->time_base.num == TimeBase.num &&
+		Stream->time_base.den == TimeBase.den;
+}
+
+void StreamParameters::Apply(AVStream *Stream) const {
+	AVCodecContext *CodecContext = Stream->codec;
+	if (!CodecContext->codec_tag)
+		CodecContext->codec_tag = CodecTag;
+	if (!ExtraData.empty() && !CodecContext->extradata_size) {
+		CodecContext->extradata = static_cast<uint8_t*>(av_mallocz(ExtraData.size() + FF_INPUT_BUFFER_PADDING_SIZE));
+		memcpy(CodecContext->extradata, &ExtraData[0], ExtraData.size());
+		CodecContext->extradata_size = ExtraData.size();
+	}
+	CodecContext->width = Width;
+	CodecContext->height = Height;
+	CodecContext->pix_fmt = static_cast<PixelFormat>(PixFmt);
+	CodecContext->sample_rate = SampleRate;
+	CodecContext->channels = Channels;
+	CodecContext->channel_layout = ChannelLayout;
+	CodecContext->sample_fmt = static_cast<AVSampleFormat>(SampleFormat);
+	CodecContext->bits_per_coded_sample = BitsPerCodedSample;
+	CodecContext->block_align = BlockAlign;
+	CodecContext->bit_rate = BitRate;
+	Stream->sample_aspect_ratio = SampleAspectRatio;
+}
+
+TrackProperties::TrackProperties()
+: Valid(false)
+, EncodedWidth(0)
+, EncodedHeight(0)
+, EncodedPixelFormat(PIX_FMT_NONE)
+, ColorSpace(AVCOL_SPC_UNSPECIFIED)
+, ColorRange(AVCOL_RANGE_UNSPECIFIED)
+{
+	memset(&VP, 0, sizeof(VP));
+	memset(&AP, 0, sizeof(AP));
+}
+
+void TrackProperties::Read(ZipFile &Stream) {
+	Valid = !!Stream.Read<uint8_t>();
+	if (!Valid)
+		return;
+
+	VP.FPSDenominator = Stream.Read<int32_t>();
+	VP.FPSNumerator = Stream.Read<int32_t>();
+	VP.RFFDenominator = Stream.Read<int32_t>();
+	VP.RFFNumerator = Stream.Read<int32_t>();
+	VP.NumFrames = Stream.Read<int32_t>();
+	VP.SARNum = Stream.Read<int32_t>();
+	VP.SARDen = Stream.Read<int32_t>();
+	VP.CropTop = Stream.Read<int32_t>();
+	VP.CropBottom = Stream.Read<int32_t>();
+	VP.CropLeft = Stream.Read<int32_t>();
+	VP.CropRight = Stream.Read<int32_t>();
+	VP.TopFieldFirst = Stream.Read<int32_t>();
+	VP.FirstTime = Stream.Read<double>();
+	VP.LastTime = Stream.Read<double>();
+	EncodedWidth = Stream.Read<int32_t>();
+	EncodedHeight = Stream.Read<int32_t>();
+	EncodedPixelFormat = Stream.Read<int32_t>();
+	ColorSpace = Stream.Read<int32_t>();
+	ColorRange = Stream.Read<int32_t>();
+
+	AP.SampleFormat = Stream.Read<int32_t>();
+	AP.SampleRate = Stream.Read<int32_t>();
+	AP.BitsPerSample = Stream.Read<int32_t>();
+	AP.Channels = Stream.Read<int32_t>();
+	AP.ChannelLayout = Stream.Read<int64_t>();
+	AP.NumSamples = Stream.Read<int64_t>();
+	AP.FirstTime = Stream.Read<double>();
+	AP.LastTime = Stream.Read<double>();
+}
+
+void TrackProperties::Write(ZipFile &Stream) const {
+	Stream.Write<uint8_t>(Valid);
+	if (!Valid)
+		return;
+
+	Stream.Write<int32_t>(VP.FPSDenominator);
+	Stream.Write<int32_t>(VP.FPSNumerator);
+	Stream.Write<int32_t>(VP.RFFDenominator);
+	Stream.Write<int32_t>(VP.RFFNumerator);
+	Stream.Write<int32_t>(VP.NumFrames);
+	Stream.Write<int32_t>(VP.SARNum);
+	Stream.Write<int32_t>(VP.SARDen);
+	Stream.Write<int32_t>(VP.CropTop);
+	Stream.Write<int32_t>(VP.CropBottom);
+	Stream.Write<int32_t>(VP.CropLeft);
+	Stream.Write<int32_t>(VP.CropRight);
+	Stream.Write<int32_t>(VP.TopFieldFirst);
+	Stream.Write<double>(VP.FirstTime);
+	Stream.Write<double>(VP.LastTime);
+	Stream.Write<int32_t>(EncodedWidth);
+	Stream.Write<int32_t>(EncodedHeight);
+	Stream.Write<int32_t>(EncodedPixelFormat);
+	Stream.Write<int32_t>(ColorSpace);
+	Stream.Write<int32_t>(ColorRange);
+
+	Stream.Write<int32_t>(AP.SampleFormat);
+	Stream.Write<int32_t>(AP.SampleRate);
+	Stream.Write<int32_t>(AP.BitsPerSample);
+	Stream.Write<int32_t>(AP.Channels);
+	Stream.Write<int64_t>(AP.ChannelLayout);
+	Stream.Write<int64_t>(AP.NumSamples);
+	Stream.Write<double>(AP.FirstTime);
+	Stream.Write<double>(AP.LastTime);
+}
+
+namespace {
+// Indexes read while caching is enabled, by the identity of the index
+// file. The cache doesn't hold a reference; indexes remove themselves
+// when the last reference is released.
+Mutex IndexCacheLock;
+std::map<FileIdentity, FFMS_Index *> IndexCache;
+bool IndexCaching = false;
+}
+
+FFMS_Index *FFMS_Index::ReadIndex(const char *IndexFile) {
+	FileIdentity Identity;
+	if (!IndexCaching || !GetFileIdentity(IndexFile, Identity))
+		return new FFMS_Index(IndexFile);
+
+	{
+		ScopedLock Lock(IndexCacheLock);
+		std::map<FileIdentity, FFMS_Index *>::iterator it = IndexCache.find(Identity);
+		if (it != IndexCache.end()) {
+			it->second->AddRef();
+			return it->second;
 		}
 	}
-	catch (...) {
-		av_sha_final(ctx, Digest);
-		throw;
+
+	// The file is read without holding the lock, so another thread may
+	// have read it too in the meantime
+	std::auto_ptr<FFMS_Index> Index(new FFMS_Index(IndexFile));
+	ScopedLock Lock(IndexCacheLock);
+	std::map<FileIdentity, FFMS_Index *>::iterator it = IndexCache.find(Identity);
+	if (it != IndexCache.end()) {
+		it->second->AddRef();
+		return it->second;
 	}
-	av_sha_final(ctx, Digest);
+	Index->Cached = true;
+	IndexCache[Identity] = Index.get();
+	return Index.release();
+}
+
+void FFMS_Index::SetCaching(bool Enable) {
+	ScopedLock Lock(IndexCacheLock);
+	IndexCaching = Enable;
 }
 
 void FFMS_Index::AddRef() {
-	++RefCount;
+	RefCount.Increment();
 }
 
 void FFMS_Index::Release() {
-	if (--RefCount == 0)
-		delete this;
+	if (Cached) {
+		// Holding the lock stops the cache from handing out the index
+		// while it's being freed
+		ScopedLock Lock(IndexCacheLock);
+		if (RefCount.Decrement() != 0)
+			return;
+		for (std::map<FileIdentity, FFMS_Index *>::iterator it = IndexCache.begin(); it != IndexCache.end(); ++it) {
+			if (it->second == this) {
+				IndexCache.erase(it);
+				break;
+			}
+		}
+	} else if (RefCount.Decrement() != 0) {
+		return;
+	}
+	delete this;
 }
 
-void FFMS_Index::Finalize(std::vector<SharedVideoContext> const& video_contexts) {
+void FFMS_Index::Finalize(std::vector<SharedVideoContext> const& video_contexts, std::vector<size_t> const& first_new_frames) {
+	TraceSpan Span("indexing", "Finalize");
+	for (std::map<int, WaveformSummary>::iterator it = Waveforms.begin(); it != Waveforms.end(); ++it)
+		it->second.Finish();
+
 	for (size_t i = 0, end = size(); i != end; ++i) {
 		FFMS_Track& track = (*this)[i];
-		track.FinalizeTrack();
+		track.FinalizeTrack(i < first_new_frames.size() ? first_new_frames[i] : 0);
 
 		if (track.TT != FFMS_TYPE_VIDEO) continue;
 
 		if (video_contexts[i].CodecContext && video_contexts[i].CodecContext->has_b_frames) {
-			track.MaxBFrames = video_contexts[i].CodecContext->has_b_frames;
+			track.MaxBFrames = std::max(track.MaxBFrames, video_contexts[i].CodecContext->has_b_frames);
 			continue;
 		}
 
@@ -150,11 +432,27 @@ void FFMS_Index::Finalize(std::vector<SharedVideoContext> const& video_contexts)
 bool FFMS_Index::CompareFileSignature(const char *Filename) {
 	int64_t CFilesize;
 	uint8_t CDigest[20];
-	CalculateFileSignature(Filename, &CFilesize, CDigest);
+	CalculateFileSignature(Filename, &CFilesize, CDigest, -1, SignatureType);
+	return (CFilesize == Filesize && !memcmp(CDigest, Digest, sizeof(Digest)));
+}
+
+bool FFMS_Index::IsPrefixOf(const char *Filename) {
+	int64_t CFilesize;
+	uint8_t CDigest[20];
+	CalculateFileSignature(Filename, &CFilesize, CDigest, Filesize, SignatureType);
 	return (CFilesize == Filesize && !memcmp(CDigest, Digest, sizeof(Digest)));
 }
 
-void FFMS_Index::WriteIndex(const char *IndexFile) {
+void FFMS_Index::WriteIndex(const char *IndexFile, int Format) {
+	TraceSpan Span("index", "WriteIndex");
+	if (Format == FFMS_INDEX_FORMAT_COLUMNAR) {
+		WriteColumnarIndex(IndexFile);
+		return;
+	}
+	if (Format != FFMS_INDEX_FORMAT_COMPRESSED)
+		throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
+			"Invalid index format specified");
+
 	ZipFile zf(IndexFile, "wb");
 
 	// Write the index file header
@@ -169,49 +467,275 @@ void FFMS_Index::WriteIndex(const char *IndexFile) {
 	zf.Write<uint32_t>(swscale_version());
 	zf.Write<int64_t>(Filesize);
 	zf.Write(Digest);
+	zf.Write<uint32_t>(SignatureType);
 
 	for (size_t i = 0; i < size(); ++i)
-		at(i).Write(zf);
+		(*this)[i].Write(zf);
 
+	WriteExtraData(zf);
 	zf.Finish();
 }
 
-FFMS_Index::FFMS_Index(const char *IndexFile)
-: RefCount(1)
-{
-	ZipFile zf(IndexFile, "rb");
+void FFMS_Index::WriteColumnarIndex(const char *IndexFile) {
+	ZipFile zf(IndexFile, "wb");
 
-	// Read the index file header
-	if (zf.Read<uint32_t>() != INDEXID)
-		throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
-			std::string("'") + IndexFile + "' is not a valid index file");
+	// Fixed size header, followed by the offset and size of each track so
+	// that tracks can be located without reading the ones before them
+	uint32_t Header[10] = {
+		COLUMNAR_INDEXID, FFMS_VERSION, static_cast<uint32_t>(size()),
+		static_cast<uint32_t>(Decoder), static_cast<uint32_t>(ErrorHandling),
+		avutil_version(), avformat_version(), avcodec_version(), swscale_version(),
+		static_cast<uint32_t>(SignatureType)
+	};
+	uint8_t Padding[4] = {0};
+	zf.WriteRaw(Header, sizeof(Header));
+	zf.WriteRaw(&Filesize, sizeof(Filesize));
+	zf.WriteRaw(Digest, sizeof(Digest));
+	zf.WriteRaw(Padding, sizeof(Padding));
+
+	uint64_t Offset = ColumnarHeaderSize + size() * 2 * sizeof(uint64_t);
+	std::vector<uint64_t> Directory;
+	for (size_t i = 0; i < size(); ++i) {
+		uint64_t Size = (*this)[i].ColumnarSize();
+		Directory.push_back(Offset);
+		Directory.push_back(Size);
+		Offset += Size;
+	}
+	zf.WriteRaw(&Offset, sizeof(Offset));
+	if (!Directory.empty())
+		zf.WriteRaw(&Directory[0], Directory.size() * sizeof(uint64_t));
+
+	for (size_t i = 0; i < size(); ++i)
+		(*this)[i].WriteColumnar(zf);
 
-	if (zf.Read<uint32_t>() != FFMS_VERSION)
+	// Waveforms and the resume information are small and compressed
+	WriteExtraData(zf);
+	zf.Finish();
+}
+
+void FFMS_Index::WriteExtraData(ZipFile &zf) const {
+	zf.Write<uint32_t>(Waveforms.size());
+	for (std::map<int, WaveformSummary>::const_iterator it = Waveforms.begin(); it != Waveforms.end(); ++it) {
+		zf.Write<int32_t>(it->first);
+		it->second.Write(zf);
+	}
+
+	Resume.Write(zf);
+
+	zf.Write<uint32_t>(Streams.size());
+	for (size_t i = 0; i < Streams.size(); ++i)
+		Streams[i].Write(zf);
+
+	zf.Write<uint32_t>(Properties.size());
+	for (size_t i = 0; i < Properties.size(); ++i)
+		Properties[i].Write(zf);
+}
+
+void FFMS_Index::CheckHeader(const char *IndexFile, uint32_t Version, uint32_t AVUtil, uint32_t AVFormat, uint32_t AVCodec, uint32_t SWScale) {
+	if (Version != FFMS_VERSION)
 		throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
 			std::string("'") + IndexFile + "' is not the expected index version");
 
-	uint32_t Tracks = zf.Read<uint32_t>();
-	Decoder = zf.Read<uint32_t>();
-	ErrorHandling = zf.Read<uint32_t>();
-
 	if (!(Decoder & FFMS_GetEnabledSources()))
 		throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_NOT_AVAILABLE,
 			"The source which this index was created with is not available");
 
-	if (zf.Read<uint32_t>() != avutil_version() ||
-		zf.Read<uint32_t>() != avformat_version() ||
-		zf.Read<uint32_t>() != avcodec_version() ||
-		zf.Read<uint32_t>() != swscale_version())
+	if (AVUtil != avutil_version() ||
+		AVFormat != avformat_version() ||
+		AVCodec != avcodec_version() ||
+		SWScale != swscale_version())
 		throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
 			std::string("A different FFmpeg build was used to create '") + IndexFile + "'");
+}
+
+void FFMS_Index::ReadExtraData(ZipFile &zf, const char *IndexFile) {
+	uint32_t WaveformCount = zf.Read<uint32_t>();
+	for (size_t i = 0; i < WaveformCount; ++i) {
+		int Track = zf.Read<int32_t>();
+		Waveforms.insert(std::make_pair(Track, WaveformSummary(zf)));
+	}
+
+	Resume.Read(zf);
+	if (Resume.FilePos >= 0 && (Resume.LastValidTS.size() != size() || Resume.LastDuration.size() != size()))
+		throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
+			std::string("Invalid resume information in '") + IndexFile + "'");
+
+	Streams.resize(zf.Read<uint32_t>());
+	if (!Streams.empty() && Streams.size() != size())
+		throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
+			std::string("Invalid stream parameters in '") + IndexFile + "'");
+	for (size_t i = 0; i < Streams.size(); ++i)
+		Streams[i].Read(zf);
+
+	Properties.resize(zf.Read<uint32_t>());
+	if (!Properties.empty() && Properties.size() != size())
+		throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
+			std::string("Invalid track properties in '") + IndexFile + "'");
+	for (size_t i = 0; i < Properties.size(); ++i)
+		Properties[i].Read(zf);
+}
 
-	Filesize = zf.Read<int64_t>();
-	zf.Read(Digest, sizeof(Digest));
+void FFMS_Index::ReadColumnarIndex(const char *IndexFile) {
+	FileMapping Mapping(IndexFile);
+	if (Mapping.Size() < ColumnarHeaderSize)
+		throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
+			std::string("'") + IndexFile + "' is not a valid index file");
+
+	// With 32-bit builds each Read can invalidate the previous pointer,
+	// so everything is copied out right away
+	uint32_t Header[10];
+	uint64_t ExtraOffset;
+	const uint8_t *Data = Mapping.Read(0, ColumnarHeaderSize);
+	memcpy(Header, Data, sizeof(Header));
+	memcpy(&Filesize, Data + 40, sizeof(Filesize));
+	memcpy(Digest, Data + 48, sizeof(Digest));
+	memcpy(&ExtraOffset, Data + 72, sizeof(ExtraOffset));
+
+	uint32_t Tracks = Header[2];
+	Decoder = Header[3];
+	ErrorHandling = Header[4];
+	SignatureType = Header[9];
+	CheckHeader(IndexFile, Header[1], Header[5], Header[6], Header[7], Header[8]);
+
+	uint64_t DirectorySize = static_cast<uint64_t>(Tracks) * 2 * sizeof(uint64_t);
+	if (Mapping.Size() - ColumnarHeaderSize < DirectorySize || ExtraOffset > Mapping.Size())
+		throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
+			std::string("'") + IndexFile + "' is truncated");
+
+	std::vector<uint64_t> Directory(Tracks * 2);
+	if (Tracks)
+		memcpy(&Directory[0], Mapping.Read(ColumnarHeaderSize, DirectorySize), DirectorySize);
 
+	// Only the track headers are read now
 	reserve(Tracks);
+	for (size_t i = 0; i < Tracks; ++i) {
+		DeferredTrack Deferred = { Directory[i * 2], Directory[i * 2 + 1], false, FFMS_TYPE_UNKNOWN, false };
+		if ((Deferred.Offset & 7) || Deferred.Offset > ExtraOffset || Deferred.Size > ExtraOffset - Deferred.Offset ||
+			Deferred.Size > std::numeric_limits<size_t>::max())
+			throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
+				std::string("Invalid track directory in '") + IndexFile + "'");
+		uint64_t HeaderSize = std::min<uint64_t>(Deferred.Size, FFMS_Track::ColumnarSize(FFMS_TYPE_UNKNOWN, 0));
+		push_back(FFMS_Track(Mapping.Read(Deferred.Offset, HeaderSize), static_cast<size_t>(Deferred.Size), true));
+		// A track with no frames is just the track header
+		Deferred.TT = back().TT;
+		Deferred.Empty = Deferred.Size == FFMS_Track::ColumnarSize(Deferred.TT, 0);
+		DeferredTracks.push_back(Deferred);
+	}
+	DeferredFile = IndexFile;
+	DeferredFileSize = Mapping.Size();
+
+	ZipFile zf(IndexFile, "rb");
+	zf.Seek(ExtraOffset);
+	ReadExtraData(zf, IndexFile);
+}
+
+void FFMS_Index::LoadTrack(size_t Track) {
+	TraceSpan Span("index", "LoadTrack", Track);
+	ScopedLock Lock(DeferredLock);
+	DeferredTrack &Deferred = DeferredTracks[Track];
+	if (Deferred.Loaded)
+		return;
+
+	FileMapping Mapping(DeferredFile.c_str());
+	if (Mapping.Size() != static_cast<uint64_t>(DeferredFileSize))
+		throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_FILE_READ,
+			"The index file '" + DeferredFile + "' changed after it was opened");
+
+	FFMS_Track &Placeholder = std::vector<FFMS_Track>::operator[](Track);
+	FFMS_Track Loaded(Mapping.Read(Deferred.Offset, Deferred.Size), static_cast<size_t>(Deferred.Size));
+	if (Loaded.TT != Placeholder.TT || Loaded.TB.Num != Placeholder.TB.Num || Loaded.TB.Den != Placeholder.TB.Den)
+		throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_FILE_READ,
+			"The index file '" + DeferredFile + "' changed after it was opened");
+
+	if (CompactLoadedTracks)
+		Loaded.Compact();
+	Placeholder = Loaded;
+	Deferred.Loaded = true;
+}
+
+void FFMS_Index::CompactTracks() {
+	ScopedLock Lock(DeferredLock);
+	CompactLoadedTracks = true;
+	for (size_t i = 0; i < size(); ++i) {
+		if (DeferredTracks.empty() || DeferredTracks[i].Loaded)
+			std::vector<FFMS_Track>::operator[](i).Compact();
+	}
+}
+
+void FFMS_Index::LoadTracks() {
+	for (size_t i = 0; i < DeferredTracks.size(); ++i)
+		LoadTrack(i);
+}
+
+FFMS_TrackType FFMS_Index::GetTrackType(size_t Track) const {
+	if (!DeferredTracks.empty())
+		return DeferredTracks[Track].TT;
+	return std::vector<FFMS_Track>::operator[](Track).TT;
+}
+
+bool FFMS_Index::ApplyStreamParameters(AVFormatContext *FormatContext) const {
+	if (Streams.empty() || Streams.size() != FormatContext->nb_streams)
+		return false;
+	for (size_t i = 0; i < Streams.size(); ++i) {
+		if (!Streams[i].Matches(FormatContext->streams[i]))
+			return false;
+	}
+	for (size_t i = 0; i < Streams.size(); ++i)
+		Streams[i].Apply(FormatContext->streams[i]);
+	return true;
+}
+
+bool FFMS_Index::IsTrackEmpty(size_t Track) const {
+	// Tracks of columnar indexes may be being loaded on another thread
+	if (!DeferredTracks.empty())
+		return DeferredTracks[Track].Empty;
+	return std::vector<FFMS_Track>::operator[](Track).empty();
+}
+
+FFMS_Index::FFMS_Index(const char *IndexFile)
+: RefCount(1)
+, Cached(false)
+, DeferredFileSize(0)
+, CompactLoadedTracks(false)
+{
+	TraceSpan Span("index", "ReadIndex");
 	try {
+		uint32_t Id = 0;
+		{
+			FileHandle file(IndexFile, "rb", FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ);
+			file.Read(reinterpret_cast<char *>(&Id), sizeof(Id));
+		}
+		if (Id == COLUMNAR_INDEXID) {
+			ReadColumnarIndex(IndexFile);
+			return;
+		}
+
+		ZipFile zf(IndexFile, "rb");
+
+		// Read the index file header
+		if (zf.Read<uint32_t>() != INDEXID)
+			throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
+				std::string("'") + IndexFile + "' is not a valid index file");
+
+		uint32_t Version = zf.Read<uint32_t>();
+		uint32_t Tracks = zf.Read<uint32_t>();
+		Decoder = zf.Read<uint32_t>();
+		ErrorHandling = zf.Read<uint32_t>();
+		uint32_t AVUtil = zf.Read<uint32_t>();
+		uint32_t AVFormat = zf.Read<uint32_t>();
+		uint32_t AVCodec = zf.Read<uint32_t>();
+		uint32_t SWScale = zf.Read<uint32_t>();
+		CheckHeader(IndexFile, Version, AVUtil, AVFormat, AVCodec, SWScale);
+
+		Filesize = zf.Read<int64_t>();
+		zf.Read(Digest, sizeof(Digest));
+		SignatureType = zf.Read<uint32_t>();
+
+		reserve(Tracks);
 		for (size_t i = 0; i < Tracks; ++i)
 			push_back(FFMS_Track(zf));
+
+		ReadExtraData(zf, IndexFile);
 	}
 	catch (FFMS_Exception const&) {
 		throw;
@@ -222,11 +746,15 @@ FFMS_Index::FFMS_Index(const char *IndexFile)
 	}
 }
 
-FFMS_Index::FFMS_Index(int64_t Filesize, uint8_t Digest[20], int Decoder, int ErrorHandling)
+FFMS_Index::FFMS_Index(int64_t Filesize, uint8_t Digest[20], int SignatureType, int Decoder, int ErrorHandling)
 : RefCount(1)
+, Cached(false)
+, DeferredFileSize(0)
+, CompactLoadedTracks(false)
 , Decoder(Decoder)
 , ErrorHandling(ErrorHandling)
 , Filesize(Filesize)
+, SignatureType(SignatureType)
 {
 	memcpy(this->Digest, Digest, sizeof(this->Digest));
 }
@@ -239,6 +767,23 @@ void FFMS_Indexer::SetErrorHandling(int ErrorHandling) {
 	this->ErrorHandling = ErrorHandling;
 }
 
+void FFMS_Indexer::SetSignatureType(int SignatureType) {
+	if (SignatureType == this->SignatureType)
+		return;
+	FFMS_Index::CalculateFileSignature(SourceFile.c_str(), &Filesize, Digest, -1, SignatureType);
+	this->SignatureType = SignatureType;
+}
+
+void FFMS_Indexer::SetCheckpoint(const char *IndexFile, int64_t Interval) {
+	CheckpointFile = IndexFile ? IndexFile : "";
+	CheckpointInterval = Interval;
+}
+
+void FFMS_Indexer::UpdateIndex(FFMS_Index &) {
+	throw FFMS_Exception(FFMS_ERROR_INDEXING, FFMS_ERROR_UNSUPPORTED,
+		"Updating indexes is only supported for files indexed with libavformat");
+}
+
 void FFMS_Indexer::SetProgressCallback(TIndexCallback IC, void *ICPrivate) {
 	this->IC = IC;
 	this->ICPrivate = ICPrivate;
@@ -312,29 +857,35 @@ FFMS_Indexer *CreateIndexer(const char *Filename, FFMS_Sources Demuxer) {
 FFMS_Indexer::FFMS_Indexer(const char *Filename)
 : IndexMask(0)
 , DumpMask(0)
+, WaveformMask(0)
 , ErrorHandling(FFMS_IEH_CLEAR_TRACK)
+, Threads(0)
+, MinSplitSize(256 * 1024 * 1024)
+, CheckpointInterval(0)
 , IC(0)
 , ICPrivate(0)
 , ANC(0)
 , ANCPrivate(0)
 , SourceFile(Filename)
+, SignatureType(FFMS_SIGNATURE_SHA1)
+, StoreProperties(false)
 {
 	FFMS_Index::CalculateFileSignature(Filename, &Filesize, Digest);
 }
 
-void FFMS_Indexer::WriteAudio(SharedAudioContext &AudioContext, FFMS_Index *Index, int Track) {
+void FFMS_Indexer::WriteAudio(SharedAudioContext &AudioContext, AVFrame *Frame, FFMS_Index *Index, int Track) {
 #ifdef FFMBC
 	return;
 #else
 	// Delay writer creation until after an audio frame has been decoded. This ensures that all parameters are known when writing the headers.
-	if (!DecodeFrame->nb_samples) return;
+	if (!Frame->nb_samples) return;
 
 	if (!AudioContext.W64Writer) {
 		FFMS_AudioProperties AP;
 		FillAP(AP, AudioContext.CodecContext, (*Index)[Track]);
 		int FNSize = (*ANC)(SourceFile.c_str(), Track, &AP, NULL, 0, ANCPrivate);
 		if (FNSize <= 0) {
-			DumpMask = DumpMask & ~(1 << Track);
+			AudioContext.DumpDeclined = true;
 			return;
 		}
 
@@ -356,40 +907,65 @@ void FFMS_Indexer::WriteAudio(SharedAudioContext &AudioContext, FFMS_Index *Inde
 		}
 	}
 
-	AudioContext.W64Writer->WriteData(*DecodeFrame);
+	AudioContext.W64Writer->WriteData(*Frame);
 #endif
 }
 
-uint32_t FFMS_Indexer::IndexAudioPacket(int Track, AVPacket *Packet, SharedAudioContext &Context, FFMS_Index &TrackIndices) {
+uint32_t FFMS_Indexer::DecodeAudioPacket(int Track, AVPacket *Packet, SharedAudioContext &Context, AVFrame *Frame, FFMS_Index &TrackIndices, bool &Failed) {
 #ifdef FFMBC
-	if (ErrorHandling == FFMS_IEH_ABORT) {
+	if (ErrorHandling == FFMS_IEH_ABORT)
 		throw FFMS_Exception(FFMS_ERROR_DECODING, FFMS_ERROR_UNSUPPORTED,
 			"Audio is unsupported in ffmbc build");
-	} else if (ErrorHandling == FFMS_IEH_CLEAR_TRACK) {
-		TrackIndices[Track].clear();
-		IndexMask &= ~(1 << Track);
-	} else if (ErrorHandling == FFMS_IEH_STOP_TRACK) {
-		IndexMask &= ~(1 << Track);
-	}
+	Failed = true;
 	return 0;
 #else
 	AVCodecContext *CodecContext = Context.CodecContext;
+
+	// For codecs with a fixed number of samples per frame the sample count
+	// can be read from the frame headers, which is much faster than
+	// decoding. As decoders can output a different number of samples than
+	// the headers say (e.g. implicit SBR in AAC), the first packets are
+	// decoded anyway to check, and some more every so often after that.
+	// Decoding is needed for the waveform and dumping, and for packets with
+	// side data as it may trim samples. Damaged frames and format changes
+	// between the checks go unnoticed, so this is only done when errors are
+	// ignored anyway.
+	if (Context.HeaderCounts == SharedAudioContext::HEADERS_UNCHECKED) {
+		bool Usable = HasHeaderSampleCounts(CodecContext) && ErrorHandling == FFMS_IEH_IGNORE &&
+			!Context.Waveform && !(DumpMask & (1 << Track));
+		Context.HeaderCounts = Usable ? SharedAudioContext::HEADERS_VALIDATING : SharedAudioContext::HEADERS_UNUSABLE;
+	}
+
+	uint32_t HeaderSamples = 0;
+	if (Context.HeaderCounts != SharedAudioContext::HEADERS_UNUSABLE && !Packet->side_data_elems)
+		HeaderSamples = CountPacketSamples(CodecContext, Packet->data, Packet->size);
+
+	if (Context.HeaderCounts == SharedAudioContext::HEADERS_TRUSTED) {
+		if (HeaderSamples && ++Context.TrustedPackets < HEADER_REVALIDATION_INTERVAL) {
+			Context.CurrentSample += HeaderSamples;
+			return HeaderSamples;
+		}
+		// The decoder hasn't seen the preceding packets
+		avcodec_flush_buffers(CodecContext);
+		Context.Resynced = true;
+		if (HeaderSamples) {
+			Context.HeaderCounts = SharedAudioContext::HEADERS_VALIDATING;
+			Context.ValidatedPackets = HEADER_VALIDATION_PACKETS - HEADER_REVALIDATION_PACKETS;
+		}
+		Context.TrustedPackets = 0;
+	}
+
 	int64_t StartSample = Context.CurrentSample;
 	int Read = 0;
 	while (Packet->size > 0) {
-		DecodeFrame.reset();
+		av_frame_unref(Frame);
 
 		int GotFrame = 0;
-		int Ret = avcodec_decode_audio4(CodecContext, DecodeFrame, &GotFrame, Packet);
+		int Ret = avcodec_decode_audio4(CodecContext, Frame, &GotFrame, Packet);
 		if (Ret < 0) {
-			if (ErrorHandling == FFMS_IEH_ABORT) {
+			if (ErrorHandling == FFMS_IEH_ABORT)
 				throw FFMS_Exception(FFMS_ERROR_CODEC, FFMS_ERROR_DECODING, "Audio decoding error");
-			} else if (ErrorHandling == FFMS_IEH_CLEAR_TRACK) {
-				TrackIndices[Track].clear();
-				IndexMask &= ~(1 << Track);
-			} else if (ErrorHandling == FFMS_IEH_STOP_TRACK) {
-				IndexMask &= ~(1 << Track);
-			}
+			Failed = true;
 			break;
 		}
 		Packet->size -= Ret;
@@ -397,38 +973,79 @@ uint32_t FFMS_Indexer::IndexAudioPacket(int Track, AVPacket *Packet, SharedAudio
 		Read += Ret;
 
 		if (GotFrame) {
-			CheckAudioProperties(Track, CodecContext);
+			CheckAudioProperties(Context);
 
-			Context.CurrentSample += DecodeFrame->nb_samples;
+			Context.CurrentSample += Frame->nb_samples;
 
-			if (DumpMask & (1 << Track))
-				WriteAudio(Context, &TrackIndices, Track);
+			if (Context.Waveform)
+				Context.Waveform->AddFrame(*Frame, CodecContext->channels);
+
+			if ((DumpMask & (1 << Track)) && !Context.DumpDeclined)
+				WriteAudio(Context, Frame, &TrackIndices, Track);
 		}
 	}
 	Packet->size += Read;
 	Packet->data -= Read;
-	return static_cast<uint32_t>(Context.CurrentSample - StartSample);
+
+	uint32_t SampleCount = static_cast<uint32_t>(Context.CurrentSample - StartSample);
+	if (Context.Resynced) {
+		// The decoder may not output all of the first packet after a flush
+		// (e.g. MP3 frames using the bit reservoir), while decoding the
+		// track continuously would
+		Context.Resynced = false;
+		if (HeaderSamples) {
+			Context.CurrentSample = StartSample + HeaderSamples;
+			SampleCount = HeaderSamples;
+		}
+	}
+	else if (Context.HeaderCounts == SharedAudioContext::HEADERS_VALIDATING && HeaderSamples) {
+		if (HeaderSamples != SampleCount)
+			Context.HeaderCounts = SharedAudioContext::HEADERS_UNUSABLE;
+		else if (++Context.ValidatedPackets >= HEADER_VALIDATION_PACKETS)
+			Context.HeaderCounts = SharedAudioContext::HEADERS_TRUSTED;
+	}
+	return SampleCount;
 #endif
 }
 
-void FFMS_Indexer::CheckAudioProperties(int Track, AVCodecContext *Context) {
-	std::map<int, FFMS_AudioProperties>::iterator it = LastAudioProperties.find(Track);
-	if (it == LastAudioProperties.end()) {
-		FFMS_AudioProperties &AP = LastAudioProperties[Track];
-		AP.SampleRate = Context->sample_rate;
-		AP.SampleFormat = Context->sample_fmt;
-		AP.Channels = Context->channels;
+uint32_t FFMS_Indexer::IndexAudioPacket(int Track, AVPacket *Packet, SharedAudioContext &Context, FFMS_Index &TrackIndices) {
+	if ((WaveformMask & (1 << Track)) && !Context.Waveform)
+		Context.Waveform = &TrackIndices.Waveforms[Track];
+
+	bool Failed = false;
+	uint32_t SampleCount = DecodeAudioPacket(Track, Packet, Context, DecodeFrame, TrackIndices, Failed);
+	if (Failed) {
+		if (ErrorHandling == FFMS_IEH_CLEAR_TRACK) {
+			TrackIndices[Track].clear();
+			TrackIndices.Waveforms.erase(Track);
+			Context.Waveform = NULL;
+			IndexMask &= ~(1 << Track);
+		} else if (ErrorHandling == FFMS_IEH_STOP_TRACK) {
+			IndexMask &= ~(1 << Track);
+		}
+	}
+	return SampleCount;
+}
+
+void FFMS_Indexer::CheckAudioProperties(SharedAudioContext &Context) {
+	AVCodecContext *CodecContext = Context.CodecContext;
+	FFMS_AudioProperties &AP = Context.Format;
+	if (!Context.HasFormat) {
+		AP.SampleRate = CodecContext->sample_rate;
+		AP.SampleFormat = CodecContext->sample_fmt;
+		AP.Channels = CodecContext->channels;
+		Context.HasFormat = true;
 	}
-	else if (it->second.SampleRate   != Context->sample_rate ||
-			 it->second.SampleFormat != Context->sample_fmt ||
-			 it->second.Channels     != Context->channels) {
+	else if (AP.SampleRate   != CodecContext->sample_rate ||
+			 AP.SampleFormat != CodecContext->sample_fmt ||
+			 AP.Channels     != CodecContext->channels) {
 		std::ostringstream buf;
 		buf <<
 			"Audio format change detected. This is currently unsupported."
-			<< " Channels: " << it->second.Channels << " -> " << Context->channels << ";"
-			<< " Sample rate: " << it->second.SampleRate << " -> " << Context->sample_rate << ";"
-			<< " Sample format: " << GetLAVCSampleFormatName((AVSampleFormat)it->second.SampleFormat) << " -> "
-			<< GetLAVCSampleFormatName(Context->sample_fmt);
+			<< " Channels: " << AP.Channels << " -> " << CodecContext->channels << ";"
+			<< " Sample rate: " << AP.SampleRate << " -> " << CodecContext->sample_rate << ";"
+			<< " Sample format: " << GetLAVCSampleFormatName((AVSampleFormat)AP.SampleFormat) << " -> "
+			<< GetLAVCSampleFormatName(CodecContext->sample_fmt);
 		throw FFMS_Exception(FFMS_ERROR_UNSUPPORTED, FFMS_ERROR_DECODING, buf.str());
 	}
 }
@@ -21,7 +21,9 @@
 #ifndef INDEXING_H
 #define INDEXING_H
 
+#include "threading.h"
 #include "utils.h"
+#include "waveform.h"
 
 #include <map>
 #include <memory>
@@ -47,38 +49,207 @@ public:
 	Wave64Writer *W64Writer;
 	int64_t CurrentSample;
 	TrackCompressionContext *TCC;
+	WaveformSummary *Waveform;
+	// Format of the first decoded frame, to detect format changes
+	FFMS_AudioProperties Format;
+	bool HasFormat;
+	// Set if the audio name callback didn't want this track dumped
+	bool DumpDeclined;
+
+	// Whether sample counts can be read from the packet headers instead of
+	// decoding; see FFMS_Indexer::DecodeAudioPacket
+	enum HeaderCountMode {
+		HEADERS_UNCHECKED,
+		HEADERS_VALIDATING,
+		HEADERS_TRUSTED,
+		HEADERS_UNUSABLE
+	};
+	HeaderCountMode HeaderCounts;
+	int ValidatedPackets;
+	// Packets counted from their headers since the decoder last checked them
+	int TrustedPackets;
+	// The decoder was flushed before the current packet, so its output for
+	// it can't be compared with the header
+	bool Resynced;
 
 	SharedAudioContext(bool FreeCodecContext);
 	~SharedAudioContext();
 };
 
+// Where indexing can continue if more data is appended to the file, along
+// with the demuxing state at that point
+struct IndexResumePoint {
+	// Position of the packet to restart demuxing from, or -1 if the index
+	// can't be updated
+	int64_t FilePos;
+	int IndexMask;
+	std::vector<int64_t> LastValidTS;
+	std::vector<int> LastDuration;
+
+	void Read(ZipFile &Stream);
+	void Write(ZipFile &Stream) const;
+
+	IndexResumePoint();
+};
+
+// The parts of a stream's codec parameters which sources need, stored so
+// that opening a file doesn't have to probe the streams again
+struct StreamParameters {
+	int CodecType;
+	int CodecID;
+	unsigned int CodecTag;
+	std::vector<uint8_t> ExtraData;
+	int Width;
+	int Height;
+	int PixFmt;
+	int SampleRate;
+	int Channels;
+	uint64_t ChannelLayout;
+	int SampleFormat;
+	int BitsPerCodedSample;
+	int BlockAlign;
+	int64_t BitRate;
+	AVRational TimeBase;
+	AVRational SampleAspectRatio;
+
+	void Read(ZipFile &Stream);
+	void Write(ZipFile &Stream) const;
+
+	// Whether Stream is the one the parameters were stored from, as far as
+	// the demuxer knows before probing
+	bool Matches(AVStream const* Stream) const;
+	void Apply(AVStream *Stream) const;
+
+	StreamParameters();
+	explicit StreamParameters(AVStream const* Stream);
+};
+
+// The properties a source reports for a track, stored so that they can be
+// looked up without opening a decoder
+struct TrackProperties {
+	bool Valid;
+	FFMS_VideoProperties VP;
+	int EncodedWidth;
+	int EncodedHeight;
+	int EncodedPixelFormat;
+	// As reported by frames output in their own format
+	int ColorSpace;
+	int ColorRange;
+	// Without any delay compensation
+	FFMS_AudioProperties AP;
+	// Why the track couldn't be opened when Valid isn't set; not stored in
+	// index files
+	std::string Error;
+
+	void Read(ZipFile &Stream);
+	void Write(ZipFile &Stream) const;
+
+	TrackProperties();
+};
+
 struct FFMS_Index : public std::vector<FFMS_Track>, private noncopyable {
-	int RefCount;
+	AtomicCounter RefCount;
+	// Whether the index is in the cache of read indexes, and so may be
+	// shared by unrelated callers
+	bool Cached;
+
+	// Tracks of columnar index files are only read from the file when
+	// they're first used. Until then they have their properties but no
+	// frames. The type and emptiness of every track are kept here as well
+	// so that they can be looked up without DeferredLock while another
+	// thread replaces the placeholder with the loaded track.
+	struct DeferredTrack {
+		uint64_t Offset;
+		uint64_t Size;
+		bool Loaded;
+		FFMS_TrackType TT;
+		bool Empty;
+	};
+	std::vector<DeferredTrack> DeferredTracks;
+	std::string DeferredFile;
+	int64_t DeferredFileSize;
+	Mutex DeferredLock;
+	// Whether tracks read from the file later should be compacted as well
+	bool CompactLoadedTracks;
+
+	void LoadTrack(size_t Track);
+
+	void CheckHeader(const char *IndexFile, uint32_t Version, uint32_t AVUtil, uint32_t AVFormat, uint32_t AVCodec, uint32_t SWScale);
+	void ReadColumnarIndex(const char *IndexFile);
+	void ReadExtraData(ZipFile &zf, const char *IndexFile);
+	void WriteColumnarIndex(const char *IndexFile);
+	void WriteExtraData(ZipFile &zf) const;
 public:
-	static void CalculateFileSignature(const char *Filename, int64_t *Filesize, uint8_t Digest[20]);
+	// Signatures of files are calculated from the first and last MB, so
+	// the signature of the first Length bytes of a file is the signature the
+	// file had when it was that long. Signatures are cached per process
+	// until the file's size or modification time changes.
+	static void CalculateFileSignature(const char *Filename, int64_t *Filesize, uint8_t Digest[20], int64_t Length = -1, int SignatureType = FFMS_SIGNATURE_SHA1);
+
+	// Reads an index file, or returns another reference to the index read
+	// from it earlier if caching is enabled and the file hasn't changed
+	static FFMS_Index *ReadIndex(const char *IndexFile);
+	static void SetCaching(bool Enable);
 
 	void AddRef();
 	void Release();
+	bool IsCached() const { return Cached; }
 
 	int Decoder;
 	int ErrorHandling;
 	int64_t Filesize;
 	uint8_t Digest[20];
+	int SignatureType;
+	std::map<int, WaveformSummary> Waveforms;
+	IndexResumePoint Resume;
+	// Only stored by the libavformat indexer; empty otherwise
+	std::vector<StreamParameters> Streams;
+	// Either empty or one per track
+	std::vector<TrackProperties> Properties;
+
+	// Accessing a track reads it from the index file if needed
+	FFMS_Track &operator[](size_t Track) {
+		if (!DeferredTracks.empty())
+			LoadTrack(Track);
+		return std::vector<FFMS_Track>::operator[](Track);
+	}
+	FFMS_Track const& operator[](size_t Track) const {
+		return (*const_cast<FFMS_Index *>(this))[Track];
+	}
+	// These don't need the track to be read
+	FFMS_TrackType GetTrackType(size_t Track) const;
+	bool IsTrackEmpty(size_t Track) const;
+	void LoadTracks();
+	// Switch all tracks, including ones not yet read, to compact storage
+	void CompactTracks();
+	// Set up the streams of a file opened with avformat_open_input from the
+	// stored parameters. Returns false, leaving the streams untouched, if the
+	// index doesn't have them or the file's streams are different.
+	bool ApplyStreamParameters(AVFormatContext *FormatContext) const;
 
-	void Finalize(std::vector<SharedVideoContext> const& video_contexts);
+	void Finalize(std::vector<SharedVideoContext> const& video_contexts, std::vector<size_t> const& first_new_frames = std::vector<size_t>());
 	bool CompareFileSignature(const char *Filename);
-	void WriteIndex(const char *IndexFile);
+	// Whether the file is the one the index was made from with data appended
+	bool IsPrefixOf(const char *Filename);
+	void WriteIndex(const char *IndexFile, int Format = FFMS_INDEX_FORMAT_COMPRESSED);
 
 	FFMS_Index(const char *IndexFile);
-	FFMS_Index(int64_t Filesize, uint8_t Digest[20], int Decoder, int ErrorHandling);
+	FFMS_Index(int64_t Filesize, uint8_t Digest[20], int SignatureType, int Decoder, int ErrorHandling);
 };
 
 struct FFMS_Indexer : private noncopyable {
-	std::map<int, FFMS_AudioProperties> LastAudioProperties;
+	friend class AudioIndexPipeline;
 protected:
 	int IndexMask;
 	int DumpMask;
+	int WaveformMask;
 	int ErrorHandling;
+	int Threads;
+	// Files are only split into parts indexed on separate threads if each
+	// part would be at least this big
+	int64_t MinSplitSize;
+	std::string CheckpointFile;
+	int64_t CheckpointInterval;
 	TIndexCallback IC;
 	void *ICPrivate;
 	TAudioNameCallback ANC;
@@ -88,9 +259,16 @@ protected:
 
 	int64_t Filesize;
 	uint8_t Digest[20];
+	int SignatureType;
+	bool StoreProperties;
 
-	void WriteAudio(SharedAudioContext &AudioContext, FFMS_Index *Index, int Track);
-	void CheckAudioProperties(int Track, AVCodecContext *Context);
+	void WriteAudio(SharedAudioContext &AudioContext, AVFrame *Frame, FFMS_Index *Index, int Track);
+	void CheckAudioProperties(SharedAudioContext &Context);
+	// Decode a packet and return the number of samples in it. Only touches
+	// the given context and frame, so different tracks can be decoded on
+	// different threads. Failed is set for errors which aren't fatal with
+	// the current error handling mode.
+	uint32_t DecodeAudioPacket(int Track, AVPacket *Packet, SharedAudioContext &Context, AVFrame *Frame, FFMS_Index &TrackIndices, bool &Failed);
 	uint32_t IndexAudioPacket(int Track, AVPacket *Packet, SharedAudioContext &Context, FFMS_Index &TrackIndices);
 	void ParseVideoPacket(SharedVideoContext &VideoContext, AVPacket &pkt, int *RepeatPict, int *FrameType, bool *Invisible);
 
@@ -100,11 +278,21 @@ public:
 
 	void SetIndexMask(int IndexMask) { this->IndexMask = IndexMask; }
 	void SetDumpMask(int DumpMask) { this->DumpMask = DumpMask; }
+	void SetWaveformMask(int WaveformMask) { this->WaveformMask = WaveformMask; }
 	void SetErrorHandling(int ErrorHandling);
+	void SetThreads(int Threads) { this->Threads = Threads; }
+	void SetMinSplitSize(int64_t Size) { MinSplitSize = Size < 1 ? 1 : Size; }
+	void SetSignatureType(int SignatureType);
+	void SetCheckpoint(const char *IndexFile, int64_t Interval);
+	void SetStoreProperties(bool Store) { StoreProperties = Store; }
+	bool GetStoreProperties() const { return StoreProperties; }
 	void SetProgressCallback(TIndexCallback IC, void *ICPrivate);
 	void SetAudioNameCallback(TAudioNameCallback ANC, void *ANCPrivate);
+	const char *GetSourceFile() const { return SourceFile.c_str(); }
 
 	virtual FFMS_Index *DoIndexing() = 0;
+	// Index the data appended to the file since Index was made
+	virtual void UpdateIndex(FFMS_Index &Index);
 	virtual int GetNumberOfTracks() = 0;
 	virtual FFMS_TrackType GetTrackType(int Track) = 0;
 	virtual const char *GetTrackCodec(int Track) = 0;
@@ -0,0 +1,251 @@
+//  Copyright (c) 2015 The FFmpegSource Project
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#include "indexpipeline.h"
+
+#include "numthreads.h"
+#include "trace.h"
+#include "track.h"
+
+#include <memory>
+
+namespace {
+// Limits how far the demuxer can get ahead of the slowest decoder
+const size_t MaxQueuedPackets = 256;
+}
+
+AudioIndexPipeline::TrackWorker::TrackWorker(AudioIndexPipeline *Pipeline, int Track)
+: Pipeline(Pipeline)
+, Track(Track)
+, Context(true)
+, Done(false)
+, Busy(false)
+, Failed(false)
+, StartSample(0)
+{
+}
+
+AudioIndexPipeline::AudioIndexPipeline(FFMS_Indexer &Indexer, std::vector<SharedAudioContext> &Contexts, FFMS_Index &TrackIndices)
+: Indexer(Indexer)
+, Contexts(Contexts)
+, TrackIndices(TrackIndices)
+, Workers(Contexts.size(), static_cast<TrackWorker *>(NULL))
+{
+	// The demuxing thread counts against the limit
+	int FreeThreads = (Indexer.Threads < 1 ? GetNumberOfLogicalCPUs() : Indexer.Threads) - 1;
+
+	try {
+		for (size_t i = 0; i < Contexts.size() && FreeThreads > 0; ++i) {
+			AVCodecContext *Source = Contexts[i].CodecContext;
+			if (!Source) continue;
+			// Dumped tracks stay on the demuxing thread, so that the audio
+			// name callback is called from the thread that started indexing
+			// and sees the frames indexed before the first decoded one
+			if (Indexer.DumpMask & (1 << i)) continue;
+
+			std::auto_ptr<TrackWorker> W(new TrackWorker(this, static_cast<int>(i)));
+			W->Context.CodecContext = avcodec_alloc_context3(Source->codec);
+			if (!W->Context.CodecContext ||
+				avcodec_copy_context(W->Context.CodecContext, Source) < 0 ||
+				avcodec_open2(W->Context.CodecContext, Source->codec, NULL) < 0)
+				throw FFMS_Exception(FFMS_ERROR_CODEC, FFMS_ERROR_DECODING,
+					"Could not open audio codec");
+
+			// Create the waveform now, as the map can't be modified while
+			// the workers are running
+			if (Indexer.WaveformMask & (1 << i))
+				W->Context.Waveform = &TrackIndices.Waveforms[i];
+
+			// Continue after the frames already in the index when updating
+			W->StartSample = W->Context.CurrentSample = Contexts[i].CurrentSample;
+
+			Workers[i] = W.release();
+			--FreeThreads;
+		}
+
+		for (size_t i = 0; i < Workers.size(); ++i) {
+			if (Workers[i])
+				Threads.Start(RunWorker, Workers[i]);
+		}
+	} catch (...) {
+		Stop();
+		throw;
+	}
+}
+
+AudioIndexPipeline::~AudioIndexPipeline() {
+	Stop();
+}
+
+void AudioIndexPipeline::RunWorker(void *Arg) {
+	TrackWorker *W = static_cast<TrackWorker *>(Arg);
+	W->Pipeline->DecodeTrack(*W);
+}
+
+void AudioIndexPipeline::DecodeTrack(TrackWorker &W) {
+	for (;;) {
+		AVPacket Packet;
+		{
+			ScopedLock Lock(W.Lock);
+			while (W.Queue.empty() && !W.Done)
+				W.Changed.Wait(W.Lock);
+			if (W.Queue.empty())
+				return;
+			Packet = W.Queue.front();
+			W.Queue.pop_front();
+			W.Busy = true;
+			W.Changed.Broadcast();
+		}
+
+		bool Failed = false;
+		try {
+			TraceSpan Span("indexing", "DecodeAudioPacket", W.Track);
+			W.SampleCounts.push_back(Indexer.DecodeAudioPacket(W.Track, &Packet, W.Context, W.DecodeFrame, TrackIndices, Failed));
+		} catch (...) {
+			av_free_packet(&Packet);
+			ScopedLock Lock(W.Lock);
+			W.Error.Catch();
+			W.Changed.Broadcast();
+			return;
+		}
+		av_free_packet(&Packet);
+
+		ScopedLock Lock(W.Lock);
+		W.Busy = false;
+		// When ignoring errors only the rest of the bad packet is skipped
+		if (Failed && Indexer.ErrorHandling != FFMS_IEH_IGNORE)
+			W.Failed = true;
+		W.Changed.Broadcast();
+		if (W.Failed)
+			return;
+	}
+}
+
+void AudioIndexPipeline::IndexPacket(int Track, AVPacket &Packet, int64_t PTS, bool KeyFrame, int64_t FilePos, uint32_t FrameSize) {
+	TrackWorker *W = Workers[Track];
+	if (!W) {
+		int64_t StartSample = Contexts[Track].CurrentSample;
+		uint32_t SampleCount = Indexer.IndexAudioPacket(Track, &Packet, Contexts[Track], TrackIndices);
+		TrackIndices[Track].AddAudioFrame(PTS, StartSample, SampleCount, KeyFrame, FilePos, FrameSize);
+		return;
+	}
+
+	// Take over the packet, copying the data if it still belongs to the
+	// demuxer
+	AVPacket Queued = Packet;
+	InitNullPacket(Packet);
+	if (av_dup_packet(&Queued) < 0)
+		throw FFMS_Exception(FFMS_ERROR_INDEXING, FFMS_ERROR_ALLOCATION_FAILED,
+			"Could not copy audio packet");
+
+	ScopedLock Lock(W->Lock);
+	while (W->Queue.size() >= MaxQueuedPackets && !W->Failed && !W->Error.IsSet())
+		W->Changed.Wait(W->Lock);
+
+	if (W->Failed || W->Error.IsSet()) {
+		av_free_packet(&Queued);
+		W->Error.Rethrow();
+		return;
+	}
+
+	PendingFrame Frame = { PTS, FilePos, FrameSize, KeyFrame };
+	W->Frames.push_back(Frame);
+	W->Queue.push_back(Queued);
+	W->Changed.Broadcast();
+}
+
+void AudioIndexPipeline::Finish() {
+	for (size_t i = 0; i < Workers.size(); ++i) {
+		if (!Workers[i]) continue;
+		ScopedLock Lock(Workers[i]->Lock);
+		Workers[i]->Done = true;
+		Workers[i]->Changed.Broadcast();
+	}
+	Threads.JoinAll();
+
+	for (size_t i = 0; i < Workers.size(); ++i) {
+		if (Workers[i])
+			Workers[i]->Error.Rethrow();
+	}
+
+	for (size_t i = 0; i < Workers.size(); ++i) {
+		TrackWorker *W = Workers[i];
+		if (!W) continue;
+
+		if (W->Failed && Indexer.ErrorHandling == FFMS_IEH_CLEAR_TRACK) {
+			TrackIndices[W->Track].clear();
+			TrackIndices.Waveforms.erase(W->Track);
+			continue;
+		}
+
+		AddFrames(*W);
+	}
+}
+
+void AudioIndexPipeline::Drain() {
+	for (size_t i = 0; i < Workers.size(); ++i) {
+		TrackWorker *W = Workers[i];
+		if (!W) continue;
+
+		ScopedLock Lock(W->Lock);
+		while ((!W->Queue.empty() || W->Busy) && !W->Failed && !W->Error.IsSet())
+			W->Changed.Wait(W->Lock);
+		W->Error.Rethrow();
+
+		// Whether a failed track is kept is decided by Finish
+		if (!W->Failed)
+			AddFrames(*W);
+	}
+}
+
+void AudioIndexPipeline::AddFrames(TrackWorker &W) {
+	// Packets after a failure with FFMS_IEH_STOP_TRACK were never
+	// decoded and so have no sample count
+	FFMS_Track &TrackInfo = TrackIndices[W.Track];
+	for (size_t f = 0; f < W.SampleCounts.size(); ++f) {
+		const PendingFrame &Frame = W.Frames[f];
+		TrackInfo.AddAudioFrame(Frame.PTS, W.StartSample, W.SampleCounts[f],
+			Frame.KeyFrame, Frame.FilePos, Frame.FrameSize);
+		W.StartSample += W.SampleCounts[f];
+	}
+
+	W.Frames.erase(W.Frames.begin(), W.Frames.begin() + W.SampleCounts.size());
+	W.SampleCounts.clear();
+}
+
+void AudioIndexPipeline::Stop() {
+	for (size_t i = 0; i < Workers.size(); ++i) {
+		TrackWorker *W = Workers[i];
+		if (!W) continue;
+		ScopedLock Lock(W->Lock);
+		for (size_t p = 0; p < W->Queue.size(); ++p)
+			av_free_packet(&W->Queue[p]);
+		W->Queue.clear();
+		W->Done = true;
+		W->Changed.Broadcast();
+	}
+	Threads.JoinAll();
+
+	for (size_t i = 0; i < Workers.size(); ++i) {
+		delete Workers[i];
+		Workers[i] = NULL;
+	}
+}
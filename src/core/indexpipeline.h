@@ -0,0 +1,103 @@
+//  Copyright (c) 2015 The FFmpegSource Project
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#ifndef INDEXPIPELINE_H
+#define INDEXPIPELINE_H
+
+#include "indexing.h"
+#include "threading.h"
+
+#include <deque>
+#include <vector>
+
+// Decodes the packets of the audio tracks being indexed on worker threads,
+// one per track, so that the demuxer doesn't have to wait for the decoders.
+// Tracks without a worker (dumped tracks, and tracks beyond the thread
+// limit) are decoded directly by IndexPacket as before.
+class AudioIndexPipeline : private noncopyable {
+	struct PendingFrame {
+		int64_t PTS;
+		int64_t FilePos;
+		uint32_t FrameSize;
+		bool KeyFrame;
+	};
+
+	struct TrackWorker : private noncopyable {
+		AudioIndexPipeline *Pipeline;
+		int Track;
+		// Owns a copy of the track's codec context, as demuxers may update
+		// the original while parsing
+		SharedAudioContext Context;
+		ScopedFrame DecodeFrame;
+
+		Mutex Lock;
+		Condition Changed;
+		// Everything below is protected by Lock
+		std::deque<AVPacket> Queue;
+		// No more packets will be queued
+		bool Done;
+		// A packet has been taken off the queue and is being decoded
+		bool Busy;
+		// Decoding stopped due to an error which isn't fatal for the file
+		bool Failed;
+		ThreadError Error;
+
+		// Only touched by the demuxing thread until the worker has finished
+		std::vector<PendingFrame> Frames;
+		// Only touched by the worker while it's busy
+		std::vector<uint32_t> SampleCounts;
+		// Sample number of the first frame which hasn't been added to the
+		// index yet
+		int64_t StartSample;
+
+		TrackWorker(AudioIndexPipeline *Pipeline, int Track);
+	};
+
+	FFMS_Indexer &Indexer;
+	std::vector<SharedAudioContext> &Contexts;
+	FFMS_Index &TrackIndices;
+	// Indexed by track number, NULL for tracks decoded on the demuxing thread
+	std::vector<TrackWorker *> Workers;
+	ThreadGroup Threads;
+
+	static void RunWorker(void *Arg);
+	void DecodeTrack(TrackWorker &W);
+	void AddFrames(TrackWorker &W);
+	void Stop();
+
+public:
+	AudioIndexPipeline(FFMS_Indexer &Indexer, std::vector<SharedAudioContext> &Contexts, FFMS_Index &TrackIndices);
+	~AudioIndexPipeline();
+
+	// Index a packet of an audio track. If the track has a worker the
+	// packet's contents are taken over and Packet is reset.
+	void IndexPacket(int Track, AVPacket &Packet, int64_t PTS, bool KeyFrame, int64_t FilePos, uint32_t FrameSize = 0);
+
+	// Wait for all queued packets to be decoded and add the frames of the
+	// tracks with workers to the index
+	void Finish();
+
+	// Wait for the queued packets to be decoded and add the frames decoded
+	// so far to the index without stopping the workers
+	void Drain();
+};
+
+#endif
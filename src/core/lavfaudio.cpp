@@ -38,7 +38,7 @@ class FFLAVFAudio : public FFMS_AudioSource {
 		avcodec_close(CodecContext);
 		avformat_close_input(&FormatContext);
 
-		LAVFOpenFile(SourceFile.c_str(), FormatContext);
+		LAVFOpenFile(SourceFile.c_str(), FormatContext, &Index);
 		CodecContext.reset(FormatContext->streams[TrackNumber]->codec);
 		OpenCodec();
 	}
@@ -65,7 +65,7 @@ FFLAVFAudio::FFLAVFAudio(const char *SourceFile, int Track, FFMS_Index &Index, i
 , LastValidTS(ffms_av_nopts_value)
 , SourceFile(SourceFile)
 {
-	LAVFOpenFile(SourceFile, FormatContext);
+	LAVFOpenFile(SourceFile, FormatContext, &Index);
 
 	CodecContext.reset(FormatContext->streams[TrackNumber]->codec);
 	assert(CodecContext);
@@ -100,8 +100,10 @@ void FFLAVFAudio::Seek() {
 
 	int Flags = Frames.HasTS ? AVSEEK_FLAG_BACKWARD : AVSEEK_FLAG_BACKWARD | AVSEEK_FLAG_BYTE;
 
-	if (av_seek_frame(FormatContext, TrackNumber, FrameTS(TargetPacket), Flags) < 0)
+	if (av_seek_frame(FormatContext, TrackNumber, FrameTS(TargetPacket), Flags) < 0) {
+		++Stats.SeekRetries;
 		av_seek_frame(FormatContext, TrackNumber, FrameTS(TargetPacket), Flags | AVSEEK_FLAG_ANY);
+	}
 
 	if (TargetPacket != PacketNumber) {
 		// Decode until the PTS changes so we know where we are
@@ -20,21 +20,89 @@
 
 #include "indexing.h"
 
+#include "indexpipeline.h"
+#include "numthreads.h"
+#include "threading.h"
+#include "trace.h"
 #include "track.h"
 
+#include <algorithm>
+#include <cstring>
+
 extern "C" {
 #include <libavutil/avutil.h>
 };
 
 namespace {
+// How far before its start a part begins demuxing at least, so that the
+// parsers, decoders and timestamps are in the same state as when reading the
+// file from the start by the time the first packet of the part is reached.
+// This is doubled until it includes a keyframe of each video track.
+const int64_t ShardOverlap = 4 * 1024 * 1024;
+// How far past its end a part keeps reading for packets which start in the
+// part but end after it; no sane PES packet is anywhere near this big
+const int64_t MaxPESSpan = 64 * 1024 * 1024;
+const int64_t ShardProgressInterval = 4 * 1024 * 1024;
+
+class FFLAVFIndexer;
+
+// A byte range of an MPEG-TS file, indexed on its own thread with its own
+// demuxer. Every packet belongs to the part its first TS packet is in.
+struct TSShard : private noncopyable {
+	FFLAVFIndexer *Indexer;
+	AVFormatContext *FormatContext;
+	std::vector<SharedAudioContext> AudioContexts;
+	std::vector<SharedVideoContext> VideoContexts;
+	ScopedFrame DecodeFrame;
+	int64_t Start;
+	int64_t End;
+	int ResumeTrack;
+
+	// Results, valid once the worker has finished. Audio sample positions
+	// are relative to the start of the part.
+	FFMS_Index Index;
+	std::vector<int64_t> LastValidTS;
+	std::vector<int> LastDuration;
+	std::vector<int64_t> Samples;
+	int FailedMask;
+	ThreadError Error;
+
+	// Protected by the indexer's ShardLock
+	int64_t Position;
+
+	TSShard(FFLAVFIndexer *Indexer, const char *Filename, int64_t Start, int64_t End);
+	~TSShard();
+};
+
 class FFLAVFIndexer : public FFMS_Indexer {
+	friend struct TSShard;
+
 	AVFormatContext *FormatContext;
+
+	// Progress reporting and cancellation for the shard workers
+	Mutex ShardLock;
+	Condition ShardChanged;
+	int RunningShards;
+	bool ShardsCancelled;
+
 	void ReadTS(const AVPacket &Packet, int64_t &TS, bool &UseDTS);
+	void OpenDecoders(AVFormatContext *Context, int &Mask, std::vector<SharedAudioContext> &AudioContexts, std::vector<SharedVideoContext> &VideoContexts);
+	int GetResumeTrack(std::vector<SharedAudioContext> const& AudioContexts, std::vector<SharedVideoContext> const& VideoContexts);
+	std::vector<int64_t> FindShardStarts();
+	void ReadInitialTimestamps(FFMS_Index &TrackIndices);
+	void IndexShards(std::vector<int64_t> const& Starts, FFMS_Index &TrackIndices, std::vector<SharedAudioContext> &AudioContexts, std::vector<SharedVideoContext> &VideoContexts);
+	static void RunShard(void *Arg);
+	int64_t FindWarmupStart(TSShard &Shard);
+	void IndexShard(TSShard &Shard);
+	void IndexPackets(FFMS_Index &TrackIndices, std::vector<SharedAudioContext> &AudioContexts, std::vector<SharedVideoContext> &VideoContexts, std::vector<size_t> const& FirstNewFrames);
+	void WriteCheckpoint(FFMS_Index &TrackIndices, AudioIndexPipeline &Pipeline, std::vector<SharedVideoContext> const& VideoContexts, std::vector<size_t> const& FirstNewFrames);
 
 public:
 	FFLAVFIndexer(const char *Filename, AVFormatContext *FormatContext)
 	: FFMS_Indexer(Filename)
 	, FormatContext(FormatContext)
+	, RunningShards(0)
+	, ShardsCancelled(false)
 	{
 		if (avformat_find_stream_info(FormatContext,NULL) < 0) {
 			avformat_close_input(&FormatContext);
@@ -48,6 +116,7 @@ public:
 	}
 
 	FFMS_Index *DoIndexing();
+	void UpdateIndex(FFMS_Index &Index);
 
 	int GetNumberOfTracks() { return FormatContext->nb_streams; }
 	const char *GetFormatName() { return this->FormatContext->iformat->name; }
@@ -63,40 +132,86 @@ public:
 	}
 };
 
-FFMS_Index *FFLAVFIndexer::DoIndexing() {
-	std::vector<SharedAudioContext> AudioContexts(FormatContext->nb_streams, SharedAudioContext(false));
-	std::vector<SharedVideoContext> VideoContexts(FormatContext->nb_streams, SharedVideoContext(false));
+TSShard::TSShard(FFLAVFIndexer *Indexer, const char *Filename, int64_t Start, int64_t End)
+: Indexer(Indexer)
+, FormatContext(NULL)
+, Start(Start)
+, End(End)
+, ResumeTrack(-1)
+, Index(Indexer->Filesize, Indexer->Digest, Indexer->SignatureType, FFMS_SOURCE_LAVF, Indexer->ErrorHandling)
+, FailedMask(0)
+, Position(Start)
+{
+	LAVFOpenFile(Filename, FormatContext);
+
+	// Codecs are opened here rather than on the worker as opening isn't
+	// thread-safe with all versions of FFmpeg/Libav
+	try {
+		AVFormatContext *Main = Indexer->FormatContext;
+		bool Matches = FormatContext->nb_streams == Main->nb_streams;
+		for (unsigned int i = 0; Matches && i < FormatContext->nb_streams; i++) {
+			Matches = FormatContext->streams[i]->codec->codec_type == Main->streams[i]->codec->codec_type &&
+				FormatContext->streams[i]->codec->codec_id == Main->streams[i]->codec->codec_id;
+		}
 
-	std::auto_ptr<FFMS_Index> TrackIndices(new FFMS_Index(Filesize, Digest, FFMS_SOURCE_LAVF, ErrorHandling));
+		int Mask = Indexer->IndexMask;
+		if (Matches) {
+			AudioContexts.resize(FormatContext->nb_streams, SharedAudioContext(false));
+			VideoContexts.resize(FormatContext->nb_streams, SharedVideoContext(false));
+			Indexer->OpenDecoders(FormatContext, Mask, AudioContexts, VideoContexts);
+		}
+		if (!Matches || Mask != Indexer->IndexMask)
+			throw FFMS_Exception(FFMS_ERROR_INDEXING, FFMS_ERROR_FILE_MISMATCH,
+				"The streams found when reopening the file differ");
 
-	for (unsigned int i = 0; i < FormatContext->nb_streams; i++) {
-		TrackIndices->push_back(FFMS_Track((int64_t)FormatContext->streams[i]->time_base.num * 1000,
-			FormatContext->streams[i]->time_base.den,
-			static_cast<FFMS_TrackType>(FormatContext->streams[i]->codec->codec_type)));
+		for (unsigned int i = 0; i < FormatContext->nb_streams; i++) {
+			FFMS_TrackType TT = static_cast<FFMS_TrackType>(FormatContext->streams[i]->codec->codec_type);
+			Index.push_back(FFMS_Track(0, 1, TT, false, TT != FFMS_TYPE_AUDIO));
+		}
+		LastValidTS.assign(FormatContext->nb_streams, ffms_av_nopts_value);
+		LastDuration.assign(FormatContext->nb_streams, 0);
+		Samples.assign(FormatContext->nb_streams, 0);
+	}
+	catch (...) {
+		AudioContexts.clear();
+		VideoContexts.clear();
+		avformat_close_input(&FormatContext);
+		throw;
+	}
+}
 
-		if (FormatContext->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
-			AVCodec *VideoCodec = avcodec_find_decoder(FormatContext->streams[i]->codec->codec_id);
+TSShard::~TSShard() {
+	// The codec contexts belong to FormatContext
+	AudioContexts.clear();
+	VideoContexts.clear();
+	avformat_close_input(&FormatContext);
+}
+
+void FFLAVFIndexer::OpenDecoders(AVFormatContext *Context, int &Mask, std::vector<SharedAudioContext> &AudioContexts, std::vector<SharedVideoContext> &VideoContexts) {
+	for (unsigned int i = 0; i < Context->nb_streams; i++) {
+		if (Context->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+			AVCodec *VideoCodec = avcodec_find_decoder(Context->streams[i]->codec->codec_id);
 			if (!VideoCodec) {
-				IndexMask &= ~(1 << i);
+				Mask &= ~(1 << i);
 				continue;
 			}
 
-			if (avcodec_open2(FormatContext->streams[i]->codec, VideoCodec, NULL) < 0)
+			if (avcodec_open2(Context->streams[i]->codec, VideoCodec, NULL) < 0)
 				throw FFMS_Exception(FFMS_ERROR_CODEC, FFMS_ERROR_DECODING,
 					"Could not open video codec");
 
-			VideoContexts[i].CodecContext = FormatContext->streams[i]->codec;
-			VideoContexts[i].Parser = av_parser_init(FormatContext->streams[i]->codec->codec_id);
+			VideoContexts[i].CodecContext = Context->streams[i]->codec;
+			VideoContexts[i].Parser = av_parser_init(Context->streams[i]->codec->codec_id);
 			if (VideoContexts[i].Parser)
 				VideoContexts[i].Parser->flags = PARSER_FLAG_COMPLETE_FRAMES;
 
-			if (FormatContext->streams[i]->disposition & AV_DISPOSITION_ATTACHED_PIC)
-				IndexMask &= ~(1 << i);
+			if (Context->streams[i]->disposition & AV_DISPOSITION_ATTACHED_PIC)
+				Mask &= ~(1 << i);
 			else
-				IndexMask |= 1 << i;
+				Mask |= 1 << i;
 		}
-		else if (IndexMask & (1 << i) && FormatContext->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO) {
-			AVCodecContext *AudioCodecContext = FormatContext->streams[i]->codec;
+		else if (Mask & (1 << i) && Context->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO) {
+			AVCodecContext *AudioCodecContext = Context->streams[i]->codec;
 
 			AVCodec *AudioCodec = avcodec_find_decoder(AudioCodecContext->codec_id);
 			if (AudioCodec == NULL)
@@ -108,16 +223,134 @@ FFMS_Index *FFLAVFIndexer::DoIndexing() {
 					"Could not open audio codec");
 
 			AudioContexts[i].CodecContext = AudioCodecContext;
-			(*TrackIndices)[i].HasTS = false;
 		} else {
-			IndexMask &= ~(1 << i);
+			Mask &= ~(1 << i);
+		}
+	}
+}
+
+FFMS_Index *FFLAVFIndexer::DoIndexing() {
+	std::vector<SharedAudioContext> AudioContexts(FormatContext->nb_streams, SharedAudioContext(false));
+	std::vector<SharedVideoContext> VideoContexts(FormatContext->nb_streams, SharedVideoContext(false));
+
+	std::auto_ptr<FFMS_Index> TrackIndices(new FFMS_Index(Filesize, Digest, SignatureType, FFMS_SOURCE_LAVF, ErrorHandling));
+
+	for (unsigned int i = 0; i < FormatContext->nb_streams; i++) {
+		TrackIndices->push_back(FFMS_Track((int64_t)FormatContext->streams[i]->time_base.num * 1000,
+			FormatContext->streams[i]->time_base.den,
+			static_cast<FFMS_TrackType>(FormatContext->streams[i]->codec->codec_type)));
+		TrackIndices->Streams.push_back(StreamParameters(FormatContext->streams[i]));
+	}
+
+	OpenDecoders(FormatContext, IndexMask, AudioContexts, VideoContexts);
+	for (unsigned int i = 0; i < FormatContext->nb_streams; i++) {
+		if (AudioContexts[i].CodecContext)
+			(*TrackIndices)[i].HasTS = false;
+	}
+
+	TrackIndices->Resume.LastValidTS.assign(FormatContext->nb_streams, ffms_av_nopts_value);
+	TrackIndices->Resume.LastDuration.assign(FormatContext->nb_streams, 0);
+
+	std::vector<int64_t> ShardStarts = FindShardStarts();
+	if (!ShardStarts.empty()) {
+		TrackIndices->Resume.IndexMask = IndexMask;
+		ReadInitialTimestamps(*TrackIndices);
+		IndexShards(ShardStarts, *TrackIndices, AudioContexts, VideoContexts);
+	} else {
+		IndexPackets(*TrackIndices, AudioContexts, VideoContexts, std::vector<size_t>());
+	}
+	return TrackIndices.release();
+}
+
+void FFLAVFIndexer::UpdateIndex(FFMS_Index &Index) {
+	if (Index.Decoder != FFMS_SOURCE_LAVF || Index.Resume.FilePos < 0)
+		throw FFMS_Exception(FFMS_ERROR_INDEXING, FFMS_ERROR_UNSUPPORTED,
+			"The index has no position to continue indexing from");
+
+	// The updated index keeps the kind of signature it was made with
+	SetSignatureType(Index.SignatureType);
+
+	if (Index.size() != FormatContext->nb_streams || !Index.IsPrefixOf(SourceFile.c_str()))
+		throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_FILE_MISMATCH,
+			"The file is not a continuation of the indexed file");
+
+	for (unsigned int i = 0; i < FormatContext->nb_streams; i++) {
+		if (Index[i].TT != static_cast<FFMS_TrackType>(FormatContext->streams[i]->codec->codec_type))
+			throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_FILE_MISMATCH,
+				"The file is not a continuation of the indexed file");
+	}
+
+	// Work on a copy so that the index is left untouched if anything fails
+	Index.LoadTracks();
+	std::auto_ptr<FFMS_Index> TrackIndices(new FFMS_Index(Filesize, Digest, SignatureType, FFMS_SOURCE_LAVF, Index.ErrorHandling));
+	TrackIndices->assign(Index.begin(), Index.end());
+	TrackIndices->Resume = Index.Resume;
+	for (unsigned int i = 0; i < FormatContext->nb_streams; i++)
+		TrackIndices->Streams.push_back(StreamParameters(FormatContext->streams[i]));
+
+	IndexMask = Index.Resume.IndexMask;
+	DumpMask = 0;
+	// Waveform summaries can't be continued and are dropped
+	WaveformMask = 0;
+	ErrorHandling = Index.ErrorHandling;
+
+	std::vector<SharedAudioContext> AudioContexts(FormatContext->nb_streams, SharedAudioContext(false));
+	std::vector<SharedVideoContext> VideoContexts(FormatContext->nb_streams, SharedVideoContext(false));
+	OpenDecoders(FormatContext, IndexMask, AudioContexts, VideoContexts);
+
+	// Everything from the resume position on is indexed again, as the last
+	// packets before the end of the file may have been incomplete
+	std::vector<size_t> FirstNewFrames;
+	for (size_t i = 0; i < TrackIndices->size(); ++i) {
+		FFMS_Track &TrackInfo = (*TrackIndices)[i];
+		TrackInfo.PrepareForAppend(TrackIndices->Resume.FilePos);
+		FirstNewFrames.push_back(TrackInfo.size());
+		if (!TrackInfo.empty() && TrackInfo.TT == FFMS_TYPE_AUDIO)
+			AudioContexts[i].CurrentSample = TrackInfo.back().SampleStart + TrackInfo.back().SampleCount;
+	}
+
+	if (av_seek_frame(FormatContext, -1, TrackIndices->Resume.FilePos, AVSEEK_FLAG_BYTE) < 0)
+		throw FFMS_Exception(FFMS_ERROR_INDEXING, FFMS_ERROR_FILE_READ,
+			"Couldn't seek to the position indexing stopped at");
+
+	IndexPackets(*TrackIndices, AudioContexts, VideoContexts, FirstNewFrames);
+
+	Index.swap(*TrackIndices);
+	Index.Filesize = Filesize;
+	memcpy(Index.Digest, Digest, sizeof(Index.Digest));
+	Index.Waveforms.clear();
+	Index.Resume = TrackIndices->Resume;
+	Index.Streams.swap(TrackIndices->Streams);
+}
+
+int FFLAVFIndexer::GetResumeTrack(std::vector<SharedAudioContext> const& AudioContexts, std::vector<SharedVideoContext> const& VideoContexts) {
+	// Indexing can only be continued from keyframes of the first video
+	// track, or any packet of the first audio track for audio-only files
+	int ResumeTrack = -1;
+	if (FormatContext->pb && !(FormatContext->iformat->flags & AVFMT_NO_BYTE_SEEK)) {
+		for (unsigned int i = 0; i < FormatContext->nb_streams && ResumeTrack < 0; i++) {
+			if (IndexMask & (1 << i) && VideoContexts[i].CodecContext)
+				ResumeTrack = i;
+		}
+		for (unsigned int i = 0; i < FormatContext->nb_streams && ResumeTrack < 0; i++) {
+			if (IndexMask & (1 << i) && AudioContexts[i].CodecContext)
+				ResumeTrack = i;
 		}
 	}
+	return ResumeTrack;
+}
+
+void FFLAVFIndexer::IndexPackets(FFMS_Index &TrackIndices, std::vector<SharedAudioContext> &AudioContexts, std::vector<SharedVideoContext> &VideoContexts, std::vector<size_t> const& FirstNewFrames) {
+	TraceSpan Span("indexing", "IndexPackets");
+	AudioIndexPipeline Pipeline(*this, AudioContexts, TrackIndices);
 
 	AVPacket Packet;
 	InitNullPacket(Packet);
-	std::vector<int64_t> LastValidTS(FormatContext->nb_streams, ffms_av_nopts_value);
-	std::vector<int> LastDuration(FormatContext->nb_streams, 0);
+	std::vector<int64_t> LastValidTS(TrackIndices.Resume.LastValidTS);
+	std::vector<int> LastDuration(TrackIndices.Resume.LastDuration);
+
+	int ResumeTrack = GetResumeTrack(AudioContexts, VideoContexts);
+	int64_t LastCheckpoint = std::max<int64_t>(TrackIndices.Resume.FilePos, 0);
 
 	int64_t filesize = avio_size(FormatContext->pb);
 	while (av_read_frame(FormatContext, &Packet) >= 0) {
@@ -134,9 +367,23 @@ FFMS_Index *FFLAVFIndexer::DoIndexing() {
 		}
 
 		int Track = Packet.stream_index;
-		FFMS_Track &TrackInfo = (*TrackIndices)[Track];
+		FFMS_Track &TrackInfo = TrackIndices[Track];
 		bool KeyFrame = !!(Packet.flags & AV_PKT_FLAG_KEY);
-		ReadTS(Packet, LastValidTS[Track], (*TrackIndices)[Track].UseDTS);
+
+		if (Track == ResumeTrack && KeyFrame && Packet.pos > TrackIndices.Resume.FilePos) {
+			IndexResumePoint &Resume = TrackIndices.Resume;
+			Resume.FilePos = Packet.pos;
+			Resume.IndexMask = IndexMask;
+			Resume.LastValidTS = LastValidTS;
+			Resume.LastDuration = LastDuration;
+
+			if (!CheckpointFile.empty() && Packet.pos - LastCheckpoint >= CheckpointInterval) {
+				WriteCheckpoint(TrackIndices, Pipeline, VideoContexts, FirstNewFrames);
+				LastCheckpoint = Packet.pos;
+			}
+		}
+
+		ReadTS(Packet, LastValidTS[Track], TrackIndices[Track].UseDTS);
 
 		if (FormatContext->streams[Track]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
 			int64_t PTS = TrackInfo.UseDTS ? Packet.dts : Packet.pts;
@@ -169,18 +416,357 @@ FFMS_Index *FFLAVFIndexer::DoIndexing() {
 			if (LastValidTS[Track] != ffms_av_nopts_value)
 				TrackInfo.HasTS = true;
 
-			int64_t StartSample = AudioContexts[Track].CurrentSample;
-			uint32_t SampleCount = IndexAudioPacket(Track, &Packet, AudioContexts[Track], *TrackIndices);
+			Pipeline.IndexPacket(Track, Packet, LastValidTS[Track], KeyFrame, Packet.pos);
+		}
+
+		av_free_packet(&Packet);
+	}
+
+	Pipeline.Finish();
+	TrackIndices.Finalize(VideoContexts, FirstNewFrames);
+}
 
-			TrackInfo.AddAudioFrame(LastValidTS[Track],
-				StartSample, SampleCount, KeyFrame, Packet.pos);
+void FFLAVFIndexer::WriteCheckpoint(FFMS_Index &TrackIndices, AudioIndexPipeline &Pipeline, std::vector<SharedVideoContext> const& VideoContexts, std::vector<size_t> const& FirstNewFrames) {
+	TraceSpan Span("indexing", "WriteCheckpoint");
+	Pipeline.Drain();
+
+	// A checkpoint is an index of everything read so far which
+	// FFMS_UpdateIndex can continue from
+	FFMS_Index Checkpoint(Filesize, Digest, SignatureType, FFMS_SOURCE_LAVF, ErrorHandling);
+	Checkpoint.assign(TrackIndices.begin(), TrackIndices.end());
+	Checkpoint.Resume = TrackIndices.Resume;
+	Checkpoint.Streams = TrackIndices.Streams;
+	Checkpoint.Finalize(VideoContexts, FirstNewFrames);
+	Checkpoint.WriteIndex(CheckpointFile.c_str());
+}
+
+std::vector<int64_t> FFLAVFIndexer::FindShardStarts() {
+	std::vector<int64_t> Starts;
+
+	// Only MPEG-TS can be split up at arbitrary byte positions, as the
+	// demuxer finds the next packet boundary by itself and every PES packet
+	// starts with a flagged TS packet. Dumping, waveforms and checkpoints
+	// need the whole file processed in order.
+	if (strcmp(FormatContext->iformat->name, "mpegts") || !FormatContext->pb ||
+		(FormatContext->iformat->flags & AVFMT_NO_BYTE_SEEK) ||
+		(DumpMask & IndexMask) || (WaveformMask & IndexMask) || !CheckpointFile.empty())
+		return Starts;
+
+	int MaxShards = Threads < 1 ? GetNumberOfLogicalCPUs() : Threads;
+	MaxShards = static_cast<int>(std::min<int64_t>(MaxShards, Filesize / MinSplitSize));
+	for (int i = 1; i < MaxShards; i++)
+		Starts.push_back(Filesize / MaxShards * i);
+	return Starts;
+}
+
+void FFLAVFIndexer::ReadInitialTimestamps(FFMS_Index &TrackIndices) {
+	// Whether a track's timestamps are taken from the DTS is decided by its
+	// first packet when the file is read in order. The parts can't see that
+	// packet, so decide it here for all of them.
+	unsigned int NumStreams = FormatContext->nb_streams;
+	std::vector<bool> Seen(NumStreams, false);
+	int Pending = 0;
+	for (unsigned int i = 0; i < NumStreams; i++) {
+		if (IndexMask & (1 << i))
+			++Pending;
+	}
+
+	AVPacket Packet;
+	InitNullPacket(Packet);
+	while (Pending > 0 && av_read_frame(FormatContext, &Packet) >= 0) {
+		int Track = Packet.stream_index;
+		if ((IndexMask & (1 << Track)) && !Seen[Track]) {
+			int64_t TS = ffms_av_nopts_value;
+			ReadTS(Packet, TS, TrackIndices[Track].UseDTS);
+			Seen[Track] = true;
+			--Pending;
+		}
+		av_free_packet(&Packet);
+	}
+}
+
+void FFLAVFIndexer::RunShard(void *Arg) {
+	TSShard *Shard = static_cast<TSShard *>(Arg);
+	try {
+		Shard->Indexer->IndexShard(*Shard);
+	} catch (...) {
+		Shard->Error.Catch();
+	}
+
+	ScopedLock Lock(Shard->Indexer->ShardLock);
+	--Shard->Indexer->RunningShards;
+	Shard->Indexer->ShardChanged.Broadcast();
+}
+
+static void SeekShard(AVFormatContext *Context, int64_t Pos) {
+	if (av_seek_frame(Context, -1, Pos, AVSEEK_FLAG_BYTE) < 0)
+		throw FFMS_Exception(FFMS_ERROR_INDEXING, FFMS_ERROR_FILE_READ,
+			"Couldn't seek to the start of a part of the file");
+}
+
+int64_t FFLAVFIndexer::FindWarmupStart(TSShard &Shard) {
+	// The video parsers only know the frame types and field repeats once
+	// they've seen the sequence headers, which come with the keyframes. Any
+	// video track with packets just before the part needs a keyframe
+	// before the part starts, so look further back until each one has one.
+	AVFormatContext *Context = Shard.FormatContext;
+	unsigned int NumStreams = Context->nb_streams;
+	for (int64_t Overlap = ShardOverlap; ; Overlap *= 2) {
+		int64_t WarmupStart = std::max<int64_t>(Shard.Start - Overlap, 0);
+		if (WarmupStart == 0)
+			return 0;
+
+		SeekShard(Context, WarmupStart);
+		std::vector<bool> HasPackets(NumStreams, false);
+		std::vector<bool> HasKeyFrame(NumStreams, false);
+		AVPacket Packet;
+		InitNullPacket(Packet);
+		while (av_read_frame(Context, &Packet) >= 0) {
+			int Track = Packet.stream_index;
+			bool Past = Packet.pos >= Shard.Start;
+			if (!Past && Packet.pos >= 0 && (IndexMask & (1 << Track)) &&
+				Context->streams[Track]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+				HasPackets[Track] = true;
+				if (Packet.flags & AV_PKT_FLAG_KEY)
+					HasKeyFrame[Track] = true;
+			}
+			av_free_packet(&Packet);
+			if (Past)
+				break;
+		}
+
+		if (HasPackets == HasKeyFrame)
+			return WarmupStart;
+	}
+}
+
+void FFLAVFIndexer::IndexShard(TSShard &Shard) {
+	TraceSpan Span("indexing", "IndexShard", Shard.Start);
+	AVFormatContext *Context = Shard.FormatContext;
+	unsigned int NumStreams = Context->nb_streams;
+
+	if (Shard.Start > 0)
+		SeekShard(Context, FindWarmupStart(Shard));
+
+	// Tracks which haven't had a packet past the end of the part yet, and
+	// so may still have packets which started in it
+	int Pending = 0;
+	std::vector<bool> Finished(NumStreams, false);
+	for (unsigned int i = 0; i < NumStreams; i++) {
+		if (IndexMask & (1 << i))
+			++Pending;
+	}
+	std::vector<int64_t> LastPTS(NumStreams, ffms_av_nopts_value);
+
+	AVPacket Packet;
+	InitNullPacket(Packet);
+	int64_t Reported = Shard.Start;
+	while (Pending > 0 && av_read_frame(Context, &Packet) >= 0) {
+		if (Packet.pos - Reported >= ShardProgressInterval) {
+			ScopedLock Lock(ShardLock);
+			if (ShardsCancelled) {
+				av_free_packet(&Packet);
+				return;
+			}
+			Shard.Position = Reported = Packet.pos;
+			ShardChanged.Broadcast();
+		}
+
+		int Track = Packet.stream_index;
+		if (!(IndexMask & (1 << Track))) {
+			av_free_packet(&Packet);
+			continue;
+		}
+
+		if (Shard.End > 0 && Packet.pos >= Shard.End) {
+			if (!Finished[Track]) {
+				Finished[Track] = true;
+				--Pending;
+			}
+			// Tracks which have ended don't get a packet past the end
+			if (Packet.pos >= Shard.End + MaxPESSpan)
+				Pending = 0;
+			av_free_packet(&Packet);
+			continue;
+		}
+
+		// Packets before the start only bring the state up to date
+		bool Warmup = Packet.pos >= 0 && Packet.pos < Shard.Start;
+		FFMS_Track &TrackInfo = Shard.Index[Track];
+		bool KeyFrame = !!(Packet.flags & AV_PKT_FLAG_KEY);
+
+		if (!Warmup && Track == Shard.ResumeTrack && KeyFrame && Packet.pos > Shard.Index.Resume.FilePos) {
+			IndexResumePoint &Resume = Shard.Index.Resume;
+			Resume.FilePos = Packet.pos;
+			Resume.IndexMask = IndexMask & ~Shard.FailedMask;
+			Resume.LastValidTS = Shard.LastValidTS;
+			Resume.LastDuration = Shard.LastDuration;
+		}
+
+		// UseDTS was decided from the start of the file, so a part starting
+		// on a packet without a PTS only falls back to the DTS for it
+		bool UseDTS = TrackInfo.UseDTS;
+		ReadTS(Packet, Shard.LastValidTS[Track], UseDTS);
+
+		if (Context->streams[Track]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+			int64_t PTS = TrackInfo.UseDTS ? Packet.dts : Packet.pts;
+			if (PTS == ffms_av_nopts_value) {
+				if (Packet.duration == 0)
+					throw FFMS_Exception(FFMS_ERROR_INDEXING, FFMS_ERROR_PARSER,
+						"Invalid initial pts, dts, and duration");
+
+				if (LastPTS[Track] == ffms_av_nopts_value)
+					PTS = 0;
+				else
+					PTS = LastPTS[Track] + Shard.LastDuration[Track];
+
+				if (!Warmup)
+					TrackInfo.HasTS = false;
+			}
+			LastPTS[Track] = PTS;
+			Shard.LastDuration[Track] = Packet.duration;
+
+			int RepeatPict = -1;
+			int FrameType = 0;
+			bool Invisible = false;
+			ParseVideoPacket(Shard.VideoContexts[Track], Packet, &RepeatPict, &FrameType, &Invisible);
+
+			if (!Warmup)
+				TrackInfo.AddVideoFrame(PTS, RepeatPict, KeyFrame,
+					FrameType, Packet.pos, 0, Invisible);
+		}
+		else if (Context->streams[Track]->codec->codec_type == AVMEDIA_TYPE_AUDIO && !(Shard.FailedMask & (1 << Track))) {
+			if (!Warmup && Shard.LastValidTS[Track] != ffms_av_nopts_value)
+				TrackInfo.HasTS = true;
+
+			SharedAudioContext &AudioContext = Shard.AudioContexts[Track];
+			bool Failed = false;
+			if (Warmup) {
+				// Errors here are the previous part's to report, so even
+				// with FFMS_IEH_ABORT just start again from the next packet
+				uint8_t *Data = Packet.data;
+				int Size = Packet.size;
+				try {
+					DecodeAudioPacket(Track, &Packet, AudioContext, Shard.DecodeFrame, Shard.Index, Failed);
+				} catch (FFMS_Exception &) {
+					Packet.data = Data;
+					Packet.size = Size;
+					avcodec_flush_buffers(AudioContext.CodecContext);
+					AudioContext.HasFormat = false;
+				}
+				AudioContext.CurrentSample = 0;
+			} else {
+				int64_t StartSample = AudioContext.CurrentSample;
+				uint32_t SampleCount = DecodeAudioPacket(Track, &Packet, AudioContext, Shard.DecodeFrame, Shard.Index, Failed);
+				TrackInfo.AddAudioFrame(Shard.LastValidTS[Track], StartSample, SampleCount, KeyFrame, Packet.pos);
+				if (Failed && ErrorHandling != FFMS_IEH_IGNORE)
+					Shard.FailedMask |= 1 << Track;
+			}
 		}
 
 		av_free_packet(&Packet);
 	}
 
-	TrackIndices->Finalize(VideoContexts);
-	return TrackIndices.release();
+	for (unsigned int i = 0; i < NumStreams; i++)
+		Shard.Samples[i] = Shard.AudioContexts[i].CurrentSample;
+}
+
+void FFLAVFIndexer::IndexShards(std::vector<int64_t> const& Starts, FFMS_Index &TrackIndices, std::vector<SharedAudioContext> &AudioContexts, std::vector<SharedVideoContext> &VideoContexts) {
+	TraceSpan Span("indexing", "IndexShards");
+	std::vector<TSShard *> Shards;
+	try {
+		int ResumeTrack = GetResumeTrack(AudioContexts, VideoContexts);
+		for (size_t i = 0; i <= Starts.size(); i++) {
+			Shards.push_back(new TSShard(this, SourceFile.c_str(),
+				i == 0 ? 0 : Starts[i - 1], i == Starts.size() ? 0 : Starts[i]));
+			Shards.back()->ResumeTrack = ResumeTrack;
+			for (size_t t = 0; t < TrackIndices.size(); t++)
+				Shards.back()->Index[t].UseDTS = TrackIndices[t].UseDTS;
+		}
+
+		{
+			ThreadGroup Threads;
+			RunningShards = static_cast<int>(Shards.size());
+			for (size_t i = 0; i < Shards.size(); i++)
+				Threads.Start(RunShard, Shards[i]);
+
+			// Only the indexing thread may call the progress callback, so
+			// wait for the workers here rather than in JoinAll
+			ScopedLock Lock(ShardLock);
+			while (RunningShards > 0 && !ShardsCancelled) {
+				ShardChanged.Wait(ShardLock);
+
+				int64_t Done = 0;
+				for (size_t i = 0; i < Shards.size(); i++)
+					Done += std::max<int64_t>(Shards[i]->Position - Shards[i]->Start, 0);
+
+				ShardLock.Unlock();
+				bool Cancel = IC && (*IC)(Done, Filesize, ICPrivate);
+				ShardLock.Lock();
+				if (Cancel)
+					ShardsCancelled = true;
+			}
+		}
+
+		if (ShardsCancelled)
+			throw FFMS_Exception(FFMS_ERROR_CANCELLED, FFMS_ERROR_USER, "Cancelled by user");
+
+		for (size_t i = 0; i < Shards.size(); i++)
+			Shards[i]->Error.Rethrow();
+
+		// Put the pieces together in file order, stopping tracks where the
+		// serial indexer would have
+		std::vector<int64_t> SampleOffsets(TrackIndices.size(), 0);
+		for (size_t i = 0; i < Shards.size(); i++) {
+			TSShard &Shard = *Shards[i];
+			for (size_t t = 0; t < TrackIndices.size(); t++) {
+				if (!(IndexMask & (1 << t))) continue;
+
+				FFMS_Track &TrackInfo = TrackIndices[t];
+				FFMS_Track const& Part = Shard.Index[t];
+
+				if (TrackInfo.TT == FFMS_TYPE_VIDEO) {
+					TrackInfo.HasTS = TrackInfo.HasTS && Part.HasTS;
+					if (Shard.VideoContexts[t].CodecContext)
+						TrackInfo.MaxBFrames = std::max(TrackInfo.MaxBFrames, Shard.VideoContexts[t].CodecContext->has_b_frames);
+					for (size_t f = 0; f < Part.size(); f++) {
+						FrameInfo const& Frame = Part[f];
+						TrackInfo.AddVideoFrame(Frame.PTS, Frame.RepeatPict, Frame.KeyFrame,
+							Frame.FrameType, Frame.FilePos, Frame.FrameSize, Frame.Hidden);
+					}
+				} else {
+					TrackInfo.HasTS = TrackInfo.HasTS || Part.HasTS;
+					for (size_t f = 0; f < Part.size(); f++) {
+						FrameInfo const& Frame = Part[f];
+						TrackInfo.AddAudioFrame(Frame.PTS, SampleOffsets[t] + Frame.SampleStart,
+							Frame.SampleCount, Frame.KeyFrame, Frame.FilePos, Frame.FrameSize);
+					}
+					SampleOffsets[t] += Shard.Samples[t];
+				}
+
+				if (Shard.FailedMask & (1 << t)) {
+					if (ErrorHandling == FFMS_IEH_CLEAR_TRACK)
+						TrackInfo.clear();
+					IndexMask &= ~(1 << t);
+				}
+			}
+
+			if (Shard.Index.Resume.FilePos >= 0) {
+				TrackIndices.Resume = Shard.Index.Resume;
+				TrackIndices.Resume.IndexMask &= IndexMask;
+			}
+
+			delete Shards[i];
+			Shards[i] = NULL;
+		}
+	}
+	catch (...) {
+		for (size_t i = 0; i < Shards.size(); i++)
+			delete Shards[i];
+		throw;
+	}
+
+	TrackIndices.Finalize(VideoContexts);
 }
 
 void FFLAVFIndexer::ReadTS(const AVPacket &Packet, int64_t &TS, bool &UseDTS) {
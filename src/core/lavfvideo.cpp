@@ -20,6 +20,8 @@
 
 #include "videosource.h"
 
+#include "trace.h"
+
 namespace {
 class FFLAVFVideo : public FFMS_VideoSource {
 	AVFormatContext *FormatContext;
@@ -33,6 +35,7 @@ class FFLAVFVideo : public FFMS_VideoSource {
 	void Free(bool CloseCodec);
 
 	int Seek(int n) {
+		++Stats.Seeks;
 		int ret = -1;
 		if (!SeekByPos || Frames[n].FilePos < 0) {
 			ret = av_seek_frame(FormatContext, VideoTrack, Frames[n].PTS, AVSEEK_FLAG_BACKWARD);
@@ -49,6 +52,7 @@ class FFLAVFVideo : public FFMS_VideoSource {
 	}
 
 	int ReadFrame(AVPacket *pkt) {
+		StatsTimer Timer(Stats.DemuxTime);
 		int ret = av_read_frame(FormatContext, pkt);
 		if (ret >= 0 || ret == AVERROR(EOF)) return ret;
 
@@ -85,7 +89,7 @@ FFLAVFVideo::FFLAVFVideo(const char *SourceFile, int Track, FFMS_Index &Index,
 , SeekByPos(false)
 , PosOffset(0)
 {
-	LAVFOpenFile(SourceFile, FormatContext);
+	LAVFOpenFile(SourceFile, FormatContext, &Index);
 
 	if (SeekMode >= 0 && Frames.size() > 1 && Seek(0) < 0)
 		throw FFMS_Exception(FFMS_ERROR_DECODING, FFMS_ERROR_CODEC,
@@ -144,6 +148,7 @@ FFLAVFVideo::FFLAVFVideo(const char *SourceFile, int Track, FFMS_Index &Index,
 }
 
 void FFLAVFVideo::DecodeNextFrame(int64_t *AStartTime, int64_t *Pos) {
+	TraceSpan Span("video", "DecodeNextFrame");
 	*AStartTime = -1;
 	if (HasPendingDelayedFrames()) return;
 
@@ -156,6 +161,9 @@ void FFLAVFVideo::DecodeNextFrame(int64_t *AStartTime, int64_t *Pos) {
 			continue;
 		}
 
+		++Stats.PacketsRead;
+		Stats.BytesRead += Packet.size;
+
 		if (*AStartTime < 0)
 			*AStartTime = Frames.UseDTS ? Packet.dts : Packet.pts;
 
@@ -171,6 +179,7 @@ void FFLAVFVideo::DecodeNextFrame(int64_t *AStartTime, int64_t *Pos) {
 }
 
 bool FFLAVFVideo::SeekTo(int n, int SeekOffset) {
+	TraceSpan Span("video", "SeekTo", n);
 	if (SeekMode >= 0) {
 		int TargetFrame = n + SeekOffset;
 		if (TargetFrame < 0)
@@ -183,7 +192,7 @@ bool FFLAVFVideo::SeekTo(int n, int SeekOffset) {
 		if (SeekMode == 0) {
 			if (n < CurrentFrame) {
 				Seek(0);
-				FlushBuffers(CodecContext);
+				FlushDecoder();
 				CurrentFrame = 0;
 				DelayCounter = 0;
 				InitialDecode = 1;
@@ -192,7 +201,7 @@ bool FFLAVFVideo::SeekTo(int n, int SeekOffset) {
 			// 10 frames is used as a margin to prevent excessive seeking since the predicted best keyframe isn't always selected by avformat
 			if (n < CurrentFrame || TargetFrame > CurrentFrame + 10 || (SeekMode == 3 && n > CurrentFrame + 10)) {
 				Seek(TargetFrame);
-				FlushBuffers(CodecContext);
+				FlushDecoder();
 				DelayCounter = 0;
 				InitialDecode = 1;
 				return true;
@@ -209,8 +218,11 @@ FFMS_Frame *FFLAVFVideo::GetFrame(int n) {
 	GetFrameCheck(n);
 	n = Frames.RealFrameNumber(n);
 
-	if (LastFrameNum == n)
+	if (LastFrameNum == n) {
+		++Stats.CacheHits;
 		return &LocalFrame;
+	}
+	++Stats.CacheMisses;
 
 	int SeekOffset = 0;
 	bool Seek = true;
@@ -256,6 +268,7 @@ FFMS_Frame *FFLAVFVideo::GetFrame(int n) {
 				// No idea where we are so go back a bit further
 				SeekOffset -= 10;
 				Seek = true;
+				++Stats.SeekRetries;
 				continue;
 			}
 			CurrentFrame = Frames.ClosestFrameFromPTS(StartTime);
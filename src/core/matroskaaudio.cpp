@@ -80,11 +80,11 @@ FFMatroskaAudio::~FFMatroskaAudio() {
 }
 
 bool FFMatroskaAudio::ReadPacket(AVPacket *Packet) {
-	MC.ReadFrame(CurrentFrame->FilePos, CurrentFrame->FrameSize, TCC.get());
+	MC.ReadFrame(CurrentFrame.FilePos, CurrentFrame.FrameSize, TCC.get());
 	InitNullPacket(*Packet);
 	Packet->data = MC.Buffer;
 	Packet->size = MC.FrameSize;
-	Packet->flags = CurrentFrame->KeyFrame ? AV_PKT_FLAG_KEY : 0;
+	Packet->flags = CurrentFrame.KeyFrame ? AV_PKT_FLAG_KEY : 0;
 
 	return true;
 }
@@ -21,14 +21,172 @@
 #include "indexing.h"
 
 #include "codectype.h"
+#include "indexpipeline.h"
 #include "matroskareader.h"
+#include "numthreads.h"
+#include "threading.h"
+#include "trace.h"
 #include "track.h"
 
+#include <algorithm>
+
 namespace {
+// How much of each video frame has to be read for the parser to find the
+// frame type and repeat count
+struct HeaderScan {
+	enum Mode {
+		// Read the whole frame
+		SCAN_FULL,
+		// Read only the first Length bytes
+		SCAN_PREFIX,
+		// Read the first Length bytes and cut the first slice NAL unit of
+		// the length-prefixed H.264 or HEVC frame down to its header
+		SCAN_AVC,
+		SCAN_HEVC,
+		// Every frame is a keyframe, so there's nothing to parse
+		SCAN_NONE
+	};
+
+	Mode ScanMode;
+	size_t Length;
+	int NALLengthSize;
+
+	HeaderScan() : ScanMode(SCAN_FULL), Length(0), NALLengthSize(0) { }
+};
+
+// Enough for the parsers to get through the slice header including the
+// reference picture marking, which is all they look at
+const size_t SliceHeaderBytes = 1024;
+
+HeaderScan GetHeaderScan(TrackInfo *TI, FFMS_CodecID CodecID) {
+	HeaderScan Scan;
+	const uint8_t *Private = static_cast<const uint8_t *>(TI->CodecPrivate);
+	switch (CodecID) {
+		case FFMS_ID(MJPEG):
+		case FFMS_ID(DNXHD):
+		case FFMS_ID(PNG):
+			Scan.ScanMode = HeaderScan::SCAN_NONE;
+			break;
+		case FFMS_ID(MPEG1VIDEO):
+		case FFMS_ID(MPEG2VIDEO):
+		case FFMS_ID(MPEG4):
+		case FFMS_ID(VC1):
+			Scan.ScanMode = HeaderScan::SCAN_PREFIX;
+			Scan.Length = 4096;
+			break;
+		case FFMS_ID(VP8):
+			Scan.ScanMode = HeaderScan::SCAN_PREFIX;
+			Scan.Length = 16;
+			break;
+		case FFMS_ID(H264):
+			// avcC; without it the frames are in Annex B format
+			if (TI->CodecPrivateSize >= 7 && Private[0] == 1) {
+				Scan.ScanMode = HeaderScan::SCAN_AVC;
+				Scan.Length = 16384;
+				Scan.NALLengthSize = (Private[4] & 3) + 1;
+			}
+			break;
+		case FFMS_ID(HEVC):
+			// hvcC
+			if (TI->CodecPrivateSize >= 23 && Private[0] == 1) {
+				Scan.ScanMode = HeaderScan::SCAN_HEVC;
+				Scan.Length = 16384;
+				Scan.NALLengthSize = (Private[21] & 3) + 1;
+			}
+			break;
+		default:
+			break;
+	}
+	return Scan;
+}
+
+// Cut a partially read frame of length-prefixed NAL units off after the
+// header of its first slice. Returns the new size of the frame, or 0 if
+// more of the frame is needed.
+size_t TrimToFirstSlice(uint8_t *Data, size_t Size, int LengthSize, bool HEVC) {
+	size_t Pos = 0;
+	while (Pos + LengthSize < Size) {
+		size_t NALSize = 0;
+		for (int i = 0; i < LengthSize; ++i)
+			NALSize = (NALSize << 8) | Data[Pos + i];
+		size_t Start = Pos + LengthSize;
+
+		int Type = HEVC ? (Data[Start] >> 1) & 0x3F : Data[Start] & 0x1F;
+		bool Slice = HEVC ? Type < 32 : Type >= 1 && Type <= 5;
+		if (Slice) {
+			size_t Keep = std::min(NALSize, Size - Start);
+			if (Keep < std::min(NALSize, SliceHeaderBytes))
+				return 0;
+			for (int i = LengthSize - 1, Length = static_cast<int>(Keep); i >= 0; --i, Length >>= 8)
+				Data[Pos + i] = static_cast<uint8_t>(Length & 0xFF);
+			return Start + Keep;
+		}
+
+		// Parameter sets and SEI messages are needed in full
+		if (NALSize > Size - Start)
+			return 0;
+		Pos = Start + NALSize;
+	}
+	return 0;
+}
+
+// Audio packets found by a range worker, which are decoded afterwards on
+// the indexing thread as decoding has to happen in order
+struct RangePacket {
+	ulonglong StartTime;
+	ulonglong FilePos;
+	unsigned int FrameSize;
+	unsigned int Track;
+	bool KeyFrame;
+};
+
+class FFMatroskaIndexer;
+
+// A part of the file from one cluster up to the first cluster of the next
+// part, indexed on its own thread with its own parser instance
+struct ClusterRange : private noncopyable {
+	FFMatroskaIndexer *Indexer;
+	MatroskaReaderContext MC;
+	MatroskaFile *MF;
+	std::vector<SharedVideoContext> VideoContexts;
+	uint64_t Start;
+	uint64_t End;
+
+	// Results, valid once the worker has finished
+	std::vector<FFMS_Track> Tracks;
+	std::vector<RangePacket> AudioPackets;
+	ThreadError Error;
+
+	// Protected by the indexer's RangeLock
+	uint64_t Position;
+
+	ClusterRange(FFMatroskaIndexer *Indexer, const char *Filename, uint64_t Start, uint64_t End);
+	~ClusterRange();
+};
+
 class FFMatroskaIndexer : public FFMS_Indexer {
+	friend struct ClusterRange;
+
 	MatroskaFile *MF;
 	MatroskaReaderContext MC;
 	AVCodec *Codec[32];
+	HeaderScan Scan[32];
+
+	// Progress reporting and cancellation for the range workers
+	Mutex RangeLock;
+	Condition RangeChanged;
+	int RunningRanges;
+	bool RangesCancelled;
+
+	bool OpenVideoParser(MatroskaFile *File, unsigned int Track, SharedVideoContext &Context);
+	void ReadVideoHeader(MatroskaReaderContext &Reader, unsigned int Track, uint64_t FilePos, unsigned int FrameSize, TrackCompressionContext *TCC);
+	void IndexVideoFrame(MatroskaReaderContext &Reader, SharedVideoContext &Context, FFMS_Track &TrackInfo, unsigned int Track, ulonglong StartTime, ulonglong FilePos, unsigned int FrameSize, unsigned int FrameFlags);
+	void IndexAudioFrame(AudioIndexPipeline &Pipeline, std::vector<SharedAudioContext> &AudioContexts, unsigned int Track, ulonglong StartTime, ulonglong FilePos, unsigned int FrameSize, bool KeyFrame);
+
+	std::vector<uint64_t> FindRangeStarts();
+	void IndexRanges(std::vector<uint64_t> const& Starts, FFMS_Index &TrackIndices, AudioIndexPipeline &Pipeline, std::vector<SharedAudioContext> &AudioContexts);
+	static void RunRange(void *Arg);
+	void IndexRange(ClusterRange &Range);
 
 public:
 	FFMatroskaIndexer(const char *Filename);
@@ -45,9 +203,48 @@ public:
 	FFMS_Sources GetSourceType() { return FFMS_SOURCE_MATROSKA; }
 };
 
+ClusterRange::ClusterRange(FFMatroskaIndexer *Indexer, const char *Filename, uint64_t Start, uint64_t End)
+: Indexer(Indexer)
+, MC(Filename)
+, MF(NULL)
+, Start(Start)
+, End(End)
+, Position(Start)
+{
+	char ErrorMessage[256];
+	MF = mkv_OpenEx(&MC.Reader, 0, 0, ErrorMessage, sizeof(ErrorMessage));
+	if (MF == NULL)
+		throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
+			std::string("Can't parse Matroska file: ") + ErrorMessage);
+	mkv_SetReadRange(MF, Start, End);
+	MC.Reader.SetAccessPattern(FileReader::ACCESS_SEQUENTIAL);
+
+	// Codecs are opened here rather than on the worker as opening isn't
+	// thread-safe with all versions of FFmpeg/Libav
+	try {
+		VideoContexts.resize(mkv_GetNumTracks(MF), SharedVideoContext(true));
+		Tracks.resize(mkv_GetNumTracks(MF));
+		for (unsigned int i = 0; i < mkv_GetNumTracks(MF); i++)
+			Indexer->OpenVideoParser(MF, i, VideoContexts[i]);
+	}
+	catch (...) {
+		VideoContexts.clear();
+		mkv_Close(MF);
+		throw;
+	}
+}
+
+ClusterRange::~ClusterRange() {
+	// The compression contexts belong to MF
+	VideoContexts.clear();
+	mkv_Close(MF);
+}
+
 FFMatroskaIndexer::FFMatroskaIndexer(const char *Filename)
 : FFMS_Indexer(Filename)
 , MC(Filename)
+, RunningRanges(0)
+, RangesCancelled(false)
 {
 	memset(Codec, 0, sizeof(Codec));
 
@@ -60,101 +257,275 @@ FFMatroskaIndexer::FFMatroskaIndexer(const char *Filename)
 	for (unsigned int i = 0; i < mkv_GetNumTracks(MF); i++) {
 		TrackInfo *TI = mkv_GetTrackInfo(MF, i);
 		Codec[i] = avcodec_find_decoder(MatroskaToFFCodecID(TI->CodecID, TI->CodecPrivate, 0, TI->AV.Audio.BitDepth));
+		if (Codec[i] && TI->Type == TT_VIDEO)
+			Scan[i] = GetHeaderScan(TI, Codec[i]->id);
 	}
 }
 
-FFMS_Index *FFMatroskaIndexer::DoIndexing() {
-	std::vector<SharedAudioContext> AudioContexts(mkv_GetNumTracks(MF), SharedAudioContext(true));
-	std::vector<SharedVideoContext> VideoContexts(mkv_GetNumTracks(MF), SharedVideoContext(true));
+bool FFMatroskaIndexer::OpenVideoParser(MatroskaFile *File, unsigned int Track, SharedVideoContext &Context) {
+	TrackInfo *TI = mkv_GetTrackInfo(File, Track);
+	if (!Codec[Track] || TI->Type != TT_VIDEO || !(Context.Parser = av_parser_init(Codec[Track]->id)))
+		return false;
 
-	std::auto_ptr<FFMS_Index> TrackIndices(new FFMS_Index(Filesize, Digest, FFMS_SOURCE_MATROSKA, ErrorHandling));
+	AVCodecContext *CodecContext = avcodec_alloc_context3(NULL);
+	InitializeCodecContextFromMatroskaTrackInfo(TI, CodecContext);
 
-	for (unsigned int i = 0; i < mkv_GetNumTracks(MF); i++) {
-		TrackInfo *TI = mkv_GetTrackInfo(MF, i);
-		TrackIndices->push_back(FFMS_Track(mkv_TruncFloat(mkv_GetTrackInfo(MF, i)->TimecodeScale), 1000000, HaaliTrackTypeToFFTrackType(mkv_GetTrackInfo(MF, i)->Type)));
+	if (avcodec_open2(CodecContext, Codec[Track], NULL) < 0) {
+		av_freep(&CodecContext);
+		throw FFMS_Exception(FFMS_ERROR_CODEC, FFMS_ERROR_DECODING,
+			"Could not open video codec");
+	}
 
-		if (!Codec[i]) continue;
+	Context.CodecContext = CodecContext;
+	Context.Parser->flags = PARSER_FLAG_COMPLETE_FRAMES;
+	if (TI->CompEnabled)
+		Context.TCC = new TrackCompressionContext(File, TI, Track);
+	return true;
+}
 
-		AVCodecContext *CodecContext = avcodec_alloc_context3(NULL);
-		InitializeCodecContextFromMatroskaTrackInfo(TI, CodecContext);
+void FFMatroskaIndexer::ReadVideoHeader(MatroskaReaderContext &Reader, unsigned int Track, uint64_t FilePos, unsigned int FrameSize, TrackCompressionContext *TCC) {
+	const HeaderScan &S = Scan[Track];
+	if (S.ScanMode == HeaderScan::SCAN_FULL) {
+		Reader.ReadFrame(FilePos, FrameSize, TCC);
+		return;
+	}
 
-		try {
-			if (TI->Type == TT_VIDEO && (VideoContexts[i].Parser = av_parser_init(Codec[i]->id))) {
-				if (avcodec_open2(CodecContext, Codec[i], NULL) < 0)
-					throw FFMS_Exception(FFMS_ERROR_CODEC, FFMS_ERROR_DECODING,
-						"Could not open video codec");
+	Reader.ReadFrame(FilePos, FrameSize, TCC, S.Length);
+	if (S.ScanMode == HeaderScan::SCAN_AVC || S.ScanMode == HeaderScan::SCAN_HEVC) {
+		size_t Trimmed = TrimToFirstSlice(Reader.Buffer, Reader.FrameSize, S.NALLengthSize, S.ScanMode == HeaderScan::SCAN_HEVC);
+		if (Trimmed)
+			Reader.FrameSize = Trimmed;
+		else
+			Reader.ReadFrame(FilePos, FrameSize, TCC);
+	}
+}
 
-				if (TI->CompEnabled)
-					VideoContexts[i].TCC = new TrackCompressionContext(MF, TI, i);
+void FFMatroskaIndexer::IndexVideoFrame(MatroskaReaderContext &Reader, SharedVideoContext &Context, FFMS_Track &TrackInfo, unsigned int Track, ulonglong StartTime, ulonglong FilePos, unsigned int FrameSize, unsigned int FrameFlags) {
+	int RepeatPict = -1;
+	int FrameType = 0;
+	bool Invisible = false;
 
-				VideoContexts[i].CodecContext = CodecContext;
-				VideoContexts[i].Parser->flags = PARSER_FLAG_COMPLETE_FRAMES;
-			}
-			else if (IndexMask & (1 << i) && TI->Type == TT_AUDIO) {
-				if (avcodec_open2(CodecContext, Codec[i], NULL) < 0)
-					throw FFMS_Exception(FFMS_ERROR_CODEC, FFMS_ERROR_DECODING,
-						"Could not open audio codec");
+	if (Context.Parser && Scan[Track].ScanMode == HeaderScan::SCAN_NONE) {
+		// What the parser would report for an intra-only codec
+		RepeatPict = 0;
+		FrameType = AV_PICTURE_TYPE_I;
+	}
+	else if (Context.Parser) {
+		// Video frames are only read as far as the parser needs
+		ReadVideoHeader(Reader, Track, FilePos, FrameSize, Context.TCC);
 
-				if (TI->CompEnabled)
-					AudioContexts[i].TCC = new TrackCompressionContext(MF, TI, i);
+		AVPacket Packet;
+		InitNullPacket(Packet);
+		Packet.data = Reader.Buffer;
+		Packet.size = Reader.FrameSize;
+		Packet.flags = FrameFlags & FRAME_KF ? AV_PKT_FLAG_KEY : 0;
+		Packet.pts = Packet.dts = Packet.pos = ffms_av_nopts_value;
+		ParseVideoPacket(Context, Packet, &RepeatPict, &FrameType, &Invisible);
+	}
 
-				AudioContexts[i].CodecContext = CodecContext;
-			} else {
-				IndexMask &= ~(1 << i);
-				av_freep(&CodecContext);
-			}
-		}
-		catch (...) {
-			av_freep(&CodecContext);
-			throw;
-		}
+	TrackInfo.AddVideoFrame(StartTime, RepeatPict,
+		(FrameFlags & FRAME_KF) != 0, FrameType, FilePos,
+		FrameSize, Invisible);
+}
+
+void FFMatroskaIndexer::IndexAudioFrame(AudioIndexPipeline &Pipeline, std::vector<SharedAudioContext> &AudioContexts, unsigned int Track, ulonglong StartTime, ulonglong FilePos, unsigned int FrameSize, bool KeyFrame) {
+	MC.ReadFrame(FilePos, FrameSize, AudioContexts[Track].TCC);
+
+	AVPacket Packet;
+	InitNullPacket(Packet);
+	Packet.data = MC.Buffer;
+	Packet.size = MC.FrameSize;
+	Packet.flags = KeyFrame ? AV_PKT_FLAG_KEY : 0;
+	Pipeline.IndexPacket(Track, Packet, StartTime, KeyFrame, FilePos, FrameSize);
+}
+
+std::vector<uint64_t> FFMatroskaIndexer::FindRangeStarts() {
+	std::vector<uint64_t> Starts;
+
+	int MaxRanges = Threads < 1 ? GetNumberOfLogicalCPUs() : Threads;
+	MaxRanges = static_cast<int>(std::min<int64_t>(MaxRanges, Filesize / MinSplitSize));
+	if (MaxRanges < 2)
+		return Starts;
+
+	// The cues point at clusters; files without any are scanned for them
+	std::vector<uint64_t> Clusters;
+	for (unsigned int i = 0, Count = mkv_GetNumCues(MF); i < Count; i++)
+		Clusters.push_back(mkv_GetCuePosition(MF, i));
+	std::sort(Clusters.begin(), Clusters.end());
+
+	for (int i = 1; i < MaxRanges; i++) {
+		uint64_t Target = static_cast<uint64_t>(Filesize / MaxRanges * i);
+		std::vector<uint64_t>::iterator Cluster = std::lower_bound(Clusters.begin(), Clusters.end(), Target);
+		if (Cluster != Clusters.end() && (Starts.empty() || *Cluster > Starts.back()))
+			Starts.push_back(*Cluster);
 	}
+	return Starts;
+}
+
+void FFMatroskaIndexer::RunRange(void *Arg) {
+	ClusterRange *Range = static_cast<ClusterRange *>(Arg);
+	try {
+		Range->Indexer->IndexRange(*Range);
+	} catch (...) {
+		Range->Error.Catch();
+	}
+
+	ScopedLock Lock(Range->Indexer->RangeLock);
+	--Range->Indexer->RunningRanges;
+	Range->Indexer->RangeChanged.Broadcast();
+}
 
+void FFMatroskaIndexer::IndexRange(ClusterRange &Range) {
+	TraceSpan Span("indexing", "IndexRange", Range.Start);
 	ulonglong StartTime, EndTime, FilePos;
 	unsigned int Track, FrameFlags, FrameSize;
-	AVPacket TempPacket;
-	InitNullPacket(TempPacket);
+	uint64_t Reported = Range.Start;
+
+	while (mkv_ReadFrame(Range.MF, 0, &Track, &StartTime, &EndTime, &FilePos, &FrameSize, &FrameFlags) == 0) {
+		if (FilePos - Reported >= 4 * 1024 * 1024) {
+			ScopedLock Lock(RangeLock);
+			if (RangesCancelled)
+				return;
+			Range.Position = Reported = FilePos;
+			RangeChanged.Broadcast();
+		}
 
-	while (mkv_ReadFrame(MF, 0, &Track, &StartTime, &EndTime, &FilePos, &FrameSize, &FrameFlags) == 0) {
-		// Update progress
-		if (IC && (*IC)(FilePos, Filesize, ICPrivate))
+		unsigned char TrackType = mkv_GetTrackInfo(Range.MF, Track)->Type;
+		if (TrackType == TT_VIDEO) {
+			IndexVideoFrame(Range.MC, Range.VideoContexts[Track], Range.Tracks[Track],
+				Track, StartTime, FilePos, FrameSize, FrameFlags);
+		} else if (TrackType == TT_AUDIO && (IndexMask & (1 << Track))) {
+			RangePacket Packet = { StartTime, FilePos, FrameSize, Track, (FrameFlags & FRAME_KF) != 0 };
+			Range.AudioPackets.push_back(Packet);
+		}
+	}
+}
+
+void FFMatroskaIndexer::IndexRanges(std::vector<uint64_t> const& Starts, FFMS_Index &TrackIndices, AudioIndexPipeline &Pipeline, std::vector<SharedAudioContext> &AudioContexts) {
+	TraceSpan Span("indexing", "IndexRanges");
+	std::vector<ClusterRange *> Ranges;
+	try {
+		for (size_t i = 0; i <= Starts.size(); i++)
+			Ranges.push_back(new ClusterRange(this, SourceFile.c_str(),
+				i == 0 ? 0 : Starts[i - 1], i == Starts.size() ? 0 : Starts[i]));
+
+		{
+			ThreadGroup Threads;
+			RunningRanges = static_cast<int>(Ranges.size());
+			for (size_t i = 0; i < Ranges.size(); i++)
+				Threads.Start(RunRange, Ranges[i]);
+
+			// Only the indexing thread may call the progress callback, so
+			// wait for the workers here rather than in JoinAll
+			ScopedLock Lock(RangeLock);
+			while (RunningRanges > 0 && !RangesCancelled) {
+				RangeChanged.Wait(RangeLock);
+
+				int64_t Done = 0;
+				for (size_t i = 0; i < Ranges.size(); i++)
+					Done += Ranges[i]->Position - (i == 0 ? 0 : Ranges[i]->Start);
+
+				RangeLock.Unlock();
+				bool Cancel = IC && (*IC)(Done / 2, Filesize, ICPrivate);
+				RangeLock.Lock();
+				if (Cancel)
+					RangesCancelled = true;
+			}
+		}
+
+		if (RangesCancelled)
 			throw FFMS_Exception(FFMS_ERROR_CANCELLED, FFMS_ERROR_USER, "Cancelled by user");
 
-		unsigned int CompressedFrameSize = FrameSize;
-		unsigned char TrackType = mkv_GetTrackInfo(MF, Track)->Type;
-
-		TrackCompressionContext *TCC = NULL;
-		if (VideoContexts[Track].Parser || (TrackType == TT_AUDIO && (IndexMask & (1 << Track)))) {
-			if (TrackType == TT_VIDEO)
-				TCC = VideoContexts[Track].TCC;
-			else
-				TCC = AudioContexts[Track].TCC;
-			MC.ReadFrame(FilePos, FrameSize, TCC);
-			TempPacket.data = MC.Buffer;
-			TempPacket.size = MC.FrameSize;
-			TempPacket.flags = FrameFlags & FRAME_KF ? AV_PKT_FLAG_KEY : 0;
+		for (size_t i = 0; i < Ranges.size(); i++)
+			Ranges[i]->Error.Rethrow();
+
+		// Put the pieces together in file order
+		for (size_t i = 0; i < Ranges.size(); i++) {
+			ClusterRange &Range = *Ranges[i];
+			for (size_t t = 0; t < Range.Tracks.size(); t++) {
+				FFMS_Track &TrackInfo = TrackIndices[t];
+				for (size_t f = 0; f < Range.Tracks[t].size(); f++) {
+					FrameInfo const& Frame = Range.Tracks[t][f];
+					TrackInfo.AddVideoFrame(Frame.PTS, Frame.RepeatPict, Frame.KeyFrame,
+						Frame.FrameType, Frame.FilePos, Frame.FrameSize, Frame.Hidden);
+				}
+			}
+
+			for (size_t p = 0; p < Range.AudioPackets.size(); p++) {
+				RangePacket const& Packet = Range.AudioPackets[p];
+				if (IC && (*IC)((Filesize + Packet.FilePos) / 2, Filesize, ICPrivate))
+					throw FFMS_Exception(FFMS_ERROR_CANCELLED, FFMS_ERROR_USER, "Cancelled by user");
+				IndexAudioFrame(Pipeline, AudioContexts, Packet.Track, Packet.StartTime,
+					Packet.FilePos, Packet.FrameSize, Packet.KeyFrame);
+			}
+
+			delete Ranges[i];
+			Ranges[i] = NULL;
 		}
+	}
+	catch (...) {
+		for (size_t i = 0; i < Ranges.size(); i++)
+			delete Ranges[i];
+		throw;
+	}
+}
 
-		if (TrackType == TT_VIDEO) {
-			TempPacket.pts = TempPacket.dts = TempPacket.pos = ffms_av_nopts_value;
+FFMS_Index *FFMatroskaIndexer::DoIndexing() {
+	std::vector<SharedAudioContext> AudioContexts(mkv_GetNumTracks(MF), SharedAudioContext(true));
+	std::vector<SharedVideoContext> VideoContexts(mkv_GetNumTracks(MF), SharedVideoContext(true));
 
-			int RepeatPict = -1;
-			int FrameType = 0;
-			bool Invisible = false;
-			ParseVideoPacket(VideoContexts[Track], TempPacket, &RepeatPict, &FrameType, &Invisible);
+	std::auto_ptr<FFMS_Index> TrackIndices(new FFMS_Index(Filesize, Digest, SignatureType, FFMS_SOURCE_MATROSKA, ErrorHandling));
 
-			(*TrackIndices)[Track].AddVideoFrame(StartTime, RepeatPict,
-				(FrameFlags & FRAME_KF) != 0, FrameType, FilePos,
-				CompressedFrameSize, Invisible);
-		} else if (TrackType == TT_AUDIO && (IndexMask & (1 << Track))) {
-			int64_t StartSample = AudioContexts[Track].CurrentSample;
-			uint32_t SampleCount = IndexAudioPacket(Track, &TempPacket, AudioContexts[Track], *TrackIndices);
+	for (unsigned int i = 0; i < mkv_GetNumTracks(MF); i++) {
+		TrackInfo *TI = mkv_GetTrackInfo(MF, i);
+		TrackIndices->push_back(FFMS_Track(mkv_TruncFloat(mkv_GetTrackInfo(MF, i)->TimecodeScale), 1000000, HaaliTrackTypeToFFTrackType(mkv_GetTrackInfo(MF, i)->Type)));
+
+		if (!Codec[i] || OpenVideoParser(MF, i, VideoContexts[i])) continue;
+
+		if (IndexMask & (1 << i) && TI->Type == TT_AUDIO) {
+			AVCodecContext *CodecContext = avcodec_alloc_context3(NULL);
+			InitializeCodecContextFromMatroskaTrackInfo(TI, CodecContext);
+
+			if (avcodec_open2(CodecContext, Codec[i], NULL) < 0) {
+				av_freep(&CodecContext);
+				throw FFMS_Exception(FFMS_ERROR_CODEC, FFMS_ERROR_DECODING,
+					"Could not open audio codec");
+			}
 
-			(*TrackIndices)[Track].AddAudioFrame(StartTime, StartSample,
-				SampleCount, (FrameFlags & FRAME_KF) != 0, FilePos, CompressedFrameSize);
+			AudioContexts[i].CodecContext = CodecContext;
+			if (TI->CompEnabled)
+				AudioContexts[i].TCC = new TrackCompressionContext(MF, TI, i);
+		} else {
+			IndexMask &= ~(1 << i);
+		}
+	}
+
+	AudioIndexPipeline Pipeline(*this, AudioContexts, *TrackIndices);
+
+	std::vector<uint64_t> RangeStarts = FindRangeStarts();
+	if (!RangeStarts.empty()) {
+		IndexRanges(RangeStarts, *TrackIndices, Pipeline, AudioContexts);
+	} else {
+		ulonglong StartTime, EndTime, FilePos;
+		unsigned int Track, FrameFlags, FrameSize;
+
+		while (mkv_ReadFrame(MF, 0, &Track, &StartTime, &EndTime, &FilePos, &FrameSize, &FrameFlags) == 0) {
+			// Update progress
+			if (IC && (*IC)(FilePos, Filesize, ICPrivate))
+				throw FFMS_Exception(FFMS_ERROR_CANCELLED, FFMS_ERROR_USER, "Cancelled by user");
+
+			unsigned char TrackType = mkv_GetTrackInfo(MF, Track)->Type;
+			if (TrackType == TT_VIDEO) {
+				IndexVideoFrame(MC, VideoContexts[Track], (*TrackIndices)[Track],
+					Track, StartTime, FilePos, FrameSize, FrameFlags);
+			} else if (TrackType == TT_AUDIO && (IndexMask & (1 << Track))) {
+				IndexAudioFrame(Pipeline, AudioContexts, Track, StartTime,
+					FilePos, FrameSize, (FrameFlags & FRAME_KF) != 0);
+			}
 		}
 	}
 
+	Pipeline.Finish();
 	TrackIndices->Finalize(VideoContexts);
 	return TrackIndices.release();
 }
@@ -208,6 +208,7 @@ struct MatroskaFile {
   unsigned int	    trackMask;
   ulonglong	    pSegmentTop;  // offset of next byte after the segment
   ulonglong	    tcCluster;    // current cluster timecode
+  ulonglong	    readStop;     // no blocks are read from here on, 0 = segment end
 
   // Cues
   unsigned int	    nCues,nCuesSize;
@@ -2395,8 +2396,9 @@ static int  readMoreBlocks(MatroskaFile *mf) {
   int			cid, ret = 0;
   jmp_buf		jb;
   volatile unsigned	retries = 0;
+  ulonglong		top = mf->readStop && mf->readStop < mf->pSegmentTop ? mf->readStop : mf->pSegmentTop;
 
-  if (mf->readPosition >= mf->pSegmentTop)
+  if (mf->readPosition >= top)
     return EOF;
 
   memcpy(&jb,&mf->jb,sizeof(jb));
@@ -2412,12 +2414,12 @@ static int  readMoreBlocks(MatroskaFile *mf) {
       goto ex;
 
     for (;;) {
-      if (filepos(mf) >= mf->pSegmentTop)
+      if (filepos(mf) >= top)
 	goto ex;
 
       cp = mf->cache->scan(mf->cache,filepos(mf),0x1f43b675); // cluster
 
-      if (cp < 0 || (ulonglong)cp >= mf->pSegmentTop)
+      if (cp < 0 || (ulonglong)cp >= top)
 	goto ex;
 
       seek(mf,cp);
@@ -2446,7 +2448,7 @@ static int  readMoreBlocks(MatroskaFile *mf) {
 
   seek(mf,mf->readPosition);
 
-  while (filepos(mf) < mf->pSegmentTop) {
+  while (filepos(mf) < top) {
     cid = readID(mf);
     if (cid == EOF) {
       ret = EOF;
@@ -2956,6 +2958,26 @@ ulonglong     mkv_GetSegmentTop(MatroskaFile *mf) {
   return mf->pSegmentTop;
 }
 
+unsigned      mkv_GetNumCues(MatroskaFile *mf) {
+  if (mf->nCues == 0 && !(mf->flags & MKVF_AVOID_SEEKS)) {
+    if (setjmp(mf->jb)!=0)
+      return 0;
+    reindex(mf);
+  }
+  return mf->nCues;
+}
+
+ulonglong     mkv_GetCuePosition(MatroskaFile *mf,unsigned cue) {
+  return mf->Cues[cue].Position + mf->pSegment;
+}
+
+void	      mkv_SetReadRange(MatroskaFile *mf,ulonglong start,ulonglong end) {
+  EmptyQueues(mf);
+  mf->readPosition = start ? start : mf->pCluster;
+  mf->readStop = end;
+  mf->flags &= ~MPF_ERROR;
+}
+
 #define	IS_DELTA(f) (!((f)->flags & FRAME_KF) || ((f)->flags & FRAME_UNKNOWN_START))
 
 void  mkv_Seek(MatroskaFile *mf,ulonglong timecode,unsigned flags) {
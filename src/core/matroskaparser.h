@@ -317,6 +317,18 @@ X void	      mkv_GetTags(/* in */  MatroskaFile *mf,
 
 X ulonglong   mkv_GetSegmentTop(MatroskaFile *mf);
 
+/* Cue points, used to find cluster positions. If the file has no cues
+ * it is scanned for clusters instead.
+ */
+X unsigned    mkv_GetNumCues(MatroskaFile *mf);
+X ulonglong   mkv_GetCuePosition(MatroskaFile *mf,unsigned cue);
+
+/* Only read the clusters between two file positions, which should be
+ * cluster starts. start = 0 is the first cluster and end = 0 the end of
+ * the segment. This call discards all parsed and queued frames.
+ */
+X void	      mkv_SetReadRange(MatroskaFile *mf,ulonglong start,ulonglong end);
+
 /* Seek to specified timecode,
  * if timecode is past end of file,
  * all tracks are set to return EOF
@@ -23,198 +23,62 @@
 #include "utils.h"
 
 #include <algorithm>
-#include <cassert>
-
-#ifdef _WIN32
-#define WIN32_EXTRA_LEAN
-#include <windows.h>
-
-namespace {
-class HandleCloser {
-	HANDLE h;
-public:
-	HandleCloser(HANDLE h = INVALID_HANDLE_VALUE) : h(h) { }
-	~HandleCloser() { if (h != INVALID_HANDLE_VALUE) CloseHandle(h); }
-	operator HANDLE() const { return h; }
-	HandleCloser& operator=(HANDLE new_h) {
-		this->~HandleCloser();
-		h = new_h;
-		return *this;
-	}
-};
-
-std::string errmsg() {
-	LPWSTR lpstr = NULL;
-
-	if(FormatMessageW(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM, NULL, GetLastError(), 0, reinterpret_cast<LPWSTR>(&lpstr), 0, NULL) == NULL)
-		return "Unknown Error";
-
-	int len = WideCharToMultiByte(CP_UTF8, 0, lpstr, -1, NULL, 0, NULL, NULL);
-	if (len == 0) {
-		LocalFree(lpstr);
-		return "Unknown Error";
-	}
-
-	std::string ret(len, '\0');
-	WideCharToMultiByte(CP_UTF8, 0, lpstr, -1, &ret[0], len, NULL, NULL);
-	LocalFree(lpstr);
-	return ret;
-}
-}
-
-class FileMapping {
-	HandleCloser file_mapping;
-	longlong file_size;
-
-	ulonglong mapping_start;
-	ulonglong mapping_length;
-	const uint8_t *buffer;
-
-public:
-	FileMapping(const char *path)
-	: mapping_start(0)
-	, mapping_length(0)
-	, buffer(NULL)
-	{
-		HandleCloser file = CreateFileW(widen_path(path).c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, 0, 0);
-		if (file == INVALID_HANDLE_VALUE)
-			throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
-				std::string("Can't open '") + path + "': " + errmsg());
-
-		LARGE_INTEGER li;
-		if (!GetFileSizeEx(file, &li))
-			throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
-				std::string("Can't get size of file '") + path + "': " + errmsg());
-		file_size = li.QuadPart;
-
-		file_mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
-		if (file_mapping == INVALID_HANDLE_VALUE)
-			throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
-				std::string("Can't create mapping for '") + path + "': " + errmsg());
-	}
-
-	~FileMapping() {
-		if (buffer)
-			UnmapViewOfFile(buffer);
-	}
-
-	void Map(ulonglong start, size_t length) {
-		if (buffer)
-			UnmapViewOfFile(buffer);
-
-		LARGE_INTEGER li;
-		li.QuadPart = mapping_start;
-		buffer = (uint8_t *)MapViewOfFile(file_mapping, FILE_MAP_READ, li.HighPart, li.LowPart, static_cast<size_t>(length));
-		if (!buffer)
-			throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_ALLOCATION_FAILED,
-				"MapViewOfFile failed: " + errmsg());
-		mapping_length = length;
-	}
-
-	ulonglong Size() const { return file_size; }
-	const uint8_t *Read(ulonglong start, ulonglong length);
-};
-#else
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <unistd.h>
+#include <cstring>
 
 namespace {
-class FileDescriptor {
-	int fd;
-public:
-	FileDescriptor(const char *path)
-	: fd(open(path, O_RDONLY))
-	{
-		if (fd < 0)
-			throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
-			std::string("Can't open '") + path + "': " + strerror(errno));
-	}
-
-	~FileDescriptor() { close(fd); }
-	operator int() const { return fd; }
-};
-}
-
-class FileMapping {
-	FileDescriptor fd;
-	longlong file_size;
-
-	ulonglong mapping_start;
-	ulonglong mapping_length;
-	const uint8_t *buffer;
-
-public:
-	FileMapping(const char *path)
-	: fd(path)
-	, mapping_start(0)
-	, mapping_length(0)
-	, buffer(NULL)
-	{
-		struct stat st;
-		if (fstat(fd, &st) < 0)
-			throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
-				std::string("Can't get size of file '") + path + "': " + strerror(errno));
-		file_size = st.st_size;
-	}
+const unsigned ClusterID = 0x1f43b675;
+// Bytes read at a time when scanning for a signature
+const size_t ScanWindow = 1024 * 1024;
+// Enough for a cluster ID, its size and the ID and size of its first child
+const size_t MaxClusterHeader = 4 + 8 + 1 + 8;
 
-	~FileMapping() {
-		if (buffer && buffer != MAP_FAILED)
-			munmap(const_cast<uint8_t *>(buffer), mapping_length);
-	}
-
-	void Map(ulonglong start, size_t length) {
-		if (buffer && buffer != MAP_FAILED) {
-			munmap(const_cast<uint8_t *>(buffer), mapping_length);
-			buffer = NULL;
-		}
-
-		buffer = static_cast<uint8_t*>(mmap(NULL, static_cast<size_t>(length), PROT_READ, MAP_PRIVATE, fd, start));
-		if (buffer == MAP_FAILED)
-			throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_ALLOCATION_FAILED,
-				std::string("mmap failed: ") + strerror(errno));
-		mapping_length = length;
-	}
-
-	ulonglong Size() const { return file_size; }
-	const uint8_t *Read(ulonglong start, ulonglong length);
-};
-#endif
-
-const uint8_t *FileMapping::Read(ulonglong start, ulonglong length) {
-	assert(start + length <= static_cast<ulonglong>(file_size));
-
-	// Check if we can just use the current mapping
-	if (buffer && start >= mapping_start && start + length <= mapping_start + mapping_length)
-		return buffer + start - mapping_start;
-
-	if (sizeof(size_t) == 4) {
-		mapping_start = start & ~0xFFFFFULL; // Align to 1 MB boundary
-		length += static_cast<size_t>(start - mapping_start);
-		// Map 16 MB or length rounded up to the next MB
-		length = std::min<uint64_t>(std::max<uint64_t>(0x1000000U, (length + 0xFFFFF) & ~0xFFFFF), file_size - mapping_start);
-	}
-	else {
-		// Just map the whole file
-		mapping_start = 0;
-		length = file_size;
-	}
-
-	Map(mapping_start, static_cast<size_t>(length));
-	return buffer + start - mapping_start;
-}
-
-namespace {
 unsigned GetCacheSize(InputStream *) { return 16 * 1024 * 1024; }
 void *Malloc(InputStream *, size_t size) { return malloc(size); }
 void *Realloc(InputStream *, void *mem, size_t size) { return realloc(mem, size); }
 void Free(InputStream *, void *mem) { free(mem); }
 int Progress(InputStream *, ulonglong, ulonglong) { return 1; }
+
+// Number of bytes in an EBML variable length integer, or 0 if the first
+// byte can't start one
+size_t VintLength(uint8_t First) {
+	for (size_t i = 0; i < 8; ++i) {
+		if (First & (0x80 >> i))
+			return i + 1;
+	}
+	return 0;
+}
+
+// Checks that what follows a cluster ID looks like the rest of a cluster
+// header, since four bytes matching the ID turn up often enough in damaged
+// or unrelated data: a valid size followed by the cluster timecode, or by
+// the CRC-32 which has to come before it
+bool IsClusterHeader(const uint8_t *Data, size_t Length) {
+	if (!Length)
+		return false;
+	size_t SizeLength = VintLength(Data[0]);
+	if (!SizeLength || SizeLength + 2 > Length)
+		return false;
+	Data += SizeLength;
+	Length -= SizeLength;
+
+	if (Data[0] == 0xBF) // CRC-32
+		return Data[1] == 0x84;
+	if (Data[0] != 0xE7) // Timecode
+		return false;
+
+	// Timecode is an unsigned integer of at most eight bytes
+	size_t TimecodeSizeLength = VintLength(Data[1]);
+	if (!TimecodeSizeLength || TimecodeSizeLength + 1 > Length)
+		return false;
+	uint64_t TimecodeSize = Data[1] & (0xFF >> TimecodeSizeLength);
+	for (size_t i = 2; i <= TimecodeSizeLength; ++i)
+		TimecodeSize = (TimecodeSize << 8) | Data[i];
+	return TimecodeSize >= 1 && TimecodeSize <= 8;
+}
 }
 
 MatroskaReader::MatroskaReader(const char *path)
-: file(new FileMapping(path))
+: file(CreateFileReader(path))
 {
 	read = (int (*)(InputStream *, ulonglong, void *, int))ISRead;
 	scan = (longlong (*)(InputStream *, ulonglong, unsigned))Scan;
@@ -233,6 +97,15 @@ const void *MatroskaReader::Read(ulonglong pos, size_t count) {
 	return file->Read(pos, count);
 }
 
+void MatroskaReader::SetAccessPattern(FileReader::AccessPattern pattern) {
+	file->SetAccessPattern(pattern);
+}
+
+void MatroskaReader::Prefetch(ulonglong pos, ulonglong length) {
+	if (pos < file->Size())
+		file->Prefetch(pos, std::min<uint64_t>(length, file->Size() - pos));
+}
+
 int MatroskaReader::ISRead(MatroskaReader *self, ulonglong pos, void *buffer, int count) {
 	if (pos >= self->file->Size())
 		return 0;
@@ -253,12 +126,46 @@ int MatroskaReader::ISRead(MatroskaReader *self, ulonglong pos, void *buffer, in
 }
 
 longlong MatroskaReader::Scan(MatroskaReader *self, ulonglong start, unsigned signature) {
-	unsigned cmp = 0;
-	for (ulonglong i = start; i < self->file->Size(); ++i) {
-		int c = *self->file->Read(i, 1);
-		cmp = ((cmp << 8) | c) & 0xffffffff;
-		if (cmp == signature)
-			return static_cast<longlong>(i) - 3;
+	const uint8_t Signature[4] = {
+		static_cast<uint8_t>(signature >> 24),
+		static_cast<uint8_t>(signature >> 16),
+		static_cast<uint8_t>(signature >> 8),
+		static_cast<uint8_t>(signature)
+	};
+	bool Validate = signature == ClusterID;
+	uint64_t Size = self->file->Size();
+
+	try {
+		uint64_t Pos = start;
+		while (Pos + 4 <= Size) {
+			size_t Length = static_cast<size_t>(std::min<uint64_t>(ScanWindow, Size - Pos));
+			bool AtEnd = Pos + Length == Size;
+			const uint8_t *Data = self->file->Read(Pos, Length);
+
+			// Matches near the end of the window are left for the next one
+			// unless the file ends there, so that the header after them can
+			// be checked without another read
+			size_t Limit = AtEnd ? Length - 3 : Length - MaxClusterHeader;
+
+			const uint8_t *Cur = Data;
+			const uint8_t *End = Data + Limit;
+			while (Cur < End) {
+				Cur = static_cast<const uint8_t *>(memchr(Cur, Signature[0], End - Cur));
+				if (!Cur)
+					break;
+				if (!memcmp(Cur + 1, Signature + 1, 3) &&
+					(!Validate || IsClusterHeader(Cur + 4, Data + Length - Cur - 4)))
+					return static_cast<longlong>(Pos + (Cur - Data));
+				++Cur;
+			}
+
+			if (AtEnd)
+				break;
+			Pos += Limit;
+		}
+	}
+	catch (FFMS_Exception const& e) {
+		self->error = e.GetErrorMessage();
 	}
 
 	return -1;
@@ -311,14 +218,14 @@ void MatroskaReaderContext::Append(const void *Data, size_t Length) {
 	FrameSize += Length;
 }
 
-void MatroskaReaderContext::ReadFrame(uint64_t FilePos, size_t InputFrameSize, TrackCompressionContext *TCC) {
+void MatroskaReaderContext::ReadFrame(uint64_t FilePos, size_t InputFrameSize, TrackCompressionContext *TCC, size_t MaxLength) {
 	FrameSize = 0;
 	if (TCC && TCC->CompressionMethod == COMP_ZLIB) {
 		CompressedStream *CS = TCC->CS;
 		cs_NextFrame(CS, FilePos, FrameSize);
 
 		char CSBuffer[4096];
-		for (;;) {
+		while (FrameSize < MaxLength) {
 			int ReadBytes = cs_ReadData(CS, CSBuffer, sizeof(CSBuffer));
 			if (ReadBytes == 0) break;
 			if (ReadBytes < 0)
@@ -336,7 +243,10 @@ void MatroskaReaderContext::ReadFrame(uint64_t FilePos, size_t InputFrameSize, T
 			throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
 				"Truncated input file");
 
-		Append(Reader.Read(FilePos, InputFrameSize), InputFrameSize);
+		if (FrameSize < MaxLength) {
+			size_t Length = std::min(InputFrameSize, MaxLength - FrameSize);
+			Append(Reader.Read(FilePos, Length), Length);
+		}
 	}
 
 	if (FrameSize)
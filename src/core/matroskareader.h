@@ -21,17 +21,18 @@
 #ifndef MATROSKAREADER_H
 #define MATROSKAREADER_H
 
+#include "filereader.h"
 #include "matroskaparser.h"
 
+#include <limits>
 #include <memory>
 #include <stdint.h>
 #include <string>
 
-class FileMapping;
 struct TrackCompressionContext;
 
 class MatroskaReader : public InputStream {
-	std::auto_ptr<FileMapping> file;
+	std::auto_ptr<FileReader> file;
 	std::string error;
 
 	static int ISRead(MatroskaReader *st, ulonglong pos, void *buffer, int count);
@@ -48,6 +49,8 @@ public:
 
 	ulonglong Size() const;
 	const void *Read(ulonglong pos, size_t length);
+	void SetAccessPattern(FileReader::AccessPattern pattern);
+	void Prefetch(ulonglong pos, ulonglong length);
 };
 
 class MatroskaReaderContext {
@@ -63,6 +66,8 @@ public:
 	MatroskaReaderContext(const char *filename);
 	~MatroskaReaderContext();
 
-	void ReadFrame(uint64_t FilePos, size_t InputFrameSize, TrackCompressionContext *TCC);
+	// Read (and decompress) a frame into Buffer, stopping once at least
+	// MaxLength bytes have been read
+	void ReadFrame(uint64_t FilePos, size_t InputFrameSize, TrackCompressionContext *TCC, size_t MaxLength = std::numeric_limits<size_t>::max());
 };
 #endif
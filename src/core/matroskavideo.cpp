@@ -22,8 +22,12 @@
 
 #include "codectype.h"
 #include "matroskareader.h"
+#include "trace.h"
 
 namespace {
+// Number of packets ahead of the decoder to ask the reader to load
+const size_t PrefetchDistance = 64;
+
 class FFMatroskaVideo : public FFMS_VideoSource {
 	MatroskaFile *MF;
 	MatroskaReaderContext MC;
@@ -31,7 +35,9 @@ class FFMatroskaVideo : public FFMS_VideoSource {
 	char ErrorMessage[256];
 	FFSourceResources<FFMS_VideoSource> Res;
 	size_t PacketNumber;
+	size_t PrefetchedPackets;
 
+	void PrefetchPackets(size_t Start, size_t End);
 	void DecodeNextFrame();
 	void Free(bool CloseCodec);
 
@@ -55,6 +61,7 @@ FFMatroskaVideo::FFMatroskaVideo(const char *SourceFile, int Track,
 , MC(SourceFile)
 , Res(this)
 , PacketNumber(0)
+, PrefetchedPackets(0)
 {
 	AVCodec *Codec = NULL;
 	TrackInfo *TI = NULL;
@@ -64,6 +71,11 @@ FFMatroskaVideo::FFMatroskaVideo(const char *SourceFile, int Track,
 		throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
 			std::string("Can't parse Matroska file: ") + ErrorMessage);
 
+	// Decoding jumps between keyframes, so the pread backend reading far
+	// past what's actually needed is mostly wasted; PrefetchPackets says
+	// what will be. Memory mappings ignore this and keep normal readahead
+	MC.Reader.SetAccessPattern(FileReader::ACCESS_RANDOM);
+
 	TI = mkv_GetTrackInfo(MF, VideoTrack);
 
 	if (TI->CompEnabled)
@@ -118,18 +130,43 @@ FFMatroskaVideo::FFMatroskaVideo(const char *SourceFile, int Track,
 	VP.CropBottom = TI->AV.Video.CropB;
 }
 
+void FFMatroskaVideo::PrefetchPackets(size_t Start, size_t End) {
+	End = std::min(End, Frames.size());
+	if (Start >= End)
+		return;
+
+	uint64_t First = std::numeric_limits<uint64_t>::max();
+	uint64_t Last = 0;
+	for (size_t i = Start; i < End; ++i) {
+		FrameInfo FI = Frames[Frames[i].OriginalPos];
+		First = std::min<uint64_t>(First, FI.FilePos);
+		Last = std::max<uint64_t>(Last, FI.FilePos + FI.FrameSize);
+	}
+	PrefetchedPackets = End;
+	MC.Reader.Prefetch(First, Last - First);
+}
+
 void FFMatroskaVideo::DecodeNextFrame() {
+	TraceSpan Span("video", "DecodeNextFrame");
 	if (HasPendingDelayedFrames()) return;
 
 	AVPacket Packet;
 	InitNullPacket(Packet);
 
 	while (PacketNumber < Frames.size()) {
+		if (PacketNumber >= PrefetchedPackets)
+			PrefetchPackets(PacketNumber, PacketNumber + PrefetchDistance);
+
 		// The additional indirection is because the packets are stored in
 		// presentation order and not decoding order, this is unnoticeable
 		// in the other sources where less is done manually
 		const FrameInfo &FI = Frames[Frames[PacketNumber].OriginalPos];
-		MC.ReadFrame(FI.FilePos, FI.FrameSize, TCC.get());
+		{
+			StatsTimer Timer(Stats.DemuxTime);
+			MC.ReadFrame(FI.FilePos, FI.FrameSize, TCC.get());
+		}
+		++Stats.PacketsRead;
+		Stats.BytesRead += MC.FrameSize;
 
 		Packet.data = MC.Buffer;
 		Packet.size = MC.FrameSize;
@@ -148,8 +185,11 @@ FFMS_Frame *FFMatroskaVideo::GetFrame(int n) {
 	GetFrameCheck(n);
 	n = Frames.RealFrameNumber(n);
 
-	if (LastFrameNum == n)
+	if (LastFrameNum == n) {
+		++Stats.CacheHits;
 		return &LocalFrame;
+	}
+	++Stats.CacheMisses;
 
 	bool HasSeeked = false;
 	int ClosestKF = Frames.FindClosestVideoKeyFrame(n);
@@ -158,8 +198,10 @@ FFMS_Frame *FFMatroskaVideo::GetFrame(int n) {
 		InitialDecode = 1;
 		PacketNumber = ClosestKF;
 		CurrentFrame = ClosestKF;
-		FlushBuffers(CodecContext);
+		FlushDecoder();
 		HasSeeked = true;
+		++Stats.Seeks;
+		PrefetchPackets(ClosestKF, n + 1);
 	}
 
 	do {
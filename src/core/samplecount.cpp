@@ -0,0 +1,216 @@
+//  Copyright (c) 2015 The FFmpegSource Project
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#include "samplecount.h"
+
+extern "C" {
+#include <libavutil/intreadwrite.h>
+}
+
+namespace {
+// Returns the size in bytes of the (E-)AC-3 frame at Data and sets Samples
+// to the number of samples it contributes
+int ParseAC3Frame(const uint8_t *Data, int Size, uint32_t *Samples) {
+	static const int Bitrates[19] = {
+		32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512, 576, 640
+	};
+
+	if (Size < 6 || AV_RB16(Data) != 0x0B77)
+		return 0;
+
+	int BSID = Data[5] >> 3;
+	if (BSID <= 10) {
+		int FSCod = Data[4] >> 6;
+		int FrmSizeCod = Data[4] & 0x3F;
+		if (FSCod == 3 || FrmSizeCod >= 38)
+			return 0;
+
+		int Bitrate = Bitrates[FrmSizeCod >> 1];
+		int Words;
+		if (FSCod == 0)
+			Words = Bitrate * 2;
+		else if (FSCod == 1)
+			Words = Bitrate * 320 / 147 + (FrmSizeCod & 1);
+		else
+			Words = Bitrate * 3;
+
+		*Samples = 1536;
+		return Words * 2;
+	}
+
+	if (BSID > 16)
+		return 0;
+
+	// E-AC-3: only the first independent substream adds samples, the others
+	// are extra channels for the same samples
+	static const int Blocks[4] = { 1, 2, 3, 6 };
+	int StreamType = Data[2] >> 6;
+	int SubstreamID = (Data[2] >> 3) & 7;
+	int FrameSize = ((((Data[2] & 7) << 8) | Data[3]) + 1) * 2;
+	int NumBlocks = (Data[4] >> 6) == 3 ? 6 : Blocks[(Data[4] >> 4) & 3];
+	if (StreamType == 3)
+		return 0;
+
+	*Samples = (StreamType != 1 && SubstreamID == 0) ? 256 * NumBlocks : 0;
+	return FrameSize;
+}
+
+int ParseMPEGAudioFrame(const uint8_t *Data, int Size, uint32_t *Samples) {
+	static const int Bitrates[2][3][15] = {
+		{ // MPEG-1 layers I, II, III
+			{ 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+			{ 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 },
+			{ 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 }
+		},
+		{ // MPEG-2 and 2.5 layers I, II, III
+			{ 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 },
+			{ 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+			{ 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 }
+		}
+	};
+	static const int SampleRates[3] = { 44100, 48000, 32000 };
+
+	if (Size < 4 || Data[0] != 0xFF || (Data[1] & 0xE0) != 0xE0)
+		return 0;
+
+	int Version = (Data[1] >> 3) & 3; // 0: 2.5, 2: 2, 3: 1
+	int Layer = 4 - ((Data[1] >> 1) & 3);
+	int BitrateIndex = Data[2] >> 4;
+	int SampleRateIndex = (Data[2] >> 2) & 3;
+	int Padding = (Data[2] >> 1) & 1;
+
+	// Free format frames would need the next header to find their size
+	if (Version == 1 || Layer == 4 || BitrateIndex == 0 || BitrateIndex == 15 || SampleRateIndex == 3)
+		return 0;
+
+	bool MPEG1 = Version == 3;
+	int Bitrate = Bitrates[MPEG1 ? 0 : 1][Layer - 1][BitrateIndex] * 1000;
+	int SampleRate = SampleRates[SampleRateIndex] >> (MPEG1 ? 0 : Version == 2 ? 1 : 2);
+
+	if (Layer == 1) {
+		*Samples = 384;
+		return (12 * Bitrate / SampleRate + Padding) * 4;
+	}
+	if (Layer == 2 || MPEG1) {
+		*Samples = 1152;
+		return 144 * Bitrate / SampleRate + Padding;
+	}
+	*Samples = 576;
+	return 72 * Bitrate / SampleRate + Padding;
+}
+
+int ParseDTSFrame(const uint8_t *Data, int Size, uint32_t *Samples) {
+	// Only the 16 bit big endian core format; the 14 bit and little endian
+	// variants are rare enough to just decode
+	if (Size < 10 || AV_RB32(Data) != 0x7FFE8001)
+		return 0;
+
+	int NumBlocks = ((Data[4] & 1) << 6) | (Data[5] >> 2);
+	int FrameSize = (((Data[5] & 3) << 12) | (Data[6] << 4) | (Data[7] >> 4)) + 1;
+	if (FrameSize < 96)
+		return 0;
+
+	*Samples = (NumBlocks + 1) * 32;
+	return FrameSize;
+}
+
+int ParseADTSFrame(const uint8_t *Data, int Size, uint32_t *Samples) {
+	if (Size < 7 || Data[0] != 0xFF || (Data[1] & 0xF6) != 0xF0)
+		return 0;
+
+	*Samples = 1024 * ((Data[6] & 3) + 1);
+	return ((Data[3] & 3) << 11) | (Data[4] << 3) | (Data[5] >> 5);
+}
+
+// Raw AAC packets have no header, so go by the decoder configuration and
+// only accept plain AAC with 1024 sample frames. Implicitly signalled SBR
+// doubles the output and can't be seen here, which is what the validation
+// against the decoder in the indexer catches.
+uint32_t RawAACFrameSamples(AVCodecContext *CodecContext) {
+	if (CodecContext->extradata_size < 2)
+		return 0;
+
+	const uint8_t *Config = CodecContext->extradata;
+	int ObjectType = Config[0] >> 3;
+	int FrequencyIndex = ((Config[0] & 7) << 1) | (Config[1] >> 7);
+	if ((ObjectType != 1 && ObjectType != 2 && ObjectType != 4) || FrequencyIndex == 15)
+		return 0;
+
+	bool FrameLength960 = !!(Config[1] & 4);
+	return FrameLength960 ? 0 : 1024;
+}
+
+typedef int (*FrameParser)(const uint8_t *Data, int Size, uint32_t *Samples);
+
+FrameParser GetParser(FFMS_CodecID Codec) {
+	switch (Codec) {
+		case FFMS_ID(AC3):
+		case FFMS_ID(EAC3):
+			return ParseAC3Frame;
+		case FFMS_ID(MP1):
+		case FFMS_ID(MP2):
+		case FFMS_ID(MP3):
+			return ParseMPEGAudioFrame;
+		case FFMS_ID(DTS):
+			return ParseDTSFrame;
+		case FFMS_ID(AAC):
+			return ParseADTSFrame;
+		default:
+			return NULL;
+	}
+}
+}
+
+bool HasHeaderSampleCounts(AVCodecContext *CodecContext) {
+	return GetParser(CodecContext->codec_id) != NULL;
+}
+
+uint32_t CountPacketSamples(AVCodecContext *CodecContext, const uint8_t *Data, int Size) {
+	FrameParser Parser = GetParser(CodecContext->codec_id);
+	if (!Parser || Size <= 0)
+		return 0;
+
+	if (CodecContext->codec_id == FFMS_ID(AAC) && !(Size >= 2 && Data[0] == 0xFF && (Data[1] & 0xF6) == 0xF0))
+		return RawAACFrameSamples(CodecContext);
+
+	// Packets may hold several frames, which must exactly fill it
+	uint32_t Total = 0;
+	while (Size > 0) {
+		uint32_t Samples = 0;
+		int FrameSize = Parser(Data, Size, &Samples);
+		if (FrameSize <= 0)
+			return 0;
+
+		// DTS-HD extension substreams follow the core frame and add no
+		// samples to it
+		if (CodecContext->codec_id == FFMS_ID(DTS) && FrameSize < Size &&
+			Size - FrameSize >= 4 && AV_RB32(Data + FrameSize) == 0x64582025)
+			return Total + Samples;
+
+		if (FrameSize > Size)
+			return 0;
+
+		Total += Samples;
+		Data += FrameSize;
+		Size -= FrameSize;
+	}
+	return Total;
+}
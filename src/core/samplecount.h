@@ -0,0 +1,37 @@
+//  Copyright (c) 2015 The FFmpegSource Project
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#ifndef SAMPLECOUNT_H
+#define SAMPLECOUNT_H
+
+#include "utils.h"
+
+// Codecs where every frame decodes to a number of samples given by its
+// header can be indexed without running the decoder
+
+// Whether packets of the given codec may be counted with CountPacketSamples
+bool HasHeaderSampleCounts(AVCodecContext *CodecContext);
+
+// Returns the number of samples the packet decodes to, or 0 if it doesn't
+// consist of whole frames with valid headers
+uint32_t CountPacketSamples(AVCodecContext *CodecContext, const uint8_t *Data, int Size);
+
+#endif
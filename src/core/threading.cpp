@@ -0,0 +1,204 @@
+//  Copyright (c) 2015 The FFmpegSource Project
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#include "threading.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <process.h>
+#endif
+
+#ifdef _WIN32
+Mutex::Mutex()
+: Handle(new CRITICAL_SECTION)
+{
+	InitializeCriticalSection(static_cast<CRITICAL_SECTION *>(Handle));
+}
+
+Mutex::~Mutex() {
+	DeleteCriticalSection(static_cast<CRITICAL_SECTION *>(Handle));
+	delete static_cast<CRITICAL_SECTION *>(Handle);
+}
+
+void Mutex::Lock() {
+	EnterCriticalSection(static_cast<CRITICAL_SECTION *>(Handle));
+}
+
+void Mutex::Unlock() {
+	LeaveCriticalSection(static_cast<CRITICAL_SECTION *>(Handle));
+}
+
+Condition::Condition()
+: Handle(new CONDITION_VARIABLE)
+{
+	InitializeConditionVariable(static_cast<CONDITION_VARIABLE *>(Handle));
+}
+
+Condition::~Condition() {
+	delete static_cast<CONDITION_VARIABLE *>(Handle);
+}
+
+void Condition::Wait(Mutex &M) {
+	SleepConditionVariableCS(static_cast<CONDITION_VARIABLE *>(Handle),
+		static_cast<CRITICAL_SECTION *>(M.Handle), INFINITE);
+}
+
+void Condition::Broadcast() {
+	WakeAllConditionVariable(static_cast<CONDITION_VARIABLE *>(Handle));
+}
+#else
+Mutex::Mutex() {
+	pthread_mutex_init(&Handle, NULL);
+}
+
+Mutex::~Mutex() {
+	pthread_mutex_destroy(&Handle);
+}
+
+void Mutex::Lock() {
+	pthread_mutex_lock(&Handle);
+}
+
+void Mutex::Unlock() {
+	pthread_mutex_unlock(&Handle);
+}
+
+Condition::Condition() {
+	pthread_cond_init(&Handle, NULL);
+}
+
+Condition::~Condition() {
+	pthread_cond_destroy(&Handle);
+}
+
+void Condition::Wait(Mutex &M) {
+	pthread_cond_wait(&Handle, &M.Handle);
+}
+
+void Condition::Broadcast() {
+	pthread_cond_broadcast(&Handle);
+}
+#endif
+
+long AtomicCounter::Increment() {
+#ifdef _WIN32
+	return InterlockedIncrement(&Value);
+#else
+	return __sync_add_and_fetch(&Value, 1);
+#endif
+}
+
+long AtomicCounter::Decrement() {
+#ifdef _WIN32
+	return InterlockedDecrement(&Value);
+#else
+	return __sync_sub_and_fetch(&Value, 1);
+#endif
+}
+
+long AtomicCounter::Load() const {
+#ifdef _WIN32
+	return InterlockedCompareExchange(const_cast<volatile long *>(&Value), 0, 0);
+#else
+	return __sync_add_and_fetch(const_cast<volatile long *>(&Value), 0);
+#endif
+}
+
+Thread::Thread(ThreadFunc Func, void *Arg)
+: Func(Func)
+, Arg(Arg)
+, Joined(false)
+{
+#ifdef _WIN32
+	Handle = reinterpret_cast<void *>(_beginthreadex(NULL, 0, Entry, this, 0, NULL));
+	if (!Handle)
+#else
+	if (pthread_create(&Handle, NULL, Entry, this))
+#endif
+		throw FFMS_Exception(FFMS_ERROR_DECODING, FFMS_ERROR_ALLOCATION_FAILED,
+			"Could not create thread");
+}
+
+Thread::~Thread() {
+	Join();
+}
+
+void Thread::Join() {
+	if (Joined) return;
+	Joined = true;
+#ifdef _WIN32
+	WaitForSingleObject(Handle, INFINITE);
+	CloseHandle(Handle);
+#else
+	pthread_join(Handle, NULL);
+#endif
+}
+
+#ifdef _WIN32
+unsigned __stdcall Thread::Entry(void *Self) {
+	Thread *T = static_cast<Thread *>(Self);
+	T->Func(T->Arg);
+	return 0;
+}
+#else
+void *Thread::Entry(void *Self) {
+	Thread *T = static_cast<Thread *>(Self);
+	T->Func(T->Arg);
+	return NULL;
+}
+#endif
+
+ThreadGroup::~ThreadGroup() {
+	for (size_t i = 0; i < Threads.size(); ++i)
+		delete Threads[i];
+}
+
+void ThreadGroup::Start(Thread::ThreadFunc Func, void *Arg) {
+	Threads.reserve(Threads.size() + 1);
+	Threads.push_back(new Thread(Func, Arg));
+}
+
+void ThreadGroup::JoinAll() {
+	for (size_t i = 0; i < Threads.size(); ++i)
+		Threads[i]->Join();
+}
+
+void ThreadError::Catch() {
+	Failed = true;
+	try {
+		throw;
+	} catch (FFMS_Exception &e) {
+		int Code = e.CopyOut(NULL);
+		ErrorType = Code >> 16;
+		SubType = Code & 0xFFFF;
+		Message = e.GetErrorMessage();
+	} catch (...) {
+		ErrorType = FFMS_ERROR_DECODING;
+		SubType = FFMS_ERROR_UNKNOWN;
+		Message = "Unexpected error on a worker thread";
+	}
+}
+
+void ThreadError::Rethrow() const {
+	if (Failed)
+		throw FFMS_Exception(ErrorType, SubType, Message);
+}
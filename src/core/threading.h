@@ -0,0 +1,144 @@
+//  Copyright (c) 2015 The FFmpegSource Project
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#ifndef THREADING_H
+#define THREADING_H
+
+#include "utils.h"
+
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+class Mutex : private noncopyable {
+	friend class Condition;
+#ifdef _WIN32
+	// CRITICAL_SECTION, allocated to avoid including windows.h here
+	void *Handle;
+#else
+	pthread_mutex_t Handle;
+#endif
+
+public:
+	Mutex();
+	~Mutex();
+
+	void Lock();
+	void Unlock();
+};
+
+class ScopedLock : private noncopyable {
+	Mutex &M;
+public:
+	ScopedLock(Mutex &M) : M(M) { M.Lock(); }
+	~ScopedLock() { M.Unlock(); }
+};
+
+class Condition : private noncopyable {
+#ifdef _WIN32
+	// CONDITION_VARIABLE
+	void *Handle;
+#else
+	pthread_cond_t Handle;
+#endif
+
+public:
+	Condition();
+	~Condition();
+
+	// M must be locked by the calling thread
+	void Wait(Mutex &M);
+	void Broadcast();
+};
+
+// A reference count which can be changed from several threads at once
+class AtomicCounter : private noncopyable {
+	volatile long Value;
+public:
+	explicit AtomicCounter(long Value) : Value(Value) { }
+
+	// Both return the new value
+	long Increment();
+	long Decrement();
+	// Only meaningful if nothing else can be changing the value
+	long Get() const { return Value; }
+	// Can be called while other threads change the value, and everything
+	// written by a thread before its last change seen is visible after it
+	long Load() const;
+};
+
+// A thread which starts running Func(Arg) when constructed and is joined
+// when destroyed if it hasn't been already. Func must not throw.
+class Thread : private noncopyable {
+public:
+	typedef void (*ThreadFunc)(void *Arg);
+
+private:
+	ThreadFunc Func;
+	void *Arg;
+	bool Joined;
+#ifdef _WIN32
+	void *Handle;
+	static unsigned __stdcall Entry(void *Self);
+#else
+	pthread_t Handle;
+	static void *Entry(void *Self);
+#endif
+
+public:
+	Thread(ThreadFunc Func, void *Arg);
+	~Thread();
+
+	void Join();
+};
+
+// A set of threads which are all joined when it goes out of scope, so that
+// an exception on the starting thread can't leave any of them running
+class ThreadGroup : private noncopyable {
+	std::vector<Thread *> Threads;
+public:
+	~ThreadGroup();
+
+	void Start(Thread::ThreadFunc Func, void *Arg);
+	void JoinAll();
+};
+
+// An exception caught on a worker thread, kept so that it can be rethrown
+// on the thread waiting for the worker
+class ThreadError {
+	bool Failed;
+	int ErrorType;
+	int SubType;
+	std::string Message;
+
+public:
+	ThreadError() : Failed(false), ErrorType(0), SubType(0) { }
+
+	// Must be called from within a catch block
+	void Catch();
+	bool IsSet() const { return Failed; }
+	void Rethrow() const;
+};
+
+#endif
@@ -0,0 +1,240 @@
+//  Copyright (c) 2015 The FFmpegSource Project
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#include "trace.h"
+
+#include "filehandle.h"
+#include "threading.h"
+
+#include <cstdio>
+#include <memory>
+#include <new>
+#include <string>
+
+#ifdef _WIN32
+#	define WIN32_LEAN_AND_MEAN
+#	include <windows.h>
+#	define FFMS_THREAD_LOCAL __declspec(thread)
+#else
+#	include <pthread.h>
+#	include <unistd.h>
+#	ifdef __linux__
+#		include <sys/syscall.h>
+#	endif
+#	define FFMS_THREAD_LOCAL __thread
+#endif
+
+volatile bool TraceActive = false;
+
+namespace {
+struct TraceEvent {
+	const char *Category;
+	const char *Name;
+	int64_t Start;
+	int64_t Duration;
+	int64_t Arg;
+};
+
+const long ChunkEvents = 1024;
+
+struct TraceChunk {
+	TraceEvent Events[ChunkEvents];
+	// Number of events which have been written. Only the owning thread
+	// changes it, and the increment publishes the event to StopTrace.
+	AtomicCounter Count;
+	// Set before the last event of the chunk is published
+	TraceChunk *Next;
+
+	TraceChunk() : Count(0), Next(NULL) { }
+};
+
+// The events recorded by one thread during one trace. Only the thread
+// itself appends to it, so recording an event doesn't need any locks.
+struct ThreadTrace {
+	unsigned long ThreadId;
+	TraceChunk *First;
+	TraceChunk *Last;
+	ThreadTrace *Next;
+
+	ThreadTrace(unsigned long ThreadId, TraceChunk *Chunk)
+	: ThreadId(ThreadId)
+	, First(Chunk)
+	, Last(Chunk)
+	, Next(NULL)
+	{
+	}
+
+	~ThreadTrace() {
+		while (First) {
+			TraceChunk *Chunk = First;
+			First = Chunk->Next;
+			delete Chunk;
+		}
+	}
+};
+
+// Guards everything below; never taken while recording an event except for
+// a thread's first event of a trace
+Mutex TraceLock;
+std::auto_ptr<FileHandle> TraceFile;
+int64_t TraceEpoch = 0;
+volatile long TraceNumber = 0;
+ThreadTrace *Threads = NULL;
+// The threads of the previous trace, which are freed when the next one
+// starts so that a thread which was in the middle of recording an event
+// when it was stopped never writes to freed memory
+ThreadTrace *FinishedThreads = NULL;
+
+FFMS_THREAD_LOCAL ThreadTrace *CurrentThread = NULL;
+FFMS_THREAD_LOCAL long CurrentTraceNumber = 0;
+
+unsigned long ThisThreadId() {
+#ifdef _WIN32
+	return GetCurrentThreadId();
+#elif defined(__linux__)
+	return static_cast<unsigned long>(syscall(SYS_gettid));
+#else
+	return reinterpret_cast<unsigned long>(pthread_self());
+#endif
+}
+
+unsigned long ThisProcessId() {
+#ifdef _WIN32
+	return GetCurrentProcessId();
+#else
+	return static_cast<unsigned long>(getpid());
+#endif
+}
+
+void FreeThreads(ThreadTrace *&List) {
+	while (List) {
+		ThreadTrace *T = List;
+		List = T->Next;
+		delete T;
+	}
+}
+
+ThreadTrace *RegisterThread() {
+	ScopedLock Lock(TraceLock);
+	if (!TraceActive)
+		return NULL;
+
+	TraceChunk *Chunk = new (std::nothrow) TraceChunk;
+	if (!Chunk)
+		return NULL;
+	ThreadTrace *T = new (std::nothrow) ThreadTrace(ThisThreadId(), Chunk);
+	if (!T) {
+		delete Chunk;
+		return NULL;
+	}
+
+	T->Next = Threads;
+	Threads = T;
+	CurrentThread = T;
+	CurrentTraceNumber = TraceNumber;
+	return T;
+}
+}
+
+void StartTrace(const char *File) {
+	ScopedLock Lock(TraceLock);
+	if (TraceActive)
+		throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_INVALID_ARGUMENT,
+			"A trace is already being recorded");
+
+	TraceFile.reset(new FileHandle(File, "wb", FFMS_ERROR_PARSER, FFMS_ERROR_FILE_WRITE));
+	FreeThreads(FinishedThreads);
+	TraceEpoch = GetMicroseconds();
+	++TraceNumber;
+	TraceActive = true;
+}
+
+void StopTrace() {
+	ScopedLock Lock(TraceLock);
+	if (!TraceActive)
+		return;
+	TraceActive = false;
+
+	std::auto_ptr<FileHandle> File(TraceFile);
+	FinishedThreads = Threads;
+	Threads = NULL;
+
+	// Events are formatted into a buffer which is written in large blocks,
+	// as FileHandle flushes after every write
+	std::string Buffer("{\"traceEvents\":[");
+	unsigned long ProcessId = ThisProcessId();
+	bool FirstEvent = true;
+	for (ThreadTrace *T = FinishedThreads; T; T = T->Next) {
+		for (TraceChunk *Chunk = T->First; Chunk; Chunk = Chunk->Next) {
+			long Count = Chunk->Count.Load();
+			for (long i = 0; i < Count; ++i) {
+				const TraceEvent &E = Chunk->Events[i];
+				char Event[512];
+				int Length = snprintf(Event, sizeof(Event), "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%lu,\"tid\":%lu,\"ts\":%lld,\"dur\":%lld",
+					FirstEvent ? "" : ",", E.Name, E.Category, ProcessId, T->ThreadId,
+					static_cast<long long>(E.Start - TraceEpoch), static_cast<long long>(E.Duration));
+				if (E.Arg >= 0)
+					Length += snprintf(Event + Length, sizeof(Event) - Length, ",\"args\":{\"n\":%lld}", static_cast<long long>(E.Arg));
+				Buffer.append(Event, Length);
+				Buffer += '}';
+				FirstEvent = false;
+
+				if (Buffer.size() >= 1 << 16) {
+					File->Write(Buffer.data(), Buffer.size());
+					Buffer.clear();
+				}
+			}
+			// Next is only safe to read once the chunk is known to be full
+			if (Count < ChunkEvents)
+				break;
+		}
+	}
+	Buffer += "\n],\"displayTimeUnit\":\"ms\"}\n";
+	File->Write(Buffer.data(), Buffer.size());
+}
+
+void AddTraceEvent(const char *Category, const char *Name, int64_t Start, int64_t Duration, int64_t Arg) {
+	ThreadTrace *T = CurrentThread;
+	if (!T || CurrentTraceNumber != TraceNumber) {
+		T = RegisterThread();
+		if (!T)
+			return;
+	}
+
+	TraceChunk *Chunk = T->Last;
+	long Count = Chunk->Count.Get();
+	TraceEvent &E = Chunk->Events[Count];
+	E.Category = Category;
+	E.Name = Name;
+	E.Start = Start;
+	E.Duration = Duration;
+	E.Arg = Arg;
+
+	if (Count + 1 == ChunkEvents) {
+		// If there's no memory for another chunk the event is dropped and
+		// its slot reused
+		Chunk->Next = new (std::nothrow) TraceChunk;
+		if (!Chunk->Next)
+			return;
+		T->Last = Chunk->Next;
+	}
+	Chunk->Count.Increment();
+}
@@ -0,0 +1,63 @@
+//  Copyright (c) 2015 The FFmpegSource Project
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "utils.h"
+
+// Set while a trace is being recorded. Spans check it before reading the
+// clock, so they cost almost nothing when tracing is off.
+extern volatile bool TraceActive;
+
+// Starts recording a trace which is written to TraceFile in Chrome's
+// trace event format when it's stopped
+void StartTrace(const char *TraceFile);
+// Writes and closes the current trace, if any
+void StopTrace();
+
+// Records a complete event on the calling thread. Arg is shown as the
+// event's argument if it isn't negative.
+void AddTraceEvent(const char *Category, const char *Name, int64_t Start, int64_t Duration, int64_t Arg);
+
+// Records the time between construction and destruction. Category and Name
+// must be string literals, as only the pointers are stored.
+class TraceSpan : private noncopyable {
+	const char *Category;
+	const char *Name;
+	int64_t Arg;
+	int64_t Start;
+public:
+	TraceSpan(const char *Category, const char *Name, int64_t Arg = -1)
+	: Category(Category)
+	, Name(Name)
+	, Arg(Arg)
+	, Start(TraceActive ? GetMicroseconds() : -1)
+	{
+	}
+
+	~TraceSpan() {
+		if (Start >= 0 && TraceActive)
+			AddTraceEvent(Category, Name, Start, GetMicroseconds() - Start, Arg);
+	}
+};
+
+#endif
@@ -22,9 +22,11 @@
 
 #include "track.h"
 
+#include "utils.h"
 #include "zipfile.h"
 
 #include <algorithm>
+#include <cstring>
 
 #include <libavutil/avutil.h>
 #include <libavutil/common.h>
@@ -63,10 +65,113 @@ static void WriteFrame(ZipFile &stream, FrameInfo const& f, FrameInfo const& pre
 		stream.Write<uint8_t>(f.Hidden);
 	}
 }
+
+const size_t CompactBlockSize = 64;
+// How many decoded blocks each copy of a compact track keeps
+const size_t MaxDecodedBlocks = 4;
+
+enum CompactFlags {
+	COMPACT_KEYFRAME = 1,
+	COMPACT_HIDDEN = 2
+};
+
+void PutVarint(std::vector<uint8_t> &Out, uint64_t Value) {
+	while (Value >= 0x80) {
+		Out.push_back(static_cast<uint8_t>(Value | 0x80));
+		Value >>= 7;
+	}
+	Out.push_back(static_cast<uint8_t>(Value));
+}
+
+// Zigzag coding so that small negative differences stay short; the
+// arithmetic is done unsigned so that AV_NOPTS_VALUE can't overflow
+void PutSigned(std::vector<uint8_t> &Out, uint64_t Value) {
+	PutVarint(Out, (Value << 1) ^ (0 - (Value >> 63)));
+}
+
+uint64_t GetVarint(const uint8_t *&Data) {
+	uint64_t Value = 0;
+	for (int Shift = 0; ; Shift += 7) {
+		uint8_t Byte = *Data++;
+		Value |= static_cast<uint64_t>(Byte & 0x7F) << Shift;
+		if (!(Byte & 0x80))
+			return Value;
+	}
+}
+
+uint64_t GetSigned(const uint8_t *&Data) {
+	uint64_t Value = GetVarint(Data);
+	return (Value >> 1) ^ (0 - (Value & 1));
+}
+
+void EncodeCompactFrame(std::vector<uint8_t> &Out, FrameInfo const& f, FrameInfo const& prev, size_t N, FFMS_TrackType TT) {
+	PutSigned(Out, static_cast<uint64_t>(f.PTS) - static_cast<uint64_t>(prev.PTS));
+	PutSigned(Out, static_cast<uint64_t>(f.FilePos) - static_cast<uint64_t>(prev.FilePos) - prev.FrameSize);
+	PutVarint(Out, f.FrameSize);
+	if (TT == FFMS_TYPE_AUDIO) {
+		PutSigned(Out, static_cast<uint64_t>(f.SampleStart) - static_cast<uint64_t>(prev.SampleStart) - prev.SampleCount);
+		PutVarint(Out, f.SampleCount);
+	}
+	else if (TT == FFMS_TYPE_VIDEO) {
+		PutSigned(Out, static_cast<uint64_t>(f.OriginalPos) - N);
+		PutSigned(Out, static_cast<int64_t>(f.RepeatPict));
+	}
+	PutVarint(Out, (static_cast<uint64_t>(static_cast<unsigned>(f.FrameType)) << 2) |
+		(f.KeyFrame ? COMPACT_KEYFRAME : 0) | (f.Hidden ? COMPACT_HIDDEN : 0));
+}
+
+FrameInfo DecodeFrame(const uint8_t *&Data, FrameInfo const& prev, size_t N, FFMS_TrackType TT) {
+	FrameInfo f = {0};
+	f.PTS = static_cast<int64_t>(static_cast<uint64_t>(prev.PTS) + GetSigned(Data));
+	f.FilePos = static_cast<int64_t>(static_cast<uint64_t>(prev.FilePos) + prev.FrameSize + GetSigned(Data));
+	f.FrameSize = static_cast<uint32_t>(GetVarint(Data));
+	if (TT == FFMS_TYPE_AUDIO) {
+		f.SampleStart = static_cast<int64_t>(static_cast<uint64_t>(prev.SampleStart) + prev.SampleCount + GetSigned(Data));
+		f.SampleCount = static_cast<uint32_t>(GetVarint(Data));
+	}
+	else if (TT == FFMS_TYPE_VIDEO) {
+		f.OriginalPos = static_cast<size_t>(N + GetSigned(Data));
+		f.RepeatPict = static_cast<int>(static_cast<int64_t>(GetSigned(Data)));
+	}
+	uint64_t Flags = GetVarint(Data);
+	f.FrameType = static_cast<int>(Flags >> 2);
+	f.KeyFrame = !!(Flags & COMPACT_KEYFRAME);
+	f.Hidden = !!(Flags & COMPACT_HIDDEN);
+	return f;
+}
+
+enum ColumnarFlags {
+	COLUMNAR_KEYFRAME = 1,
+	COLUMNAR_HIDDEN = 2
+};
+
+const size_t ColumnarHeaderSize = 32;
+
+size_t ColumnarFrameBytes(FFMS_TrackType TT) {
+	// PTS, FilePos, FrameSize and flags, plus SampleStart and SampleCount
+	// for audio or OriginalPos and RepeatPict for video
+	if (TT == FFMS_TYPE_AUDIO || TT == FFMS_TYPE_VIDEO)
+		return 8 + 8 + 8 + 4 + 4 + 1;
+	return 8 + 8 + 4 + 1;
+}
+
+template<typename T>
+void WriteColumn(ZipFile &stream, std::vector<T> const& column) {
+	if (!column.empty())
+		stream.WriteRaw(&column[0], column.size() * sizeof(T));
+}
+
+template<typename T>
+const T *ReadColumn(const uint8_t *&data, size_t count) {
+	const T *column = reinterpret_cast<const T *>(data);
+	data += count * sizeof(T);
+	return column;
+}
 }
 
 FFMS_Track::FFMS_Track()
-: TT(FFMS_TYPE_UNKNOWN)
+: Shared(new SharedData)
+, TT(FFMS_TYPE_UNKNOWN)
 , MaxBFrames(0)
 , UseDTS(false)
 , HasTS(true)
@@ -76,7 +181,8 @@ FFMS_Track::FFMS_Track()
 }
 
 FFMS_Track::FFMS_Track(int64_t Num, int64_t Den, FFMS_TrackType TT, bool UseDTS, bool HasTS)
-: TT(TT)
+: Shared(new SharedData)
+, TT(TT)
 , MaxBFrames(0)
 , UseDTS(UseDTS)
 , HasTS(HasTS)
@@ -85,24 +191,104 @@ FFMS_Track::FFMS_Track(int64_t Num, int64_t Den, FFMS_TrackType TT, bool UseDTS,
 	this->TB.Den = Den;
 }
 
-FFMS_Track::FFMS_Track(ZipFile &stream) {
-	TT = static_cast<FFMS_TrackType>(stream.Read<uint8_t>());
-	TB.Num = stream.Read<int64_t>();
-	TB.Den = stream.Read<int64_t>();
-	MaxBFrames = stream.Read<int32_t>();
-	UseDTS = !!stream.Read<uint8_t>();
-	HasTS = !!stream.Read<uint8_t>();
-	size_t FrameCount = static_cast<size_t>(stream.Read<uint64_t>());
+FFMS_Track::FFMS_Track(FFMS_Track const& Other)
+: Shared(Other.Shared)
+, TT(Other.TT)
+, TB(Other.TB)
+, MaxBFrames(Other.MaxBFrames)
+, UseDTS(Other.UseDTS)
+, HasTS(Other.HasTS)
+{
+	Shared->RefCount.Increment();
+}
+
+FFMS_Track &FFMS_Track::operator=(FFMS_Track const& Other) {
+	Other.Shared->RefCount.Increment();
+	if (Shared->RefCount.Decrement() == 0)
+		delete Shared;
+	Shared = Other.Shared;
+	DecodedBlocks.clear();
+	TT = Other.TT;
+	TB = Other.TB;
+	MaxBFrames = Other.MaxBFrames;
+	UseDTS = Other.UseDTS;
+	HasTS = Other.HasTS;
+	return *this;
+}
 
-	if (!FrameCount) return;
+FFMS_Track::~FFMS_Track() {
+	if (Shared->RefCount.Decrement() == 0)
+		delete Shared;
+}
 
-	FrameInfo temp = {0};
-	Frames.reserve(FrameCount);
-	for (size_t i = 0; i < FrameCount; ++i)
-		Frames.push_back(ReadFrame(stream, i == 0 ? temp : Frames.back(), TT));
+FFMS_Track::SharedData::SharedData()
+: RefCount(1)
+, CompactCount(0)
+, IsCompact(false)
+{
+}
+
+FFMS_Track::SharedData::SharedData(SharedData const& Other)
+: RefCount(1)
+, Frames(Other.Frames)
+, RealFrameNumbers(Other.RealFrameNumbers)
+, PublicFrameInfo(Other.PublicFrameInfo)
+, FramesByPos(Other.FramesByPos)
+, KeyFrames(Other.KeyFrames)
+, DecodingKeyFrames(Other.DecodingKeyFrames)
+, CompactBlocks(Other.CompactBlocks)
+, CompactData(Other.CompactData)
+, CompactCount(Other.CompactCount)
+, IsCompact(Other.IsCompact)
+{
+}
+
+void FFMS_Track::Unshare() {
+	// Nothing else can start sharing the data while this is the only copy
+	// with it, as that would need this copy
+	if (Shared->RefCount.Get() == 1) return;
+
+	SharedData *Copy = new SharedData(*Shared);
+	if (Shared->RefCount.Decrement() == 0)
+		delete Shared;
+	Shared = Copy;
+}
 
-	if (TT == FFMS_TYPE_VIDEO)
-		GeneratePublicInfo();
+void FFMS_Track::clear() {
+	SharedData *Empty = new SharedData;
+	if (Shared->RefCount.Decrement() == 0)
+		delete Shared;
+	Shared = Empty;
+	DecodedBlocks.clear();
+}
+
+FFMS_Track::FFMS_Track(ZipFile &stream)
+: Shared(new SharedData)
+{
+	try {
+		TT = static_cast<FFMS_TrackType>(stream.Read<uint8_t>());
+		TB.Num = stream.Read<int64_t>();
+		TB.Den = stream.Read<int64_t>();
+		MaxBFrames = stream.Read<int32_t>();
+		UseDTS = !!stream.Read<uint8_t>();
+		HasTS = !!stream.Read<uint8_t>();
+		size_t FrameCount = static_cast<size_t>(stream.Read<uint64_t>());
+
+		if (!FrameCount) return;
+
+		FrameInfo temp = {0};
+		Shared->Frames.reserve(FrameCount);
+		for (size_t i = 0; i < FrameCount; ++i)
+			Shared->Frames.push_back(ReadFrame(stream, i == 0 ? temp : Shared->Frames.back(), TT));
+
+		if (TT == FFMS_TYPE_VIDEO) {
+			GeneratePublicInfo();
+			GenerateLookupTables();
+		}
+	} catch (...) {
+		delete Shared;
+		throw;
+	}
 }
 
 void FFMS_Track::Write(ZipFile &stream) const {
@@ -116,20 +302,141 @@ void FFMS_Track::Write(ZipFile &stream) const {
 
 	if (empty()) return;
 
+	frame_vec Temp;
+	frame_vec const& All = AllFrames(Temp);
 	FrameInfo temp = {0};
+	for (size_t i = 0; i < All.size(); ++i)
+		WriteFrame(stream, All[i], i == 0 ? temp : All[i - 1], TT);
+}
+
+size_t FFMS_Track::ColumnarSize(FFMS_TrackType TT, size_t FrameCount) {
+	return ColumnarHeaderSize + ((FrameCount * ColumnarFrameBytes(TT) + 7) & ~static_cast<size_t>(7));
+}
+
+FFMS_Track::FFMS_Track(const uint8_t *Data, size_t Size, bool HeaderOnly)
+: Shared(new SharedData)
+{
+	try {
+		if (Size < ColumnarHeaderSize)
+			throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ, "Truncated track data");
+
+		TT = static_cast<FFMS_TrackType>(Data[0]);
+		UseDTS = !!Data[1];
+		HasTS = !!Data[2];
+		int32_t BFrames;
+		uint64_t FrameCount;
+		memcpy(&BFrames, Data + 4, sizeof(BFrames));
+		memcpy(&TB.Num, Data + 8, sizeof(TB.Num));
+		memcpy(&TB.Den, Data + 16, sizeof(TB.Den));
+		memcpy(&FrameCount, Data + 24, sizeof(FrameCount));
+		MaxBFrames = BFrames;
+
+		if (FrameCount > (Size - ColumnarHeaderSize) / ColumnarFrameBytes(TT) || ColumnarSize(TT, static_cast<size_t>(FrameCount)) > Size)
+			throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ, "Truncated track data");
+		if (!FrameCount || HeaderOnly) return;
+
+		size_t Count = static_cast<size_t>(FrameCount);
+		const uint8_t *Pos = Data + ColumnarHeaderSize;
+		const int64_t *PTS = ReadColumn<int64_t>(Pos, Count);
+		const int64_t *FilePos = ReadColumn<int64_t>(Pos, Count);
+		const int64_t *Extra64 = TT == FFMS_TYPE_AUDIO || TT == FFMS_TYPE_VIDEO ? ReadColumn<int64_t>(Pos, Count) : NULL;
+		const uint32_t *FrameSize = ReadColumn<uint32_t>(Pos, Count);
+		const uint32_t *Extra32 = Extra64 ? ReadColumn<uint32_t>(Pos, Count) : NULL;
+		const uint8_t *Flags = ReadColumn<uint8_t>(Pos, Count);
+
+		FrameInfo f = {0};
+		Shared->Frames.resize(Count, f);
+		for (size_t i = 0; i < Count; ++i) {
+			FrameInfo &Frame = Shared->Frames[i];
+			Frame.PTS = PTS[i];
+			Frame.FilePos = FilePos[i];
+			Frame.FrameSize = FrameSize[i];
+			Frame.KeyFrame = !!(Flags[i] & COLUMNAR_KEYFRAME);
+			Frame.Hidden = !!(Flags[i] & COLUMNAR_HIDDEN);
+		}
+
+		if (TT == FFMS_TYPE_AUDIO) {
+			for (size_t i = 0; i < Count; ++i) {
+				Shared->Frames[i].SampleStart = Extra64[i];
+				Shared->Frames[i].SampleCount = Extra32[i];
+			}
+		}
+		else if (TT == FFMS_TYPE_VIDEO) {
+			for (size_t i = 0; i < Count; ++i) {
+				if (static_cast<uint64_t>(Extra64[i]) >= FrameCount)
+					throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ, "Invalid frame order in track data");
+				Shared->Frames[i].OriginalPos = static_cast<size_t>(Extra64[i]);
+				Shared->Frames[i].RepeatPict = static_cast<int32_t>(Extra32[i]);
+			}
+			GeneratePublicInfo();
+			GenerateLookupTables();
+		}
+	} catch (...) {
+		delete Shared;
+		throw;
+	}
+}
+
+void FFMS_Track::WriteColumnar(ZipFile &stream) const {
+	uint8_t Header[ColumnarHeaderSize] = {0};
+	Header[0] = static_cast<uint8_t>(TT);
+	Header[1] = UseDTS;
+	Header[2] = HasTS;
+	int32_t BFrames = MaxBFrames;
+	uint64_t FrameCount = size();
+	memcpy(Header + 4, &BFrames, sizeof(BFrames));
+	memcpy(Header + 8, &TB.Num, sizeof(TB.Num));
+	memcpy(Header + 16, &TB.Den, sizeof(TB.Den));
+	memcpy(Header + 24, &FrameCount, sizeof(FrameCount));
+	stream.WriteRaw(Header, sizeof(Header));
+
+	frame_vec Temp;
+	frame_vec const& All = AllFrames(Temp);
+	std::vector<int64_t> Column64(size());
+	std::vector<uint32_t> Column32(size());
+	std::vector<uint8_t> Flags(size());
+
+	for (size_t i = 0; i < size(); ++i)
+		Column64[i] = All[i].PTS;
+	WriteColumn(stream, Column64);
+	for (size_t i = 0; i < size(); ++i)
+		Column64[i] = All[i].FilePos;
+	WriteColumn(stream, Column64);
+	if (TT == FFMS_TYPE_AUDIO || TT == FFMS_TYPE_VIDEO) {
+		for (size_t i = 0; i < size(); ++i)
+			Column64[i] = TT == FFMS_TYPE_AUDIO ? All[i].SampleStart : static_cast<int64_t>(All[i].OriginalPos);
+		WriteColumn(stream, Column64);
+	}
+
+	for (size_t i = 0; i < size(); ++i)
+		Column32[i] = All[i].FrameSize;
+	WriteColumn(stream, Column32);
+	if (TT == FFMS_TYPE_AUDIO || TT == FFMS_TYPE_VIDEO) {
+		for (size_t i = 0; i < size(); ++i)
+			Column32[i] = TT == FFMS_TYPE_AUDIO ? All[i].SampleCount : static_cast<uint32_t>(All[i].RepeatPict);
+		WriteColumn(stream, Column32);
+	}
+
 	for (size_t i = 0; i < size(); ++i)
-		WriteFrame(stream, Frames[i], i == 0 ? temp : Frames[i - 1], TT);
+		Flags[i] = (All[i].KeyFrame ? COLUMNAR_KEYFRAME : 0) | (All[i].Hidden ? COLUMNAR_HIDDEN : 0);
+	WriteColumn(stream, Flags);
+
+	// Pad to keep the next track aligned
+	static const uint8_t Padding[8] = {0};
+	stream.WriteRaw(Padding, ColumnarSize() - ColumnarHeaderSize - size() * ColumnarFrameBytes(TT));
 }
 
 void FFMS_Track::AddVideoFrame(int64_t PTS, int RepeatPict, bool KeyFrame, int FrameType, int64_t FilePos, uint32_t FrameSize, bool Hidden) {
 	FrameInfo f = {PTS, FilePos, 0, 0, FrameSize, 0, FrameType, RepeatPict, KeyFrame, Hidden};
-	Frames.push_back(f);
+	Expand();
+	Shared->Frames.push_back(f);
 }
 
 void FFMS_Track::AddAudioFrame(int64_t PTS, int64_t SampleStart, uint32_t SampleCount, bool KeyFrame, int64_t FilePos, uint32_t FrameSize) {
 	if (SampleCount > 0) {
 		FrameInfo f = {PTS, FilePos, SampleStart, SampleCount, FrameSize, 0, 0, 0, KeyFrame, false};
-		Frames.push_back(f);
+		Expand();
+		Shared->Frames.push_back(f);
 	}
 }
 
@@ -137,76 +444,142 @@ void FFMS_Track::WriteTimecodes(const char *TimecodeFile) const {
 	FileHandle file(TimecodeFile, "w", FFMS_ERROR_TRACK, FFMS_ERROR_FILE_WRITE);
 
 	file.Printf("# timecode format v2\n");
-	for (size_t i = 0; i < size(); ++i) {
-		if (!Frames[i].Hidden)
-			file.Printf("%.02f\n", (Frames[i].PTS * TB.Num) / (double)TB.Den);
+	frame_vec Temp;
+	frame_vec const& All = AllFrames(Temp);
+	for (size_t i = 0; i < All.size(); ++i) {
+		if (!All[i].Hidden)
+			file.Printf("%.02f\n", (All[i].PTS * TB.Num) / (double)TB.Den);
 	}
 }
 
-static bool PTSComparison(FrameInfo FI1, FrameInfo FI2) {
+static bool PTSComparison(FrameInfo const& FI1, FrameInfo const& FI2) {
 	return FI1.PTS < FI2.PTS;
 }
 
 int FFMS_Track::FrameFromPTS(int64_t PTS) const {
-	FrameInfo F;
-	F.PTS = PTS;
-
-	iterator Pos = std::lower_bound(begin(), end(), F, PTSComparison);
-	if (Pos == end() || Pos->PTS != PTS)
+	size_t Frame = LowerBoundPTS(PTS);
+	if (Frame == size() || (*this)[Frame].PTS != PTS)
 		return -1;
-	return std::distance(begin(), Pos);
+	return Frame;
+}
+
+namespace {
+struct FieldComparison {
+	int64_t FrameInfo::*Field;
+	FieldComparison(int64_t FrameInfo::*Field) : Field(Field) { }
+
+	bool operator()(FrameInfo const& Frame, int64_t Value) const { return Frame.*Field < Value; }
+	bool operator()(int64_t Value, FrameInfo const& Frame) const { return Value < Frame.*Field; }
+};
+
+struct PosComparison {
+	FFMS_Track const& Frames;
+	PosComparison(FFMS_Track const& Frames) : Frames(Frames) { }
+
+	bool operator()(int Frame, int64_t Pos) const { return Frames[Frame].FilePos < Pos; }
+	bool operator()(int64_t Pos, int Frame) const { return Pos < Frames[Frame].FilePos; }
+	bool operator()(int A, int B) const {
+		return Frames[A].FilePos < Frames[B].FilePos || (Frames[A].FilePos == Frames[B].FilePos && A < B);
+	}
+};
+
+// The last element of Sorted which is at most Frame, or 0 if there's none
+int LastAtOrBefore(std::vector<int> const& Sorted, int Frame) {
+	std::vector<int>::const_iterator it = std::upper_bound(Sorted.begin(), Sorted.end(), Frame);
+	return it == Sorted.begin() ? 0 : *(it - 1);
+}
 }
 
 int FFMS_Track::FrameFromPos(int64_t Pos) const {
-	for (size_t i = 0; i < size(); i++)
-	if (Frames[i].FilePos == Pos)
-		return i;
-	return -1;
+	if (Shared->FramesByPos.size() != size()) {
+		for (size_t i = 0; i < size(); i++)
+		if ((*this)[i].FilePos == Pos)
+			return i;
+		return -1;
+	}
+
+	std::vector<int>::const_iterator it = std::lower_bound(Shared->FramesByPos.begin(), Shared->FramesByPos.end(), Pos, PosComparison(*this));
+	if (it == Shared->FramesByPos.end() || (*this)[*it].FilePos != Pos)
+		return -1;
+	return *it;
 }
 
 int FFMS_Track::ClosestFrameFromPTS(int64_t PTS) const {
-	FrameInfo F;
-	F.PTS = PTS;
-
-	iterator Pos = std::lower_bound(begin(), end(), F, PTSComparison);
-	if (Pos == end())
+	size_t Frame = LowerBoundPTS(PTS);
+	if (Frame == size())
 		return size() - 1;
-	size_t Frame = std::distance(begin(), Pos);
-	if (Pos == begin() || FFABS(Pos->PTS - PTS) <= FFABS((Pos - 1)->PTS - PTS))
+	if (Frame == 0 || FFABS((*this)[Frame].PTS - PTS) <= FFABS((*this)[Frame - 1].PTS - PTS))
 		return Frame;
 	return Frame - 1;
 }
 
+size_t FFMS_Track::Search(int64_t FrameInfo::*Field, int64_t CompactBlock::*BlockField, int64_t Value, bool Upper) const {
+	FieldComparison Comp(Field);
+	if (!Shared->IsCompact) {
+		frame_vec const& Frames = Shared->Frames;
+		frame_vec::const_iterator Pos = Upper
+			? std::upper_bound(Frames.begin(), Frames.end(), Value, Comp)
+			: std::lower_bound(Frames.begin(), Frames.end(), Value, Comp);
+		return Pos - Frames.begin();
+	}
+
+	// Find the first block whose first frame is past the target using the
+	// block headers, so the frame is either in the block before it or
+	// that first frame
+	std::vector<CompactBlock> const& Blocks = Shared->CompactBlocks;
+	size_t Low = 0, High = Blocks.size();
+	while (Low < High) {
+		size_t Mid = Low + (High - Low) / 2;
+		if (Upper ? Blocks[Mid].*BlockField <= Value : Blocks[Mid].*BlockField < Value)
+			Low = Mid + 1;
+		else
+			High = Mid;
+	}
+	if (Low == 0)
+		return 0;
+
+	size_t First = (Low - 1) * CompactBlockSize;
+	const FrameInfo *Begin = &CompactFrame(First);
+	const FrameInfo *End = Begin + (std::min(First + CompactBlockSize, size()) - First);
+	const FrameInfo *Pos = Upper
+		? std::upper_bound(Begin, End, Value, Comp)
+		: std::lower_bound(Begin, End, Value, Comp);
+	return First + (Pos - Begin);
+}
+
 int FFMS_Track::FindClosestVideoKeyFrame(int Frame) const {
 	Frame = std::min(std::max(Frame, 0), static_cast<int>(size()) - 1);
-	for (; Frame > 0 && !Frames[Frame].KeyFrame; Frame--);
-	for (; Frame > 0 && !Frames[Frames[Frame].OriginalPos].KeyFrame; Frame--);
-	return Frame;
+	if (Shared->FramesByPos.size() != size() || empty()) {
+		for (; Frame > 0 && !(*this)[Frame].KeyFrame; Frame--);
+		for (; Frame > 0 && !(*this)[(*this)[Frame].OriginalPos].KeyFrame; Frame--);
+		return Frame;
+	}
+	return LastAtOrBefore(Shared->DecodingKeyFrames, LastAtOrBefore(Shared->KeyFrames, Frame));
 }
 
 int FFMS_Track::RealFrameNumber(int Frame) const {
-	return RealFrameNumbers[Frame];
+	return Shared->RealFrameNumbers[Frame];
 }
 
 int FFMS_Track::VisibleFrameCount() const {
-	return TT == FFMS_TYPE_AUDIO ? Frames.size() : RealFrameNumbers.size();
+	return TT == FFMS_TYPE_AUDIO ? size() : Shared->RealFrameNumbers.size();
 }
 
-void FFMS_Track::MaybeReorderFrames() {
+void FFMS_Track::MaybeReorderFrames(size_t FirstNewFrame) {
 	// First check if we need to do anything
 	bool has_b_frames = false;
-	for (size_t i = 1; i < size(); ++i) {
+	for (size_t i = FirstNewFrame + 1; i < size(); ++i) {
 		// If the timestamps are already out of order, then they actually are
 		// presentation timestamps and we don't need to do anything
-		if (Frames[i].PTS < Frames[i - 1].PTS)
+		if (Shared->Frames[i].PTS < Shared->Frames[i - 1].PTS)
 			return;
 
-		if (Frames[i].FrameType == AV_PICTURE_TYPE_B) {
+		if (Shared->Frames[i].FrameType == AV_PICTURE_TYPE_B) {
 			has_b_frames = true;
 
 			// Reordering files with multiple b-frames is currently not
 			// supported
-			if (Frames[i - 1].FrameType == AV_PICTURE_TYPE_B)
+			if (Shared->Frames[i - 1].FrameType == AV_PICTURE_TYPE_B)
 				return;
 		}
 	}
@@ -223,66 +596,204 @@ void FFMS_Track::MaybeReorderFrames() {
 	// specific case of b-frames which reference the frame immediately after
 	// them temporally, but that happens to cover the only files I've seen
 	// with b-frames and no presentation timestamps.
-	for (size_t i = 1; i < size(); ++i) {
-		if (Frames[i].FrameType == AV_PICTURE_TYPE_B)
-			std::swap(Frames[i].PTS, Frames[i - 1].PTS);
+	for (size_t i = FirstNewFrame + 1; i < size(); ++i) {
+		if (Shared->Frames[i].FrameType == AV_PICTURE_TYPE_B)
+			std::swap(Shared->Frames[i].PTS, Shared->Frames[i - 1].PTS);
 	}
 }
 
-void FFMS_Track::MaybeHideFrames() {
+void FFMS_Track::MaybeHideFrames(size_t FirstNewFrame) {
 	// Awful handling for interlaced H.264: each frame is output twice, so hide
 	// frames with an invalid file position and PTS equal to the previous one
-	for (size_t i = 1; i < size(); ++i) {
-		FrameInfo const& prev = Frames[i - 1];
-		FrameInfo& cur = Frames[i];
+	for (size_t i = std::max<size_t>(FirstNewFrame, 1); i < size(); ++i) {
+		FrameInfo const& prev = Shared->Frames[i - 1];
+		FrameInfo& cur = Shared->Frames[i];
 
 		if (prev.FilePos >= 0 && (cur.FilePos == -1 || cur.FilePos == prev.FilePos) && cur.PTS == prev.PTS)
 			cur.Hidden = true;
 	}
 }
 
-void FFMS_Track::FinalizeTrack() {
+void FFMS_Track::FinalizeTrack(size_t FirstNewFrame) {
+	Expand();
+
 	// With some formats (such as Vorbis) a bad final packet results in a
 	// frame with PTS 0, which we don't want to sort to the beginning
 	if (size() > 2 && front().PTS >= back().PTS)
-		Frames.pop_back();
+		Shared->Frames.pop_back();
 
 	if (TT != FFMS_TYPE_VIDEO)
 		return;
 
 	for (size_t i = 0; i < size(); i++)
-		Frames[i].OriginalPos = i;
+		Shared->Frames[i].OriginalPos = i;
 
-	MaybeReorderFrames();
-	MaybeHideFrames();
+	MaybeReorderFrames(FirstNewFrame);
+	MaybeHideFrames(FirstNewFrame);
 
-	sort(Frames.begin(), Frames.end(), PTSComparison);
+	sort(Shared->Frames.begin(), Shared->Frames.end(), PTSComparison);
 
 	std::vector<size_t> ReorderTemp;
 	ReorderTemp.reserve(size());
 
 	for (size_t i = 0; i < size(); i++)
-		ReorderTemp.push_back(Frames[i].OriginalPos);
+		ReorderTemp.push_back(Shared->Frames[i].OriginalPos);
 
 	for (size_t i = 0; i < size(); i++)
-		Frames[ReorderTemp[i]].OriginalPos = i;
+		Shared->Frames[ReorderTemp[i]].OriginalPos = i;
 
 	GeneratePublicInfo();
+	GenerateLookupTables();
+}
+
+void FFMS_Track::PrepareForAppend(int64_t FilePos) {
+	Expand();
+
+	// Video frames are stored in presentation order, with the OriginalPos of
+	// the Nth frame being the position of the Nth frame in decoding order.
+	// Everything from the first frame read at or after FilePos on is read
+	// again, including frames without a position of their own (FilePos -1,
+	// such as the second field of interlaced H.264) which come after it
+	frame_vec Kept;
+	Kept.reserve(size());
+	for (size_t i = 0; i < size(); ++i) {
+		FrameInfo const& f = TT == FFMS_TYPE_VIDEO ? Shared->Frames[Shared->Frames[i].OriginalPos] : Shared->Frames[i];
+		if (f.FilePos >= FilePos)
+			break;
+		Kept.push_back(f);
+	}
+
+	Shared->Frames.swap(Kept);
+	Shared->RealFrameNumbers.clear();
+	Shared->PublicFrameInfo.clear();
+	Shared->FramesByPos.clear();
+	Shared->KeyFrames.clear();
+	Shared->DecodingKeyFrames.clear();
 }
 
 void FFMS_Track::GeneratePublicInfo() {
-	RealFrameNumbers.reserve(size());
-	PublicFrameInfo.reserve(size());
+	Shared->RealFrameNumbers.reserve(size());
+	Shared->PublicFrameInfo.reserve(size());
 	for (size_t i = 0; i < size(); ++i) {
-		if (Frames[i].Hidden) continue;
-		RealFrameNumbers.push_back(i);
+		if (Shared->Frames[i].Hidden) continue;
+		Shared->RealFrameNumbers.push_back(i);
 
-		FFMS_FrameInfo info = {Frames[i].PTS, Frames[i].RepeatPict, Frames[Frames[i].OriginalPos].KeyFrame};
-		PublicFrameInfo.push_back(info);
+		FFMS_FrameInfo info = {Shared->Frames[i].PTS, Shared->Frames[i].RepeatPict, Shared->Frames[Shared->Frames[i].OriginalPos].KeyFrame};
+		Shared->PublicFrameInfo.push_back(info);
+	}
+}
+
+void FFMS_Track::GenerateLookupTables() {
+	Shared->FramesByPos.resize(size());
+	for (size_t i = 0; i < size(); ++i)
+		Shared->FramesByPos[i] = i;
+	std::sort(Shared->FramesByPos.begin(), Shared->FramesByPos.end(), PosComparison(*this));
+
+	Shared->KeyFrames.clear();
+	Shared->DecodingKeyFrames.clear();
+	for (size_t i = 0; i < size(); ++i) {
+		if (Shared->Frames[i].KeyFrame)
+			Shared->KeyFrames.push_back(i);
+		if (Shared->Frames[Shared->Frames[i].OriginalPos].KeyFrame)
+			Shared->DecodingKeyFrames.push_back(i);
 	}
 }
 
 const FFMS_FrameInfo *FFMS_Track::GetFrameInfo(size_t N) const {
-	if (N >= PublicFrameInfo.size()) return NULL;
-	return &PublicFrameInfo[N];
+	if (N >= Shared->PublicFrameInfo.size()) return NULL;
+	return &Shared->PublicFrameInfo[N];
+}
+
+void FFMS_Track::Compact() {
+	if (Shared->IsCompact) return;
+	Unshare();
+
+	std::vector<CompactBlock> Blocks;
+	std::vector<uint8_t> Data;
+	Blocks.reserve((Shared->Frames.size() + CompactBlockSize - 1) / CompactBlockSize);
+	Data.reserve(Shared->Frames.size() * 8);
+
+	FrameInfo prev = {0};
+	for (size_t i = 0; i < Shared->Frames.size(); ++i) {
+		if (i % CompactBlockSize == 0) {
+			CompactBlock Block = {Shared->Frames[i].PTS, Shared->Frames[i].FilePos, Shared->Frames[i].SampleStart, Data.size()};
+			Blocks.push_back(Block);
+			FrameInfo Base = {Block.PTS, Block.FilePos, Block.SampleStart};
+			prev = Base;
+		}
+		EncodeCompactFrame(Data, Shared->Frames[i], prev, i, TT);
+		prev = Shared->Frames[i];
+	}
+
+	// Shrink to fit, as this is all about saving memory
+	std::vector<CompactBlock>(Blocks).swap(Shared->CompactBlocks);
+	std::vector<uint8_t>(Data).swap(Shared->CompactData);
+	Shared->CompactCount = Shared->Frames.size();
+	frame_vec().swap(Shared->Frames);
+	Shared->IsCompact = true;
+	DecodedBlocks.clear();
+}
+
+void FFMS_Track::Expand() {
+	Unshare();
+	if (!Shared->IsCompact) return;
+
+	frame_vec Decoded;
+	AllFrames(Decoded);
+	Shared->Frames.swap(Decoded);
+	std::vector<CompactBlock>().swap(Shared->CompactBlocks);
+	std::vector<uint8_t>().swap(Shared->CompactData);
+	Shared->CompactCount = 0;
+	Shared->IsCompact = false;
+	DecodedBlocks.clear();
+}
+
+FrameInfo const& FFMS_Track::CompactFrame(size_t N) const {
+	size_t Block = N / CompactBlockSize;
+	size_t First = Block * CompactBlockSize;
+	// The list is kept in order of use, and moving its elements around
+	// leaves references to their frames alone
+	for (std::list<DecodedBlock>::iterator it = DecodedBlocks.begin(); it != DecodedBlocks.end(); ++it) {
+		if (it->Block == Block) {
+			DecodedBlocks.splice(DecodedBlocks.end(), DecodedBlocks, it);
+			return it->Frames[N - First];
+		}
+	}
+
+	// Reuse the block used longest ago
+	if (DecodedBlocks.size() < MaxDecodedBlocks)
+		DecodedBlocks.push_back(DecodedBlock());
+	else
+		DecodedBlocks.splice(DecodedBlocks.end(), DecodedBlocks, DecodedBlocks.begin());
+	DecodedBlock &Decoded = DecodedBlocks.back();
+	Decoded.Block = Block;
+	Decoded.Frames.clear();
+
+	CompactBlock const& Header = Shared->CompactBlocks[Block];
+	const uint8_t *Data = &Shared->CompactData[Header.Offset];
+	FrameInfo f = {Header.PTS, Header.FilePos, Header.SampleStart};
+	size_t Last = std::min(First + CompactBlockSize, Shared->CompactCount);
+	for (size_t i = First; i < Last; ++i) {
+		f = DecodeFrame(Data, f, i, TT);
+		Decoded.Frames.push_back(f);
+	}
+	return Decoded.Frames[N - First];
+}
+
+FFMS_Track::frame_vec const& FFMS_Track::AllFrames(frame_vec &Temp) const {
+	if (!Shared->IsCompact) return Shared->Frames;
+
+	Temp.clear();
+	Temp.reserve(Shared->CompactCount);
+	const uint8_t *Data = Shared->CompactData.empty() ? NULL : &Shared->CompactData[0];
+	FrameInfo prev = {0};
+	for (size_t i = 0; i < Shared->CompactCount; ++i) {
+		if (i % CompactBlockSize == 0) {
+			FrameInfo Base = {Shared->CompactBlocks[i / CompactBlockSize].PTS, Shared->CompactBlocks[i / CompactBlockSize].FilePos, Shared->CompactBlocks[i / CompactBlockSize].SampleStart};
+			prev = Base;
+		}
+		prev = DecodeFrame(Data, prev, i, TT);
+		Temp.push_back(prev);
+	}
+	return Temp;
 }
@@ -22,8 +22,11 @@
 #define TRACK_H
 
 #include "ffms.h"
+#include "threading.h"
 
 #include <cstddef>
+#include <iterator>
+#include <list>
 #include <vector>
 
 class ZipFile;
@@ -44,13 +47,70 @@ struct FrameInfo {
 struct FFMS_Track {
 private:
 	typedef std::vector<FrameInfo> frame_vec;
-	frame_vec Frames;
-	std::vector<int> RealFrameNumbers;
-	std::vector<FFMS_FrameInfo> PublicFrameInfo;
 
-	void MaybeReorderFrames();
-	void MaybeHideFrames();
+	// Compact storage: Frames is empty and the frames are stored in blocks
+	// of varint coded differences from the previous frame, with the first
+	// frame of each block coded relative to absolute values in the block
+	// header so that any frame can be decoded from its block alone
+	struct CompactBlock {
+		int64_t PTS;
+		int64_t FilePos;
+		int64_t SampleStart;
+		size_t Offset;
+	};
+
+	// The frames and everything derived from them. This is shared by all
+	// copies of a track, so that sources don't duplicate the tables of the
+	// index, and copied by whichever copy modifies it first.
+	struct SharedData {
+		AtomicCounter RefCount;
+
+		frame_vec Frames;
+		std::vector<int> RealFrameNumbers;
+		std::vector<FFMS_FrameInfo> PublicFrameInfo;
+		// Lookup tables for video tracks: frame numbers sorted by file
+		// position, keyframes, and frames whose frame in decoding order is
+		// a keyframe
+		std::vector<int> FramesByPos;
+		std::vector<int> KeyFrames;
+		std::vector<int> DecodingKeyFrames;
+
+		std::vector<CompactBlock> CompactBlocks;
+		std::vector<uint8_t> CompactData;
+		size_t CompactCount;
+		bool IsCompact;
+
+		SharedData();
+		SharedData(SharedData const& Other);
+	};
+	SharedData *Shared;
+
+	// Make sure this is the only copy of the data before modifying it
+	void Unshare();
+
+	// The blocks of a compact track which were used last, decoded, so that
+	// looking up neighbouring frames doesn't decode the block again for
+	// each of them. These belong to this copy of the track and aren't shared.
+	struct DecodedBlock {
+		size_t Block;
+		frame_vec Frames;
+	};
+	mutable std::list<DecodedBlock> DecodedBlocks;
+
+	FrameInfo const& CompactFrame(size_t N) const;
+	// The first frame whose Field is at least Value, or greater than it with
+	// Upper. Field has to be in ascending order.
+	size_t Search(int64_t FrameInfo::*Field, int64_t CompactBlock::*BlockField, int64_t Value, bool Upper) const;
+	// Get the frames ready to be modified: unshared, and decoded if the
+	// track is compact
+	void Expand();
+	// The frames as a vector, decoded into Temp if the track is compact
+	frame_vec const& AllFrames(frame_vec &Temp) const;
+
+	void MaybeReorderFrames(size_t FirstNewFrame);
+	void MaybeHideFrames(size_t FirstNewFrame);
 	void GeneratePublicInfo();
+	void GenerateLookupTables();
 
 public:
 	FFMS_TrackType TT;
@@ -62,7 +122,13 @@ public:
 	void AddVideoFrame(int64_t PTS, int RepeatPict, bool KeyFrame, int FrameType, int64_t FilePos = 0, uint32_t FrameSize = 0, bool Invisible = false);
 	void AddAudioFrame(int64_t PTS, int64_t SampleStart, uint32_t SampleCount, bool KeyFrame, int64_t FilePos = 0, uint32_t FrameSize = 0);
 
-	void FinalizeTrack();
+	// Frames before FirstNewFrame are ones kept by PrepareForAppend and have
+	// already been reordered
+	void FinalizeTrack(size_t FirstNewFrame = 0);
+	// Undo FinalizeTrack and drop the frames from the first one in decoding
+	// order which starts at or after FilePos on, so that indexing can
+	// continue from there
+	void PrepareForAppend(int64_t FilePos);
 
 	int FindClosestVideoKeyFrame(int Frame) const;
 	int FrameFromPTS(int64_t PTS) const;
@@ -71,37 +137,91 @@ public:
 	int RealFrameNumber(int Frame) const;
 	int VisibleFrameCount() const;
 
+	// Binary searches of finalized tracks, which only decode a single block
+	// of compact tracks
+	size_t LowerBoundPTS(int64_t PTS) const { return Search(&FrameInfo::PTS, &CompactBlock::PTS, PTS, false); }
+	size_t LowerBoundSampleStart(int64_t Sample) const { return Search(&FrameInfo::SampleStart, &CompactBlock::SampleStart, Sample, false); }
+	size_t UpperBoundSampleStart(int64_t Sample) const { return Search(&FrameInfo::SampleStart, &CompactBlock::SampleStart, Sample, true); }
+
 	const FFMS_FrameInfo *GetFrameInfo(size_t N) const;
 
 	void WriteTimecodes(const char *TimecodeFile) const;
 	void Write(ZipFile &Stream) const;
 
-	typedef frame_vec::allocator_type allocator_type;
+	// Uncompressed struct-of-arrays form used by columnar index files
+	static size_t ColumnarSize(FFMS_TrackType TT, size_t FrameCount);
+	size_t ColumnarSize() const { return ColumnarSize(TT, size()); }
+	void WriteColumnar(ZipFile &Stream) const;
+
+	// Switch to compact storage, which shrinks each frame record to a few
+	// bytes but has to decode a block of frames whenever one from a block
+	// which wasn't used recently is looked up. The public frame info and the
+	// lookup tables of video tracks stay as they are, so those only drop to
+	// around 40%. Modifying the track switches back. As lookups decode into
+	// the track, a compact track can't be read by several threads at once,
+	// though its copies can.
+	void Compact();
+
 	typedef frame_vec::size_type size_type;
 	typedef frame_vec::difference_type difference_type;
-	typedef frame_vec::const_pointer pointer;
-	typedef frame_vec::const_reference reference;
-	typedef frame_vec::value_type value_type;
-	typedef frame_vec::const_iterator iterator;
-	typedef frame_vec::const_reverse_iterator reverse_iterator;
-
-	void clear() {
-		Frames.clear();
-		RealFrameNumbers.clear();
-		PublicFrameInfo.clear();
+	// Frames of compact tracks are returned from the decoded blocks, so
+	// references to them are only valid until a few other blocks are used
+	typedef const FrameInfo &reference;
+	typedef FrameInfo value_type;
+
+	class iterator : public std::iterator<std::random_access_iterator_tag, FrameInfo, difference_type, const FrameInfo *, const FrameInfo &> {
+		FFMS_Track const* Track;
+		size_type Pos;
+	public:
+		iterator() : Track(NULL), Pos(0) { }
+		iterator(FFMS_Track const* Track, size_type Pos) : Track(Track), Pos(Pos) { }
+
+		const FrameInfo &operator*() const { return (*Track)[Pos]; }
+		const FrameInfo &operator[](difference_type n) const { return (*Track)[Pos + n]; }
+		iterator& operator++() { ++Pos; return *this; }
+		iterator& operator--() { --Pos; return *this; }
+		iterator operator++(int) { iterator ret = *this; ++Pos; return ret; }
+		iterator operator--(int) { iterator ret = *this; --Pos; return ret; }
+		iterator& operator+=(difference_type n) { Pos += n; return *this; }
+		iterator& operator-=(difference_type n) { Pos -= n; return *this; }
+		iterator operator+(difference_type n) const { return iterator(Track, Pos + n); }
+		iterator operator-(difference_type n) const { return iterator(Track, Pos - n); }
+		difference_type operator-(iterator const& other) const { return static_cast<difference_type>(Pos) - static_cast<difference_type>(other.Pos); }
+		bool operator==(iterator const& other) const { return Pos == other.Pos; }
+		bool operator!=(iterator const& other) const { return Pos != other.Pos; }
+		bool operator<(iterator const& other) const { return Pos < other.Pos; }
+		bool operator>(iterator const& other) const { return Pos > other.Pos; }
+		bool operator<=(iterator const& other) const { return Pos <= other.Pos; }
+		bool operator>=(iterator const& other) const { return Pos >= other.Pos; }
+	};
+
+	void clear();
+
+	bool empty() const { return size() == 0; }
+	size_type size() const { return Shared->IsCompact ? Shared->CompactCount : Shared->Frames.size(); }
+	reference operator[](size_type pos) const {
+		if (Shared->IsCompact)
+			return CompactFrame(pos);
+		return Shared->Frames[pos];
 	}
-
-	bool empty() const { return Frames.empty(); }
-	size_type size() const { return Frames.size(); }
-	reference operator[](size_type pos) const { return Frames[pos]; }
-	reference front() const { return Frames.front(); }
-	reference back() const { return Frames.back(); }
-	iterator begin() const { return Frames.begin(); }
-	iterator end() const { return Frames.end(); }
+	reference front() const { return (*this)[0]; }
+	reference back() const { return (*this)[size() - 1]; }
+	iterator begin() const { return iterator(this, 0); }
+	iterator end() const { return iterator(this, size()); }
 
 	FFMS_Track();
 	FFMS_Track(ZipFile &Stream);
+	// Reads a track in the columnar form. Data must be 8-byte aligned. The
+	// columns are copied into ordinary frame records rather than used in
+	// place, so Data needn't outlive the track. With HeaderOnly only the
+	// properties of the track are read and it's left without frames.
+	FFMS_Track(const uint8_t *Data, size_t Size, bool HeaderOnly = false);
 	FFMS_Track(int64_t Num, int64_t Den, FFMS_TrackType TT, bool UseDTS = false, bool HasTS = true);
+	// Copies share the frames but not the properties above, so a copy's
+	// TB can be adjusted without affecting the original
+	FFMS_Track(FFMS_Track const& Other);
+	FFMS_Track &operator=(FFMS_Track const& Other);
+	~FFMS_Track();
 };
 
 #endif
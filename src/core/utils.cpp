@@ -32,6 +32,9 @@
 #ifdef _WIN32
 #	define WIN32_LEAN_AND_MEAN
 #	include <windows.h>
+#else
+#	include <sys/time.h>
+#	include <time.h>
 #endif // _WIN32
 
 #include <algorithm>
@@ -215,11 +218,14 @@ std::wstring widen_path(const char *s) {
 
 // End of filename hackery.
 
-void LAVFOpenFile(const char *SourceFile, AVFormatContext *&FormatContext) {
+void LAVFOpenFile(const char *SourceFile, AVFormatContext *&FormatContext, FFMS_Index const* Index) {
 	if (avformat_open_input(&FormatContext, SourceFile, NULL, NULL) != 0)
 		throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ,
 			std::string("Couldn't open '") + SourceFile + "'");
 
+	if (Index && Index->ApplyStreamParameters(FormatContext))
+		return;
+
 	if (avformat_find_stream_info(FormatContext,NULL) < 0) {
 		avformat_close_input(&FormatContext);
 		FormatContext = NULL;
@@ -228,10 +234,11 @@ void LAVFOpenFile(const char *SourceFile, AVFormatContext *&FormatContext) {
 	}
 }
 
-void FlushBuffers(AVCodecContext *CodecContext) {
-	if (CodecContext->codec->flush)
+bool FlushBuffers(AVCodecContext *CodecContext) {
+	if (CodecContext->codec->flush) {
 		avcodec_flush_buffers(CodecContext);
-	else {
+		return false;
+	} else {
 		// If the codec doesn't have flush(), it might not need it... or it
 		// might need it and just not implement it as in the case of VC-1, so
 		// close and reopen the codec
@@ -245,5 +252,46 @@ void FlushBuffers(AVCodecContext *CodecContext) {
 		if (avcodec_open2(CodecContext, const_cast<AVCodec *>(codec), 0) < 0)
 			throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_CODEC,
 				"Couldn't re-open codec.");
+		return true;
 	}
 }
+
+int64_t GetMicroseconds() {
+#ifdef _WIN32
+	static LARGE_INTEGER Frequency;
+	if (!Frequency.QuadPart)
+		QueryPerformanceFrequency(&Frequency);
+	LARGE_INTEGER Counter;
+	QueryPerformanceCounter(&Counter);
+	return Counter.QuadPart / Frequency.QuadPart * 1000000 +
+		Counter.QuadPart % Frequency.QuadPart * 1000000 / Frequency.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+#else
+	timeval tv;
+	gettimeofday(&tv, NULL);
+	return static_cast<int64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+#endif
+}
+
+void ResetStats(FFMS_SourceStats &Stats) {
+	memset(&Stats, 0, sizeof(Stats));
+}
+
+void AddStats(FFMS_SourceStats &Dst, const FFMS_SourceStats &Src) {
+	Dst.PacketsRead += Src.PacketsRead;
+	Dst.BytesRead += Src.BytesRead;
+	Dst.FramesDecoded += Src.FramesDecoded;
+	Dst.FramesOutput += Src.FramesOutput;
+	Dst.Seeks += Src.Seeks;
+	Dst.SeekRetries += Src.SeekRetries;
+	Dst.Flushes += Src.Flushes;
+	Dst.Reopens += Src.Reopens;
+	Dst.CacheHits += Src.CacheHits;
+	Dst.CacheMisses += Src.CacheMisses;
+	Dst.DemuxTime += Src.DemuxTime;
+	Dst.DecodeTime += Src.DecodeTime;
+	Dst.ConvertTime += Src.ConvertTime;
+}
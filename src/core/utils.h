@@ -164,9 +164,28 @@ void FillAP(FFMS_AudioProperties &AP, AVCodecContext *CTX, FFMS_Track &Frames);
 
 void InitializeCodecContextFromMatroskaTrackInfo(TrackInfo *TI, AVCodecContext *CodecContext);
 std::wstring widen_path(const char *s);
-void LAVFOpenFile(const char *SourceFile, AVFormatContext *&FormatContext);
+// If Index is given and has the parameters of the file's streams, probing
+// the streams is skipped
+void LAVFOpenFile(const char *SourceFile, AVFormatContext *&FormatContext, FFMS_Index const* Index = NULL);
 
-void FlushBuffers(AVCodecContext *CodecContext);
+// Flush the decoder, returning true if the codec had to be closed and
+// reopened because it doesn't support flushing
+bool FlushBuffers(AVCodecContext *CodecContext);
+
+// Monotonic clock used for the source statistics
+int64_t GetMicroseconds();
+
+// Adds the time between construction and destruction to Total
+class StatsTimer : private noncopyable {
+	int64_t &Total;
+	int64_t Start;
+public:
+	StatsTimer(int64_t &Total) : Total(Total), Start(GetMicroseconds()) { }
+	~StatsTimer() { Total += GetMicroseconds() - Start; }
+};
+
+void ResetStats(FFMS_SourceStats &Stats);
+void AddStats(FFMS_SourceStats &Dst, const FFMS_SourceStats &Src);
 
 namespace optdetail {
 	template<typename T>
@@ -22,8 +22,15 @@
 
 #include "indexing.h"
 #include "numthreads.h"
+#include "trace.h"
 #include "videoutils.h"
 
+#include <memory>
+#include <string>
+
+extern bool HasHaaliMPEG;
+extern bool HasHaaliOGG;
+
 namespace {
 void CopyAVPictureFields(AVPicture &Picture, FFMS_Frame &Dst) {
 	for (int i = 0; i < 4; i++) {
@@ -50,6 +57,7 @@ void FFMS_VideoSource::GetFrameCheck(int n) {
 }
 
 FFMS_Frame *FFMS_VideoSource::OutputFrame(AVFrame *Frame) {
+	TraceSpan Span("video", "OutputFrame");
 	SanityCheckFrameForData(Frame);
 
 	if (LastFrameWidth != CodecContext->width || LastFrameHeight != CodecContext->height || LastFramePixelFormat != CodecContext->pix_fmt) {
@@ -64,7 +72,11 @@ FFMS_Frame *FFMS_VideoSource::OutputFrame(AVFrame *Frame) {
 		}
 	}
 
+	++Stats.FramesOutput;
+
 	if (SWS) {
+		StatsTimer Timer(Stats.ConvertTime);
+		TraceSpan Span("video", "sws_scale");
 		sws_scale(SWS, Frame->data, Frame->linesize, 0, CodecContext->height, SWSFrame.data, SWSFrame.linesize);
 		CopyAVPictureFields(SWSFrame, LocalFrame);
 	} else {
@@ -104,11 +116,11 @@ FFMS_VideoSource::FFMS_VideoSource(const char *SourceFile, FFMS_Index &Index, in
 		throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
 			"Out of bounds track index selected");
 
-	if (Index[Track].TT != FFMS_TYPE_VIDEO)
+	if (Index.GetTrackType(Track) != FFMS_TYPE_VIDEO)
 		throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
 			"Not a video track");
 
-	if (Index[Track].empty())
+	if (Index.IsTrackEmpty(Track))
 		throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
 			"Video track contains no frames");
 
@@ -121,6 +133,7 @@ FFMS_VideoSource::FFMS_VideoSource(const char *SourceFile, FFMS_Index &Index, in
 
 	memset(&VP, 0, sizeof(VP));
 	memset(&LocalFrame, 0, sizeof(LocalFrame));
+	::ResetStats(Stats);
 	SWS = NULL;
 	LastFrameNum = 0;
 	CurrentFrame = 1;
@@ -364,8 +377,14 @@ void FFMS_VideoSource::SetVideoProperties() {
 bool FFMS_VideoSource::DecodePacket(AVPacket *Packet) {
 	int FrameFinished = 0;
 	std::swap(DecodeFrame, LastDecodedFrame);
-	avcodec_decode_video2(CodecContext, DecodeFrame, &FrameFinished, Packet);
-	if (!FrameFinished)
+	{
+		StatsTimer Timer(Stats.DecodeTime);
+		TraceSpan Span("video", "DecodePacket");
+		avcodec_decode_video2(CodecContext, DecodeFrame, &FrameFinished, Packet);
+	}
+	if (FrameFinished)
+		++Stats.FramesDecoded;
+	else
 		std::swap(DecodeFrame, LastDecodedFrame);
 
 	if (!FrameFinished)
@@ -396,6 +415,13 @@ void FFMS_VideoSource::FlushFinalFrames() {
 	DecodePacket(&Packet);
 }
 
+void FFMS_VideoSource::FlushDecoder() {
+	TraceSpan Span("video", "FlushDecoder");
+	++Stats.Flushes;
+	if (FlushBuffers(CodecContext))
+		++Stats.Reopens;
+}
+
 bool FFMS_VideoSource::HasPendingDelayedFrames() {
 	if (InitialDecode == -1) {
 		if (DelayCounter > FFMS_CALCULATE_DELAY) {
@@ -406,3 +432,82 @@ bool FFMS_VideoSource::HasPendingDelayedFrames() {
 	}
 	return false;
 }
+
+namespace {
+class FFLazyVideo : public FFMS_VideoSource {
+	std::string SourceFile;
+	int Threads;
+	int SeekMode;
+	std::auto_ptr<FFMS_VideoSource> Source;
+
+	FFMS_VideoSource *Open() {
+		if (!Source.get()) {
+			Source.reset(CreateVideoSource(SourceFile.c_str(), VideoTrack, Index, Threads, SeekMode));
+			VP = Source->GetVideoProperties();
+		}
+		return Source.get();
+	}
+
+	void Free(bool) { }
+
+public:
+	FFLazyVideo(const char *SourceFile, int Track, FFMS_Index &Index, int Threads, int SeekMode)
+	: FFMS_VideoSource(SourceFile, Index, Track, Threads)
+	, SourceFile(SourceFile)
+	, Threads(Threads)
+	, SeekMode(SeekMode)
+	{
+		VP = Index.Properties[Track].VP;
+	}
+
+	FFMS_Frame *GetFrame(int n) {
+		GetFrameCheck(n);
+		return Open()->GetFrame(n);
+	}
+
+	// Everything which changes the output needs a decoded frame to apply to
+	void SetOutputFormat(const PixelFormat *TargetFormats, int Width, int Height, int Resizer) {
+		Open()->SetOutputFormat(TargetFormats, Width, Height, Resizer);
+	}
+	void ResetOutputFormat() { Open()->ResetOutputFormat(); }
+	void SetInputFormat(int ColorSpace, int ColorRange, PixelFormat Format) {
+		Open()->SetInputFormat(ColorSpace, ColorRange, Format);
+	}
+	void ResetInputFormat() { Open()->ResetInputFormat(); }
+
+	const FFMS_SourceStats &GetStats() const {
+		return Source.get() ? Source->GetStats() : Stats;
+	}
+	void ResetStats() {
+		if (Source.get())
+			Source->ResetStats();
+	}
+};
+}
+
+FFMS_VideoSource *CreateVideoSource(const char *SourceFile, int Track, FFMS_Index &Index, int Threads, int SeekMode) {
+	switch (Index.Decoder) {
+		case FFMS_SOURCE_LAVF:
+			return CreateLavfVideoSource(SourceFile, Track, Index, Threads, SeekMode);
+		case FFMS_SOURCE_MATROSKA:
+			return CreateMatroskaVideoSource(SourceFile, Track, Index, Threads);
+#ifdef HAALISOURCE
+		case FFMS_SOURCE_HAALIMPEG:
+			if (HasHaaliMPEG)
+				return CreateHaaliVideoSource(SourceFile, Track, Index, Threads, FFMS_SOURCE_HAALIMPEG);
+			throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_NOT_AVAILABLE, "Haali MPEG/TS source unavailable");
+		case FFMS_SOURCE_HAALIOGG:
+			if (HasHaaliOGG)
+				return CreateHaaliVideoSource(SourceFile, Track, Index, Threads, FFMS_SOURCE_HAALIOGG);
+			throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_NOT_AVAILABLE, "Haali OGG/OGM source unavailable");
+#endif
+		default:
+			throw FFMS_Exception(FFMS_ERROR_PARSER, FFMS_ERROR_FILE_READ, "Unsupported format");
+	}
+}
+
+FFMS_VideoSource *CreateLazyVideoSource(const char *SourceFile, int Track, FFMS_Index &Index, int Threads, int SeekMode) {
+	if (Track >= 0 && Track < static_cast<int>(Index.Properties.size()) && Index.Properties[Track].Valid)
+		return new FFLazyVideo(SourceFile, Track, Index, Threads, SeekMode);
+	return CreateVideoSource(SourceFile, Track, Index, Threads, SeekMode);
+}
@@ -73,6 +73,7 @@ protected:
 	int InitialDecode;
 	int DecodingThreads;
 	AVCodecContext *CodecContext;
+	FFMS_SourceStats Stats;
 
 	FFMS_VideoSource(const char *SourceFile, FFMS_Index &Index, int Track, int Threads);
 	void ReAdjustOutputFormat();
@@ -82,6 +83,7 @@ protected:
 	bool DecodePacket(AVPacket *Packet);
 	void FlushFinalFrames();
 	bool HasPendingDelayedFrames();
+	void FlushDecoder();
 public:
 	virtual ~FFMS_VideoSource();
 	const FFMS_VideoProperties& GetVideoProperties() { return VP; }
@@ -89,14 +91,20 @@ public:
 	virtual FFMS_Frame *GetFrame(int n) = 0;
 	void GetFrameCheck(int n);
 	FFMS_Frame *GetFrameByTime(double Time);
-	void SetOutputFormat(const PixelFormat *TargetFormats, int Width, int Height, int Resizer);
-	void ResetOutputFormat();
-	void SetInputFormat(int ColorSpace, int ColorRange, PixelFormat Format);
-	void ResetInputFormat();
+	virtual void SetOutputFormat(const PixelFormat *TargetFormats, int Width, int Height, int Resizer);
+	virtual void ResetOutputFormat();
+	virtual void SetInputFormat(int ColorSpace, int ColorRange, PixelFormat Format);
+	virtual void ResetInputFormat();
+	virtual const FFMS_SourceStats &GetStats() const { return Stats; }
+	virtual void ResetStats() { ::ResetStats(Stats); }
 };
 
 FFMS_VideoSource *CreateLavfVideoSource(const char *SourceFile, int Track, FFMS_Index &Index, int Threads, int SeekMode);
 FFMS_VideoSource *CreateMatroskaVideoSource(const char *SourceFile, int Track, FFMS_Index &Index, int Threads);
 FFMS_VideoSource *CreateHaaliVideoSource(const char *SourceFile, int Track, FFMS_Index &Index, int Threads, FFMS_Sources SourceMode);
+FFMS_VideoSource *CreateVideoSource(const char *SourceFile, int Track, FFMS_Index &Index, int Threads, int SeekMode);
+// Uses the properties stored in the index, if it has any for the track, and
+// opens the file and the decoder the first time a frame is needed
+FFMS_VideoSource *CreateLazyVideoSource(const char *SourceFile, int Track, FFMS_Index &Index, int Threads, int SeekMode);
 
 #endif
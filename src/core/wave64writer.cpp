@@ -23,11 +23,16 @@
 #include "filehandle.h"
 #include "utils.h"
 
+#include <algorithm>
 #include <cstring>
 
 #define WAVE_FORMAT_IEEE_FLOAT 0x0003
 #define WAVE_FORMAT_PCM 1
 
+// Size of each of the two buffers. Every write but the last is this large,
+// so the data is written in large blocks at aligned offsets from its start.
+static const size_t BufferSize = 4 << 20;
+
 static const uint8_t GuidRIFF[16]={
 	// {66666972-912E-11CF-A5D6-28DB04C10000}
 	0x72, 0x69, 0x66, 0x66, 0x2E, 0x91, 0xCF, 0x11, 0xA5, 0xD6, 0x28, 0xDB, 0x04, 0xC1, 0x00, 0x00
@@ -55,14 +60,76 @@ Wave64Writer::Wave64Writer(const char *Filename, uint16_t BytesPerSample, uint16
 , BytesPerSample(BytesPerSample)
 , Channels(Channels)
 , IsFloat(IsFloat)
+, Filling(0)
+, Filled(0)
+, Pending(0)
+, Stopping(false)
 {
 	WriteHeader(true, IsFloat);
+	Buffers[0].resize(BufferSize);
+	Buffers[1].resize(BufferSize);
+	Writer.reset(new Thread(RunWriter, this));
 }
 
 Wave64Writer::~Wave64Writer() {
+	{
+		ScopedLock L(Lock);
+		Stopping = true;
+		Changed.Broadcast();
+	}
+	// Joins the writer once it has written any pending buffer
+	Writer.reset();
+
+	// The file is unusable if a write failed, and the error has already
+	// been reported by WriteData unless it was the final buffer
+	if (Error.IsSet())
+		return;
+	WavFile.Write(&Buffers[Filling][0], Filled);
 	WriteHeader(false, IsFloat);
 }
 
+void Wave64Writer::RunWriter(void *Arg) {
+	static_cast<Wave64Writer *>(Arg)->WriteBuffers();
+}
+
+void Wave64Writer::WriteBuffers() {
+	ScopedLock L(Lock);
+	for (;;) {
+		while (!Pending && !Stopping)
+			Changed.Wait(Lock);
+		if (!Pending)
+			return;
+
+		// WriteData only touches the other buffer while this one is written
+		Lock.Unlock();
+		try {
+			WavFile.Write(&Buffers[!Filling][0], Pending);
+		} catch (...) {
+			Lock.Lock();
+			Error.Catch();
+			Pending = 0;
+			Changed.Broadcast();
+			return;
+		}
+		Lock.Lock();
+
+		Pending = 0;
+		Changed.Broadcast();
+	}
+}
+
+void Wave64Writer::Submit() {
+	ScopedLock L(Lock);
+	while (Pending && !Error.IsSet())
+		Changed.Wait(Lock);
+	Error.Rethrow();
+
+	Filling = !Filling;
+	Pending = Filled;
+	Filled = 0;
+	Changed.Broadcast();
+}
+
 void Wave64Writer::WriteHeader(bool Initial, bool IsFloat) {
 	FFMS_WAVEFORMATEX WFEX;
 	if (IsFloat)
@@ -106,17 +173,41 @@ void Wave64Writer::WriteHeader(bool Initial, bool IsFloat) {
 		WavFile.Seek(pos, SEEK_SET);
 }
 
+void Wave64Writer::Append(const char *Src, size_t Length) {
+	while (Length > 0) {
+		size_t Size = std::min(Length, BufferSize - Filled);
+		memcpy(&Buffers[Filling][Filled], Src, Size);
+		Filled += Size;
+		Src += Size;
+		Length -= Size;
+		if (Filled == BufferSize)
+			Submit();
+	}
+}
+
 void Wave64Writer::WriteData(AVFrame const& Frame) {
 #ifndef FFMBC
 	size_t Length = (size_t)Frame.nb_samples * BytesPerSample * Channels;
 	if (Channels > 1 && av_sample_fmt_is_planar(static_cast<AVSampleFormat>(Frame.format))) {
+		size_t SampleSize = BytesPerSample * Channels;
 		for (int32_t sample = 0; sample < Frame.nb_samples; ++sample) {
+			if (BufferSize - Filled < SampleSize) {
+				// Split the sample across the two buffers so that the
+				// full one is written whole
+				for (int32_t channel = 0; channel < Channels; ++channel)
+					Append(reinterpret_cast<const char *>(&Frame.extended_data[channel][sample * BytesPerSample]), BytesPerSample);
+				continue;
+			}
+			char *Dst = &Buffers[Filling][Filled];
 			for (int32_t channel = 0; channel < Channels; ++channel)
-				WavFile.Write(reinterpret_cast<char *>(&Frame.extended_data[channel][sample * BytesPerSample]), BytesPerSample);
+				memcpy(Dst + channel * BytesPerSample, &Frame.extended_data[channel][sample * BytesPerSample], BytesPerSample);
+			Filled += SampleSize;
+			if (Filled == BufferSize)
+				Submit();
 		}
 	}
 	else {
-		WavFile.Write(reinterpret_cast<char *>(Frame.extended_data[0]), Length);
+		Append(reinterpret_cast<const char *>(Frame.extended_data[0]), Length);
 	}
 	BytesWritten += Length;
 #endif
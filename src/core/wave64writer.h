@@ -22,8 +22,11 @@
 #define	WAVE64WRITER_H
 
 #include "filehandle.h"
+#include "threading.h"
 
+#include <memory>
 #include <stdint.h>
+#include <vector>
 
 struct AVFrame;
 
@@ -38,7 +41,10 @@ typedef struct FFMS_WAVEFORMATEX {
 	uint16_t cbSize;
 } FFMS_WAVEFORMATEX;
 
-class Wave64Writer {
+// Samples are interleaved into one of two large buffers while a background
+// thread writes the other, so that dumping audio while indexing doesn't
+// wait for the disk
+class Wave64Writer : private noncopyable {
 	FileHandle WavFile;
 	uint64_t BytesWritten;
 	uint32_t SamplesPerSec;
@@ -46,7 +52,27 @@ class Wave64Writer {
 	uint16_t Channels;
 	bool IsFloat;
 
+	std::vector<char> Buffers[2];
+	// Buffer currently being filled and how much of it is used
+	int Filling;
+	size_t Filled;
+
+	// Guards everything below
+	Mutex Lock;
+	Condition Changed;
+	// Bytes of the other buffer waiting to be written, or 0 if it's free
+	size_t Pending;
+	bool Stopping;
+	ThreadError Error;
+	std::auto_ptr<Thread> Writer;
+
 	void WriteHeader(bool Initial, bool IsFloat);
+	// Copies Length bytes into the buffers, submitting each one as it fills
+	void Append(const char *Src, size_t Length);
+	// Hands the filled buffer to the writer thread once it's free
+	void Submit();
+	static void RunWriter(void *Arg);
+	void WriteBuffers();
 
 public:
 	Wave64Writer(const char *Filename, uint16_t BitsPerSample, uint16_t Channels, uint32_t SamplesPerSec, bool IsFloat);
@@ -0,0 +1,217 @@
+//  Copyright (c) 2015 The FFmpegSource Project
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#include "waveform.h"
+
+#include "zipfile.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+namespace {
+// The resolutions stored in the index. Finer ones can't be produced without
+// decoding anyway, and coarser ones are cheap to derive from the 4096 level.
+const int WaveformLevels[] = { 256, 4096 };
+
+template<typename T>
+void ConvertSamples(const uint8_t *Data, int Stride, int Count, float Scale, float Offset, float *Out) {
+	const T *Samples = reinterpret_cast<const T *>(Data);
+	for (int i = 0; i < Count; ++i)
+		Out[i] = (static_cast<float>(Samples[i * Stride]) - Offset) * Scale;
+}
+
+void ConvertChannel(const AVFrame &Frame, int Channel, int Channels, float *Out) {
+	AVSampleFormat Format = static_cast<AVSampleFormat>(Frame.format);
+	bool Planar = !!av_sample_fmt_is_planar(Format);
+	int Stride = Planar ? 1 : Channels;
+	int BytesPerSample = av_get_bytes_per_sample(Format);
+	const uint8_t *Data = Planar
+		? Frame.extended_data[Channel]
+		: Frame.extended_data[0] + Channel * BytesPerSample;
+
+	switch (av_get_packed_sample_fmt(Format)) {
+		case AV_SAMPLE_FMT_U8:
+			ConvertSamples<uint8_t>(Data, Stride, Frame.nb_samples, 1.f / 128, 128.f, Out); break;
+		case AV_SAMPLE_FMT_S16:
+			ConvertSamples<int16_t>(Data, Stride, Frame.nb_samples, 1.f / 32768, 0.f, Out); break;
+		case AV_SAMPLE_FMT_S32:
+			ConvertSamples<int32_t>(Data, Stride, Frame.nb_samples, 1.f / 2147483648.f, 0.f, Out); break;
+		case AV_SAMPLE_FMT_FLT:
+			ConvertSamples<float>(Data, Stride, Frame.nb_samples, 1.f, 0.f, Out); break;
+		case AV_SAMPLE_FMT_DBL:
+			ConvertSamples<double>(Data, Stride, Frame.nb_samples, 1.f, 0.f, Out); break;
+		default:
+			throw FFMS_Exception(FFMS_ERROR_INDEXING, FFMS_ERROR_UNSUPPORTED,
+				"Unsupported sample format for waveform generation");
+	}
+}
+
+// Peaks are stored as 16 bit fixed point, which is plenty for drawing and
+// halves the size of the index compared to floats
+int16_t QuantizePeak(float Value) {
+	return static_cast<int16_t>(std::max(-32767.f, std::min(32767.f, Value * 32767.f + (Value < 0 ? -.5f : .5f))));
+}
+
+float DequantizePeak(int16_t Value) {
+	return Value / 32767.f;
+}
+}
+
+WaveformSummary::WaveformSummary()
+: Channels(0)
+, NumSamples(0)
+{
+}
+
+WaveformSummary::WaveformSummary(ZipFile &Stream) {
+	Channels = Stream.Read<int32_t>();
+	NumSamples = Stream.Read<int64_t>();
+	Levels.resize(Stream.Read<uint32_t>());
+	for (size_t i = 0; i < Levels.size(); ++i) {
+		Level &L = Levels[i];
+		L.SamplesPerPeak = Stream.Read<int32_t>();
+		L.Peaks.resize(static_cast<size_t>(Stream.Read<uint64_t>()));
+		for (size_t j = 0; j < L.Peaks.size(); ++j) {
+			L.Peaks[j].Min = DequantizePeak(Stream.Read<int16_t>());
+			L.Peaks[j].Max = DequantizePeak(Stream.Read<int16_t>());
+			L.Peaks[j].RMS = DequantizePeak(Stream.Read<int16_t>());
+		}
+	}
+}
+
+void WaveformSummary::Write(ZipFile &Stream) const {
+	Stream.Write<int32_t>(Channels);
+	Stream.Write<int64_t>(NumSamples);
+	Stream.Write<uint32_t>(Levels.size());
+	for (size_t i = 0; i < Levels.size(); ++i) {
+		Level const& L = Levels[i];
+		Stream.Write<int32_t>(L.SamplesPerPeak);
+		Stream.Write<uint64_t>(L.Peaks.size());
+		for (size_t j = 0; j < L.Peaks.size(); ++j) {
+			Stream.Write(QuantizePeak(L.Peaks[j].Min));
+			Stream.Write(QuantizePeak(L.Peaks[j].Max));
+			Stream.Write(QuantizePeak(L.Peaks[j].RMS));
+		}
+	}
+}
+
+void WaveformSummary::ResetPeak(Level &L, int Channel) {
+	L.Current[Channel].Min = FLT_MAX;
+	L.Current[Channel].Max = -FLT_MAX;
+	L.Current[Channel].RMS = 0;
+	L.SumSquares[Channel] = 0;
+}
+
+void WaveformSummary::AddChannel(Level &L, int Channel, const float *Samples, int Count) {
+	FFMS_WaveformPeak &Peak = L.Current[Channel];
+	double &SumSquares = L.SumSquares[Channel];
+	int64_t Position = NumSamples;
+
+	while (Count > 0) {
+		int Filled = static_cast<int>(Position % L.SamplesPerPeak);
+		int Take = std::min(Count, L.SamplesPerPeak - Filled);
+
+		for (int i = 0; i < Take; ++i) {
+			float Sample = Samples[i];
+			Peak.Min = std::min(Peak.Min, Sample);
+			Peak.Max = std::max(Peak.Max, Sample);
+			SumSquares += Sample * Sample;
+		}
+
+		Samples += Take;
+		Count -= Take;
+		Position += Take;
+
+		if (Filled + Take == L.SamplesPerPeak) {
+			size_t PeakNumber = static_cast<size_t>(Position / L.SamplesPerPeak - 1);
+			Peak.RMS = static_cast<float>(std::sqrt(SumSquares / L.SamplesPerPeak));
+			L.Peaks[PeakNumber * Channels + Channel] = Peak;
+			ResetPeak(L, Channel);
+		}
+	}
+}
+
+void WaveformSummary::AddFrame(const AVFrame &Frame, int FrameChannels) {
+	if (Frame.nb_samples <= 0)
+		return;
+
+	if (Levels.empty()) {
+		Channels = FrameChannels;
+		Levels.resize(sizeof(WaveformLevels) / sizeof(WaveformLevels[0]));
+		for (size_t i = 0; i < Levels.size(); ++i) {
+			Levels[i].SamplesPerPeak = WaveformLevels[i];
+			Levels[i].Current.resize(Channels);
+			Levels[i].SumSquares.resize(Channels);
+			for (int c = 0; c < Channels; ++c)
+				ResetPeak(Levels[i], c);
+		}
+	}
+	else if (FrameChannels != Channels)
+		throw FFMS_Exception(FFMS_ERROR_INDEXING, FFMS_ERROR_UNSUPPORTED,
+			"Channel count changed while generating waveform");
+
+	int64_t EndSample = NumSamples + Frame.nb_samples;
+	for (size_t i = 0; i < Levels.size(); ++i)
+		Levels[i].Peaks.resize(static_cast<size_t>(EndSample / Levels[i].SamplesPerPeak) * Channels);
+
+	ChannelBuffer.resize(Frame.nb_samples);
+	for (int c = 0; c < Channels; ++c) {
+		ConvertChannel(Frame, c, Channels, &ChannelBuffer[0]);
+		for (size_t i = 0; i < Levels.size(); ++i)
+			AddChannel(Levels[i], c, &ChannelBuffer[0], Frame.nb_samples);
+	}
+
+	NumSamples = EndSample;
+}
+
+void WaveformSummary::Finish() {
+	for (size_t i = 0; i < Levels.size(); ++i) {
+		Level &L = Levels[i];
+		int Filled = static_cast<int>(NumSamples % L.SamplesPerPeak);
+		if (Filled) {
+			for (int c = 0; c < Channels; ++c) {
+				L.Current[c].RMS = static_cast<float>(std::sqrt(L.SumSquares[c] / Filled));
+				L.Peaks.push_back(L.Current[c]);
+				ResetPeak(L, c);
+			}
+		}
+		std::vector<FFMS_WaveformPeak>().swap(L.Current);
+		std::vector<double>().swap(L.SumSquares);
+	}
+	std::vector<float>().swap(ChannelBuffer);
+}
+
+const FFMS_WaveformPeak *WaveformSummary::GetPeaks(int SamplesPerPeak, int *OutChannels, int64_t *NumPeaks) const {
+	for (size_t i = 0; i < Levels.size(); ++i) {
+		if (Levels[i].SamplesPerPeak != SamplesPerPeak)
+			continue;
+
+		if (OutChannels)
+			*OutChannels = Channels;
+		if (NumPeaks)
+			*NumPeaks = Channels ? Levels[i].Peaks.size() / Channels : 0;
+		return Levels[i].Peaks.empty() ? NULL : &Levels[i].Peaks[0];
+	}
+
+	throw FFMS_Exception(FFMS_ERROR_INDEX, FFMS_ERROR_INVALID_ARGUMENT,
+		"No waveform with the requested resolution is stored in the index");
+}
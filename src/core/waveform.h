@@ -0,0 +1,62 @@
+//  Copyright (c) 2015 The FFmpegSource Project
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#ifndef WAVEFORM_H
+#define WAVEFORM_H
+
+#include "utils.h"
+
+#include <vector>
+
+class ZipFile;
+
+// Per-channel min/max/RMS envelopes of an audio track at a few fixed
+// resolutions, built from the decoded frames while indexing
+class WaveformSummary {
+	struct Level {
+		int SamplesPerPeak;
+		// Finished peaks, interleaved by channel
+		std::vector<FFMS_WaveformPeak> Peaks;
+		// The peak currently being accumulated for each channel
+		std::vector<FFMS_WaveformPeak> Current;
+		std::vector<double> SumSquares;
+	};
+
+	int Channels;
+	int64_t NumSamples;
+	std::vector<Level> Levels;
+	std::vector<float> ChannelBuffer;
+
+	void AddChannel(Level &L, int Channel, const float *Samples, int Count);
+	void ResetPeak(Level &L, int Channel);
+
+public:
+	WaveformSummary();
+	WaveformSummary(ZipFile &Stream);
+
+	void AddFrame(const AVFrame &Frame, int Channels);
+	void Finish();
+	void Write(ZipFile &Stream) const;
+
+	const FFMS_WaveformPeak *GetPeaks(int SamplesPerPeak, int *Channels, int64_t *NumPeaks) const;
+};
+
+#endif
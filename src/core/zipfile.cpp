@@ -105,3 +105,17 @@ void ZipFile::Finish() {
 	deflateEnd(&z);
 	state = Initial;
 }
+
+void ZipFile::WriteRaw(const void *data, size_t size) {
+	file.Write(static_cast<const char *>(data), size);
+}
+
+void ZipFile::Seek(int64_t offset) {
+	if (state == Inflate)
+		inflateEnd(&z);
+	if (state == Deflate)
+		deflateEnd(&z);
+	state = Initial;
+	memset(&z, 0, sizeof(z));
+	file.Seek(offset, SEEK_SET);
+}
@@ -41,6 +41,12 @@ public:
 	int Write(const void *buffer, size_t size);
 	void Finish();
 
+	// Uncompressed data, which may only be written before compressed data
+	// or after calling Finish
+	void WriteRaw(const void *buffer, size_t size);
+	// Move to a compressed section which starts at offset
+	void Seek(int64_t offset);
+
 	template<typename T>
 	T Read() {
 		T ret = T();
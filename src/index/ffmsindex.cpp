@@ -22,23 +22,31 @@
 #include "ffmscompat.h"
 
 extern "C" {
+#include <libavcodec/avcodec.h>
 #include <libavutil/log.h>
 }
 
 #ifdef _WIN32
 #include <objbase.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
 #endif
 
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <vector>
 
 namespace {
 
 int TrackMask = 0;
 int DumpMask = 0;
+int WaveformMask = 0;
 int Verbose = 0;
 int IgnoreErrors = 0;
 int Demuxer = FFMS_SOURCE_DEFAULT;
@@ -46,11 +54,22 @@ bool Overwrite = false;
 bool PrintProgress = true;
 bool WriteTC = false;
 bool WriteKF = false;
-const char *InputFile = 0;
-std::string CacheFile;
+bool StoreProperties = false;
+bool Batch = false;
+int Workers = 1;
+int ThreadBudget = 0;
+int IndexFormat = FFMS_INDEX_FORMAT_COMPRESSED;
 std::string AudioFile;
 
-FFMS_Index *Index = NULL;
+struct Job {
+	std::string InputFile;
+	std::string CacheFile;
+	int LastProgress;
+};
+
+std::vector<Job> Jobs;
+size_t NextJob = 0;
+int FailedJobs = 0;
 
 struct Error {
 	std::string msg;
@@ -60,10 +79,68 @@ struct Error {
 	}
 };
 
+class Mutex {
+#ifdef _WIN32
+	CRITICAL_SECTION Handle;
+public:
+	Mutex() { InitializeCriticalSection(&Handle); }
+	~Mutex() { DeleteCriticalSection(&Handle); }
+	void Lock() { EnterCriticalSection(&Handle); }
+	void Unlock() { LeaveCriticalSection(&Handle); }
+#else
+	pthread_mutex_t Handle;
+public:
+	Mutex() { pthread_mutex_init(&Handle, NULL); }
+	~Mutex() { pthread_mutex_destroy(&Handle); }
+	void Lock() { pthread_mutex_lock(&Handle); }
+	void Unlock() { pthread_mutex_unlock(&Handle); }
+#endif
+private:
+	Mutex(Mutex const&);
+	Mutex& operator=(Mutex const&);
+};
+
+class ScopedLock {
+	Mutex &M;
+	ScopedLock(ScopedLock const&);
+	ScopedLock& operator=(ScopedLock const&);
+public:
+	ScopedLock(Mutex &M) : M(M) { M.Lock(); }
+	~ScopedLock() { M.Unlock(); }
+};
+
+// Guards the job queue and stdout in batch mode
+Mutex OutputLock;
+
+// libavcodec needs to be told how to lock when codecs are opened on
+// several threads at once
+int LockManager(void **M, enum AVLockOp Op) {
+	switch (Op) {
+		case AV_LOCK_CREATE: *M = new Mutex; break;
+		case AV_LOCK_OBTAIN: static_cast<Mutex *>(*M)->Lock(); break;
+		case AV_LOCK_RELEASE: static_cast<Mutex *>(*M)->Unlock(); break;
+		case AV_LOCK_DESTROY: delete static_cast<Mutex *>(*M); *M = NULL; break;
+	}
+	return 0;
+}
+
+int CPUCount() {
+#ifdef _WIN32
+	SYSTEM_INFO Info;
+	GetSystemInfo(&Info);
+	return Info.dwNumberOfProcessors;
+#else
+	long Count = sysconf(_SC_NPROCESSORS_ONLN);
+	return Count > 0 ? static_cast<int>(Count) : 1;
+#endif
+}
+
 void PrintUsage() {
 	std::cout <<
 		"FFmpegSource2 indexing app\n"
 		"Usage: ffmsindex [options] inputfile [outputfile]\n"
+		"       ffmsindex [options] -b inputfile [inputfile ...]\n"
+		"       ffmsindex [options] -l listfile\n"
 		"If no output filename is specified, inputfile.ffindex will be used.\n"
 		"\n"
 		"Options:\n"
@@ -72,15 +149,56 @@ void PrintUsage() {
 		"-p        Disable progress reporting. (default: progress reporting on)\n"
 		"-c        Write timecodes for all video tracks to outputfile_track00.tc.txt (default: no)\n"
 		"-k        Write keyframes for all video tracks to outputfile_track00.kf.txt (default: no)\n"
+		"-u        Write an uncompressed columnar index, which is larger but loads faster (default: no)\n"
+		"-P        Store the properties of the indexed tracks in the index; opens each track once (default: no)\n"
 		"-t N      Set the audio indexing mask to N (-1 means index all tracks, 0 means index none, default: 0)\n"
 		"-d N      Set the audio decoding mask to N (mask syntax same as -t, default: 0)\n"
+		"-w N      Store waveform summaries for the audio tracks in mask N (mask syntax same as -t, default: 0)\n"
 		"-a NAME   Set the audio output base filename to NAME (default: input filename)\n"
 		"-s N      Set audio decoding error handling. See the documentation for details. (default: 0)\n"
-		"-m NAME   Force the use of demuxer NAME (default, lavf, matroska, haalimpeg, haaliogg)"
+		"-m NAME   Force the use of demuxer NAME (default, lavf, matroska, haalimpeg, haaliogg)\n"
+		"-b        Batch mode: index every file named on the commandline to inputfile.ffindex (default: no)\n"
+		"-l FILE   Index the files listed in FILE, or in stdin if FILE is -, one per line, with an optional\n"
+		"          tab-separated output filename after each (implies -b)\n"
+		"-j N      Index N files at once in batch mode (default: 1)\n"
+		"-T N      Split N indexing threads between the files being indexed at once (default: one per CPU)"
 		<< std::endl;
 }
 
+void AddJob(std::string const& InputFile, std::string const& CacheFile) {
+	Job j;
+	j.InputFile = InputFile;
+	j.CacheFile = CacheFile.empty() ? InputFile + ".ffindex" : CacheFile;
+	j.LastProgress = 0;
+	Jobs.push_back(j);
+}
+
+void ReadFileList(const char *ListFile) {
+	std::ifstream File;
+	if (strcmp(ListFile, "-")) {
+		File.open(ListFile);
+		if (!File)
+			throw Error("Error: can't open the file list");
+	}
+	std::istream &List = strcmp(ListFile, "-") ? File : std::cin;
+
+	std::string Line;
+	while (std::getline(List, Line)) {
+		if (!Line.empty() && Line[Line.size() - 1] == '\r')
+			Line.erase(Line.size() - 1);
+		if (Line.empty())
+			continue;
+
+		std::string::size_type Tab = Line.find('\t');
+		if (Tab == std::string::npos)
+			AddJob(Line, "");
+		else
+			AddJob(Line.substr(0, Tab), Line.substr(Tab + 1));
+	}
+}
+
 void ParseCMDLine(int argc, char *argv[]) {
+	std::vector<const char *> Files;
 	for (int i = 1; i < argc; ++i) {
 		const char *Option = argv[i];
 #define OPTION_ARG(flag) i + 1 < argc ? argv[i+1] : throw Error("Error: missing argument for -" flag)
@@ -95,12 +213,19 @@ void ParseCMDLine(int argc, char *argv[]) {
 			WriteTC = true;
 		} else if (!strcmp(Option, "-k")) {
 			WriteKF = true;
+		} else if (!strcmp(Option, "-u")) {
+			IndexFormat = FFMS_INDEX_FORMAT_COLUMNAR;
+		} else if (!strcmp(Option, "-P")) {
+			StoreProperties = true;
 		} else if (!strcmp(Option, "-t")) {
 			TrackMask = atoi(OPTION_ARG("t"));
 			i++;
 		} else if (!strcmp(Option, "-d")) {
 			DumpMask = atoi(OPTION_ARG("d"));
 			i++;
+		} else if (!strcmp(Option, "-w")) {
+			WaveformMask = atoi(OPTION_ARG("w"));
+			i++;
 		} else if (!strcmp(Option, "-a")) {
 			AudioFile = OPTION_ARG("a");
 			i++;
@@ -123,35 +248,75 @@ void ParseCMDLine(int argc, char *argv[]) {
 				std::cout << "Warning: invalid argument to -m (" << arg << "), using default instead" << std::endl;
 
 			i++;
-		} else if (!InputFile) {
-			InputFile = Option;
-		} else if (CacheFile.empty()) {
-			CacheFile = Option;
-		} else {
+		} else if (!strcmp(Option, "-b")) {
+			Batch = true;
+		} else if (!strcmp(Option, "-l")) {
+			ReadFileList(OPTION_ARG("l"));
+			Batch = true;
+			i++;
+		} else if (!strcmp(Option, "-j")) {
+			Workers = atoi(OPTION_ARG("j"));
+			i++;
+		} else if (!strcmp(Option, "-T")) {
+			ThreadBudget = atoi(OPTION_ARG("T"));
+			i++;
+		} else if (Option[0] == '-' && Option[1]) {
 			std::cout << "Warning: ignoring unknown option " << Option << std::endl;
+		} else {
+			Files.push_back(Option);
 		}
 	}
 
 	if (IgnoreErrors < 0 || IgnoreErrors > 3)
 		throw Error("Error: invalid error handling mode");
-	if (!InputFile)
-		throw Error("Error: no input file specified");
-
-	if (CacheFile.empty()) {
-		CacheFile = InputFile;
-		CacheFile.append(".ffindex");
+	if (Workers < 1)
+		throw Error("Error: invalid number of jobs");
+
+	if (Batch) {
+		for (size_t i = 0; i < Files.size(); ++i)
+			AddJob(Files[i], "");
+	} else if (!Files.empty()) {
+		AddJob(Files[0], Files.size() > 1 ? Files[1] : "");
+		for (size_t i = 2; i < Files.size(); ++i)
+			std::cout << "Warning: ignoring extra argument " << Files[i] << std::endl;
 	}
+
+	if (Jobs.empty())
+		throw Error("Error: no input file specified");
+	if (Workers > static_cast<int>(Jobs.size()))
+		Workers = static_cast<int>(Jobs.size());
 	AudioFile.append("%s.%02d.w64");
 }
 
+// Prefix for the messages about a job in batch mode
+std::string JobName(Job const& j) {
+	char Number[32];
+	snprintf(Number, sizeof(Number), "[%d/%d] ", static_cast<int>(&j - &Jobs[0]) + 1, static_cast<int>(Jobs.size()));
+	return Number + j.InputFile + ": ";
+}
+
 int FFMS_CC UpdateProgress(int64_t Current, int64_t Total, void *Private) {
 	if (!PrintProgress)
 		return 0;
 
 	int Percentage = int((double(Current)/double(Total)) * 100);
 
+	if (Batch) {
+		// Lines for every 10% so that jobs running at once don't overwrite
+		// each other's progress
+		Job *j = static_cast<Job *>(Private);
+		Percentage -= Percentage % 10;
+		if (Percentage <= j->LastProgress)
+			return 0;
+		j->LastProgress = Percentage;
+
+		ScopedLock Lock(OutputLock);
+		std::cout << JobName(*j) << Percentage << "%" << std::endl;
+		return 0;
+	}
+
 	if (Private) {
-		int *LastPercentage = (int *)Private;
+		int *LastPercentage = &static_cast<Job *>(Private)->LastProgress;
 		if (Percentage <= *LastPercentage)
 			return 0;
 		*LastPercentage = Percentage;
@@ -166,86 +331,183 @@ int FFMS_CC GenAudioFilename(const char *SourceFile, int Track, const FFMS_Audio
 	return snprintf(FileName, FileName ? FNSize : 0, AudioFile.c_str(), SourceFile, Track) + 1;
 }
 
-std::string DumpFilename(FFMS_Track *Track, int TrackNum, const char *Suffix) {
+std::string DumpFilename(Job const& j, FFMS_Track *Track, int TrackNum, const char *Suffix) {
 	if (FFMS_GetTrackType(Track) != FFMS_TYPE_VIDEO || !FFMS_GetNumFrames(Track))
 		return "";
 
 	char tn[3];
 	snprintf(tn, 3, "%02d", TrackNum);
-	return CacheFile + "_track" + tn + Suffix;
+	return j.CacheFile + "_track" + tn + Suffix;
 }
 
-void DoIndexing() {
+// Only prints the step messages when indexing a single file
+void PrintStep(const char *Message) {
+	if (PrintProgress && !Batch)
+		std::cout << Message << std::flush;
+}
+
+void WriteTimecodes(Job const& j, FFMS_Index *Index) {
 	char ErrorMsg[1024];
 	FFMS_ErrorInfo E;
 	E.Buffer = ErrorMsg;
 	E.BufferSize = sizeof(ErrorMsg);
 
-	int Progress = 0;
+	PrintStep("Writing timecodes... ");
+	int NumTracks = FFMS_GetNumTracks(Index);
+	for (int t = 0; t < NumTracks; t++) {
+		FFMS_Track *Track = FFMS_GetTrackFromIndex(Index, t);
+		std::string Filename = DumpFilename(j, Track, t, ".tc.txt");
+		if (!Filename.empty()) {
+			if (FFMS_WriteTimecodes(Track, Filename.c_str(), &E)) {
+				ScopedLock Lock(OutputLock);
+				std::cout << (Batch ? JobName(j) : "\n") << "Failed to write timecodes file "
+					<< Filename << ": " << E.Buffer << std::endl;
+			}
+		}
+	}
+	PrintStep("done.\n");
+}
+
+void WriteKeyframes(Job const& j, FFMS_Index *Index) {
+	PrintStep("Writing keyframes... ");
+	int NumTracks = FFMS_GetNumTracks(Index);
+	for (int t = 0; t < NumTracks; t++) {
+		FFMS_Track *Track = FFMS_GetTrackFromIndex(Index, t);
+		std::string Filename = DumpFilename(j, Track, t, ".kf.txt");
+		if (!Filename.empty()) {
+			std::ofstream kf(Filename.c_str());
+			kf << "# keyframe format v1\n"
+			      "fps 0\n";
+
+			int FrameCount = FFMS_GetNumFrames(Track);
+			for (int CurFrameNum = 0; CurFrameNum < FrameCount; CurFrameNum++) {
+				if (FFMS_GetFrameInfo(Track, CurFrameNum)->KeyFrame)
+					kf << CurFrameNum << "\n";
+			}
+		}
+	}
+	PrintStep("done.    \n");
+}
 
-	Index = FFMS_ReadIndex(CacheFile.c_str(), &E);
-	if (!Overwrite && Index)
-		throw Error("Error: index file already exists, use -f if you are sure you want to overwrite it.");
+void DoIndexing(Job &j) {
+	char ErrorMsg[1024];
+	FFMS_ErrorInfo E;
+	E.Buffer = ErrorMsg;
+	E.BufferSize = sizeof(ErrorMsg);
+
+	FFMS_Index *Index = FFMS_ReadIndex(j.CacheFile.c_str(), &E);
+	if (Index) {
+		FFMS_DestroyIndex(Index);
+		if (!Overwrite)
+			throw Error("Error: index file already exists, use -f if you are sure you want to overwrite it.");
+	}
 
-	UpdateProgress(0, 100, 0);
-	FFMS_Indexer *Indexer = FFMS_CreateIndexerWithDemuxer(InputFile, Demuxer, &E);
+	if (!Batch)
+		UpdateProgress(0, 100, 0);
+	FFMS_Indexer *Indexer = FFMS_CreateIndexerWithDemuxer(j.InputFile.c_str(), Demuxer, &E);
 	if (Indexer == NULL)
-		throw Error("\nFailed to initialize indexing: ", E);
+		throw Error(Batch ? "Failed to initialize indexing: " : "\nFailed to initialize indexing: ", E);
 
-	Index = FFMS_DoIndexing(Indexer, TrackMask, DumpMask, &GenAudioFilename, NULL, IgnoreErrors, UpdateProgress, &Progress, &E);
+	FFMS_SetWaveformMask(Indexer, WaveformMask);
+	FFMS_SetStoreTrackProperties(Indexer, StoreProperties);
+	if (ThreadBudget > 0)
+		FFMS_SetIndexingThreads(Indexer, ThreadBudget / Workers > 1 ? ThreadBudget / Workers : 1);
+	Index = FFMS_DoIndexing(Indexer, TrackMask | WaveformMask, DumpMask, &GenAudioFilename, NULL, IgnoreErrors, UpdateProgress, &j, &E);
 	if (Index == NULL)
-		throw Error("\nIndexing error: ", E);
-
-	UpdateProgress(100, 100, 0);
-
-	if (WriteTC) {
-		if (PrintProgress)
-			std::cout << "Writing timecodes... ";
-		int NumTracks = FFMS_GetNumTracks(Index);
-		for (int t = 0; t < NumTracks; t++) {
-			FFMS_Track *Track = FFMS_GetTrackFromIndex(Index, t);
-			std::string Filename = DumpFilename(Track, t, ".tc.txt");
-			if (!Filename.empty()) {
-				if (FFMS_WriteTimecodes(Track, Filename.c_str(), &E))
-					std::cout << std::endl << "Failed to write timecodes file "
-						<< Filename << ": " << E.Buffer << std::endl;
-			}
-		}
-		if (PrintProgress)
-			std::cout << "done." << std::endl;
+		throw Error(Batch ? "Indexing error: " : "\nIndexing error: ", E);
+
+	if (!Batch)
+		UpdateProgress(100, 100, 0);
+
+	try {
+		if (WriteTC)
+			WriteTimecodes(j, Index);
+		if (WriteKF)
+			WriteKeyframes(j, Index);
+
+		PrintStep("Writing index... ");
+		if (FFMS_WriteIndexV2(j.CacheFile.c_str(), Index, IndexFormat, &E))
+			throw Error("Error writing index: ", E);
+		PrintStep("done.\n");
+	} catch (...) {
+		FFMS_DestroyIndex(Index);
+		throw;
 	}
+	FFMS_DestroyIndex(Index);
+}
+
+// Indexes jobs from the queue until it's empty
+#ifdef _WIN32
+unsigned __stdcall Worker(void *)
+#else
+void *Worker(void *)
+#endif
+{
+#ifdef _WIN32
+	bool ComInitialized = SUCCEEDED(CoInitializeEx(NULL, COINIT_MULTITHREADED));
+#endif
+
+	for (;;) {
+		Job *j;
+		{
+			ScopedLock Lock(OutputLock);
+			if (NextJob == Jobs.size())
+				break;
+			j = &Jobs[NextJob++];
+		}
 
-	if (WriteKF) {
-		if (PrintProgress)
-			std::cout << "Writing keyframes... ";
-		int NumTracks = FFMS_GetNumTracks(Index);
-		for (int t = 0; t < NumTracks; t++) {
-			FFMS_Track *Track = FFMS_GetTrackFromIndex(Index, t);
-			std::string Filename = DumpFilename(Track, t, ".kf.txt");
-			if (!Filename.empty()) {
-				std::ofstream kf(Filename.c_str());
-				kf << "# keyframe format v1\n"
-				      "fps 0\n";
-
-				int FrameCount = FFMS_GetNumFrames(Track);
-				for (int CurFrameNum = 0; CurFrameNum < FrameCount; CurFrameNum++) {
-					if (FFMS_GetFrameInfo(Track, CurFrameNum)->KeyFrame)
-						kf << CurFrameNum << "\n";
-				}
+		try {
+			DoIndexing(*j);
+			if (Batch) {
+				ScopedLock Lock(OutputLock);
+				std::cout << JobName(*j) << "done" << std::endl;
 			}
 		}
-		if (PrintProgress)
-			std::cout << "done.    " << std::endl;
+		catch (Error const& e) {
+			ScopedLock Lock(OutputLock);
+			std::cout << (Batch ? JobName(*j) : "") << e.msg << std::endl;
+			FailedJobs++;
+		}
 	}
 
-	if (PrintProgress)
-		std::cout << "Writing index... ";
+#ifdef _WIN32
+	if (ComInitialized)
+		CoUninitialize();
+#endif
+	return 0;
+}
 
-	if (FFMS_WriteIndex(CacheFile.c_str(), Index, &E))
-		throw Error("Error writing index: ", E);
+// Runs Workers threads, of which the calling thread is the first
+void RunJobs() {
+	if (Workers > 1)
+		av_lockmgr_register(LockManager);
 
-	if (PrintProgress)
-		std::cout << "done." << std::endl;
+#ifdef _WIN32
+	std::vector<HANDLE> Threads;
+	for (int i = 1; i < Workers; ++i) {
+		HANDLE Thread = reinterpret_cast<HANDLE>(_beginthreadex(NULL, 0, Worker, NULL, 0, NULL));
+		if (Thread)
+			Threads.push_back(Thread);
+	}
+	Worker(NULL);
+	for (size_t i = 0; i < Threads.size(); ++i) {
+		WaitForSingleObject(Threads[i], INFINITE);
+		CloseHandle(Threads[i]);
+	}
+#else
+	std::vector<pthread_t> Threads;
+	for (int i = 1; i < Workers; ++i) {
+		pthread_t Thread;
+		if (!pthread_create(&Thread, NULL, Worker, NULL))
+			Threads.push_back(Thread);
+	}
+	Worker(NULL);
+	for (size_t i = 0; i < Threads.size(); ++i)
+		pthread_join(Threads[i], NULL);
+#endif
+
+	if (Workers > 1)
+		av_lockmgr_register(NULL);
 }
 
 } // namespace {
@@ -312,13 +574,12 @@ int main(int argc, char *argv[]) {
 		default: FFMS_SetLogLevel(AV_LOG_DEBUG); // if user used -v 4 or more times, he deserves the spam
 	}
 
-	try {
-		DoIndexing();
-	}
-	catch (Error const& e) {
-		std::cout << e.msg << std::endl;
-		return 1;
-	}
+	// Without an explicit budget, jobs indexed at once share one thread per
+	// CPU rather than each using that many
+	if (ThreadBudget <= 0 && Workers > 1)
+		ThreadBudget = CPUCount();
 
-	return 0;
+	RunJobs();
+
+	return FailedJobs ? 1 : 0;
 }
@@ -103,6 +103,8 @@ static void VS_CC CreateIndex(const VSMap *in, VSMap *out, void *, VSCore *, con
 
 static void VS_CC CreateSource(const VSMap *in, VSMap *out, void *, VSCore *core, const VSAPI *vsapi)  {
 	FFMS_Init(0,  1);
+	// Scripts often open the same file several times
+	FFMS_SetIndexCaching(1);
 
 	char ErrorMsg[1024];
 	FFMS_ErrorInfo E;